@@ -0,0 +1,259 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "platform.h"
+
+#include "util.h"
+#include "net.h"
+#include "ip.h"
+#include "tcp.h"
+#include "sock.h"
+#include "stats.h"
+
+#include "driver/loopback.h"
+
+#include "test/test.h"
+
+#define NETSTAT_PORT 7
+#define NETSTAT_CONN_MAX 16
+
+static size_t total = 1024 * 1024;
+
+static const char *
+state_ntoa(int state)
+{
+    static const char *names[] = {
+        "FREE", "CLOSED", "LISTEN", "SYN_SENT", "SYN_RECEIVED", "ESTABLISHED",
+        "FIN_WAIT1", "FIN_WAIT2", "CLOSING", "TIME_WAIT", "CLOSE_WAIT", "LAST_ACK"
+    };
+
+    if (state < 0 || state >= (int)countof(names)) {
+        return "UNKNOWN";
+    }
+    return names[state];
+}
+
+static void
+print_devices(void)
+{
+    struct net_device *dev;
+    uint64_t counters[STATS_DEV_NUM];
+    unsigned int index, id;
+
+    printf("Devices:\n");
+    printf("  %-8s", "name");
+    for (id = 0; id < STATS_DEV_NUM; id++) {
+        printf(" %14s", stats_dev_name(id));
+    }
+    printf("\n");
+    for (index = 0; (dev = net_device_get(index)); index++) {
+        stats_dev_get(dev, counters);
+        printf("  %-8s", dev->name);
+        for (id = 0; id < STATS_DEV_NUM; id++) {
+            printf(" %14lu", counters[id]);
+        }
+        printf("\n");
+    }
+}
+
+static void
+print_counters(void)
+{
+    uint64_t counters[STATS_NUM];
+    unsigned int id;
+
+    stats_get(counters);
+    printf("Statistics:\n");
+    for (id = 0; id < STATS_NUM; id++) {
+        printf("  %-24s %lu\n", stats_name(id), counters[id]);
+    }
+    printf("  %-24s %d\n", "ip.InQueueLen", net_protocol_queue_len(NET_PROTOCOL_TYPE_IP));
+    printf("  %-24s %d\n", "arp.InQueueLen", net_protocol_queue_len(NET_PROTOCOL_TYPE_ARP));
+}
+
+static void
+print_connections(void)
+{
+    struct tcp_info infos[NETSTAT_CONN_MAX];
+    char ep1[IP_ENDPOINT_STR_LEN];
+    char ep2[IP_ENDPOINT_STR_LEN];
+    int num, i;
+
+    num = tcp_get_info_all(infos, countof(infos));
+    printf("Connections:\n");
+    printf("  %-3s %-12s %-21s %-21s %5s %8s %10s %8s %8s %8s %8s %8s %7s %10s %10s\n",
+        "id", "state", "local", "foreign", "mss", "cwnd", "ssthresh", "srtt(us)", "rto(us)",
+        "inflight", "sndq", "rcvq", "retrans", "acked", "received");
+    for (i = 0; i < num; i++) {
+        printf("  %-3d %-12s %-21s %-21s %5u %8u %10u %8u %8u %8u %8u %8u %7u %10u %10u\n",
+            infos[i].id, state_ntoa(infos[i].state),
+            ip_endpoint_ntop(&infos[i].local, ep1, sizeof(ep1)), ip_endpoint_ntop(&infos[i].foreign, ep2, sizeof(ep2)),
+            infos[i].mss, infos[i].cwnd, infos[i].ssthresh, infos[i].srtt, infos[i].rto,
+            infos[i].inflight, infos[i].sndq, infos[i].rcvq, infos[i].retrans, infos[i].bytes_acked, infos[i].bytes_received);
+    }
+}
+
+static void
+print_histograms(void)
+{
+    static struct stats_hist hist;
+    unsigned int id;
+
+    printf("Histograms:\n");
+    printf("  %-22s %10s %10s %10s %10s %10s %10s %10s\n", "name", "count", "mean", "p50", "p90", "p99", "p99.9", "max");
+    for (id = 0; id < STATS_HIST_NUM; id++) {
+        stats_hist_get(id, &hist);
+        printf("  %-22s %10lu %10lu %10lu %10lu %10lu %10lu %10lu\n", stats_hist_name(id), hist.count,
+            hist.count ? hist.sum / hist.count : 0,
+            stats_hist_percentile(&hist, 50), stats_hist_percentile(&hist, 90), stats_hist_percentile(&hist, 99),
+            stats_hist_percentile(&hist, 99.9), stats_hist_percentile(&hist, 100));
+    }
+}
+
+static void *
+server(void *arg)
+{
+    int soc = *(int *)arg, acc;
+    struct sockaddr_in foreign;
+    int foreignlen = sizeof(foreign);
+    uint8_t buf[4096];
+    size_t got = 0;
+    ssize_t ret;
+
+    acc = sock_accept(soc, (struct sockaddr *)&foreign, &foreignlen);
+    if (acc == -1) {
+        errorf("sock_accept() failure");
+        return NULL;
+    }
+    while (got < total) {
+        ret = sock_recv(acc, buf, sizeof(buf));
+        if (ret <= 0) {
+            break;
+        }
+        got += ret;
+    }
+    sock_close(acc);
+    return NULL;
+}
+
+static int
+setup(void)
+{
+    struct net_device *dev;
+    struct ip_iface *iface;
+
+    if (net_init() == -1) {
+        errorf("net_init() failure");
+        return -1;
+    }
+    dev = loopback_init();
+    if (!dev) {
+        errorf("loopback_init() failure");
+        return -1;
+    }
+    iface = ip_iface_alloc(LOOPBACK_IP_ADDR, LOOPBACK_NETMASK);
+    if (!iface) {
+        errorf("ip_iface_alloc() failure");
+        return -1;
+    }
+    if (ip_iface_register(dev, iface) == -1) {
+        errorf("ip_iface_register() failure");
+        return -1;
+    }
+    if (net_run() == -1) {
+        errorf("net_run() failure");
+        return -1;
+    }
+    return 0;
+}
+
+/* NOTE: runs a bulk TCP transfer over the loopback, then dumps the statistics of it */
+int
+main(int argc, char *argv[])
+{
+    int listener, soc;
+    struct sockaddr_in local = { .sin_family=AF_INET }, peer = { .sin_family=AF_INET };
+    static uint8_t data[65536];
+    size_t sent = 0, n, dumped = 0;
+    ssize_t ret;
+    thread_t thread;
+
+    /*
+     * Parse command line parameters
+     */
+    switch (argc) {
+    case 2:
+        total = strtoul(argv[1], NULL, 10);
+        /* fall through */
+    case 1:
+        break;
+    default:
+        fprintf(stderr, "Usage: %s [bytes]\n", argv[0]);
+        return -1;
+    }
+    /*
+     * Setup protocol stack
+     */
+    if (setup() == -1) {
+        errorf("setup() failure");
+        return -1;
+    }
+    /*
+     * Application Code
+     */
+    listener = sock_open(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (listener == -1) {
+        errorf("sock_open() failure");
+        return -1;
+    }
+    local.sin_port = hton16(NETSTAT_PORT);
+    if (sock_bind(listener, (struct sockaddr *)&local, sizeof(local)) == -1 || sock_listen(listener, 1) == -1) {
+        errorf("sock_bind()/sock_listen() failure");
+        return -1;
+    }
+    if (thread_create(&thread, server, &listener, -1) == -1) {
+        errorf("thread_create() failure");
+        return -1;
+    }
+    soc = sock_open(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (soc == -1) {
+        errorf("sock_open() failure");
+        return -1;
+    }
+    ip_addr_pton(LOOPBACK_IP_ADDR, &peer.sin_addr);
+    peer.sin_port = hton16(NETSTAT_PORT);
+    if (sock_connect(soc, (struct sockaddr *)&peer, sizeof(peer)) == -1) {
+        errorf("sock_connect() failure");
+        return -1;
+    }
+    memset(data, 0x5a, sizeof(data));
+    while (sent < total) {
+        n = MIN(sizeof(data), total - sent);
+        ret = sock_send(soc, data, n);
+        if (ret <= 0) {
+            errorf("sock_send() failure");
+            break;
+        }
+        sent += ret;
+        if (!dumped && sent >= total / 2) {
+            /* NOTE: in the middle of the transfer */
+            print_connections();
+            dumped = 1;
+        }
+    }
+    thread_join(thread);
+    print_connections();
+    sock_close(soc);
+    sock_close(listener);
+    print_devices();
+    print_counters();
+    print_histograms();
+    /*
+     * Cleanup protocol stack
+     */
+    net_shutdown();
+    return 0;
+}
@@ -0,0 +1,83 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "platform.h"
+
+#include "util.h"
+#include "ip.h"
+#include "trace.h"
+
+static void
+print_record(const struct trace_record *rec, uint64_t base)
+{
+    char addr1[IP_ADDR_STR_LEN];
+    char addr2[IP_ADDR_STR_LEN];
+
+    printf("%12.3f %3u %-10s ", (double)(rec->ts - base) / 1000, rec->thread, trace_event_name(rec->id));
+    switch (rec->id) {
+    case TRACE_EVENT_NET_INPUT:
+    case TRACE_EVENT_NET_OUTPUT:
+        printf("dev=%u, type=0x%04x, len=%u", rec->args[0], rec->args[1], rec->args[2]);
+        if (rec->id == TRACE_EVENT_NET_INPUT) {
+            printf(", worker=%u", rec->args[3]);
+        }
+        break;
+    case TRACE_EVENT_IP_INPUT:
+    case TRACE_EVENT_IP_OUTPUT:
+        printf("%s => %s, protocol=%u, len=%u",
+            ip_addr_ntop(rec->args[0], addr1, sizeof(addr1)), ip_addr_ntop(rec->args[1], addr2, sizeof(addr2)),
+            rec->args[2], rec->args[3]);
+        break;
+    case TRACE_EVENT_TCP_INPUT:
+    case TRACE_EVENT_TCP_OUTPUT:
+        printf("%u => %u, seq=%u, ack=%u, flg=0x%02x, len=%u",
+            rec->args[0] >> 16, rec->args[0] & 0xffff, rec->args[1], rec->args[2], rec->args[3] >> 16, rec->args[3] & 0xffff);
+        break;
+    case TRACE_EVENT_UDP_INPUT:
+    case TRACE_EVENT_UDP_OUTPUT:
+        printf("%u => %u, len=%u", rec->args[0] >> 16, rec->args[0] & 0xffff, rec->args[1]);
+        break;
+    case TRACE_EVENT_SOFTIRQ:
+        printf("worker=%u, type=0x%04x, num=%u, left=%u", rec->args[0], rec->args[1], rec->args[2], rec->args[3]);
+        break;
+    default:
+        printf("%08x %08x %08x %08x", rec->args[0], rec->args[1], rec->args[2], rec->args[3]);
+        break;
+    }
+    printf("\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+    const char *path = TRACE_RING_FILE;
+    struct trace_record *recs;
+    size_t num, i;
+
+    /*
+     * Parse command line parameters
+     */
+    switch (argc) {
+    case 2:
+        path = argv[1];
+        break;
+    case 1:
+        break;
+    default:
+        fprintf(stderr, "Usage: %s [file]\n", argv[0]);
+        return -1;
+    }
+    recs = trace_load(path, &num);
+    if (!recs) {
+        errorf("trace_load() failure, path=%s", path);
+        return -1;
+    }
+    /* NOTE: time in microseconds from the first record */
+    for (i = 0; i < num; i++) {
+        print_record(&recs[i], recs[0].ts);
+    }
+    memory_free(recs);
+    return 0;
+}
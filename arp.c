@@ -1,7 +1,6 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
-#include <sys/time.h>
 
 #include "platform.h"
 
@@ -10,6 +9,8 @@
 #include "ether.h"
 #include "arp.h"
 #include "ip.h"
+#include "stats.h"
+#include "timer.h"
 
 /* see https://www.iana.org/assignments/arp-parameters/arp-parameters.txt */
 #define ARP_HRD_ETHER 0x0001
@@ -19,8 +20,22 @@
 #define ARP_OP_REQUEST 0x0001
 #define ARP_OP_REPLY   0x0002
 
-#define ARP_CACHE_SIZE 32
+#ifndef ARP_CACHE_SIZE
+#define ARP_CACHE_SIZE 1024 /* maximum number of the entries */
+#endif
+#define ARP_CACHE_HASH_SIZE 64 /* initial number of buckets (grows) */
 #define ARP_CACHE_TIMEOUT 30 /* seconds */
+#define ARP_CACHE_REFRESH 5 /* seconds before the timeout, a used entry is probed again (unicast, see RFC 1122 2.3.2.1) */
+
+#define ARP_REQUEST_INTERVAL 1000 /* milliseconds, at most one request per entry in this */
+#define ARP_REQUEST_RETRY 3 /* incomplete entry is deleted after this number of requests */
+
+#ifndef ARP_PENDING_MAX
+#define ARP_PENDING_MAX 64 /* packets held per incomplete entry (enough for the fragments of a datagram) */
+#endif
+#ifndef ARP_PENDING_TOTAL_MAX
+#define ARP_PENDING_TOTAL_MAX 512 /* packets held by all the entries */
+#endif
 
 #define ARP_CACHE_STATE_FREE       0
 #define ARP_CACHE_STATE_INCOMPLETE 1
@@ -44,14 +59,25 @@ struct arp_ether {
 };
 
 struct arp_cache {
+    struct hash_node node; /* NOTE: keyed by pa */
     unsigned char state;
     ip_addr_t pa;
     uint8_t ha[ETHER_ADDR_LEN];
-    struct timeval timestamp;
+    uint64_t timestamp; /* resolved (or created if incomplete), see net_timer_clock() */
+    struct net_iface *iface;
+    uint64_t requested; /* the last request sent */
+    int requests; /* sent since the last resolution */
+    int used; /* by arp_resolve() since the last request */
+    struct pbuf *pending; /* the packets (IP) waiting for the resolution, linked by pb->next */
+    struct pbuf *pending_tail;
+    unsigned int pending_num;
+    int stale; /* NOTE: the cached struct ip_dst were invalidated to see if it is still used */
+    struct net_timer timer; /* NOTE: at the next deadline of the entry, see arp_cache_timer() */
 };
 
 static mutex_t mutex = MUTEX_INITIALIZER;
-static struct arp_cache caches[ARP_CACHE_SIZE];
+static struct hash_table caches;
+static unsigned int pending_total;
 
 static char *
 arp_opcode_ntoa(uint16_t opcode)
@@ -72,6 +98,9 @@ arp_dump(const uint8_t *data, size_t len)
     ip_addr_t spa, tpa;
     char addr[128];
 
+    if (!LOG_ENABLED(DEBUG)) {
+        return;
+    }
     message = (struct arp_ether *)data;
     flockfile(stderr);
     fprintf(stderr, "        hrd: 0x%04x\n", ntoh16(message->hdr.hrd));
@@ -97,29 +126,141 @@ arp_dump(const uint8_t *data, size_t len)
  * NOTE: ARP Cache functions must be called after mutex locked
  */
 
+static void
+arp_cache_pending_free(struct arp_cache *cache)
+{
+    struct pbuf *pb;
+
+    stats_add(STATS_ARP_PENDING_DROPS, cache->pending_num);
+    while (cache->pending) {
+        pb = cache->pending;
+        cache->pending = pb->next;
+        pb->next = NULL;
+        pbuf_free(pb);
+    }
+    cache->pending_tail = NULL;
+    pending_total -= cache->pending_num;
+    cache->pending_num = 0;
+}
+
+/* NOTE: the packets are left to the caller (see arp_pending_output()) */
+static struct pbuf *
+arp_cache_pending_take(struct arp_cache *cache)
+{
+    struct pbuf *pending;
+
+    pending = cache->pending;
+    cache->pending = cache->pending_tail = NULL;
+    pending_total -= cache->pending_num;
+    cache->pending_num = 0;
+    return pending;
+}
+
+/* NOTE: consumes pb, the oldest one is dropped if full */
+static void
+arp_cache_pending_push(struct arp_cache *cache, struct pbuf *pb)
+{
+    struct pbuf *oldest;
+
+    if (pending_total >= ARP_PENDING_TOTAL_MAX && !cache->pending) {
+        debugf("too many pending packets, total=%u", pending_total);
+        stats_inc(STATS_ARP_PENDING_DROPS);
+        pbuf_free(pb);
+        return;
+    }
+    if (cache->pending_num >= ARP_PENDING_MAX || pending_total >= ARP_PENDING_TOTAL_MAX) {
+        oldest = cache->pending;
+        cache->pending = oldest->next;
+        oldest->next = NULL;
+        stats_inc(STATS_ARP_PENDING_DROPS);
+        pbuf_free(oldest);
+        cache->pending_num--;
+        pending_total--;
+        if (!cache->pending) {
+            cache->pending_tail = NULL;
+        }
+    }
+    pb->next = NULL;
+    if (cache->pending_tail) {
+        cache->pending_tail->next = pb;
+    } else {
+        cache->pending = pb;
+    }
+    cache->pending_tail = pb;
+    cache->pending_num++;
+    pending_total++;
+}
+
+static void
+arp_cache_delete(struct arp_cache *cache)
+{
+    char addr1[IP_ADDR_STR_LEN];
+    char addr2[ETHER_ADDR_STR_LEN];
+
+    debugf("DELETE: pa=%s, ha=%s, pending=%u", ip_addr_ntop(cache->pa, addr1, sizeof(addr1)),
+        ether_addr_ntop(cache->ha, addr2, sizeof(addr2)), cache->pending_num);
+    if (cache->state == ARP_CACHE_STATE_RESOLVED) {
+        /* NOTE: forget the link address cached with the routes too */
+        ip_dst_invalidate();
+    }
+    hash_table_remove(&caches, &cache->node);
+    arp_cache_pending_free(cache);
+    if (net_timer_cancel(&cache->timer) == -1) {
+        /* NOTE: the timer is running (waiting for the mutex), it frees the entry instead */
+        cache->state = ARP_CACHE_STATE_FREE;
+        return;
+    }
+    memory_free(cache);
+}
+
+static void
+arp_cache_timer(void *arg);
+
+/* NOTE: the oldest (not static) entry is reused if the cache is full */
 static struct arp_cache *
-arp_cache_alloc(void)
+arp_cache_alloc(ip_addr_t pa)
 {
     struct arp_cache *entry, *oldest = NULL;
-
-    for (entry = caches; entry < tailof(caches); entry++) {
-        if (entry->state == ARP_CACHE_STATE_FREE) {
-            return entry;
+    struct hash_node *node;
+    size_t i;
+
+    if (caches.num >= ARP_CACHE_SIZE) {
+        for (i = 0; i < caches.size; i++) {
+            for (node = caches.buckets[i]; node; node = node->next) {
+                entry = (struct arp_cache *)node;
+                if (entry->state != ARP_CACHE_STATE_STATIC &&
+                    (!oldest || oldest->timestamp > entry->timestamp)) {
+                    oldest = entry;
+                }
+            }
         }
-        if (!oldest || timercmp(&oldest->timestamp, &entry->timestamp, >)) {
-            oldest = entry;
+        if (!oldest) {
+            return NULL;
         }
+        arp_cache_delete(oldest);
     }
-    return oldest;
+    entry = memory_alloc(sizeof(*entry));
+    if (!entry) {
+        errorf("memory_alloc() failure");
+        return NULL;
+    }
+    entry->pa = pa;
+    net_timer_init(&entry->timer, arp_cache_timer, entry);
+    hash_table_insert(&caches, &entry->node, hash32(pa));
+    return entry;
 }
 
 static struct arp_cache *
 arp_cache_select(ip_addr_t pa)
 {
     struct arp_cache *entry;
+    struct hash_node *node;
+    uint32_t hash;
 
-    for (entry = caches; entry < tailof(caches); entry++) {
-        if (entry->state != ARP_CACHE_STATE_FREE && entry->pa == pa) {
+    hash = hash32(pa);
+    for (node = hash_table_lookup(&caches, hash); node; node = node->next) {
+        entry = (struct arp_cache *)node;
+        if (node->hash == hash && entry->pa == pa) {
             return entry;
         }
     }
@@ -138,130 +279,191 @@ arp_cache_update(ip_addr_t pa, const uint8_t *ha)
         /* not found */
         return NULL;
     }
+    if (cache->state == ARP_CACHE_STATE_STATIC) {
+        return cache;
+    }
+    if (cache->state == ARP_CACHE_STATE_RESOLVED && memcmp(cache->ha, ha, ETHER_ADDR_LEN) != 0) {
+        ip_dst_invalidate();
+    }
     cache->state = ARP_CACHE_STATE_RESOLVED;
     memcpy(cache->ha, ha, ETHER_ADDR_LEN);
-    gettimeofday(&cache->timestamp, NULL);
+    cache->timestamp = net_timer_clock();
+    cache->requests = 0;
+    cache->used = 0;
+    cache->stale = 0;
+    net_timer_arm(&cache->timer, cache->timestamp + NET_TIMER_SEC(ARP_CACHE_TIMEOUT - ARP_CACHE_REFRESH));
     debugf("UPDATE: pa=%s, ha=%s", ip_addr_ntop(pa, addr1, sizeof(addr1)), ether_addr_ntop(ha, addr2, sizeof(addr2)));
     return cache;
 }
 
 static struct arp_cache *
-arp_cache_insert(ip_addr_t pa, const uint8_t *ha)
+arp_cache_insert(struct net_iface *iface, ip_addr_t pa, const uint8_t *ha)
 {
     struct arp_cache *cache;
     char addr1[IP_ADDR_STR_LEN];
     char addr2[ETHER_ADDR_STR_LEN];
 
-    cache = arp_cache_alloc();
+    cache = arp_cache_alloc(pa);
     if (!cache) {
         errorf("arp_cache_alloc() failure");
         return NULL;
     }
     cache->state = ARP_CACHE_STATE_RESOLVED;
-    cache->pa = pa;
+    cache->iface = iface;
     memcpy(cache->ha, ha, ETHER_ADDR_LEN);
-    gettimeofday(&cache->timestamp, NULL);
+    cache->timestamp = net_timer_clock();
+    net_timer_arm(&cache->timer, cache->timestamp + NET_TIMER_SEC(ARP_CACHE_TIMEOUT - ARP_CACHE_REFRESH));
     debugf("INSERT: pa=%s, ha=%s", ip_addr_ntop(pa, addr1, sizeof(addr1)), ether_addr_ntop(ha, addr2, sizeof(addr2)));
     return cache;
 }
 
-static void
-arp_cache_delete(struct arp_cache *cache)
+/* NOTE: dst is the broadcast address of the device unless probing a known entry */
+static int
+arp_request(struct net_iface *iface, ip_addr_t tpa, const uint8_t *dst)
 {
-    char addr1[IP_ADDR_STR_LEN];
-    char addr2[ETHER_ADDR_STR_LEN];
+    struct pbuf *pb;
+    struct arp_ether *request;
 
-    debugf("DELETE: pa=%s, ha=%s", ip_addr_ntop(cache->pa, addr1, sizeof(addr1)), ether_addr_ntop(cache->ha, addr2, sizeof(addr2)));
-    cache->state = ARP_CACHE_STATE_FREE;
-    cache->pa = 0;
-    memset(cache->ha, 0, ETHER_ADDR_LEN);
-    timerclear(&cache->timestamp);
+    pb = pbuf_alloc(sizeof(*request));
+    if (!pb) {
+        errorf("pbuf_alloc() failure");
+        return -1;
+    }
+    request = (struct arp_ether *)pb->data;
+    request->hdr.hrd = hton16(ARP_HRD_ETHER);
+    request->hdr.pro = hton16(ARP_PRO_IP);
+    request->hdr.hln = ETHER_ADDR_LEN;
+    request->hdr.pln = IP_ADDR_LEN;
+    request->hdr.op = hton16(ARP_OP_REQUEST);
+    memcpy(request->sha, iface->dev->addr, ETHER_ADDR_LEN);
+    memcpy(request->spa, &((struct ip_iface *)iface)->unicast, IP_ADDR_LEN);
+    memset(request->tha, 0, ETHER_ADDR_LEN);
+    memcpy(request->tpa, &tpa, IP_ADDR_LEN);
+    debugf("dev=%s, opcode=%s(0x%04x), len=%zu", iface->dev->name, arp_opcode_ntoa(request->hdr.op), ntoh16(request->hdr.op), pb->len);
+    arp_dump(pb->data, pb->len);
+    stats_inc(STATS_ARP_OUT_REQUESTS);
+    return net_device_output(iface->dev, ETHER_TYPE_ARP, pb, dst);
 }
 
-static int
-arp_request(struct net_iface *iface, ip_addr_t tpa)
+/* NOTE: you must hold the mutex, rate limited by ARP_REQUEST_INTERVAL */
+static void
+arp_cache_request(struct arp_cache *cache, uint64_t now, const uint8_t *dst)
 {
-    struct arp_ether request;
-
-    request.hdr.hrd = hton16(ARP_HRD_ETHER);
-    request.hdr.pro = hton16(ARP_PRO_IP);
-    request.hdr.hln = ETHER_ADDR_LEN;
-    request.hdr.pln = IP_ADDR_LEN;
-    request.hdr.op = hton16(ARP_OP_REQUEST);
-    memcpy(request.sha, iface->dev->addr, ETHER_ADDR_LEN);
-    memcpy(request.spa, &((struct ip_iface *)iface)->unicast, IP_ADDR_LEN);
-    memset(request.tha, 0, ETHER_ADDR_LEN);
-    memcpy(request.tpa, &tpa, IP_ADDR_LEN);
-    debugf("dev=%s, opcode=%s(0x%04x), len=%zu", iface->dev->name, arp_opcode_ntoa(request.hdr.op), ntoh16(request.hdr.op), sizeof(request));
-    arp_dump((uint8_t *)&request, sizeof(request));
-    return net_device_output(iface->dev, ETHER_TYPE_ARP, (uint8_t *)&request, sizeof(request), iface->dev->broadcast);
+    if (cache->requests && now - cache->requested < NET_TIMER_MSEC(ARP_REQUEST_INTERVAL)) {
+        return;
+    }
+    cache->requested = now;
+    cache->requests++;
+    arp_request(cache->iface, cache->pa, dst);
+}
+
+/* NOTE: the packets waiting for the resolution of ha */
+static void
+arp_pending_output(struct net_device *dev, struct pbuf *pending, const uint8_t *ha)
+{
+    struct pbuf *pb;
+
+    net_tx_begin();
+    while (pending) {
+        pb = pending;
+        pending = pb->next;
+        pb->next = NULL;
+        net_device_output(dev, NET_PROTOCOL_TYPE_IP, pb, ha);
+    }
+    net_tx_end();
 }
 
 static int
 arp_reply(struct net_iface *iface, const uint8_t *tha, ip_addr_t tpa, const uint8_t *dst)
 {
-    struct arp_ether reply;
-
-    reply.hdr.hrd = hton16(ARP_HRD_ETHER);
-    reply.hdr.pro = hton16(ARP_PRO_IP);
-    reply.hdr.hln = ETHER_ADDR_LEN;
-    reply.hdr.pln = IP_ADDR_LEN;
-    reply.hdr.op = hton16(ARP_OP_REPLY);
-    memcpy(reply.sha, iface->dev->addr, ETHER_ADDR_LEN);
-    memcpy(reply.spa, &((struct ip_iface *)iface)->unicast, IP_ADDR_LEN);
-    memcpy(reply.tha, tha, ETHER_ADDR_LEN);
-    memcpy(reply.tpa, &tpa, IP_ADDR_LEN);
-    debugf("dev=%s, opcode=%s(0x%04x), len=%zu", iface->dev->name, arp_opcode_ntoa(reply.hdr.op), ntoh16(reply.hdr.op), sizeof(reply));
-    arp_dump((uint8_t *)&reply, sizeof(reply));
-    return net_device_output(iface->dev, ETHER_TYPE_ARP, (uint8_t *)&reply, sizeof(reply), dst);
+    struct pbuf *pb;
+    struct arp_ether *reply;
+
+    pb = pbuf_alloc(sizeof(*reply));
+    if (!pb) {
+        errorf("pbuf_alloc() failure");
+        return -1;
+    }
+    reply = (struct arp_ether *)pb->data;
+    reply->hdr.hrd = hton16(ARP_HRD_ETHER);
+    reply->hdr.pro = hton16(ARP_PRO_IP);
+    reply->hdr.hln = ETHER_ADDR_LEN;
+    reply->hdr.pln = IP_ADDR_LEN;
+    reply->hdr.op = hton16(ARP_OP_REPLY);
+    memcpy(reply->sha, iface->dev->addr, ETHER_ADDR_LEN);
+    memcpy(reply->spa, &((struct ip_iface *)iface)->unicast, IP_ADDR_LEN);
+    memcpy(reply->tha, tha, ETHER_ADDR_LEN);
+    memcpy(reply->tpa, &tpa, IP_ADDR_LEN);
+    debugf("dev=%s, opcode=%s(0x%04x), len=%zu", iface->dev->name, arp_opcode_ntoa(reply->hdr.op), ntoh16(reply->hdr.op), pb->len);
+    arp_dump(pb->data, pb->len);
+    stats_inc(STATS_ARP_OUT_REPLIES);
+    return net_device_output(iface->dev, ETHER_TYPE_ARP, pb, dst);
 }
 
 static void
-arp_input(const uint8_t *data, size_t len, struct net_device *dev)
+arp_input(struct pbuf *pb, struct net_device *dev)
 {
+    const uint8_t *data = pb->data;
+    size_t len = pb->len;
     struct arp_ether *msg;
     ip_addr_t spa, tpa;
     int merge = 0;
     struct net_iface *iface;
+    struct arp_cache *cache;
+    struct pbuf *pending = NULL;
+    struct net_device *pdev = NULL;
+    uint8_t ha[ETHER_ADDR_LEN];
 
     if (len < sizeof(*msg)) {
         errorf("too short");
+        stats_inc(STATS_ARP_IN_ERRORS);
         return;
     }
     msg = (struct arp_ether *)data;
     if (ntoh16(msg->hdr.hrd) != ARP_HRD_ETHER || msg->hdr.hln != ETHER_ADDR_LEN) {
         errorf("unsupported hardware address");
+        stats_inc(STATS_ARP_IN_ERRORS);
         return;
     }
     if (ntoh16(msg->hdr.pro) != ARP_PRO_IP || msg->hdr.pln != IP_ADDR_LEN) {
         errorf("unsupported protocol address");
+        stats_inc(STATS_ARP_IN_ERRORS);
         return;
     }
     debugf("dev=%s, opcode=%s(0x%04x), len=%zu", dev->name, arp_opcode_ntoa(msg->hdr.op), ntoh16(msg->hdr.op), len);
     arp_dump(data, len);
+    stats_inc(ntoh16(msg->hdr.op) == ARP_OP_REQUEST ? STATS_ARP_IN_REQUESTS : STATS_ARP_IN_REPLIES);
     memcpy(&spa, msg->spa, sizeof(spa));
     memcpy(&tpa, msg->tpa, sizeof(tpa));
+    iface = net_device_get_iface(dev, NET_IFACE_FAMILY_IP);
     mutex_lock(&mutex);
-    if (arp_cache_update(spa, msg->sha)) {
+    cache = arp_cache_update(spa, msg->sha);
+    if (cache) {
         /* updated */
         merge = 1;
+    } else if (iface && ((struct ip_iface *)iface)->unicast == tpa) {
+        cache = arp_cache_insert(iface, spa, msg->sha);
+    }
+    if (cache && cache->pending) {
+        pending = arp_cache_pending_take(cache);
+        memcpy(ha, cache->ha, ETHER_ADDR_LEN);
+        pdev = cache->iface->dev;
     }
     mutex_unlock(&mutex);
-    iface = net_device_get_iface(dev, NET_IFACE_FAMILY_IP);
+    if (pending) {
+        debugf("output the pending packets, merge=%d", merge);
+        arp_pending_output(pdev, pending, ha);
+    }
     if (iface && ((struct ip_iface *)iface)->unicast == tpa) {
-        if (!merge) {
-            mutex_lock(&mutex);
-            arp_cache_insert(spa, msg->sha);
-            mutex_unlock(&mutex);
-        }
         if (ntoh16(msg->hdr.op) == ARP_OP_REQUEST) {
             arp_reply(iface, msg->sha, spa, msg->sha);
         }
     }
 }
 
+/* NOTE: if not resolved yet, pb (if any) is held and sent on the resolution (consumed in any case but ARP_RESOLVE_FOUND) */
 int
-arp_resolve(struct net_iface *iface, ip_addr_t pa, uint8_t *ha)
+arp_resolve(struct net_iface *iface, ip_addr_t pa, uint8_t *ha, struct pbuf *pb)
 {
     struct arp_cache *cache;
     char addr1[IP_ADDR_STR_LEN];
@@ -269,34 +471,47 @@ arp_resolve(struct net_iface *iface, ip_addr_t pa, uint8_t *ha)
 
     if (iface->dev->type != NET_DEVICE_TYPE_ETHERNET) {
         debugf("unsupported hardware address type");
+        if (pb) {
+            pbuf_free(pb);
+        }
         return ARP_RESOLVE_ERROR;
     }
     if (iface->family != NET_IFACE_FAMILY_IP) {
         debugf("unsupported protocol address type");
+        if (pb) {
+            pbuf_free(pb);
+        }
         return ARP_RESOLVE_ERROR;
     }
     mutex_lock(&mutex);
     cache = arp_cache_select(pa);
     if (!cache) {
-        cache = arp_cache_alloc();
+        cache = arp_cache_alloc(pa);
         if (!cache) {
             mutex_unlock(&mutex);
             errorf("arp_cache_alloc() failure");
+            if (pb) {
+                pbuf_free(pb);
+            }
             return ARP_RESOLVE_ERROR;
         }
         cache->state = ARP_CACHE_STATE_INCOMPLETE;
-        cache->pa = pa;
-        gettimeofday(&cache->timestamp, NULL);
-        arp_request(iface, pa);
-        mutex_unlock(&mutex);
+        cache->iface = iface;
+        cache->timestamp = net_timer_clock();
         debugf("cache not found, pa=%s", ip_addr_ntop(pa, addr1, sizeof(addr1)));
-        return ARP_RESOLVE_INCOMPLETE;
     }
     if (cache->state == ARP_CACHE_STATE_INCOMPLETE) {
-        arp_request(iface, pa); /* just in case packet loss */
+        stats_inc(STATS_ARP_MISSES);
+        if (pb) {
+            arp_cache_pending_push(cache, pb);
+        }
+        arp_cache_request(cache, net_timer_clock(), iface->dev->broadcast);
+        /* NOTE: retransmitted (or timed out) by arp_cache_timer() */
+        net_timer_reduce(&cache->timer, cache->requested + NET_TIMER_MSEC(ARP_REQUEST_INTERVAL));
         mutex_unlock(&mutex);
         return ARP_RESOLVE_INCOMPLETE;
     }
+    cache->used = 1;
     memcpy(ha, cache->ha, ETHER_ADDR_LEN);
     mutex_unlock(&mutex);
     debugf("resolved, pa=%s, ha=%s",
@@ -304,21 +519,71 @@ arp_resolve(struct net_iface *iface, ip_addr_t pa, uint8_t *ha)
     return ARP_RESOLVE_FOUND;
 }
 
+/* NOTE: you must hold the mutex */
+static uint64_t
+arp_cache_deadline(struct arp_cache *cache, uint64_t now)
+{
+    uint64_t refresh;
+
+    if (cache->state == ARP_CACHE_STATE_INCOMPLETE) {
+        return cache->requested + NET_TIMER_MSEC(ARP_REQUEST_INTERVAL);
+    }
+    refresh = cache->timestamp + NET_TIMER_SEC(ARP_CACHE_TIMEOUT - ARP_CACHE_REFRESH);
+    if (now < refresh) {
+        return refresh;
+    }
+    /* NOTE: checked at every request interval while refreshing */
+    return MIN(cache->timestamp + NET_TIMER_SEC(ARP_CACHE_TIMEOUT), now + NET_TIMER_MSEC(ARP_REQUEST_INTERVAL));
+}
+
+/* NOTE: the timer of the entry (not static) */
 static void
-arp_timer(void)
+arp_cache_timer(void *arg)
 {
-    struct arp_cache *entry;
-    struct timeval now, diff;
+    struct arp_cache *entry = arg;
+    uint64_t now;
 
     mutex_lock(&mutex);
-    gettimeofday(&now, NULL);
-    for (entry = caches; entry < tailof(caches); entry++) {
-        if (entry->state != ARP_CACHE_STATE_FREE && entry->state != ARP_CACHE_STATE_STATIC) {
-            timersub(&now, &entry->timestamp, &diff);
-            if (diff.tv_sec > ARP_CACHE_TIMEOUT) {
+    if (entry->state == ARP_CACHE_STATE_FREE) {
+        /* NOTE: deleted while this was about to run */
+        mutex_unlock(&mutex);
+        memory_free(entry);
+        return;
+    }
+    now = net_timer_clock();
+    if (entry->state == ARP_CACHE_STATE_INCOMPLETE) {
+        if (entry->requests >= ARP_REQUEST_RETRY) {
+            if (now - entry->requested >= NET_TIMER_MSEC(ARP_REQUEST_INTERVAL)) {
+                /* NOTE: no reply, the pending packets are dropped */
+                stats_inc(STATS_ARP_TIMEOUTS);
                 arp_cache_delete(entry);
             }
+        } else {
+            arp_cache_request(entry, now, entry->iface->dev->broadcast);
         }
+    } else if (entry->state == ARP_CACHE_STATE_RESOLVED) {
+        if (now - entry->timestamp >= NET_TIMER_SEC(ARP_CACHE_TIMEOUT)) {
+            arp_cache_delete(entry);
+        } else if (now - entry->timestamp >= NET_TIMER_SEC(ARP_CACHE_TIMEOUT - ARP_CACHE_REFRESH)) {
+            if (!entry->used && !entry->stale) {
+                /* NOTE: the flows with the cached struct ip_dst do not call arp_resolve(), make them to do once */
+                entry->stale = 1;
+                ip_dst_invalidate();
+            }
+            if (entry->used && entry->requests < ARP_REQUEST_RETRY) {
+                /* NOTE: refreshed before it expires, not to lose the packets of an active flow */
+                arp_cache_request(entry, now, entry->ha);
+            }
+        }
+    }
+    if (entry->state == ARP_CACHE_STATE_FREE) {
+        /* NOTE: deleted above, left by arp_cache_delete() as this is running */
+        mutex_unlock(&mutex);
+        memory_free(entry);
+        return;
+    }
+    if (entry->state != ARP_CACHE_STATE_STATIC) {
+        net_timer_arm(&entry->timer, arp_cache_deadline(entry, now));
     }
     mutex_unlock(&mutex);
 }
@@ -326,14 +591,12 @@ arp_timer(void)
 int
 arp_init(void)
 {
-    struct timeval interval = {1, 0};
-
-    if (net_protocol_register("ARP", NET_PROTOCOL_TYPE_ARP, arp_input) == -1) {
-        errorf("net_protocol_register() failure");
+    if (hash_table_init(&caches, ARP_CACHE_HASH_SIZE) == -1) {
+        errorf("hash_table_init() failure");
         return -1;
     }
-    if (net_timer_register("ARP Timer", interval, arp_timer) == -1) {
-        errorf("net_timer_register() failure");
+    if (net_protocol_register("ARP", NET_PROTOCOL_TYPE_ARP, arp_input) == -1) {
+        errorf("net_protocol_register() failure");
         return -1;
     }
     return 0;
@@ -0,0 +1,45 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "stats.h"
+
+#include "bench/bench.h"
+
+uint64_t
+bench_now(void)
+{
+    return stats_clock();
+}
+
+void
+bench_result(const char *bench, const char *param, double value, const char *unit)
+{
+    printf("{\"bench\":\"%s\",\"param\":\"%s\",\"value\":%.3f,\"unit\":\"%s\"}\n", bench, param ? param : "", value, unit);
+    fflush(stdout);
+}
+
+static int
+bench_compare(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* NOTE: nearest-rank (0-100), the samples are sorted in place */
+uint64_t
+bench_percentile(uint64_t *samples, size_t num, double percentile)
+{
+    size_t rank;
+
+    if (!num) {
+        return 0;
+    }
+    qsort(samples, num, sizeof(*samples), bench_compare);
+    rank = (size_t)(num * percentile / 100);
+    if (rank >= num) {
+        rank = num - 1;
+    }
+    return samples[rank];
+}
@@ -0,0 +1,24 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Benchmark helpers
+ *
+ * NOTE: the results are written to stdout one JSON object per line (the logs go to stderr), e.g.
+ *       {"bench":"cksum16","param":"1500","value":123.4,"unit":"ns/op"}
+ */
+
+extern uint64_t
+bench_now(void);
+extern void
+bench_result(const char *bench, const char *param, double value, const char *unit);
+extern uint64_t
+bench_percentile(uint64_t *samples, size_t num, double percentile);
+
+/* NOTE: keeps the compiler from optimizing away the value */
+#define bench_keep(x) __asm__ __volatile__("" : : "g"(x) : "memory")
+
+#endif
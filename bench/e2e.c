@@ -0,0 +1,549 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+
+#include "platform.h"
+
+#include "util.h"
+#include "net.h"
+#include "ip.h"
+#include "sock.h"
+
+#include "driver/null.h"
+#include "driver/loopback.h"
+#include "driver/ether_tap.h"
+
+#include "test/test.h"
+
+#include "bench/bench.h"
+
+#define E2E_PORT_SINK    5001
+#define E2E_PORT_ECHO    5002
+#define E2E_PORT_CONNECT 5003
+#define E2E_PORT_UDP     5004
+
+/* NOTE: the benchmarking address range (RFC 2544) */
+#define E2E_NULL_ADDR    "198.18.0.1"
+#define E2E_NULL_PEER    "198.18.0.2"
+#define E2E_TAP_NETMASK  "255.255.255.0"
+
+#define E2E_BULK_SIZE     65536
+#define E2E_RR_SIZE       64
+#define E2E_RR_SAMPLES    (1 << 20)
+#define E2E_CONNECT_MAX   4096
+#define E2E_UDP_SIZE      64
+#define E2E_UDP_BATCH     32
+#define E2E_UDP_END       "END"
+#define E2E_UDP_END_TRIES 10
+
+static const char *mode;
+static uint64_t duration = 3; /* seconds */
+
+static int
+e2e_listen(uint16_t port)
+{
+    struct sockaddr_in local = { .sin_family=AF_INET };
+    int soc;
+
+    soc = sock_open(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (soc == -1) {
+        errorf("sock_open() failure");
+        return -1;
+    }
+    local.sin_port = hton16(port);
+    if (sock_bind(soc, (struct sockaddr *)&local, sizeof(local)) == -1) {
+        errorf("sock_bind() failure, port=%u", port);
+        sock_close(soc);
+        return -1;
+    }
+    if (sock_listen(soc, 16) == -1) {
+        errorf("sock_listen() failure, port=%u", port);
+        sock_close(soc);
+        return -1;
+    }
+    return soc;
+}
+
+static int
+e2e_accept(int soc)
+{
+    struct sockaddr_in foreign;
+    int foreignlen = sizeof(foreign);
+
+    return sock_accept(soc, (struct sockaddr *)&foreign, &foreignlen);
+}
+
+static int
+e2e_connect(ip_addr_t peer, uint16_t port)
+{
+    struct sockaddr_in foreign = { .sin_family=AF_INET };
+    int soc;
+
+    soc = sock_open(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (soc == -1) {
+        errorf("sock_open() failure");
+        return -1;
+    }
+    foreign.sin_addr = peer;
+    foreign.sin_port = hton16(port);
+    if (sock_connect(soc, (struct sockaddr *)&foreign, sizeof(foreign)) == -1) {
+        errorf("sock_connect() failure, port=%u", port);
+        sock_close(soc);
+        return -1;
+    }
+    return soc;
+}
+
+/*
+ * Servers (run forever)
+ */
+
+static void *
+server_sink(void *arg)
+{
+    static uint8_t buf[E2E_BULK_SIZE];
+    int soc, acc;
+
+    soc = e2e_listen(E2E_PORT_SINK);
+    if (soc == -1) {
+        return NULL;
+    }
+    while ((acc = e2e_accept(soc)) != -1) {
+        while (sock_recv(acc, buf, sizeof(buf)) > 0);
+        sock_close(acc);
+    }
+    errorf("sock_accept() failure");
+    sock_close(soc);
+    return NULL;
+}
+
+static void *
+server_echo(void *arg)
+{
+    uint8_t buf[4096];
+    int soc, acc, one = 1;
+    ssize_t ret;
+
+    soc = e2e_listen(E2E_PORT_ECHO);
+    if (soc == -1) {
+        return NULL;
+    }
+    while ((acc = e2e_accept(soc)) != -1) {
+        sock_setsockopt(acc, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        while ((ret = sock_recv(acc, buf, sizeof(buf))) > 0) {
+            if (sock_send(acc, buf, ret) != ret) {
+                break;
+            }
+        }
+        sock_close(acc);
+    }
+    errorf("sock_accept() failure");
+    sock_close(soc);
+    return NULL;
+}
+
+static void *
+server_connect(void *arg)
+{
+    int soc, acc;
+
+    soc = e2e_listen(E2E_PORT_CONNECT);
+    if (soc == -1) {
+        return NULL;
+    }
+    while ((acc = e2e_accept(soc)) != -1) {
+        sock_close(acc);
+    }
+    errorf("sock_accept() failure");
+    sock_close(soc);
+    return NULL;
+}
+
+/* NOTE: counts the datagrams, answers the count to E2E_UDP_END (also to the retries) and starts over on the next one */
+static void *
+server_udp(void *arg)
+{
+    struct sockaddr_in local = { .sin_family=AF_INET }, foreign;
+    int soc, foreignlen;
+    uint8_t buf[2048];
+    uint64_t count = 0;
+    int answered = 0;
+    ssize_t ret;
+
+    soc = sock_open(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (soc == -1) {
+        errorf("sock_open() failure");
+        return NULL;
+    }
+    local.sin_port = hton16(E2E_PORT_UDP);
+    if (sock_bind(soc, (struct sockaddr *)&local, sizeof(local)) == -1) {
+        errorf("sock_bind() failure");
+        sock_close(soc);
+        return NULL;
+    }
+    while (1) {
+        foreignlen = sizeof(foreign);
+        ret = sock_recvfrom(soc, buf, sizeof(buf), (struct sockaddr *)&foreign, &foreignlen);
+        if (ret == -1) {
+            errorf("sock_recvfrom() failure");
+            break;
+        }
+        if (ret == sizeof(E2E_UDP_END) && memcmp(buf, E2E_UDP_END, sizeof(E2E_UDP_END)) == 0) {
+            sock_sendto(soc, &count, sizeof(count), (struct sockaddr *)&foreign, foreignlen);
+            answered = 1;
+            continue;
+        }
+        if (answered) {
+            count = 0;
+            answered = 0;
+        }
+        count++;
+    }
+    sock_close(soc);
+    return NULL;
+}
+
+static int
+servers_start(void)
+{
+    void *(*servers[])(void *arg) = { server_sink, server_echo, server_connect, server_udp };
+    thread_t thread;
+    size_t i;
+
+    for (i = 0; i < countof(servers); i++) {
+        if (thread_create(&thread, servers[i], NULL, -1) == -1) {
+            errorf("thread_create() failure");
+            return -1;
+        }
+    }
+    /* NOTE: give them time to be listening */
+    usleep(100 * 1000);
+    return 0;
+}
+
+/*
+ * Clients
+ */
+
+static int
+client_tcp_bulk(ip_addr_t peer)
+{
+    static uint8_t buf[E2E_BULK_SIZE];
+    uint64_t start, elapsed, total = 0;
+    ssize_t ret;
+    int soc;
+
+    soc = e2e_connect(peer, E2E_PORT_SINK);
+    if (soc == -1) {
+        return -1;
+    }
+    memset(buf, 0x5a, sizeof(buf));
+    start = bench_now();
+    do {
+        ret = sock_send(soc, buf, sizeof(buf));
+        if (ret <= 0) {
+            errorf("sock_send() failure");
+            sock_close(soc);
+            return -1;
+        }
+        total += ret;
+        elapsed = bench_now() - start;
+    } while (elapsed < duration * 1000000000);
+    sock_close(soc);
+    bench_result("tcp_bulk", mode, (double)total * 8 * 1000 / elapsed, "Mbit/s");
+    return 0;
+}
+
+static int
+client_tcp_rr(ip_addr_t peer)
+{
+    uint8_t buf[E2E_RR_SIZE];
+    uint64_t *samples, start, begin, now, count = 0;
+    size_t got, num = 0;
+    ssize_t ret;
+    int soc, one = 1;
+
+    samples = memory_alloc(sizeof(*samples) * E2E_RR_SAMPLES);
+    if (!samples) {
+        errorf("memory_alloc() failure");
+        return -1;
+    }
+    soc = e2e_connect(peer, E2E_PORT_ECHO);
+    if (soc == -1) {
+        memory_free(samples);
+        return -1;
+    }
+    sock_setsockopt(soc, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    memset(buf, 0xa5, sizeof(buf));
+    begin = now = bench_now();
+    while (now - begin < duration * 1000000000) {
+        start = now;
+        if (sock_send(soc, buf, sizeof(buf)) != sizeof(buf)) {
+            errorf("sock_send() failure");
+            break;
+        }
+        for (got = 0; got < sizeof(buf); got += ret) {
+            ret = sock_recv(soc, buf + got, sizeof(buf) - got);
+            if (ret <= 0) {
+                break;
+            }
+        }
+        if (got < sizeof(buf)) {
+            errorf("sock_recv() failure");
+            break;
+        }
+        now = bench_now();
+        if (num < E2E_RR_SAMPLES) {
+            samples[num++] = now - start;
+        }
+        count++;
+    }
+    sock_close(soc);
+    if (count) {
+        bench_result("tcp_rr", mode, (double)count * 1000000000 / (now - begin), "trans/s");
+        bench_result("tcp_rr_p50", mode, bench_percentile(samples, num, 50) / 1000.0, "us");
+        bench_result("tcp_rr_p90", mode, bench_percentile(samples, num, 90) / 1000.0, "us");
+        bench_result("tcp_rr_p99", mode, bench_percentile(samples, num, 99) / 1000.0, "us");
+        bench_result("tcp_rr_p99.9", mode, bench_percentile(samples, num, 99.9) / 1000.0, "us");
+    }
+    memory_free(samples);
+    return count ? 0 : -1;
+}
+
+/* NOTE: the server closes first, TIME_WAIT is left on its side (E2E_CONNECT_MAX keeps the PCBs bounded) */
+static int
+client_tcp_connect(ip_addr_t peer)
+{
+    uint64_t begin, elapsed;
+    uint8_t buf[16];
+    size_t count = 0;
+    int soc;
+
+    begin = bench_now();
+    do {
+        soc = e2e_connect(peer, E2E_PORT_CONNECT);
+        if (soc == -1) {
+            break;
+        }
+        /* NOTE: wait for the FIN from the server */
+        while (sock_recv(soc, buf, sizeof(buf)) > 0);
+        sock_close(soc);
+        count++;
+        elapsed = bench_now() - begin;
+    } while (elapsed < duration * 1000000000 && count < E2E_CONNECT_MAX);
+    if (!count) {
+        return -1;
+    }
+    bench_result("tcp_connect", mode, (double)count * 1000000000 / elapsed, "conn/s");
+    return 0;
+}
+
+/* NOTE: rx is not measured without a peer (the null device) */
+static int
+client_udp_pps(ip_addr_t peer, int with_peer)
+{
+    struct sockaddr_in foreign = { .sin_family=AF_INET }, from;
+    struct mmsghdr msgs[E2E_UDP_BATCH];
+    struct pollfd pfd;
+    uint8_t buf[E2E_UDP_SIZE];
+    uint64_t begin, elapsed, sent = 0, received = 0, failed = 0;
+    int soc, ret, i, fromlen;
+
+    soc = sock_open(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (soc == -1) {
+        errorf("sock_open() failure");
+        return -1;
+    }
+    foreign.sin_addr = peer;
+    foreign.sin_port = hton16(E2E_PORT_UDP);
+    memset(buf, 0x3c, sizeof(buf));
+    for (i = 0; i < E2E_UDP_BATCH; i++) {
+        msgs[i].msg_buf = buf;
+        msgs[i].msg_size = sizeof(buf);
+        msgs[i].msg_name = (struct sockaddr *)&foreign;
+        msgs[i].msg_namelen = sizeof(foreign);
+    }
+    begin = bench_now();
+    do {
+        ret = sock_sendmmsg(soc, msgs, E2E_UDP_BATCH);
+        if (ret == -1) {
+            /* NOTE: out of the buffers (the queue of the receiver is full), let it drain */
+            failed++;
+            sched_yield();
+        } else {
+            sent += ret;
+        }
+        elapsed = bench_now() - begin;
+    } while (elapsed < duration * 1000000000);
+    if (failed) {
+        warnf("sock_sendmmsg() failed %lu times", failed);
+    }
+    bench_result("udp_tx_pps", mode, (double)sent * 1000000000 / elapsed, "pkt/s");
+    if (with_peer) {
+        pfd.fd = soc;
+        pfd.events = POLLIN;
+        for (i = 0; i < E2E_UDP_END_TRIES; i++) {
+            sock_sendto(soc, E2E_UDP_END, sizeof(E2E_UDP_END), (struct sockaddr *)&foreign, sizeof(foreign));
+            if (sock_poll(&pfd, 1, 1000) == 1) {
+                fromlen = sizeof(from);
+                if (sock_recvfrom(soc, &received, sizeof(received), (struct sockaddr *)&from, &fromlen) == sizeof(received)) {
+                    break;
+                }
+            }
+        }
+        if (i == E2E_UDP_END_TRIES) {
+            errorf("no answer from the server");
+        } else {
+            bench_result("udp_rx_pps", mode, (double)received * 1000000000 / elapsed, "pkt/s");
+            bench_result("udp_loss", mode, sent ? 100.0 * (sent - MIN(received, sent)) / sent : 0, "%");
+        }
+    }
+    sock_close(soc);
+    return 0;
+}
+
+static int
+clients_run(ip_addr_t peer)
+{
+    int ret = 0;
+
+    ret |= client_tcp_bulk(peer);
+    ret |= client_tcp_rr(peer);
+    ret |= client_tcp_connect(peer);
+    ret |= client_udp_pps(peer, 1);
+    return ret;
+}
+
+/*
+ * Setup
+ */
+
+static struct ip_iface *
+setup_iface(struct net_device *dev, const char *addr, const char *netmask)
+{
+    struct ip_iface *iface;
+
+    if (!dev) {
+        errorf("device initialize failure");
+        return NULL;
+    }
+    iface = ip_iface_alloc(addr, netmask);
+    if (!iface) {
+        errorf("ip_iface_alloc() failure");
+        return NULL;
+    }
+    if (ip_iface_register(dev, iface) == -1) {
+        errorf("ip_iface_register() failure");
+        return NULL;
+    }
+    return iface;
+}
+
+static void
+usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s loopback [seconds]\n", name);
+    fprintf(stderr, "       %s null [seconds]\n", name);
+    fprintf(stderr, "       %s tap server|client <name> <hwaddr> <addr> <peer> [seconds]\n", name);
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct ip_iface *iface;
+    ip_addr_t peer;
+    int server = 0, ret = 0;
+
+    /*
+     * Parse command line parameters
+     */
+    if (argc < 2) {
+        usage(argv[0]);
+        return -1;
+    }
+    mode = argv[1];
+    if (strcmp(mode, "loopback") == 0 || strcmp(mode, "null") == 0) {
+        if (argc > 3) {
+            usage(argv[0]);
+            return -1;
+        }
+        if (argc == 3) {
+            duration = strtoul(argv[2], NULL, 10);
+        }
+    } else if (strcmp(mode, "tap") == 0) {
+        if (argc != 7 && argc != 8) {
+            usage(argv[0]);
+            return -1;
+        }
+        if (strcmp(argv[2], "server") == 0) {
+            server = 1;
+        } else if (strcmp(argv[2], "client") != 0) {
+            usage(argv[0]);
+            return -1;
+        }
+        if (ip_addr_pton(argv[6], &peer) == -1) {
+            errorf("ip_addr_pton() failure, addr=%s", argv[6]);
+            return -1;
+        }
+        if (argc == 8) {
+            duration = strtoul(argv[7], NULL, 10);
+        }
+    } else {
+        usage(argv[0]);
+        return -1;
+    }
+    if (!duration) {
+        fprintf(stderr, "seconds must be positive\n");
+        return -1;
+    }
+    /*
+     * Setup protocol stack
+     */
+    if (net_init() == -1) {
+        errorf("net_init() failure");
+        return -1;
+    }
+    if (strcmp(mode, "loopback") == 0) {
+        iface = setup_iface(loopback_init(), LOOPBACK_IP_ADDR, LOOPBACK_NETMASK);
+        ip_addr_pton(LOOPBACK_IP_ADDR, &peer);
+    } else if (strcmp(mode, "null") == 0) {
+        iface = setup_iface(null_init(), E2E_NULL_ADDR, E2E_TAP_NETMASK);
+        ip_addr_pton(E2E_NULL_PEER, &peer);
+    } else {
+        iface = setup_iface(ether_tap_init(argv[3], argv[4]), argv[5], E2E_TAP_NETMASK);
+    }
+    if (!iface) {
+        return -1;
+    }
+    if (net_run() == -1) {
+        errorf("net_run() failure");
+        return -1;
+    }
+    /*
+     * Application Code
+     */
+    if (strcmp(mode, "null") == 0) {
+        ret = client_udp_pps(peer, 0);
+    } else if (strcmp(mode, "loopback") == 0) {
+        ret = servers_start() == -1 ? -1 : clients_run(peer);
+    } else if (server) {
+        if (servers_start() == -1) {
+            ret = -1;
+        } else {
+            infof("serving, press Ctrl+C to terminate");
+            while (1) {
+                pause();
+            }
+        }
+    } else {
+        ret = clients_run(peer);
+    }
+    /*
+     * Cleanup protocol stack
+     */
+    net_shutdown();
+    return ret;
+}
@@ -0,0 +1,405 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+
+#include "platform.h"
+
+#include "util.h"
+#include "net.h"
+#include "ip.h"
+
+#include "driver/null.h"
+
+#include "bench/bench.h"
+
+#define MICRO_NULL_ADDR    "198.18.0.1"
+#define MICRO_NULL_NETMASK "255.254.0.0"
+#define MICRO_NEXTHOP      "198.18.0.2"
+
+#define MICRO_KEYS 4096 /* power of 2 */
+
+static size_t iterations = 1000000;
+
+static uint32_t
+micro_random(uint32_t *state)
+{
+    /* NOTE: xorshift32, reproducible across the runs */
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
+
+static void
+micro_cksum16(void)
+{
+    static const uint16_t sizes[] = { 20, 64, 576, 1500, 9000, 65535 };
+    static uint8_t src[65536], dst[65536];
+    char param[16];
+    uint64_t start, elapsed;
+    size_t i, j, n;
+    uint16_t sum = 0;
+
+    for (i = 0; i < sizeof(src); i++) {
+        src[i] = i * 7;
+    }
+    for (i = 0; i < countof(sizes); i++) {
+        snprintf(param, sizeof(param), "%u", sizes[i]);
+        n = MAX(iterations * 64 / sizes[i], 1000);
+        start = bench_now();
+        for (j = 0; j < n; j++) {
+            sum = cksum16((uint16_t *)src, sizes[i], sum);
+            bench_keep(sum);
+        }
+        elapsed = bench_now() - start;
+        bench_result("cksum16", param, (double)sizes[i] * n / elapsed, "GB/s");
+        start = bench_now();
+        for (j = 0; j < n; j++) {
+            sum = cksum16_copy(dst, src, sizes[i], sum);
+            bench_keep(sum);
+        }
+        elapsed = bench_now() - start;
+        bench_result("cksum16_copy", param, (double)sizes[i] * n / elapsed, "GB/s");
+    }
+}
+
+static void
+micro_list(void)
+{
+    static const size_t depths[] = { 1, 64, 1024 };
+    static struct list_node nodes[1024];
+    struct list_head list;
+    struct list_node *node;
+    char param[16];
+    uint64_t start, elapsed;
+    size_t i, j, k, rounds;
+
+    list_init(&list);
+    for (i = 0; i < countof(depths); i++) {
+        snprintf(param, sizeof(param), "depth=%zu", depths[i]);
+        rounds = MAX(iterations / depths[i], 1);
+        start = bench_now();
+        for (j = 0; j < rounds; j++) {
+            for (k = 0; k < depths[i]; k++) {
+                list_push(&list, &nodes[k]);
+            }
+            for (k = 0; k < depths[i]; k++) {
+                node = list_pop(&list);
+                bench_keep(node);
+            }
+        }
+        elapsed = bench_now() - start;
+        bench_result("list_push_pop", param, (double)elapsed / (rounds * depths[i]), "ns/op");
+    }
+}
+
+/* NOTE: one thread, enqueue and dequeue in batches of the given size */
+static void
+micro_ring(void)
+{
+    static const unsigned int batches[] = { 1, 8, 32 };
+    struct ring *ring;
+    void *objs[32];
+    char param[32];
+    uint64_t start, elapsed;
+    size_t i, j, rounds;
+    int mp;
+
+    ring = ring_alloc(1024);
+    if (!ring) {
+        errorf("ring_alloc() failure");
+        return;
+    }
+    for (i = 0; i < countof(objs); i++) {
+        objs[i] = &objs[i];
+    }
+    for (mp = 0; mp < 2; mp++) {
+        for (i = 0; i < countof(batches); i++) {
+            snprintf(param, sizeof(param), "%s,batch=%u", mp ? "mp" : "sp", batches[i]);
+            rounds = MAX(iterations / batches[i], 1);
+            start = bench_now();
+            for (j = 0; j < rounds; j++) {
+                if (mp) {
+                    ring_enqueue_mp(ring, objs, batches[i]);
+                } else {
+                    ring_enqueue(ring, objs, batches[i]);
+                }
+                ring_dequeue(ring, objs, batches[i]);
+            }
+            elapsed = bench_now() - start;
+            bench_result("ring_enqueue_dequeue", param, (double)elapsed / (rounds * batches[i]), "ns/op");
+        }
+    }
+    ring_free(ring);
+}
+
+#define MICRO_HANDOFF_PRODUCERS_MAX 4
+#define MICRO_HANDOFF_BATCH 32
+
+struct micro_handoff {
+    struct ring *ring;
+    int mp;
+    size_t num; /* per producer */
+};
+
+static void *
+micro_handoff_producer(void *arg)
+{
+    struct micro_handoff *handoff = arg;
+    void *objs[MICRO_HANDOFF_BATCH];
+    size_t sent = 0, i;
+    unsigned int n;
+
+    for (i = 0; i < countof(objs); i++) {
+        objs[i] = handoff;
+    }
+    while (sent < handoff->num) {
+        n = MIN(MICRO_HANDOFF_BATCH, handoff->num - sent);
+        n = handoff->mp ? ring_enqueue_mp(handoff->ring, objs, n) : ring_enqueue(handoff->ring, objs, n);
+        if (!n) {
+            sched_yield();
+        }
+        sent += n;
+    }
+    return NULL;
+}
+
+/* NOTE: from the producer threads to the consumer (this thread) through a ring, SPSC and MPSC */
+static void
+micro_ring_handoff(void)
+{
+    static const unsigned int producers[] = { 1, 1, MICRO_HANDOFF_PRODUCERS_MAX };
+    struct micro_handoff handoff;
+    thread_t threads[MICRO_HANDOFF_PRODUCERS_MAX];
+    void *objs[MICRO_HANDOFF_BATCH];
+    char param[32];
+    uint64_t start, elapsed;
+    size_t got, total;
+    unsigned int i, p, n;
+
+    handoff.ring = ring_alloc(1024);
+    if (!handoff.ring) {
+        errorf("ring_alloc() failure");
+        return;
+    }
+    for (i = 0; i < countof(producers); i++) {
+        handoff.mp = (i > 0);
+        handoff.num = iterations * 4 / producers[i];
+        total = handoff.num * producers[i];
+        start = bench_now();
+        for (p = 0; p < producers[i]; p++) {
+            if (thread_create(&threads[p], micro_handoff_producer, &handoff, -1) == -1) {
+                errorf("thread_create() failure");
+                return;
+            }
+        }
+        for (got = 0; got < total; got += n) {
+            n = ring_dequeue(handoff.ring, objs, countof(objs));
+            if (!n) {
+                sched_yield();
+            }
+        }
+        elapsed = bench_now() - start;
+        for (p = 0; p < producers[i]; p++) {
+            thread_join(threads[p]);
+        }
+        snprintf(param, sizeof(param), "%s,producers=%u", handoff.mp ? "mpsc" : "spsc", producers[i]);
+        bench_result("ring_handoff", param, (double)total * 1000 / elapsed, "Mops/s");
+    }
+    ring_free(handoff.ring);
+}
+
+/*
+ * NOTE: tcp_pcb_select() is internal to tcp.c, this one measures the same lookup on its own:
+ *       the connection table (util hash_table) keyed by tcp_pcb_conn_hash() and compared by the 4-tuple.
+ */
+struct micro_pcb {
+    struct hash_node node;
+    struct ip_endpoint local;
+    struct ip_endpoint foreign;
+};
+
+static uint32_t
+micro_pcb_hash(uint16_t port, struct ip_endpoint *foreign)
+{
+    return hash32(foreign->addr ^ hash32(((uint32_t)port << 16) | foreign->port));
+}
+
+static struct micro_pcb *
+micro_pcb_select(struct hash_table *table, struct ip_endpoint *local, struct ip_endpoint *foreign)
+{
+    struct hash_node *node;
+    struct micro_pcb *pcb;
+    uint32_t hash;
+
+    hash = micro_pcb_hash(local->port, foreign);
+    for (node = hash_table_lookup(table, hash); node; node = node->next) {
+        if (node->hash != hash) {
+            continue;
+        }
+        pcb = containerof(node, struct micro_pcb, node);
+        if (pcb->local.addr == local->addr && pcb->local.port == local->port &&
+            pcb->foreign.addr == foreign->addr && pcb->foreign.port == foreign->port) {
+            return pcb;
+        }
+    }
+    return NULL;
+}
+
+static void
+micro_pcb_lookup(void)
+{
+    static const size_t nums[] = { 16, 1024, 65536 };
+    struct hash_table table;
+    struct micro_pcb *pcbs, *pcb;
+    struct ip_endpoint *keys;
+    char param[16];
+    uint64_t start, elapsed;
+    uint32_t state = 1;
+    size_t i, j, found;
+
+    for (i = 0; i < countof(nums); i++) {
+        if (hash_table_init(&table, 16) == -1) {
+            errorf("hash_table_init() failure");
+            return;
+        }
+        pcbs = memory_alloc(sizeof(*pcbs) * nums[i]);
+        keys = memory_alloc(sizeof(*keys) * MICRO_KEYS);
+        if (!pcbs || !keys) {
+            errorf("memory_alloc() failure");
+            return;
+        }
+        for (j = 0; j < nums[i]; j++) {
+            pcbs[j].local.addr = hton32(0xc6120001); /* 198.18.0.1 */
+            pcbs[j].local.port = hton16(5001);
+            pcbs[j].foreign.addr = hton32(0xc6130000 | (micro_random(&state) & 0xffff)); /* 198.19.0.0/16 */
+            pcbs[j].foreign.port = hton16(1024 + j % 60000);
+            hash_table_insert(&table, &pcbs[j].node, micro_pcb_hash(pcbs[j].local.port, &pcbs[j].foreign));
+        }
+        for (j = 0; j < MICRO_KEYS; j++) {
+            keys[j] = pcbs[micro_random(&state) % nums[i]].foreign;
+        }
+        found = 0;
+        start = bench_now();
+        for (j = 0; j < iterations; j++) {
+            pcb = micro_pcb_select(&table, &pcbs[0].local, &keys[j & (MICRO_KEYS - 1)]);
+            found += pcb ? 1 : 0;
+            bench_keep(pcb);
+        }
+        elapsed = bench_now() - start;
+        if (found != iterations) {
+            warnf("missed, %zu/%zu", iterations - found, iterations);
+        }
+        snprintf(param, sizeof(param), "pcbs=%zu", nums[i]);
+        bench_result("pcb_lookup", param, (double)elapsed / iterations, "ns/op");
+        for (j = 0; j < nums[i]; j++) {
+            hash_table_remove(&table, &pcbs[j].node);
+        }
+        memory_free(table.buckets);
+        memory_free(keys);
+        memory_free(pcbs);
+    }
+}
+
+static void
+micro_route_lookup(void)
+{
+    static const size_t nums[] = { 1, 256, 4096, 32768 };
+    struct net_device *dev;
+    struct ip_iface *iface;
+    struct ip_dst dst;
+    ip_addr_t nexthop, *keys;
+    char param[16];
+    uint64_t start, elapsed;
+    uint32_t state = 1;
+    size_t added = 0, i, j;
+
+    dev = null_init();
+    if (!dev) {
+        errorf("null_init() failure");
+        return;
+    }
+    iface = ip_iface_alloc(MICRO_NULL_ADDR, MICRO_NULL_NETMASK);
+    if (!iface) {
+        errorf("ip_iface_alloc() failure");
+        return;
+    }
+    if (ip_iface_register(dev, iface) == -1) {
+        errorf("ip_iface_register() failure");
+        return;
+    }
+    ip_addr_pton(MICRO_NEXTHOP, &nexthop);
+    /* NOTE: the default route makes any address found, the others are /24s in 10.0.0.0/8 */
+    if (ip_route_add(IP_ADDR_ANY, IP_ADDR_ANY, nexthop, iface) == -1) {
+        errorf("ip_route_add() failure");
+        return;
+    }
+    keys = memory_alloc(sizeof(*keys) * MICRO_KEYS);
+    if (!keys) {
+        errorf("memory_alloc() failure");
+        return;
+    }
+    for (i = 0; i < countof(nums); i++) {
+        for (; added < nums[i]; added++) {
+            if (ip_route_add(hton32(0x0a000000 | (added << 8)), hton32(0xffffff00), nexthop, iface) == -1) {
+                errorf("ip_route_add() failure");
+                memory_free(keys);
+                return;
+            }
+        }
+        for (j = 0; j < MICRO_KEYS; j++) {
+            /* NOTE: the half of them hit one of the /24s, the others fall to the default route */
+            keys[j] = hton32(0x0a000000 | (micro_random(&state) % (nums[i] * 2) << 8 & 0xffff00) | (j & 0xff));
+        }
+        start = bench_now();
+        for (j = 0; j < iterations; j++) {
+            if (ip_dst_lookup(&dst, IP_ADDR_ANY, keys[j & (MICRO_KEYS - 1)]) == -1) {
+                errorf("ip_dst_lookup() failure");
+                break;
+            }
+            bench_keep(dst.iface);
+        }
+        elapsed = bench_now() - start;
+        snprintf(param, sizeof(param), "routes=%zu", nums[i] + 2);
+        bench_result("route_lookup", param, (double)elapsed / j, "ns/op");
+    }
+    memory_free(keys);
+}
+
+int
+main(int argc, char *argv[])
+{
+    /*
+     * Parse command line parameters
+     */
+    switch (argc) {
+    case 2:
+        iterations = strtoul(argv[1], NULL, 10);
+        /* fall through */
+    case 1:
+        break;
+    default:
+        fprintf(stderr, "Usage: %s [iterations]\n", argv[0]);
+        return -1;
+    }
+    if (!iterations) {
+        fprintf(stderr, "iterations must be positive\n");
+        return -1;
+    }
+    /*
+     * Setup protocol stack (only the tables, not running)
+     */
+    if (net_init() == -1) {
+        errorf("net_init() failure");
+        return -1;
+    }
+    micro_cksum16();
+    micro_list();
+    micro_ring();
+    micro_ring_handoff();
+    micro_pcb_lookup();
+    micro_route_lookup();
+    return 0;
+}
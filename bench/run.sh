@@ -0,0 +1,72 @@
+#!/bin/sh
+#
+# Runs the benchmarks and writes the results (JSON lines) to $BENCH_OUT
+#
+#   BENCH_OUT      results file (default: bench/results.jsonl)
+#   BENCH_LOG      logs of the stacks (default: bench/bench.log)
+#   BENCH_SECONDS  duration of each end-to-end benchmark (default: 3)
+#   BENCH_TAP=1    also over a pair of tap devices bridged by the kernel (requires root)
+#
+# NOTE: build with CFLAGS=-DLOG_LEVEL=LOG_LEVEL_WARN for the numbers, the debug logs dominate otherwise
+#
+
+cd "$(dirname "$0")/.." || exit 1
+
+OUT=${BENCH_OUT:-bench/results.jsonl}
+LOG=${BENCH_LOG:-bench/bench.log}
+SEC=${BENCH_SECONDS:-3}
+
+TAP_BRIDGE=bbench0
+TAP_CLIENT=tbench0
+TAP_SERVER=tbench1
+TAP_CLIENT_HWADDR=00:00:5e:00:53:10
+TAP_SERVER_HWADDR=00:00:5e:00:53:11
+TAP_CLIENT_ADDR=198.18.0.1
+TAP_SERVER_ADDR=198.18.0.2
+
+: > "$OUT"
+: > "$LOG"
+
+run() {
+    echo "# $*" >&2
+    "$@" >> "$OUT" 2>> "$LOG" || echo "# failed: $*" >&2
+}
+
+tap_setup() {
+    ip link add "$TAP_BRIDGE" type bridge || return 1
+    ip link set "$TAP_BRIDGE" up
+    for tap in "$TAP_CLIENT" "$TAP_SERVER"; do
+        ip tuntap add mode tap name "$tap" || return 1
+        ip link set "$tap" master "$TAP_BRIDGE"
+        ip link set "$tap" up
+    done
+}
+
+tap_cleanup() {
+    for dev in "$TAP_CLIENT" "$TAP_SERVER" "$TAP_BRIDGE"; do
+        ip link del "$dev" 2> /dev/null
+    done
+}
+
+run ./bench/micro.exe
+run ./bench/e2e.exe loopback "$SEC"
+run ./bench/e2e.exe null "$SEC"
+
+if [ "$BENCH_TAP" = 1 ]; then
+    if [ "$(id -u)" != 0 ]; then
+        echo "# BENCH_TAP=1 requires root, skipped" >&2
+    elif tap_setup; then
+        ./bench/e2e.exe tap server "$TAP_SERVER" "$TAP_SERVER_HWADDR" "$TAP_SERVER_ADDR" "$TAP_CLIENT_ADDR" 2>> "$LOG" &
+        server=$!
+        sleep 1
+        run ./bench/e2e.exe tap client "$TAP_CLIENT" "$TAP_CLIENT_HWADDR" "$TAP_CLIENT_ADDR" "$TAP_SERVER_ADDR" "$SEC"
+        kill "$server"
+        wait "$server" 2> /dev/null
+        tap_cleanup
+    else
+        echo "# failed to create the tap devices, skipped" >&2
+        tap_cleanup
+    fi
+fi
+
+echo "# results in $OUT" >&2
@@ -0,0 +1,9 @@
+#ifndef ETHER_XDP_H
+#define ETHER_XDP_H
+
+#include "net.h"
+
+extern struct net_device *
+ether_xdp_init(const char *name, const char *addr, unsigned int queue);
+
+#endif
@@ -71,6 +71,9 @@ ether_dump(const uint8_t *frame, size_t flen)
     struct ether_hdr *hdr;
     char addr[ETHER_ADDR_STR_LEN];
 
+    if (!LOG_ENABLED(DEBUG)) {
+        return;
+    }
     hdr = (struct ether_hdr *)frame;
     flockfile(stderr);
     fprintf(stderr, "        src: %s\n", ether_addr_ntop(hdr->src, addr, sizeof(addr)));
@@ -82,51 +85,123 @@ ether_dump(const uint8_t *frame, size_t flen)
     funlockfile(stderr);
 }
 
-int
-ether_transmit_helper(struct net_device *dev, uint16_t type, const uint8_t *data, size_t len, const void *dst, ssize_t (*callback)(struct net_device *dev, const uint8_t *data, size_t len))
+/* NOTE: the header is prepended into the headroom of pb */
+static int
+ether_output_frame(struct net_device *dev, uint16_t type, struct pbuf *pb, const void *dst)
 {
-    uint8_t frame[ETHER_FRAME_SIZE_MAX] = {};
     struct ether_hdr *hdr;
-    size_t flen, pad = 0;
+    uint8_t *pad;
 
-    hdr = (struct ether_hdr *)frame;
+    if (pb->len < ETHER_PAYLOAD_SIZE_MIN) {
+        pad = pbuf_put(pb, ETHER_PAYLOAD_SIZE_MIN - pb->len);
+        if (!pad) {
+            errorf("no tailroom for padding, dev=%s", dev->name);
+            return -1;
+        }
+        memset(pad, 0, pb->data + pb->len - pad);
+    }
+    hdr = (struct ether_hdr *)pbuf_push(pb, sizeof(*hdr));
+    if (!hdr) {
+        return -1;
+    }
     memcpy(hdr->dst, dst, ETHER_ADDR_LEN);
     memcpy(hdr->src, dev->addr, ETHER_ADDR_LEN);
     hdr->type = hton16(type);
-    memcpy(hdr + 1, data, len);
-    if (len < ETHER_PAYLOAD_SIZE_MIN) {
-        pad = ETHER_PAYLOAD_SIZE_MIN - len;
+    debugf("dev=%s, type=%s(0x%04x), len=%zu", dev->name, ether_type_ntoa(hdr->type), type, pb->len);
+    ether_dump(pb->data, pb->len);
+    return 0;
+}
+
+/* NOTE: consumes pb */
+int
+ether_transmit_helper(struct net_device *dev, uint16_t type, struct pbuf *pb, const void *dst, ssize_t (*callback)(struct net_device *dev, const uint8_t *data, size_t len))
+{
+    int ret;
+
+    if (ether_output_frame(dev, type, pb, dst) == -1) {
+        pbuf_free(pb);
+        return -1;
     }
-    flen = sizeof(*hdr) + len + pad;
-    debugf("dev=%s, type=%s(0x%04x), len=%zu", dev->name, ether_type_ntoa(hdr->type), type, flen);
-    ether_dump(frame, flen);
-    return callback(dev, frame, flen) == (ssize_t)flen ? 0 : -1;
+    ret = callback(dev, pb->data, pb->len) == (ssize_t)pb->len ? 0 : -1;
+    pbuf_free(pb);
+    return ret;
 }
 
+/* NOTE: for a device with transmit_batch, the frame is queued and handed down later (see net_device_queue()), consumes pb */
 int
-ether_poll_helper(struct net_device *dev, ssize_t (*callback)(struct net_device *dev, uint8_t *buf, size_t size))
+ether_queue_helper(struct net_device *dev, uint16_t type, struct pbuf *pb, const void *dst)
 {
-    uint8_t frame[ETHER_FRAME_SIZE_MAX];
+    if (ether_output_frame(dev, type, pb, dst) == -1) {
+        pbuf_free(pb);
+        return -1;
+    }
+    return net_device_queue(dev, pb);
+}
+
+/*
+ * NOTE: reads up to budget frames until the callback returns -1 (nothing to read, it must not block),
+ *       and hands them up at once. returns the number of frames read.
+ */
+int
+ether_poll_helper(struct net_device *dev, ssize_t (*callback)(struct net_device *dev, uint8_t *buf, size_t size), int budget)
+{
+    struct pbuf *pb, *pbs[NET_DEVICE_POLL_BUDGET];
     ssize_t flen;
-    struct ether_hdr *hdr;
-    uint16_t type;
+    int num = 0;
 
-    flen = callback(dev, frame, sizeof(frame));
-    if (flen < (ssize_t)sizeof(*hdr)) {
-        errorf("input data is too short");
-        return -1;
+    budget = MIN(budget, NET_DEVICE_POLL_BUDGET);
+    while (num < budget) {
+        pb = pbuf_alloc(ETHER_FRAME_SIZE_MAX);
+        if (!pb) {
+            errorf("pbuf_alloc() failure");
+            break;
+        }
+        /* NOTE: the frame is read directly into the packet buffer */
+        flen = callback(dev, pb->data, pb->len);
+        if (flen < 0) {
+            pbuf_free(pb);
+            break;
+        }
+        pbuf_trim(pb, flen);
+        pbs[num++] = pb;
     }
-    hdr = (struct ether_hdr *)frame;
-    if (memcmp(dev->addr, hdr->dst, ETHER_ADDR_LEN) != 0) {
-        if (memcmp(ETHER_ADDR_BROADCAST, hdr->dst, ETHER_ADDR_LEN) != 0) {
-            /* for other host */
-            return -1;
+    ether_input_helper(dev, pbs, num);
+    return num;
+}
+
+/* NOTE: each of pbs holds a whole frame, the frames for us are handed up at once, consumes pbs */
+int
+ether_input_helper(struct net_device *dev, struct pbuf **pbs, int num)
+{
+    struct pbuf *pb;
+    struct ether_hdr *hdr;
+    int i, n = 0;
+
+    for (i = 0; i < num; i++) {
+        pb = pbs[i];
+        if (pb->len < sizeof(*hdr)) {
+            errorf("input data is too short");
+            pbuf_free(pb);
+            continue;
         }
+        hdr = (struct ether_hdr *)pb->data;
+        if (memcmp(dev->addr, hdr->dst, ETHER_ADDR_LEN) != 0) {
+            if (memcmp(ETHER_ADDR_BROADCAST, hdr->dst, ETHER_ADDR_LEN) != 0) {
+                /* for other host */
+                pbuf_free(pb);
+                continue;
+            }
+        }
+        pb->type = ntoh16(hdr->type);
+        debugf("dev=%s, type=%s(0x%04x), len=%zu", dev->name, ether_type_ntoa(hdr->type), pb->type, pb->len);
+        ether_dump(pb->data, pb->len);
+        pbuf_pull(pb, sizeof(*hdr));
+        pbs[n++] = pb;
+    }
+    if (!n) {
+        return 0;
     }
-    type = ntoh16(hdr->type);
-    debugf("dev=%s, type=%s(0x%04x), len=%zu", dev->name, ether_type_ntoa(hdr->type), type, flen);
-    ether_dump(frame, flen);
-    return net_input_handler(type, (uint8_t *)(hdr + 1), flen - sizeof(*hdr), dev);
+    return net_input_handler_batch(pbs, n, dev);
 }
 
 void
@@ -5,6 +5,7 @@
 #include "util.h"
 #include "ip.h"
 #include "icmp.h"
+#include "stats.h"
 
 #define ICMP_BUFSIZ IP_PAYLOAD_SIZE_MAX
 
@@ -58,6 +59,9 @@ icmp_dump(const uint8_t *data, size_t len)
     struct icmp_hdr *hdr;
     struct icmp_echo *echo;
 
+    if (!LOG_ENABLED(DEBUG)) {
+        return;
+    }
     flockfile(stderr);
     hdr = (struct icmp_hdr *)data;
     fprintf(stderr, "       type: %u (%s)\n", hdr->type, icmp_type_ntoa(hdr->type));
@@ -80,21 +84,50 @@ icmp_dump(const uint8_t *data, size_t len)
     funlockfile(stderr);
 }
 
+/* NOTE: the request is turned into the reply in place, only the type changes (RFC 1624 incremental update) */
+static int
+icmp_echo_reply(struct pbuf *pb, ip_addr_t src, ip_addr_t dst)
+{
+    struct icmp_hdr *hdr;
+    uint16_t old, new;
+    char addr1[IP_ADDR_STR_LEN];
+    char addr2[IP_ADDR_STR_LEN];
+
+    hdr = (struct icmp_hdr *)pb->data;
+    memcpy(&old, hdr, sizeof(old)); /* type and code */
+    hdr->type = ICMP_TYPE_ECHOREPLY;
+    memcpy(&new, hdr, sizeof(new));
+    hdr->sum = cksum16_adjust(hdr->sum, old, new);
+    pb->flags = 0;
+    debugf("%s => %s, type=%s(%u), len=%zu",
+        ip_addr_ntop(src, addr1, sizeof(addr1)),
+        ip_addr_ntop(dst, addr2, sizeof(addr2)),
+        icmp_type_ntoa(hdr->type), hdr->type, pb->len);
+    icmp_dump((uint8_t *)hdr, pb->len);
+    stats_inc(STATS_ICMP_OUT_MSGS);
+    return ip_output(IP_PROTOCOL_ICMP, pbuf_ref(pb), src, dst);
+}
+
 static void
-icmp_input(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct ip_iface *iface)
+icmp_input(struct pbuf *pb, ip_addr_t src, ip_addr_t dst, struct ip_iface *iface)
 {
+    const uint8_t *data = pb->data;
+    size_t len = pb->len;
     struct icmp_hdr *hdr;
     char addr1[IP_ADDR_STR_LEN];
     char addr2[IP_ADDR_STR_LEN];
     char addr3[IP_ADDR_STR_LEN];
 
+    stats_inc(STATS_ICMP_IN_MSGS);
     if (len < sizeof(*hdr)) {
         errorf("too short");
+        stats_inc(STATS_ICMP_IN_ERRORS);
         return;
     }
     hdr = (struct icmp_hdr *)data;
     if (cksum16((uint16_t *)data, len, 0) != 0) {
         errorf("checksum error, sum=0x%04x, verify=0x%04x", ntoh16(hdr->sum), ntoh16(cksum16((uint16_t *)data, len, -hdr->sum)));
+        stats_inc(STATS_ICMP_IN_ERRORS);
         return;
     }
     debugf("%s => %s, type=%s(%u), len=%zu, iface=%s",
@@ -110,7 +143,7 @@ icmp_input(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct
             /* responds with the address of the received interface. */
             dst = iface->unicast;
         }
-        icmp_output(ICMP_TYPE_ECHOREPLY, hdr->code, hdr->values, (uint8_t *)(hdr + 1), len - sizeof(*hdr), dst, src);
+        icmp_echo_reply(pb, dst, src);
         break;
     default:
         /* ignore */
@@ -121,13 +154,25 @@ icmp_input(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct
 int
 icmp_output(uint8_t type, uint8_t code, uint32_t values, const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst)
 {
-    uint8_t buf[ICMP_BUFSIZ];
+    struct pbuf *pb;
     struct icmp_hdr *hdr;
     size_t msg_len;
     char addr1[IP_ADDR_STR_LEN];
     char addr2[IP_ADDR_STR_LEN];
 
-    hdr = (struct icmp_hdr *)buf;
+    stats_inc(STATS_ICMP_OUT_MSGS);
+    if (len > ICMP_BUFSIZ - sizeof(*hdr)) {
+        errorf("too long");
+        stats_inc(STATS_ICMP_OUT_ERRORS);
+        return -1;
+    }
+    pb = pbuf_alloc(sizeof(*hdr) + len);
+    if (!pb) {
+        errorf("pbuf_alloc() failure");
+        stats_inc(STATS_ICMP_OUT_ERRORS);
+        return -1;
+    }
+    hdr = (struct icmp_hdr *)pb->data;
     hdr->type = type;
     hdr->code = code;
     hdr->sum = 0;
@@ -140,7 +185,7 @@ icmp_output(uint8_t type, uint8_t code, uint32_t values, const uint8_t *data, si
         ip_addr_ntop(dst, addr2, sizeof(addr2)),
         icmp_type_ntoa(hdr->type), hdr->type, msg_len);
     icmp_dump((uint8_t *)hdr, msg_len);
-    return ip_output(IP_PROTOCOL_ICMP, (uint8_t *)hdr, msg_len, src, dst);
+    return ip_output(IP_PROTOCOL_ICMP, pb, src, dst);
 }
 
 int
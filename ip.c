@@ -9,22 +9,52 @@
 #include "net.h"
 #include "arp.h"
 #include "ip.h"
+#include "icmp.h"
+#include "trace.h"
+#include "stats.h"
+#include "timer.h"
+
+#define IP_HDR_FLAG_MF 0x2000
+#define IP_HDR_OFFSET_MASK 0x1fff
+
+#ifndef IP_REASS_NUM_MAX
+#define IP_REASS_NUM_MAX 64 /* datagrams being reassembled at once */
+#endif
+#ifndef IP_REASS_MEM_MAX
+#define IP_REASS_MEM_MAX (256 * 1024) /* bytes held by the fragments of all of them */
+#endif
+#ifndef IP_REASS_TIMEOUT
+#define IP_REASS_TIMEOUT 30 /* seconds, see RFC 791 */
+#endif
+#define IP_REASS_HASH_SIZE 16 /* initial number of buckets (grows) */
 
 struct ip_protocol {
     struct ip_protocol *next;
     char name[16];
     uint8_t type;
-    void (*handler)(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct ip_iface *iface);
+    void (*handler)(struct pbuf *pb, ip_addr_t src, ip_addr_t dst, struct ip_iface *iface); /* NOTE: the handler does not own pb */
+    struct pbuf *(*gso)(struct pbuf *pb, ip_addr_t src, ip_addr_t dst, uint16_t offload); /* NOTE: see ip_gso_segment() (optional) */
+    int (*gro)(struct pbuf **head, struct pbuf *pb, size_t hlen, ip_addr_t src, ip_addr_t dst); /* NOTE: see ip_gro() (optional) */
 };
 
 struct ip_route {
-    struct ip_route *next;
     ip_addr_t network;
     ip_addr_t netmask;
     ip_addr_t nexthop;
     struct ip_iface *iface;
 };
 
+/*
+ * NOTE: a node of the routing table, a path-compressed binary trie keyed by the prefix (in host byte order).
+ *       a node without the route is a branch, it always has two children.
+ */
+struct ip_route_node {
+    struct ip_route_node *child[2];
+    uint32_t prefix; /* the bits after plen are zero */
+    uint8_t plen;
+    struct ip_route *route;
+};
+
 struct ip_hdr {
     uint8_t vhl;
     uint8_t tos;
@@ -39,13 +69,46 @@ struct ip_hdr {
     uint8_t options[0];
 };
 
+struct ip_frag {
+    struct ip_frag *next;
+    uint16_t offset; /* bytes from the start of the payload */
+    uint16_t len;
+    uint8_t data[0];
+};
+
+/* NOTE: a datagram being reassembled, keyed by (src, dst, id, protocol) */
+struct ip_reass {
+    struct hash_node node;
+    ip_addr_t src;
+    ip_addr_t dst;
+    uint16_t id;
+    uint8_t protocol;
+    struct ip_frag *frags; /* sorted by offset, never overlapped */
+    size_t recv; /* bytes of the payload */
+    size_t total; /* bytes of the whole payload, 0 until the last fragment */
+    size_t mem;
+    uint64_t timestamp; /* the first fragment received (in any order), see net_timer_clock() */
+    struct net_timer timer; /* NOTE: expires IP_REASS_TIMEOUT after the timestamp, see ip_reass_timeout() */
+    int freed; /* NOTE: left to the timer running at the time, see ip_reass_free() */
+    uint16_t hlen; /* of the first fragment (offset 0), 0 until received */
+    uint8_t hdr[IP_HDR_SIZE_MAX + 8]; /* the header and the first 8 bytes, for the one of the datagram and ICMP */
+};
+
 const ip_addr_t IP_ADDR_ANY       = 0x00000000; /* 0.0.0.0 */
 const ip_addr_t IP_ADDR_BROADCAST = 0xffffffff; /* 255.255.255.255 */
 
 /* NOTE: if you want to add/delete the entries after net_run(), you need to protect these lists with a mutex. */
 static struct ip_iface *ifaces;
 static struct ip_protocol *protocols;
-static struct ip_route *routes;
+
+static rwlock_t route_lock = RWLOCK_INITIALIZER; /* NOTE: protects route_root and the routes, can be updated after net_run() */
+static struct ip_route_node *route_root;
+
+static unsigned int dst_gen; /* NOTE: see ip_dst_invalidate() */
+
+static mutex_t reass_mutex = MUTEX_INITIALIZER; /* NOTE: protects reass_table and reass_mem */
+static struct hash_table reass_table;
+static size_t reass_mem;
 
 int
 ip_addr_pton(const char *p, ip_addr_t *n)
@@ -124,6 +187,9 @@ ip_dump(const uint8_t *data, size_t len)
     uint16_t total, offset;
     char addr[IP_ADDR_STR_LEN];
 
+    if (!LOG_ENABLED(DEBUG)) {
+        return;
+    }
     flockfile(stderr);
     hdr = (struct ip_hdr *)data;
     v = (hdr->vhl & 0xf0) >> 4;
@@ -147,27 +213,198 @@ ip_dump(const uint8_t *data, size_t len)
     funlockfile(stderr);
 }
 
-/* NOTE: must not be call after net_run() */
+static uint32_t
+ip_route_mask(uint8_t plen)
+{
+    return plen ? ~(uint32_t)0 << (32 - plen) : 0;
+}
+
+/* NOTE: pos must be less than 32 */
+static int
+ip_route_bit(uint32_t key, uint8_t pos)
+{
+    return (key >> (31 - pos)) & 0x01;
+}
+
+/* NOTE: returns -1 if the netmask is not contiguous */
+static int
+ip_route_plen(ip_addr_t netmask)
+{
+    uint32_t mask;
+    int plen = 0;
+
+    mask = ntoh32(netmask);
+    while (plen < 32 && ip_route_bit(mask, plen)) {
+        plen++;
+    }
+    if (mask != ip_route_mask(plen)) {
+        return -1;
+    }
+    return plen;
+}
+
+static struct ip_route_node *
+ip_route_node_alloc(uint32_t prefix, uint8_t plen, struct ip_route *route)
+{
+    struct ip_route_node *node;
+
+    node = memory_alloc(sizeof(*node));
+    if (!node) {
+        errorf("memory_alloc() failure");
+        return NULL;
+    }
+    node->prefix = prefix & ip_route_mask(plen);
+    node->plen = plen;
+    node->route = route;
+    return node;
+}
+
+/* NOTE: you must hold route_lock (write), returns -1 if the prefix already has a route */
+static int
+ip_route_insert(uint32_t prefix, uint8_t plen, struct ip_route *route)
+{
+    struct ip_route_node **p, *node, *leaf, *branch;
+    uint8_t common;
+
+    p = &route_root;
+    while (*p) {
+        node = *p;
+        common = MIN(plen, node->plen);
+        if (prefix ^ node->prefix) {
+            common = MIN(common, __builtin_clz(prefix ^ node->prefix));
+        }
+        if (common == node->plen) {
+            if (plen == node->plen) {
+                if (node->route) {
+                    return -1;
+                }
+                node->route = route;
+                return 0;
+            }
+            p = &node->child[ip_route_bit(prefix, node->plen)];
+            continue;
+        }
+        /* NOTE: the node is longer than common, a new node at common takes its place */
+        leaf = ip_route_node_alloc(prefix, plen, route);
+        if (!leaf) {
+            return -1;
+        }
+        if (common == plen) {
+            leaf->child[ip_route_bit(node->prefix, plen)] = node;
+            *p = leaf;
+            return 0;
+        }
+        branch = ip_route_node_alloc(prefix, common, NULL);
+        if (!branch) {
+            memory_free(leaf);
+            return -1;
+        }
+        branch->child[ip_route_bit(prefix, common)] = leaf;
+        branch->child[ip_route_bit(node->prefix, common)] = node;
+        *p = branch;
+        return 0;
+    }
+    leaf = ip_route_node_alloc(prefix, plen, route);
+    if (!leaf) {
+        return -1;
+    }
+    *p = leaf;
+    return 0;
+}
+
+/* NOTE: you must hold route_lock (write), returns the route removed from the trie (the caller frees it) */
+static struct ip_route *
+ip_route_remove(uint32_t prefix, uint8_t plen)
+{
+    struct ip_route_node **p, **pp = NULL, *node, *parent;
+    struct ip_route *route;
+
+    prefix &= ip_route_mask(plen);
+    p = &route_root;
+    while (*p && (*p)->plen < plen && ((*p)->prefix == (prefix & ip_route_mask((*p)->plen)))) {
+        pp = p;
+        p = &(*p)->child[ip_route_bit(prefix, (*p)->plen)];
+    }
+    node = *p;
+    if (!node || node->plen != plen || node->prefix != prefix || !node->route) {
+        return NULL;
+    }
+    route = node->route;
+    node->route = NULL;
+    if (node->child[0] && node->child[1]) {
+        /* NOTE: becomes a branch */
+        return route;
+    }
+    *p = node->child[0] ? node->child[0] : node->child[1];
+    memory_free(node);
+    if (!*p && pp) {
+        /* NOTE: the parent may be a branch left with one child, replace it with the child */
+        parent = *pp;
+        if (!parent->route) {
+            *pp = parent->child[0] ? parent->child[0] : parent->child[1];
+            memory_free(parent);
+        }
+    }
+    return route;
+}
+
+/* NOTE: you must hold route_lock (read or write), returns the route with the longest prefix matched */
 static struct ip_route *
+ip_route_lookup(ip_addr_t dst)
+{
+    struct ip_route_node *node;
+    struct ip_route *candidate = NULL;
+    uint32_t key;
+
+    key = ntoh32(dst);
+    node = route_root;
+    while (node && (key & ip_route_mask(node->plen)) == node->prefix) {
+        if (node->route) {
+            candidate = node->route;
+        }
+        if (node->plen == 32) {
+            break;
+        }
+        node = node->child[ip_route_bit(key, node->plen)];
+    }
+    return candidate;
+}
+
+/* NOTE: can be called after net_run(), the next hop is IP_ADDR_ANY for the directly connected network */
+int
 ip_route_add(ip_addr_t network, ip_addr_t netmask, ip_addr_t nexthop, struct ip_iface *iface)
 {
     struct ip_route *route;
+    int plen;
     char addr1[IP_ADDR_STR_LEN];
     char addr2[IP_ADDR_STR_LEN];
     char addr3[IP_ADDR_STR_LEN];
     char addr4[IP_ADDR_STR_LEN];
 
+    plen = ip_route_plen(netmask);
+    if (plen == -1) {
+        errorf("invalid netmask, netmask=%s", ip_addr_ntop(netmask, addr2, sizeof(addr2)));
+        return -1;
+    }
     route = memory_alloc(sizeof(*route));
     if (!route) {
         errorf("memory_alloc() failure");
-        return NULL;
+        return -1;
     }
-    route->network = network;
+    route->network = network & netmask;
     route->netmask = netmask;
     route->nexthop = nexthop;
     route->iface = iface;
-    route->next = routes;
-    routes = route;
+    rwlock_wrlock(&route_lock);
+    if (ip_route_insert(ntoh32(route->network), plen, route) == -1) {
+        rwlock_unlock(&route_lock);
+        errorf("already exists (or no memory), network=%s, netmask=%s",
+            ip_addr_ntop(route->network, addr1, sizeof(addr1)), ip_addr_ntop(route->netmask, addr2, sizeof(addr2)));
+        memory_free(route);
+        return -1;
+    }
+    rwlock_unlock(&route_lock);
+    ip_dst_invalidate();
     infof("network=%s, netmask=%s, nexthop=%s, iface=%s dev=%s",
         ip_addr_ntop(route->network, addr1, sizeof(addr1)),
         ip_addr_ntop(route->netmask, addr2, sizeof(addr2)),
@@ -175,25 +412,38 @@ ip_route_add(ip_addr_t network, ip_addr_t netmask, ip_addr_t nexthop, struct ip_
         ip_addr_ntop(route->iface->unicast, addr4, sizeof(addr4)),
         NET_IFACE(iface)->dev->name
     );
-    return route;
+    return 0;
 }
 
-static struct ip_route *
-ip_route_lookup(ip_addr_t dst)
+/* NOTE: can be called after net_run(), the struct ip_dst already looked up are invalidated */
+int
+ip_route_del(ip_addr_t network, ip_addr_t netmask)
 {
-    struct ip_route *route, *candidate = NULL;
+    struct ip_route *route;
+    int plen;
+    char addr1[IP_ADDR_STR_LEN];
+    char addr2[IP_ADDR_STR_LEN];
 
-    for (route = routes; route; route = route->next) {
-        if ((dst & route->netmask) == route->network) {
-            if (!candidate || ntoh32(candidate->netmask) < ntoh32(route->netmask)) {
-                candidate = route;
-            }
-        }
+    plen = ip_route_plen(netmask);
+    if (plen == -1) {
+        errorf("invalid netmask, netmask=%s", ip_addr_ntop(netmask, addr2, sizeof(addr2)));
+        return -1;
     }
-    return candidate;
+    rwlock_wrlock(&route_lock);
+    route = ip_route_remove(ntoh32(network & netmask), plen);
+    rwlock_unlock(&route_lock);
+    ip_dst_invalidate();
+    if (!route) {
+        errorf("not found, network=%s, netmask=%s",
+            ip_addr_ntop(network & netmask, addr1, sizeof(addr1)), ip_addr_ntop(netmask, addr2, sizeof(addr2)));
+        return -1;
+    }
+    infof("network=%s, netmask=%s",
+        ip_addr_ntop(route->network, addr1, sizeof(addr1)), ip_addr_ntop(route->netmask, addr2, sizeof(addr2)));
+    memory_free(route);
+    return 0;
 }
 
-/* NOTE: must not be call after net_run() */
 int
 ip_route_set_default_gateway(struct ip_iface *iface, const char *gateway)
 {
@@ -203,7 +453,7 @@ ip_route_set_default_gateway(struct ip_iface *iface, const char *gateway)
         errorf("ip_addr_pton() failure, addr=%s", gateway);
         return -1;
     }
-    if (!ip_route_add(IP_ADDR_ANY, IP_ADDR_ANY, gw, iface)) {
+    if (ip_route_add(IP_ADDR_ANY, IP_ADDR_ANY, gw, iface) == -1) {
         errorf("ip_route_add() failure");
         return -1;
     }
@@ -214,12 +464,15 @@ struct ip_iface *
 ip_route_get_iface(ip_addr_t dst)
 {
     struct ip_route *route;
+    struct ip_iface *iface = NULL;
 
+    rwlock_rdlock(&route_lock);
     route = ip_route_lookup(dst);
-    if (!route) {
-        return NULL;
+    if (route) {
+        iface = route->iface;
     }
-    return route->iface;
+    rwlock_unlock(&route_lock);
+    return iface;
 }
 
 struct ip_iface *
@@ -259,7 +512,7 @@ ip_iface_register(struct net_device *dev, struct ip_iface *iface)
         errorf("net_device_add_iface() failure");
         return -1;
     }
-    if (!ip_route_add(iface->unicast & iface->netmask, iface->netmask, IP_ADDR_ANY, iface)) {
+    if (ip_route_add(iface->unicast & iface->netmask, iface->netmask, IP_ADDR_ANY, iface) == -1) {
         errorf("ip_route_add() failure");
         return -1;
     }
@@ -286,169 +539,596 @@ ip_iface_select(ip_addr_t addr)
     return entry;
 }
 
+/*
+ * Reassembly
+ *
+ * NOTE: bounded by IP_REASS_NUM_MAX datagrams and IP_REASS_MEM_MAX bytes, the oldest one is evicted to make room.
+ *       a fragment overlapping another (or inconsistent with the last one) discards the whole datagram,
+ *       see RFC 5722 for the reason (it is the same for IPv4).
+ */
+
+static uint32_t
+ip_reass_hash(ip_addr_t src, ip_addr_t dst, uint16_t id, uint8_t protocol)
+{
+    return hash32(src ^ hash32(dst ^ hash32(((uint32_t)id << 8) | protocol)));
+}
+
+/* NOTE: you must hold reass_mutex, must be called after removed from reass_table */
 static void
-ip_input(const uint8_t *data, size_t len, struct net_device *dev)
+ip_reass_free(struct ip_reass *reass)
 {
+    struct ip_frag *frag;
+
+    while (reass->frags) {
+        frag = reass->frags;
+        reass->frags = frag->next;
+        memory_pool_free(frag);
+    }
+    reass_mem -= reass->mem;
+    reass->mem = 0;
+    if (net_timer_cancel(&reass->timer) == -1) {
+        /* NOTE: the timer is running (waiting for reass_mutex), it frees reass instead */
+        reass->freed = 1;
+        return;
+    }
+    memory_free(reass);
+}
+
+/* NOTE: you must hold reass_mutex */
+static void
+ip_reass_delete(struct ip_reass *reass)
+{
+    stats_inc(STATS_IP_REASM_FAILS);
+    hash_table_remove(&reass_table, &reass->node);
+    ip_reass_free(reass);
+}
+
+/* NOTE: you must hold reass_mutex, evicts the oldest one except `except`, returns -1 if there is nothing to evict */
+static int
+ip_reass_evict(struct ip_reass *except)
+{
+    struct ip_reass *oldest = NULL, *reass;
+    struct hash_node *node;
+    size_t i;
+
+    for (i = 0; i < reass_table.size; i++) {
+        for (node = reass_table.buckets[i]; node; node = node->next) {
+            reass = (struct ip_reass *)node;
+            if (reass != except && (!oldest || reass->timestamp < oldest->timestamp)) {
+                oldest = reass;
+            }
+        }
+    }
+    if (!oldest) {
+        return -1;
+    }
+    debugf("evicted, id=%u, recv=%zu, mem=%zu", ntoh16(oldest->id), oldest->recv, oldest->mem);
+    ip_reass_delete(oldest);
+    return 0;
+}
+
+static void
+ip_reass_timeout(void *arg);
+
+/* NOTE: you must hold reass_mutex */
+static struct ip_reass *
+ip_reass_get(const struct ip_hdr *hdr)
+{
+    struct ip_reass *reass;
+    struct hash_node *node;
+    uint32_t hash;
+
+    hash = ip_reass_hash(hdr->src, hdr->dst, hdr->id, hdr->protocol);
+    for (node = hash_table_lookup(&reass_table, hash); node; node = node->next) {
+        reass = (struct ip_reass *)node;
+        if (node->hash == hash && reass->src == hdr->src && reass->dst == hdr->dst &&
+            reass->id == hdr->id && reass->protocol == hdr->protocol) {
+            return reass;
+        }
+    }
+    if (reass_table.num >= IP_REASS_NUM_MAX) {
+        ip_reass_evict(NULL);
+    }
+    reass = memory_alloc(sizeof(*reass));
+    if (!reass) {
+        errorf("memory_alloc() failure");
+        return NULL;
+    }
+    reass->src = hdr->src;
+    reass->dst = hdr->dst;
+    reass->id = hdr->id;
+    reass->protocol = hdr->protocol;
+    reass->mem = sizeof(*reass);
+    reass->timestamp = net_timer_clock();
+    reass_mem += reass->mem;
+    hash_table_insert(&reass_table, &reass->node, hash);
+    net_timer_init(&reass->timer, ip_reass_timeout, reass);
+    net_timer_arm(&reass->timer, reass->timestamp + NET_TIMER_SEC(IP_REASS_TIMEOUT));
+    return reass;
+}
+
+/* NOTE: you must hold reass_mutex, removes reass from the table and returns the whole datagram */
+static struct pbuf *
+ip_reass_complete(struct ip_reass *reass)
+{
+    struct pbuf *pb;
+    struct ip_hdr *hdr;
+    struct ip_frag *frag;
+
+    hash_table_remove(&reass_table, &reass->node);
+    pb = pbuf_alloc(reass->hlen + reass->total);
+    if (!pb) {
+        errorf("pbuf_alloc() failure");
+        stats_inc(STATS_IP_REASM_FAILS);
+        ip_reass_free(reass);
+        return NULL;
+    }
+    memcpy(pb->data, reass->hdr, reass->hlen);
+    for (frag = reass->frags; frag; frag = frag->next) {
+        memcpy(pb->data + reass->hlen + frag->offset, frag->data, frag->len);
+    }
+    hdr = (struct ip_hdr *)pb->data;
+    hdr->total = hton16(pb->len);
+    hdr->offset = 0;
+    hdr->sum = 0;
+    hdr->sum = cksum16((uint16_t *)hdr, reass->hlen, 0);
+    ip_reass_free(reass);
+    return pb;
+}
+
+/* NOTE: the fragment is copied, returns the reassembled datagram (the caller owns it) when this completes one */
+static struct pbuf *
+ip_reass_input(const struct ip_hdr *hdr, uint16_t hlen, uint16_t total)
+{
+    struct ip_reass *reass;
+    struct ip_frag **p, *frag;
+    uint16_t offset, len, end;
+    int more;
+    struct pbuf *pb = NULL;
+
+    offset = (ntoh16(hdr->offset) & IP_HDR_OFFSET_MASK) << 3;
+    more = ntoh16(hdr->offset) & IP_HDR_FLAG_MF;
+    len = total - hlen;
+    if (!len || (more && (len & 0x07)) || (size_t)hlen + offset + len > IP_TOTAL_SIZE_MAX) {
+        errorf("invalid fragment, offset=%u, len=%u, more=%d", offset, len, more ? 1 : 0);
+        stats_inc(STATS_IP_REASM_FAILS);
+        return NULL;
+    }
+    end = offset + len;
+    mutex_lock(&reass_mutex);
+    reass = ip_reass_get(hdr);
+    if (!reass) {
+        mutex_unlock(&reass_mutex);
+        return NULL;
+    }
+    if ((reass->total && (end > reass->total || (!more && end != reass->total)))) {
+        errorf("inconsistent with the last fragment, id=%u, offset=%u, len=%u", ntoh16(hdr->id), offset, len);
+        ip_reass_delete(reass);
+        mutex_unlock(&reass_mutex);
+        return NULL;
+    }
+    if (!more) {
+        for (frag = reass->frags; frag && frag->next; frag = frag->next);
+        if (frag && frag->offset + frag->len > end) {
+            errorf("inconsistent with the last fragment, id=%u, offset=%u, len=%u", ntoh16(hdr->id), offset, len);
+            ip_reass_delete(reass);
+            mutex_unlock(&reass_mutex);
+            return NULL;
+        }
+    }
+    for (p = &reass->frags; *p && (*p)->offset < offset; p = &(*p)->next) {
+        if ((*p)->offset + (*p)->len > offset) {
+            break;
+        }
+    }
+    if (*p && (*p)->offset == offset && (*p)->len == len && memcmp((*p)->data, (uint8_t *)hdr + hlen, len) == 0) {
+        /* NOTE: duplicated by the network, not an overlap (RFC 5722 discards only the ones overlapping) */
+        debugf("duplicate, id=%u, offset=%u, len=%u", ntoh16(hdr->id), offset, len);
+        mutex_unlock(&reass_mutex);
+        return NULL;
+    }
+    if (*p && (*p)->offset < end) {
+        errorf("overlapped, id=%u, offset=%u, len=%u", ntoh16(hdr->id), offset, len);
+        ip_reass_delete(reass);
+        mutex_unlock(&reass_mutex);
+        return NULL;
+    }
+    while (reass_mem + sizeof(*frag) + len > IP_REASS_MEM_MAX) {
+        if (ip_reass_evict(reass) == -1) {
+            errorf("out of the reassembly memory, id=%u", ntoh16(hdr->id));
+            ip_reass_delete(reass);
+            mutex_unlock(&reass_mutex);
+            return NULL;
+        }
+    }
+    frag = memory_pool_alloc(sizeof(*frag) + len);
+    if (!frag) {
+        errorf("memory_pool_alloc() failure");
+        mutex_unlock(&reass_mutex);
+        return NULL;
+    }
+    frag->offset = offset;
+    frag->len = len;
+    memcpy(frag->data, (uint8_t *)hdr + hlen, len);
+    frag->next = *p;
+    *p = frag;
+    reass->recv += len;
+    reass->mem += sizeof(*frag) + len;
+    reass_mem += sizeof(*frag) + len;
+    if (!more) {
+        reass->total = end;
+    }
+    if (!offset) {
+        reass->hlen = hlen;
+        memcpy(reass->hdr, hdr, hlen + MIN(len, 8));
+    }
+    debugf("id=%u, offset=%u, len=%u, recv=%zu, total=%zu", ntoh16(hdr->id), offset, len, reass->recv, reass->total);
+    /* NOTE: no overlaps, all the payload is there if the number of bytes matches */
+    if (reass->total && reass->recv == reass->total) {
+        pb = ip_reass_complete(reass);
+    }
+    mutex_unlock(&reass_mutex);
+    return pb;
+}
+
+/* NOTE: the timer of reass, the datagram was not completed in time */
+static void
+ip_reass_timeout(void *arg)
+{
+    struct ip_reass *reass = arg;
+    const struct ip_hdr *hdr;
+
+    mutex_lock(&reass_mutex);
+    if (reass->freed) {
+        /* NOTE: completed or deleted while this was about to run */
+        mutex_unlock(&reass_mutex);
+        memory_free(reass);
+        return;
+    }
+    hash_table_remove(&reass_table, &reass->node);
+    mutex_unlock(&reass_mutex);
+    debugf("timeout, id=%u, recv=%zu, total=%zu", ntoh16(reass->id), reass->recv, reass->total);
+    stats_inc(STATS_IP_REASM_FAILS);
+    hdr = (struct ip_hdr *)reass->hdr;
+    if (reass->hlen && ip_iface_select(hdr->dst)) {
+        /* NOTE: only when the first fragment was received (and not for a broadcast), see RFC 792 */
+        icmp_output(ICMP_TYPE_TIME_EXCEEDED, ICMP_CODE_EXCEEDED_FRAGMENT, 0,
+            reass->hdr, reass->hlen + MIN(ntoh16(hdr->total) - reass->hlen, 8), hdr->dst, hdr->src);
+    }
+    mutex_lock(&reass_mutex);
+    ip_reass_free(reass);
+    mutex_unlock(&reass_mutex);
+    /* NOTE: left by ip_reass_free(), this is running */
+    memory_free(reass);
+}
+
+static void
+ip_input(struct pbuf *pb, struct net_device *dev)
+{
+    const uint8_t *data = pb->data;
+    size_t len = pb->len;
     struct ip_hdr *hdr;
     uint8_t v;
     uint16_t hlen, total, offset;
     struct ip_iface *iface;
     char addr[IP_ADDR_STR_LEN];
     struct ip_protocol *proto;
+    struct pbuf *whole = NULL;
 
+    stats_inc(STATS_IP_IN_RECEIVES);
     if (len < IP_HDR_SIZE_MIN) {
         errorf("too short");
+        stats_inc(STATS_IP_IN_HDR_ERRORS);
         return;
     }
     hdr = (struct ip_hdr *)data;
     v = hdr->vhl >> 4;
     if (v != IP_VERSION_IPV4) {
         errorf("ip version error: v=%u", v);
+        stats_inc(STATS_IP_IN_HDR_ERRORS);
         return;
     }
     hlen = (hdr->vhl & 0x0f) << 2;
     if (len < hlen) {
         errorf("header length error: hlen=%u, len=%u", hlen, len);
+        stats_inc(STATS_IP_IN_HDR_ERRORS);
         return;
     }
     total = ntoh16(hdr->total);
     if (len < total) {
         errorf("total length error: total=%u, len=%u", total, len);
+        stats_inc(STATS_IP_IN_HDR_ERRORS);
         return;
     }
     if (cksum16((uint16_t *)hdr, hlen, 0) != 0) {
         errorf("checksum error: sum=0x%04x, verify=0x%04x", ntoh16(hdr->sum), ntoh16(cksum16((uint16_t *)hdr, hlen, -hdr->sum)));
-        return;
-    }
-    offset = ntoh16(hdr->offset);
-    if (offset & 0x2000 || offset & 0x1fff) {
-        errorf("fragments does not support");
+        stats_inc(STATS_IP_IN_HDR_ERRORS);
         return;
     }
     iface = (struct ip_iface *)net_device_get_iface(dev, NET_IFACE_FAMILY_IP);
     if (!iface) {
         /* iface is not registered to the device */
+        stats_inc(STATS_IP_IN_ADDR_ERRORS);
         return;
     }
     if (hdr->dst != iface->unicast) {
         if (hdr->dst != iface->broadcast && hdr->dst != IP_ADDR_BROADCAST) {
             /* for other host */
+            stats_inc(STATS_IP_IN_ADDR_ERRORS);
             return;
         }
     }
+    offset = ntoh16(hdr->offset);
+    if (offset & (IP_HDR_FLAG_MF | IP_HDR_OFFSET_MASK)) {
+        /* NOTE: the rest goes on with the reassembled one (owned here) instead */
+        stats_inc(STATS_IP_REASM_REQDS);
+        whole = ip_reass_input(hdr, hlen, total);
+        if (!whole) {
+            return;
+        }
+        stats_inc(STATS_IP_REASM_OKS);
+        whole->dev = dev;
+        pb = whole;
+        data = pb->data;
+        hdr = (struct ip_hdr *)data;
+        hlen = (hdr->vhl & 0x0f) << 2;
+        total = pb->len;
+    }
     debugf("dev=%s, iface=%s, protocol=%s(0x%02x), len=%u",
         dev->name, ip_addr_ntop(iface->unicast, addr, sizeof(addr)), ip_protocol_name(hdr->protocol), hdr->protocol, total);
     ip_dump(data, total);
+    tracef(TRACE_EVENT_IP_INPUT, hdr->src, hdr->dst, hdr->protocol, total);
     for (proto = protocols; proto; proto = proto->next) {
         if (proto->type == hdr->protocol) {
-            proto->handler((uint8_t *)hdr + hlen, total - hlen, hdr->src, hdr->dst, iface);
-            return;
+            /* NOTE: strip the header and the link padding in place, hdr is still valid */
+            pbuf_trim(pb, total);
+            pbuf_pull(pb, hlen);
+            stats_inc(STATS_IP_IN_DELIVERS);
+            proto->handler(pb, hdr->src, hdr->dst, iface);
+            break;
         }
     }
-    /* unsupported protocol */
+    if (!proto) {
+        /* unsupported protocol */
+        stats_inc(STATS_IP_IN_UNKNOWN_PROTOS);
+    }
+    if (whole) {
+        pbuf_free(whole);
+    }
 }
 
+/* NOTE: consumes pb */
 static int
-ip_output_device(struct ip_iface *iface, const uint8_t *data, size_t len, ip_addr_t dst)
+ip_output_device(struct ip_dst *dst, struct pbuf *pb)
 {
-    uint8_t hwaddr[NET_DEVICE_ADDR_LEN] = {};
+    struct net_device *dev;
     int ret;
 
-    if (NET_IFACE(iface)->dev->flags & NET_DEVICE_FLAG_NEED_ARP) {
-        if (dst == iface->broadcast || dst == IP_ADDR_BROADCAST) {
-            memcpy(hwaddr, NET_IFACE(iface)->dev->broadcast, NET_IFACE(iface)->dev->alen);
+    dev = NET_IFACE(dst->iface)->dev;
+    if ((dev->flags & NET_DEVICE_FLAG_NEED_ARP) && !dst->resolved) {
+        if (dst->nexthop == dst->iface->broadcast || dst->nexthop == IP_ADDR_BROADCAST) {
+            memcpy(dst->hwaddr, dev->broadcast, dev->alen);
         } else {
-            ret = arp_resolve(NET_IFACE(iface), dst, hwaddr);
+            ret = arp_resolve(NET_IFACE(dst->iface), dst->nexthop, dst->hwaddr, pb);
             if (ret != ARP_RESOLVE_FOUND) {
+                /* NOTE: pb is held until resolved (or dropped) by ARP */
                 return ret;
             }
         }
+        /* NOTE: kept for the following datagrams to the same destination */
+        dst->resolved = 1;
     }
-    return net_device_output(NET_IFACE(iface)->dev, NET_PROTOCOL_TYPE_IP, data, len, hwaddr);
+    return net_device_output(dev, NET_PROTOCOL_TYPE_IP, pb, dst->hwaddr);
 }
 
+/* NOTE: consumes pb, the header is prepended into the headroom of pb */
 static ssize_t
-ip_output_core(struct ip_iface *iface, uint8_t protocol, const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, ip_addr_t nexthop, uint16_t id, uint16_t offset)
+ip_output_core(struct ip_dst *dst, uint8_t protocol, struct pbuf *pb, uint16_t id, uint16_t offset)
 {
-    uint8_t buf[IP_TOTAL_SIZE_MAX];
     struct ip_hdr *hdr;
     uint16_t hlen, total;
     char addr[IP_ADDR_STR_LEN];
 
-    hdr = (struct ip_hdr *)buf;
     hlen = sizeof(*hdr);
+    hdr = (struct ip_hdr *)pbuf_push(pb, hlen);
+    if (!hdr) {
+        pbuf_free(pb);
+        return -1;
+    }
     hdr->vhl = (IP_VERSION_IPV4 << 4) | (hlen >> 2);
     hdr->tos = 0;
-    total = hlen + len;
+    total = pb->len;
     hdr->total = hton16(total);
     hdr->id = hton16(id);
     hdr->offset = hton16(offset);
     hdr->ttl = 0xff;
     hdr->protocol = protocol;
     hdr->sum = 0;
-    hdr->src = src;
-    hdr->dst = dst;
+    hdr->src = dst->src;
+    hdr->dst = dst->addr;
     hdr->sum = cksum16((uint16_t *)hdr, hlen, 0); /* don't convert bytoder */
-    memcpy(hdr+1, data, len);
     debugf("dev=%s, iface=%s, protocol=%s(0x%02x), len=%u",
-        NET_IFACE(iface)->dev->name, ip_addr_ntop(iface->unicast, addr, sizeof(addr)), ip_protocol_name(protocol), protocol, total);
-    ip_dump(buf, total);
-    return ip_output_device(iface, buf, total, nexthop);
+        NET_IFACE(dst->iface)->dev->name, ip_addr_ntop(dst->iface->unicast, addr, sizeof(addr)), ip_protocol_name(protocol), protocol, total);
+    ip_dump(pb->data, total);
+    tracef(TRACE_EVENT_IP_OUTPUT, hdr->src, hdr->dst, protocol, total);
+    return ip_output_device(dst, pb);
 }
 
+/* NOTE: consumes pb, each fragment is copied into a new pbuf to keep the headroom for the lower layers */
+static ssize_t
+ip_output_fragment(struct ip_dst *dst, uint8_t protocol, struct pbuf *pb, uint16_t id)
+{
+    struct pbuf *frag;
+    size_t size, off, n;
+    ssize_t ret = 0;
+
+    /* NOTE: the device can not compute a checksum over the fragments */
+    pbuf_csum_finish(pb);
+    size = (NET_IFACE(dst->iface)->dev->mtu - IP_HDR_SIZE_MIN) & ~0x07;
+    net_tx_begin();
+    for (off = 0; off < pb->len; off += n) {
+        n = MIN(size, pb->len - off);
+        frag = pbuf_alloc(n);
+        if (!frag) {
+            errorf("pbuf_alloc() failure");
+            ret = -1;
+            break;
+        }
+        memcpy(frag->data, pb->data + off, n);
+        stats_inc(STATS_IP_FRAG_CREATES);
+        ret = ip_output_core(dst, protocol, frag, id, (off >> 3) | (off + n < pb->len ? IP_HDR_FLAG_MF : 0));
+        if (ret == -1) {
+            /* NOTE: the rest is useless without this one */
+            break;
+        }
+    }
+    net_tx_end();
+    pbuf_free(pb);
+    stats_inc(ret == -1 ? STATS_IP_FRAG_FAILS : STATS_IP_FRAG_OKS);
+    return ret;
+}
+
+/* NOTE: num consecutive ids are reserved (for the segments of a GSO packet), returns the first */
 static uint16_t
-ip_generate_id(void)
+ip_generate_id(uint16_t num)
 {
     static mutex_t mutex = MUTEX_INITIALIZER;
     static uint16_t id = 128;
     uint16_t ret;
 
     mutex_lock(&mutex);
-    ret = id++;
+    ret = id;
+    id += num;
     mutex_unlock(&mutex);
     return ret;
 }
 
-ssize_t
-ip_output(uint8_t protocol, const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst)
+/*
+ * NOTE: the cached struct ip_dst (e.g. in a PCB) are stale once the generation is changed,
+ *       called when a route is added or deleted and when a link address is changed or forgotten (see arp.c).
+ */
+void
+ip_dst_invalidate(void)
+{
+    __atomic_add_fetch(&dst_gen, 1, __ATOMIC_RELEASE);
+}
+
+/* NOTE: the route lookup part of ip_output(), the result can be reused by ip_output_dst() */
+int
+ip_dst_lookup(struct ip_dst *dst, ip_addr_t src, ip_addr_t addr)
 {
     struct ip_route *route;
-    struct ip_iface *iface;
-    char addr[IP_ADDR_STR_LEN];
-    ip_addr_t nexthop;
-    uint16_t id;
+    unsigned int gen;
+    char str[IP_ADDR_STR_LEN];
 
-    if (src == IP_ADDR_ANY && dst == IP_ADDR_BROADCAST) {
+    /* NOTE: taken before the lookup, a change in the meantime makes it stale */
+    gen = __atomic_load_n(&dst_gen, __ATOMIC_ACQUIRE);
+
+    if (src == IP_ADDR_ANY && addr == IP_ADDR_BROADCAST) {
         errorf("source address is required for broadcast addresses");
         return -1;
     }
-    route = ip_route_lookup(dst);
+    rwlock_rdlock(&route_lock);
+    route = ip_route_lookup(addr);
     if (!route) {
-        errorf("no route to host, addr=%s", ip_addr_ntop(dst, addr, sizeof(addr)));
+        rwlock_unlock(&route_lock);
+        errorf("no route to host, addr=%s", ip_addr_ntop(addr, str, sizeof(str)));
+        stats_inc(STATS_IP_OUT_NO_ROUTES);
         return -1;
     }
-    iface = route->iface;
-    if (src != IP_ADDR_ANY && src != iface->unicast) {
-        errorf("unable to output with specified source address, addr=%s", ip_addr_ntop(src, addr, sizeof(addr)));
+    if (src != IP_ADDR_ANY && src != route->iface->unicast) {
+        rwlock_unlock(&route_lock);
+        errorf("unable to output with specified source address, addr=%s", ip_addr_ntop(src, str, sizeof(str)));
         return -1;
     }
-    nexthop = (route->nexthop != IP_ADDR_ANY) ? route->nexthop : dst;
-    if (NET_IFACE(iface)->dev->mtu < IP_HDR_SIZE_MIN + len) {
-        errorf("too long, dev=%s, mtu=%s, tatal=%zu",
-            NET_IFACE(iface)->dev->name, NET_IFACE(iface)->dev->mtu, IP_HDR_SIZE_MIN + len);
-        return -1;
+    /* NOTE: copied out, the route may be deleted after unlocked */
+    dst->addr = addr;
+    dst->src = route->iface->unicast;
+    dst->nexthop = (route->nexthop != IP_ADDR_ANY) ? route->nexthop : addr;
+    dst->iface = route->iface;
+    rwlock_unlock(&route_lock);
+    dst->resolved = 0;
+    memset(dst->hwaddr, 0, sizeof(dst->hwaddr));
+    dst->gen = gen;
+    return 0;
+}
+
+/* NOTE: dst is kept by the caller (zeroed at first), looked up again only if it is stale or for another address */
+int
+ip_dst_lookup_cached(struct ip_dst *dst, ip_addr_t src, ip_addr_t addr)
+{
+    if (dst->iface && dst->addr == addr && (src == IP_ADDR_ANY || src == dst->src) &&
+        dst->gen == __atomic_load_n(&dst_gen, __ATOMIC_ACQUIRE)) {
+        return 0;
     }
-    id = ip_generate_id();
-    if (ip_output_core(iface, protocol, data, len, iface->unicast, dst, nexthop, id, 0) == -1) {
+    return ip_dst_lookup(dst, src, addr);
+}
+
+/* NOTE: consumes pb (also on failure) */
+ssize_t
+ip_output_dst(uint8_t protocol, struct pbuf *pb, struct ip_dst *dst)
+{
+    struct net_device *dev;
+    size_t len;
+    uint16_t id;
+
+    len = pb->len;
+    dev = NET_IFACE(dst->iface)->dev;
+    stats_inc(STATS_IP_OUT_REQUESTS);
+    if (pb->gso_size) {
+        /* NOTE: split into the segments below MTU later (see ip_gso_segment()) */
+        if (IP_HDR_SIZE_MIN + len > IP_TOTAL_SIZE_MAX || dev->mtu < IP_HDR_SIZE_MIN + pb->gso_size) {
+            errorf("too long, dev=%s, mtu=%u, tatal=%zu, gso_size=%u", dev->name, dev->mtu, IP_HDR_SIZE_MIN + len, pb->gso_size);
+            stats_inc(STATS_IP_OUT_DISCARDS);
+            pbuf_free(pb);
+            return -1;
+        }
+        id = ip_generate_id((len + pb->gso_size - 1) / pb->gso_size);
+    } else {
+        if (IP_HDR_SIZE_MIN + len > IP_TOTAL_SIZE_MAX) {
+            errorf("too long, dev=%s, tatal=%zu", dev->name, IP_HDR_SIZE_MIN + len);
+            stats_inc(STATS_IP_OUT_DISCARDS);
+            pbuf_free(pb);
+            return -1;
+        }
+        id = ip_generate_id(1);
+        if (dev->mtu < IP_HDR_SIZE_MIN + len) {
+            if (dev->mtu < IP_HDR_SIZE_MIN + 8) {
+                errorf("mtu too small, dev=%s, mtu=%u", dev->name, dev->mtu);
+                stats_inc(STATS_IP_FRAG_FAILS);
+                pbuf_free(pb);
+                return -1;
+            }
+            if (ip_output_fragment(dst, protocol, pb, id) == -1) {
+                errorf("ip_output_fragment() failure");
+                return -1;
+            }
+            return len;
+        }
+    }
+    if (ip_output_core(dst, protocol, pb, id, 0) == -1) {
         errorf("ip_output_core() failure");
         return -1;
     }
     return len;
 }
 
+/* NOTE: consumes pb (also on failure) */
+ssize_t
+ip_output(uint8_t protocol, struct pbuf *pb, ip_addr_t src, ip_addr_t dst)
+{
+    struct ip_dst d;
+
+    if (ip_dst_lookup(&d, src, dst) == -1) {
+        pbuf_free(pb);
+        return -1;
+    }
+    return ip_output_dst(protocol, pb, &d);
+}
+
 /* NOTE: must not be call after net_run() */
 int
-ip_protocol_register(const char *name, uint8_t type, void (*handler)(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct ip_iface *iface))
+ip_protocol_register(const char *name, uint8_t type, void (*handler)(struct pbuf *pb, ip_addr_t src, ip_addr_t dst, struct ip_iface *iface))
 {
     struct ip_protocol *entry;
 
@@ -472,6 +1152,38 @@ ip_protocol_register(const char *name, uint8_t type, void (*handler)(const uint8
     return 0;
 }
 
+/* NOTE: must not be call after net_run() */
+int
+ip_protocol_set_gso(uint8_t type, struct pbuf *(*gso)(struct pbuf *pb, ip_addr_t src, ip_addr_t dst, uint16_t offload))
+{
+    struct ip_protocol *entry;
+
+    for (entry = protocols; entry; entry = entry->next) {
+        if (entry->type == type) {
+            entry->gso = gso;
+            return 0;
+        }
+    }
+    errorf("not registered, type=0x%02x", type);
+    return -1;
+}
+
+/* NOTE: must not be call after net_run() */
+int
+ip_protocol_set_gro(uint8_t type, int (*gro)(struct pbuf **head, struct pbuf *pb, size_t hlen, ip_addr_t src, ip_addr_t dst))
+{
+    struct ip_protocol *entry;
+
+    for (entry = protocols; entry; entry = entry->next) {
+        if (entry->type == type) {
+            entry->gro = gro;
+            return 0;
+        }
+    }
+    errorf("not registered, type=0x%02x", type);
+    return -1;
+}
+
 char *
 ip_protocol_name(uint8_t type)
 {
@@ -485,12 +1197,150 @@ ip_protocol_name(uint8_t type)
     return "UNKNOWN";
 }
 
+/* NOTE: flow hash on the 4-tuple (the ports are the first 4 bytes of the TCP/UDP header) */
+static uint32_t
+ip_flow_hash(const struct pbuf *pb)
+{
+    struct ip_hdr *hdr;
+    uint8_t hlen;
+    uint32_t hash, ports = 0;
+
+    if (pb->len < IP_HDR_SIZE_MIN) {
+        return 0;
+    }
+    hdr = (struct ip_hdr *)pb->data;
+    hlen = (hdr->vhl & 0x0f) << 2;
+    if ((hdr->protocol == IP_PROTOCOL_TCP || hdr->protocol == IP_PROTOCOL_UDP) &&
+        !(ntoh16(hdr->offset) & 0x3fff) && pb->len >= (size_t)hlen + 4) {
+        /* NOTE: fragments carry no ports, hash them on the addresses only */
+        memcpy(&ports, pb->data + hlen, sizeof(ports));
+    }
+    hash = hdr->src ^ (hdr->dst * 0x9e3779b1) ^ ports ^ hdr->protocol;
+    return hash32(hash);
+}
+
+/*
+ * NOTE: the upper protocol splits the payload (pb->data is at its header) into the segments linked by pb->next,
+ *       then the header is copied in front of each with the total length, the id and the checksum updated.
+ */
+static struct pbuf *
+ip_gso_segment(struct pbuf *pb, uint16_t offload)
+{
+    struct ip_hdr *hdr, *shdr;
+    uint16_t hlen, id;
+    struct ip_protocol *proto;
+    struct pbuf *segs, *seg, *next;
+
+    hdr = (struct ip_hdr *)pb->data;
+    hlen = (hdr->vhl & 0x0f) << 2;
+    for (proto = protocols; proto; proto = proto->next) {
+        if (proto->type == hdr->protocol) {
+            break;
+        }
+    }
+    if (!proto || !proto->gso) {
+        errorf("not supported, protocol=%s(0x%02x)", ip_protocol_name(hdr->protocol), hdr->protocol);
+        return NULL;
+    }
+    pbuf_pull(pb, hlen);
+    segs = proto->gso(pb, hdr->src, hdr->dst, offload);
+    id = ntoh16(hdr->id);
+    for (seg = segs; seg; seg = seg->next) {
+        shdr = (struct ip_hdr *)pbuf_push(seg, hlen);
+        if (!shdr) {
+            break;
+        }
+        memcpy(shdr, hdr, hlen);
+        shdr->total = hton16(seg->len);
+        shdr->id = hton16(id++);
+        shdr->sum = 0;
+        shdr->sum = cksum16((uint16_t *)shdr, hlen, 0);
+    }
+    if (seg) {
+        errorf("no headroom for the header");
+        for (seg = segs; seg; seg = next) {
+            next = seg->next;
+            pbuf_free(seg);
+        }
+        return NULL;
+    }
+    return segs;
+}
+
+/* NOTE: the header is left to ip_input() if it is not a valid one to merge, an unfragmented datagram without the options */
+static int
+ip_gro_valid(struct pbuf *pb)
+{
+    struct ip_hdr *hdr;
+    uint16_t total;
+
+    if (pb->len < IP_HDR_SIZE_MIN) {
+        return 0;
+    }
+    hdr = (struct ip_hdr *)pb->data;
+    if (hdr->vhl != ((IP_VERSION_IPV4 << 4) | (IP_HDR_SIZE_MIN >> 2)) || (ntoh16(hdr->offset) & 0x3fff)) {
+        return 0;
+    }
+    total = ntoh16(hdr->total);
+    if (total < IP_HDR_SIZE_MIN || pb->len < total || cksum16((uint16_t *)hdr, IP_HDR_SIZE_MIN, 0) != 0) {
+        return 0;
+    }
+    /* NOTE: strip the link padding, as ip_input() does */
+    pbuf_trim(pb, total);
+    return 1;
+}
+
+/* NOTE: the upper protocol merges the payload (see ip_protocol_set_gro()), the header of head is left as is */
+static int
+ip_gro(struct pbuf **head, struct pbuf *pb)
+{
+    struct ip_hdr *hdr, *hdr2;
+    struct ip_protocol *proto;
+
+    if (!ip_gro_valid(*head) || !ip_gro_valid(pb)) {
+        return NET_GRO_FLUSH;
+    }
+    hdr = (struct ip_hdr *)(*head)->data;
+    hdr2 = (struct ip_hdr *)pb->data;
+    if (hdr->src != hdr2->src || hdr->dst != hdr2->dst || hdr->protocol != hdr2->protocol) {
+        return NET_GRO_OTHER;
+    }
+    if (hdr->tos != hdr2->tos || hdr->ttl != hdr2->ttl) {
+        return NET_GRO_FLUSH;
+    }
+    for (proto = protocols; proto; proto = proto->next) {
+        if (proto->type == hdr->protocol) {
+            break;
+        }
+    }
+    if (!proto || !proto->gro) {
+        return NET_GRO_FLUSH;
+    }
+    return proto->gro(head, pb, IP_HDR_SIZE_MIN, hdr->src, hdr->dst);
+}
+
 int
 ip_init(void)
 {
+    if (hash_table_init(&reass_table, IP_REASS_HASH_SIZE) == -1) {
+        errorf("hash_table_init() failure");
+        return -1;
+    }
     if (net_protocol_register("IP", NET_PROTOCOL_TYPE_IP, ip_input) == -1) {
         errorf("net_protocol_register() failure");
         return -1;
     }
+    if (net_protocol_set_hash(NET_PROTOCOL_TYPE_IP, ip_flow_hash) == -1) {
+        errorf("net_protocol_set_hash() failure");
+        return -1;
+    }
+    if (net_protocol_set_gso(NET_PROTOCOL_TYPE_IP, ip_gso_segment) == -1) {
+        errorf("net_protocol_set_gso() failure");
+        return -1;
+    }
+    if (net_protocol_set_gro(NET_PROTOCOL_TYPE_IP, ip_gro) == -1) {
+        errorf("net_protocol_set_gro() failure");
+        return -1;
+    }
     return 0;
 }
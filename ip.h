@@ -40,6 +40,17 @@ struct ip_iface {
     ip_addr_t broadcast;
 };
 
+/* NOTE: the result of the route lookup (and the ARP resolution), reusable for the datagrams to the same destination */
+struct ip_dst {
+    ip_addr_t addr;
+    ip_addr_t src; /* the address of iface */
+    ip_addr_t nexthop;
+    struct ip_iface *iface;
+    int resolved; /* hwaddr is valid */
+    uint8_t hwaddr[NET_DEVICE_ADDR_LEN];
+    unsigned int gen; /* NOTE: valid while it matches the global one, see ip_dst_invalidate() */
+};
+
 extern const ip_addr_t IP_ADDR_ANY;
 extern const ip_addr_t IP_ADDR_BROADCAST;
 
@@ -52,6 +63,10 @@ ip_endpoint_pton(const char *p, struct ip_endpoint *n);
 extern char *
 ip_endpoint_ntop(const struct ip_endpoint *n, char *p, size_t size);
 
+extern int
+ip_route_add(ip_addr_t network, ip_addr_t netmask, ip_addr_t nexthop, struct ip_iface *iface);
+extern int
+ip_route_del(ip_addr_t network, ip_addr_t netmask);
 extern int
 ip_route_set_default_gateway(struct ip_iface *iface, const char *gateway);
 extern struct ip_iface *
@@ -65,10 +80,22 @@ extern struct ip_iface *
 ip_iface_select(ip_addr_t addr);
 
 extern ssize_t
-ip_output(uint8_t protocol, const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst);
+ip_output(uint8_t protocol, struct pbuf *pb, ip_addr_t src, ip_addr_t dst);
+extern int
+ip_dst_lookup(struct ip_dst *dst, ip_addr_t src, ip_addr_t addr);
+extern int
+ip_dst_lookup_cached(struct ip_dst *dst, ip_addr_t src, ip_addr_t addr);
+extern void
+ip_dst_invalidate(void);
+extern ssize_t
+ip_output_dst(uint8_t protocol, struct pbuf *pb, struct ip_dst *dst);
 
 extern int
-ip_protocol_register(const char *name, uint8_t type, void (*handler)(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct ip_iface *iface));
+ip_protocol_register(const char *name, uint8_t type, void (*handler)(struct pbuf *pb, ip_addr_t src, ip_addr_t dst, struct ip_iface *iface));
+extern int
+ip_protocol_set_gso(uint8_t type, struct pbuf *(*gso)(struct pbuf *pb, ip_addr_t src, ip_addr_t dst, uint16_t offload));
+extern int
+ip_protocol_set_gro(uint8_t type, int (*gro)(struct pbuf **head, struct pbuf *pb, size_t hlen, ip_addr_t src, ip_addr_t dst));
 extern char *
 ip_protocol_name(uint8_t type);
 
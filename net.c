@@ -4,33 +4,51 @@
 #include <string.h>
 #include <unistd.h>
 #include <signal.h>
-#include <sys/time.h>
 
 #include "platform.h"
 
 #include "util.h"
 #include "net.h"
+#include "trace.h"
+#include "stats.h"
 
 struct net_protocol {
     struct net_protocol *next;
     char name[16];
     uint16_t type;
-    struct queue_head queue; /* input queue */
-    void (*handler)(const uint8_t *data, size_t len, struct net_device *dev);
+    struct ring *queues[NET_WORKER_MAX]; /* input queue (struct pbuf) per worker, allocated by net_run() */
+    uint32_t (*hash)(const struct pbuf *pb); /* NOTE: flow hash for the worker selection (optional) */
+    struct pbuf *(*gso)(struct pbuf *pb, uint16_t offload); /* NOTE: splits pb into the segments linked by pb->next (optional) */
+    int (*gro)(struct pbuf **head, struct pbuf *pb); /* NOTE: merges pb into *head (may be replaced), returns NET_GRO_XXX (optional) */
+    void (*handler)(struct pbuf *pb, struct net_device *dev); /* NOTE: the handler does not own pb, use pbuf_ref() to keep it */
 };
 
-/* NOTE: the data follows immediately after the structure */
-struct net_protocol_queue_entry {
-    struct net_device *dev;
-    size_t len;
+/*
+ * NOTE: Protocol worker (RSS-style receive processing)
+ *       Received packets are steered to a worker by their flow hash, so that a flow is always
+ *       processed by the same worker. Without workers (worker_num == 0), the packets are put on
+ *       the queues of workers[0] and processed in the softirq context as before.
+ */
+struct net_worker {
+    unsigned int index;
+    mutex_t mutex; /* NOTE: for sleeping, the input queues are lock-free (pushed from any thread, e.g. the loopback transmit) */
+    struct sched_ctx ctx;
+    int idle; /* NOTE: set before the last check of the queues, see net_worker_thread() and net_worker_kick() */
+    int terminate;
+    thread_t thread;
 };
 
-struct net_timer {
-    struct net_timer *next;
-    char name[16];
-    struct timeval interval;
-    struct timeval last;
-    void (*handler)(void);
+/*
+ * NOTE: TX queue of a device with transmit_batch, one thread at a time (flushing) hands down
+ *       the frames queued meanwhile by the others, instead of a syscall per frame and per thread.
+ */
+struct net_device_txq {
+    mutex_t lock;
+    struct sched_ctx ctx; /* NOTE: the senders waiting for the room (backpressure) */
+    struct pbuf *head; /* linked by pb->next */
+    struct pbuf *tail;
+    unsigned int num;
+    int flushing;
 };
 
 struct net_event {
@@ -42,9 +60,14 @@ struct net_event {
 /* NOTE: if you want to add/delete the entries after net_run(), you need to protect these lists with a mutex. */
 static struct net_device *devices;
 static struct net_protocol *protocols;
-static struct net_timer *timers;
 static struct net_event *events;
 
+static struct net_worker workers[NET_WORKER_MAX];
+static unsigned int worker_num = NET_WORKER_NUM;
+static int running;
+
+static __thread int tx_depth; /* nesting of net_tx_begin() */
+
 struct net_device *
 net_device_alloc(void (*setup)(struct net_device *dev))
 {
@@ -67,6 +90,20 @@ net_device_register(struct net_device *dev)
 {
     static unsigned int index = 0;
 
+    if (dev->ops->transmit_batch) {
+        dev->txq = memory_alloc(sizeof(*dev->txq));
+        if (!dev->txq) {
+            errorf("memory_alloc() failure");
+            return -1;
+        }
+        mutex_init(&dev->txq->lock);
+        sched_ctx_init(&dev->txq->ctx);
+    }
+    dev->stats = stats_dev_alloc();
+    if (!dev->stats) {
+        errorf("stats_dev_alloc() failure");
+        return -1;
+    }
     dev->index = index++;
     snprintf(dev->name, sizeof(dev->name), "net%d", dev->index);
     dev->next = devices;
@@ -93,6 +130,44 @@ net_device_open(struct net_device *dev)
     return 0;
 }
 
+/* NOTE: must be called with txq->lock held, returns with it held */
+static void
+net_device_flush(struct net_device *dev)
+{
+    struct net_device_txq *txq;
+    struct pbuf *pbs[NET_DEVICE_TX_BATCH];
+    int num, sent;
+
+    txq = dev->txq;
+    if (txq->flushing) {
+        /* NOTE: the thread flushing sends ours too */
+        return;
+    }
+    txq->flushing = 1;
+    while (txq->head) {
+        for (num = 0; num < NET_DEVICE_TX_BATCH && txq->head; num++) {
+            pbs[num] = txq->head;
+            txq->head = txq->head->next;
+            pbs[num]->next = NULL;
+        }
+        if (!txq->head) {
+            txq->tail = NULL;
+        }
+        txq->num -= num;
+        if (txq->ctx.wc) {
+            sched_wakeup(&txq->ctx);
+        }
+        mutex_unlock(&txq->lock);
+        sent = dev->ops->transmit_batch(dev, pbs, num);
+        if (sent != num) {
+            errorf("device transmit failure, dev=%s, num=%d, sent=%d", dev->name, num, sent);
+            stats_dev_add(dev, STATS_DEV_TX_ERRORS, num - sent);
+        }
+        mutex_lock(&txq->lock);
+    }
+    txq->flushing = 0;
+}
+
 static int
 net_device_close(struct net_device *dev)
 {
@@ -100,6 +175,11 @@ net_device_close(struct net_device *dev)
         errorf("not opened, dev=%s", dev->name);
         return -1;
     }
+    if (dev->txq) {
+        mutex_lock(&dev->txq->lock);
+        net_device_flush(dev);
+        mutex_unlock(&dev->txq->lock);
+    }
     if (dev->ops->close) {
         if (dev->ops->close(dev) == -1) {
             errorf("failure, dev=%s", dev->name);
@@ -129,6 +209,20 @@ net_device_add_iface(struct net_device *dev, struct net_iface *iface)
     return 0;
 }
 
+/* NOTE: the devices are never removed, the pointer stays valid */
+struct net_device *
+net_device_get(unsigned int index)
+{
+    struct net_device *dev;
+
+    for (dev = devices; dev; dev = dev->next) {
+        if (dev->index == index) {
+            break;
+        }
+    }
+    return dev;
+}
+
 struct net_iface *
 net_device_get_iface(struct net_device *dev, int family)
 {
@@ -142,60 +236,343 @@ net_device_get_iface(struct net_device *dev, int family)
     return entry;
 }
 
+/*
+ * Generic Segmentation Offload
+ * NOTE: a packet larger than MTU (pb->gso_size) is built once by the upper layers and split here,
+ *       as late as possible, unless the device does it by itself (NET_DEVICE_OFFLOAD_TSO).
+ */
+static int
+net_device_output_gso(struct net_device *dev, uint16_t type, struct pbuf *pb, const void *dst)
+{
+    struct net_protocol *proto;
+    struct pbuf *segs, *next;
+    int ret = 0;
+
+    for (proto = protocols; proto; proto = proto->next) {
+        if (proto->type == type) {
+            break;
+        }
+    }
+    if (!proto || !proto->gso) {
+        errorf("not supported, dev=%s, type=0x%04x", dev->name, type);
+        pbuf_free(pb);
+        return -1;
+    }
+    segs = proto->gso(pb, dev->offload);
+    pbuf_free(pb);
+    if (!segs) {
+        errorf("segmentation failure, dev=%s, type=0x%04x", dev->name, type);
+        stats_dev_inc(dev, STATS_DEV_TX_ERRORS);
+        return -1;
+    }
+    /* NOTE: the segments are handed down to the device together */
+    net_tx_begin();
+    for (; segs; segs = next) {
+        next = segs->next;
+        segs->next = NULL;
+        stats_inc(STATS_NET_GSO_SEGMENTS);
+        if (net_device_output(dev, type, segs, dst) == -1) {
+            ret = -1;
+        }
+    }
+    net_tx_end();
+    return ret;
+}
+
+/* NOTE: consumes pb (also on failure) */
 int
-net_device_output(struct net_device *dev, uint16_t type, const uint8_t *data, size_t len, const void *dst)
+net_device_output(struct net_device *dev, uint16_t type, struct pbuf *pb, const void *dst)
 {
+    size_t len;
+
+    len = pb->len;
     if (!NET_DEVICE_IS_UP(dev)) {
         errorf("not opened, dev=%s", dev->name);
+        stats_dev_inc(dev, STATS_DEV_TX_ERRORS);
+        pbuf_free(pb);
         return -1;
     }
-    if (len > dev->mtu) {
+    if (pb->gso_size) {
+        if (!(dev->offload & NET_DEVICE_OFFLOAD_TSO)) {
+            return net_device_output_gso(dev, type, pb, dst);
+        }
+    } else if (len > dev->mtu) {
         errorf("too long, dev=%s, mtu=%u, len=%zu", dev->name, dev->mtu, len);
+        stats_dev_inc(dev, STATS_DEV_TX_ERRORS);
+        pbuf_free(pb);
         return -1;
     }
+    if (!(dev->offload & NET_DEVICE_OFFLOAD_TX_CSUM)) {
+        pbuf_csum_finish(pb);
+    }
     debugf("dev=%s, type=%s(0x%04x), len=%zu", dev->name, net_protocol_name(type), type, len);
-    debugdump(data, len);
-    if (dev->ops->transmit(dev, type, data, len, dst) == -1) {
+    tracef(TRACE_EVENT_NET_OUTPUT, dev->index, type, len, 0);
+    debugdump(pb->data, len);
+    /* NOTE: counted when handed to the device, the frames failed in a batch are counted as errors too */
+    stats_dev_inc(dev, STATS_DEV_TX_PACKETS);
+    stats_dev_add(dev, STATS_DEV_TX_BYTES, len);
+    if (dev->ops->transmit(dev, type, pb, dst) == -1) {
         errorf("device transmit failure, dev=%s, len=%zu", dev->name, len);
+        stats_dev_inc(dev, STATS_DEV_TX_ERRORS);
         return -1;
     }
     return 0;
 }
 
+/*
+ * NOTE: called by the transmit of a device with transmit_batch, consumes pb (a whole frame).
+ *       the frame is handed down at the flush point (see net_tx_begin()), or right away if out of it.
+ *       a sender finding the queue full transmits it by itself or waits for the room (backpressure).
+ */
+int
+net_device_queue(struct net_device *dev, struct pbuf *pb)
+{
+    struct net_device_txq *txq;
+
+    txq = dev->txq;
+    mutex_lock(&txq->lock);
+    while (txq->num >= NET_DEVICE_TXQ_LEN) {
+        if (!txq->flushing) {
+            net_device_flush(dev);
+            continue;
+        }
+        if (sched_sleep(&txq->ctx, &txq->lock, NULL) == -1) {
+            mutex_unlock(&txq->lock);
+            errorf("interrupted, dev=%s", dev->name);
+            pbuf_free(pb);
+            return -1;
+        }
+    }
+    pb->next = NULL;
+    if (txq->tail) {
+        txq->tail->next = pb;
+    } else {
+        txq->head = pb;
+    }
+    txq->tail = pb;
+    txq->num++;
+    if (!tx_depth) {
+        net_device_flush(dev);
+    }
+    mutex_unlock(&txq->lock);
+    return 0;
+}
+
+/*
+ * NOTE: the frames queued by the thread until net_tx_end() are handed down together there (the flush point),
+ *       may be nested. do not sleep in between, the frames are held meanwhile.
+ */
+void
+net_tx_begin(void)
+{
+    tx_depth++;
+}
+
+void
+net_tx_end(void)
+{
+    struct net_device *dev;
+
+    if (--tx_depth) {
+        return;
+    }
+    for (dev = devices; dev; dev = dev->next) {
+        if (!dev->txq || !__atomic_load_n(&dev->txq->num, __ATOMIC_RELAXED)) {
+            continue;
+        }
+        mutex_lock(&dev->txq->lock);
+        net_device_flush(dev);
+        mutex_unlock(&dev->txq->lock);
+    }
+}
+
+/*
+ * NOTE: called by the driver on an interrupt instead of receiving the frames there (NAPI-style).
+ *       the device is polled in the softirq context with a budget, and stays scheduled (the further
+ *       interrupts are ignored) as long as it uses up the budget, one wakeup for a batch of frames.
+ */
+void
+net_device_schedule(struct net_device *dev)
+{
+    if (__atomic_exchange_n(&dev->scheduled, 1, __ATOMIC_ACQ_REL)) {
+        return;
+    }
+    raise_softirq();
+}
+
+/*
+ * NOTE: returns 1 if any device has more frames to be polled.
+ *       the interrupts and the softirq are handled in the same thread, an interrupt ignored while
+ *       scheduled is always followed by a poll.
+ */
+static int
+net_device_poll(void)
+{
+    struct net_device *dev;
+    int num, more = 0;
+
+    for (dev = devices; dev; dev = dev->next) {
+        if (!__atomic_load_n(&dev->scheduled, __ATOMIC_ACQUIRE)) {
+            continue;
+        }
+        num = dev->ops->poll ? dev->ops->poll(dev, NET_DEVICE_POLL_BUDGET) : 0;
+        if (num >= NET_DEVICE_POLL_BUDGET) {
+            more = 1;
+            continue;
+        }
+        __atomic_store_n(&dev->scheduled, 0, __ATOMIC_RELEASE);
+    }
+    return more;
+}
+
+static struct net_worker *
+net_worker_select(struct net_protocol *proto, struct pbuf *pb)
+{
+    if (!worker_num) {
+        return &workers[0];
+    }
+    /* NOTE: protocols without a flow hash (e.g. ARP) are processed by the first worker */
+    return &workers[proto->hash ? proto->hash(pb) % worker_num : 0];
+}
+
+/* NOTE: wakes up the worker only when it is (about to be) sleeping, called after pushed into its queue */
+static void
+net_worker_kick(struct net_worker *worker)
+{
+    /* NOTE: orders the push before the load of idle, pairs with the store in net_worker_thread() */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&worker->idle, __ATOMIC_RELAXED)) {
+        mutex_lock(&worker->mutex);
+        sched_wakeup(&worker->ctx);
+        mutex_unlock(&worker->mutex);
+    }
+}
+
+/* NOTE: consumes pb (also on failure) */
 int
-net_input_handler(uint16_t type, const uint8_t *data, size_t len, struct net_device *dev)
+net_input_handler(uint16_t type, struct pbuf *pb, struct net_device *dev)
 {
     struct net_protocol *proto;
-    struct net_protocol_queue_entry *entry;
+    struct net_worker *worker;
+    unsigned int num;
+    size_t len;
 
+    len = pb->len;
+    stats_dev_inc(dev, STATS_DEV_RX_PACKETS);
+    stats_dev_add(dev, STATS_DEV_RX_BYTES, len);
     for (proto = protocols; proto; proto = proto->next) {
         if (proto->type == type) {
-            entry = memory_alloc(sizeof(*entry) + len);
-            if (!entry) {
-                errorf("memory_alloc() failure");
+            pb->dev = dev;
+            pb->type = type;
+            pb->queued = stats_clock();
+            worker = net_worker_select(proto, pb);
+            debugdump(pb->data, len);
+            /* NOTE: pb belongs to the worker once pushed (may be freed already), not touched after that */
+            if (!ring_enqueue_mp(proto->queues[worker->index], (void **)&pb, 1)) {
+                debugf("queue full, dev=%s, type=%s(0x%04x), worker=%u", dev->name, proto->name, type, worker->index);
+                stats_inc(STATS_NET_IN_DROPS);
+                stats_dev_inc(dev, STATS_DEV_RX_DROPS);
+                pbuf_free(pb);
                 return -1;
             }
-            entry->dev = dev;
-            entry->len = len;
-            memcpy(entry+1, data, len);
-            if (!queue_push(&proto->queue, entry)) {
-                errorf("queue_push() failure");
-                memory_free(entry);
-                return -1;
+            num = ring_count(proto->queues[worker->index]);
+            debugf("queue pushed (num:%u), dev=%s, type=%s(0x%04x), len=%zd, worker=%u",
+                num, dev->name, proto->name, type, len, worker->index);
+            tracef(TRACE_EVENT_NET_INPUT, dev->index, type, len, worker->index);
+            if (!worker_num) {
+                raise_softirq();
+            } else {
+                net_worker_kick(worker);
             }
-            debugf("queue pushed (num:%u), dev=%s, type=%s(0x%04x), len=%zd", proto->queue.num, dev->name, proto->name, type, len);
-            debugdump(data, len);
-            raise_softirq();
+            stats_hist_record(STATS_HIST_QUEUE_LEN, num);
             return 0;
         }
     }
     /* unsupported protocol */
+    stats_inc(STATS_NET_IN_UNKNOWN_PROTOS);
+    stats_dev_inc(dev, STATS_DEV_RX_DROPS);
+    pbuf_free(pb);
+    return 0;
+}
+
+/* NOTE: pb->type of each is the protocol type, a worker is locked and woken up once for the batch, consumes pbs */
+int
+net_input_handler_batch(struct pbuf **pbs, int num, struct net_device *dev)
+{
+    struct net_protocol *proto, *protos[NET_DEVICE_POLL_BUDGET];
+    struct net_worker *worker, *selected[NET_DEVICE_POLL_BUDGET];
+    unsigned int i, n, w;
+    uint16_t type;
+    size_t len;
+    int pushed = 0;
+    uint64_t now;
+
+    while (num > NET_DEVICE_POLL_BUDGET) {
+        net_input_handler_batch(pbs, NET_DEVICE_POLL_BUDGET, dev);
+        pbs += NET_DEVICE_POLL_BUDGET;
+        num -= NET_DEVICE_POLL_BUDGET;
+    }
+    now = stats_clock();
+    for (i = 0; i < (unsigned int)num; i++) {
+        stats_dev_inc(dev, STATS_DEV_RX_PACKETS);
+        stats_dev_add(dev, STATS_DEV_RX_BYTES, pbs[i]->len);
+        for (proto = protocols; proto; proto = proto->next) {
+            if (proto->type == pbs[i]->type) {
+                break;
+            }
+        }
+        protos[i] = proto;
+        if (!proto) {
+            /* unsupported protocol */
+            stats_inc(STATS_NET_IN_UNKNOWN_PROTOS);
+            stats_dev_inc(dev, STATS_DEV_RX_DROPS);
+            pbuf_free(pbs[i]);
+            continue;
+        }
+        pbs[i]->dev = dev;
+        pbs[i]->queued = now;
+        selected[i] = net_worker_select(proto, pbs[i]);
+    }
+    for (w = 0; w < MAX(worker_num, 1); w++) {
+        worker = &workers[w];
+        n = 0;
+        for (i = 0; i < (unsigned int)num; i++) {
+            if (!protos[i] || selected[i] != worker) {
+                continue;
+            }
+            type = pbs[i]->type;
+            len = pbs[i]->len;
+            /* NOTE: a running worker takes it at once (may be freed already), pbs[i] is not touched after the push */
+            if (!ring_enqueue_mp(protos[i]->queues[w], (void **)&pbs[i], 1)) {
+                debugf("queue full, dev=%s, type=%s(0x%04x), worker=%u", dev->name, protos[i]->name, type, w);
+                stats_inc(STATS_NET_IN_DROPS);
+                stats_dev_inc(dev, STATS_DEV_RX_DROPS);
+                pbuf_free(pbs[i]);
+                continue;
+            }
+            n++;
+            stats_hist_record(STATS_HIST_QUEUE_LEN, ring_count(protos[i]->queues[w]));
+            debugf("queue pushed (num:%u), dev=%s, type=%s(0x%04x), len=%zd, worker=%u",
+                ring_count(protos[i]->queues[w]), dev->name, protos[i]->name, type, len, w);
+            tracef(TRACE_EVENT_NET_INPUT, dev->index, type, len, w);
+        }
+        if (!n) {
+            continue;
+        }
+        pushed = 1;
+        if (worker_num) {
+            net_worker_kick(worker);
+        }
+    }
+    if (!worker_num && pushed) {
+        raise_softirq();
+    }
     return 0;
 }
 
 /* NOTE: must not be call after net_run() */
 int
-net_protocol_register(const char *name, uint16_t type, void (*handler)(const uint8_t *data, size_t len, struct net_device *dev))
+net_protocol_register(const char *name, uint16_t type, void (*handler)(struct pbuf *pb, struct net_device *dev))
 {
     struct net_protocol *proto;
 
@@ -219,6 +596,54 @@ net_protocol_register(const char *name, uint16_t type, void (*handler)(const uin
     return 0;
 }
 
+/* NOTE: must not be call after net_run() */
+int
+net_protocol_set_hash(uint16_t type, uint32_t (*hash)(const struct pbuf *pb))
+{
+    struct net_protocol *proto;
+
+    for (proto = protocols; proto; proto = proto->next) {
+        if (proto->type == type) {
+            proto->hash = hash;
+            return 0;
+        }
+    }
+    errorf("not registered, type=0x%04x", type);
+    return -1;
+}
+
+/* NOTE: must not be call after net_run() */
+int
+net_protocol_set_gso(uint16_t type, struct pbuf *(*gso)(struct pbuf *pb, uint16_t offload))
+{
+    struct net_protocol *proto;
+
+    for (proto = protocols; proto; proto = proto->next) {
+        if (proto->type == type) {
+            proto->gso = gso;
+            return 0;
+        }
+    }
+    errorf("not registered, type=0x%04x", type);
+    return -1;
+}
+
+/* NOTE: must not be call after net_run() */
+int
+net_protocol_set_gro(uint16_t type, int (*gro)(struct pbuf **head, struct pbuf *pb))
+{
+    struct net_protocol *proto;
+
+    for (proto = protocols; proto; proto = proto->next) {
+        if (proto->type == type) {
+            proto->gro = gro;
+            return 0;
+        }
+    }
+    errorf("not registered, type=0x%04x", type);
+    return -1;
+}
+
 char *
 net_protocol_name(uint16_t type)
 {
@@ -232,72 +657,218 @@ net_protocol_name(uint16_t type)
     return "UNKNOWN";
 }
 
+/* NOTE: the packets waiting in the input queues of the protocol (of all the workers), -1 if not registered */
 int
-net_protocol_handler(void)
+net_protocol_queue_len(uint16_t type)
+{
+    struct net_protocol *entry;
+    unsigned int i;
+    int num = 0;
+
+    for (entry = protocols; entry; entry = entry->next) {
+        if (entry->type == type) {
+            break;
+        }
+    }
+    if (!entry) {
+        return -1;
+    }
+    for (i = 0; i < MAX(worker_num, 1); i++) {
+        if (entry->queues[i]) {
+            num += ring_count(entry->queues[i]);
+        }
+    }
+    return num;
+}
+
+/*
+ * Generic Receive Offload
+ * NOTE: the packets of a flow in a batch are merged into one before the handler (the RX mirror of GSO),
+ *       each is tried against the last NET_GRO_SCAN ones held, the order within a flow is kept.
+ *       returns the number of the packets left in pbs.
+ */
+static unsigned int
+net_gro(struct net_protocol *proto, struct pbuf **pbs, unsigned int num)
+{
+    unsigned int i, j, n = 0;
+    int ret;
+
+    for (i = 0; i < num; i++) {
+        ret = NET_GRO_OTHER;
+        for (j = n; j > 0 && n - j < NET_GRO_SCAN; j--) {
+            if (pbs[j-1]->dev != pbs[i]->dev) {
+                continue;
+            }
+            ret = proto->gro(&pbs[j-1], pbs[i]);
+            if (ret != NET_GRO_OTHER) {
+                break;
+            }
+        }
+        if (ret == NET_GRO_MERGED) {
+            stats_inc(STATS_NET_GRO_MERGED);
+            pbuf_free(pbs[i]);
+            continue;
+        }
+        pbs[n++] = pbs[i];
+    }
+    return n;
+}
+
+/* NOTE: returns the number of processed packets */
+static int
+net_worker_process(struct net_worker *worker)
 {
     struct net_protocol *proto;
-    struct net_protocol_queue_entry *entry;
-    unsigned int num;
+    struct ring *queue;
+    struct pbuf *pb, *pbs[NET_DEVICE_POLL_BUDGET];
+    unsigned int num, n, i;
+    int count = 0;
+    uint64_t start, now;
 
+    start = stats_clock();
     for (proto = protocols; proto; proto = proto->next) {
+        queue = proto->queues[worker->index];
         while (1) {
-            entry = queue_pop(&proto->queue);
-            if (!entry) {
+            /* NOTE: taken out as a batch, the worker is the only consumer of its queues */
+            n = ring_dequeue(queue, (void **)pbs, NET_DEVICE_POLL_BUDGET);
+            num = ring_count(queue);
+            if (!n) {
                 break;
             }
-            num = proto->queue.num;
-            debugf("queue popped (num:%u), dev=%s, type=0x%04x, len=%zd", num, entry->dev->name, proto->type, entry->len);
-            debugdump((uint8_t *)(entry+1), entry->len);
-            proto->handler((uint8_t *)(entry+1), entry->len, entry->dev);
-            free(entry);
+            count += n;
+            tracef(TRACE_EVENT_SOFTIRQ, worker->index, proto->type, n, num);
+            now = stats_clock();
+            for (i = 0; i < n; i++) {
+                stats_hist_record(STATS_HIST_QUEUE, now - pbs[i]->queued);
+            }
+            if (proto->gro && n > 1) {
+                n = net_gro(proto, pbs, n);
+            }
+            for (i = 0; i < n; i++) {
+                pb = pbs[i];
+                debugf("queue popped (num:%u), dev=%s, type=0x%04x, len=%zd, worker=%u",
+                    num, pb->dev->name, proto->type, pb->len, worker->index);
+                debugdump(pb->data, pb->len);
+                proto->handler(pb, pb->dev);
+                pbuf_free(pb);
+            }
         }
     }
-    return 0;
+    if (count) {
+        stats_hist_record(STATS_HIST_SOFTIRQ, stats_clock() - start);
+    }
+    return count;
 }
 
-/* NOTE: must not be call after net_run() */
 int
-net_timer_register(const char *name, struct timeval interval, void (*handler)(void))
+net_protocol_handler(void)
 {
-    struct net_timer *timer;
+    net_tx_begin();
+    if (net_device_poll()) {
+        /* NOTE: come back after the other interrupts */
+        raise_softirq();
+    }
+    net_worker_process(&workers[0]);
+    net_tx_end();
+    return 0;
+}
 
-    timer = memory_alloc(sizeof(*timer));
-    if (!timer) {
-        errorf("memory_alloc() failure");
+static void *
+net_worker_thread(void *arg)
+{
+    struct net_worker *worker;
+    struct net_protocol *proto;
+    int empty;
+
+    worker = arg;
+    debugf("worker=%u, running...", worker->index);
+    while (1) {
+        net_tx_begin();
+        empty = !net_worker_process(worker);
+        net_tx_end();
+        if (!empty) {
+            continue;
+        }
+        mutex_lock(&worker->mutex);
+        /* NOTE: idle is set before the check, a producer pushing meanwhile sees it (see net_worker_kick()) */
+        __atomic_store_n(&worker->idle, 1, __ATOMIC_SEQ_CST);
+        empty = 1;
+        for (proto = protocols; proto; proto = proto->next) {
+            if (ring_count(proto->queues[worker->index])) {
+                empty = 0;
+                break;
+            }
+        }
+        if (empty && !worker->terminate) {
+            sched_sleep(&worker->ctx, &worker->mutex, NULL);
+        }
+        __atomic_store_n(&worker->idle, 0, __ATOMIC_RELAXED);
+        if (worker->terminate) {
+            mutex_unlock(&worker->mutex);
+            break;
+        }
+        mutex_unlock(&worker->mutex);
+    }
+    debugf("worker=%u, terminated", worker->index);
+    return NULL;
+}
+
+/* NOTE: must not be call after net_run(), 0 means to process the packets in the softirq context */
+int
+net_worker_setup(unsigned int num)
+{
+    if (running) {
+        errorf("already running");
+        return -1;
+    }
+    if (num > NET_WORKER_MAX) {
+        errorf("too many workers, num=%u, max=%d", num, NET_WORKER_MAX);
         return -1;
     }
-    strncpy(timer->name, name, sizeof(timer->name)-1);
-    timer->interval = interval;
-    gettimeofday(&timer->last, NULL);
-    timer->handler = handler;
-    timer->next = timers;
-    timers = timer;
-    infof("registered: %s interval={%d, %d}", timer->name, interval.tv_sec, interval.tv_usec);
+    worker_num = num;
     return 0;
 }
 
-int
-net_timer_handler(void)
+static int
+net_worker_run(void)
 {
-    struct net_timer *timer;
-    struct timeval now, diff;
+    struct net_worker *worker;
+    unsigned int i;
 
-    for (timer = timers; timer; timer = timer->next) {
-        gettimeofday(&now, NULL);
-        timersub(&now, &timer->last, &diff);
-        if (timercmp(&timer->interval, &diff, <) != 0) { /* true (!0) or false (0) */
-            timer->handler();
-            timer->last = now;
+    for (i = 0; i < worker_num; i++) {
+        worker = &workers[i];
+        /* NOTE: the threads inherit the signal mask of the caller (blocked by intr_run()) */
+        if (thread_create(&worker->thread, net_worker_thread, worker, i) == -1) {
+            errorf("thread_create() failure, worker=%u", i);
+            worker_num = i; /* NOTE: keep only the started workers */
+            return -1;
         }
     }
+    infof("workers=%u", worker_num);
     return 0;
 }
 
+static void
+net_worker_shutdown(void)
+{
+    struct net_worker *worker;
+    unsigned int i;
+
+    for (i = 0; i < worker_num; i++) {
+        worker = &workers[i];
+        mutex_lock(&worker->mutex);
+        worker->terminate = 1;
+        sched_wakeup(&worker->ctx);
+        mutex_unlock(&worker->mutex);
+        thread_join(worker->thread);
+    }
+}
+
+/* NOTE: async-signal-safe, can be called from a signal handler */
 int
 net_interrupt(void)
 {
-    /* getpid(2) and kill(2) are signal safety functions. see signal-safety(7). */
-    return kill(getpid(), SIGUSR2);
+    return raise_event();
 }
 
 /* NOTE: must not be call after net_run() */
@@ -329,15 +900,66 @@ net_event_handler(void)
     return 0;
 }
 
+/* NOTE: the input queues are allocated only for the workers in use */
+static int
+net_protocol_queue_alloc(void)
+{
+    struct net_protocol *proto;
+    unsigned int i;
+
+    for (proto = protocols; proto; proto = proto->next) {
+        for (i = 0; i < MAX(worker_num, 1); i++) {
+            proto->queues[i] = ring_alloc(NET_PROTOCOL_QUEUE_LEN);
+            if (!proto->queues[i]) {
+                errorf("ring_alloc() failure");
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+/* NOTE: the frames all the queues in use can hold at once, and the reserve for the other holders (see net.h) */
+static size_t
+net_pool_frame_capacity(void)
+{
+    struct net_protocol *proto;
+    struct net_device *dev;
+    size_t capacity = NET_POOL_FRAME_RESERVE;
+
+    for (proto = protocols; proto; proto = proto->next) {
+        capacity += (size_t)NET_PROTOCOL_QUEUE_LEN * MAX(worker_num, 1);
+    }
+    for (dev = devices; dev; dev = dev->next) {
+        if (dev->txq) {
+            capacity += NET_DEVICE_TXQ_LEN;
+        }
+    }
+    return capacity;
+}
+
 int
 net_run(void)
 {
     struct net_device *dev;
 
+    if (memory_pool_init(0, net_pool_frame_capacity()) == -1) {
+        errorf("memory_pool_init() failure");
+        return -1;
+    }
+    if (net_protocol_queue_alloc() == -1) {
+        errorf("net_protocol_queue_alloc() failure");
+        return -1;
+    }
     if (intr_run() == -1) {
         errorf("intr_run() failure");
         return -1;
     }
+    if (net_worker_run() == -1) {
+        errorf("net_worker_run() failure");
+        return -1;
+    }
+    running = 1;
     debugf("open all devices...");
     for (dev = devices; dev; dev = dev->next) {
         net_device_open(dev);
@@ -351,6 +973,10 @@ net_shutdown(void)
 {
     struct net_device *dev;
 
+    net_worker_shutdown();
+#ifdef TRACE_RING
+    trace_dump(TRACE_RING_FILE);
+#endif
     debugf("close all devices...");
     for (dev = devices; dev; dev = dev->next) {
         net_device_close(dev);
@@ -367,6 +993,18 @@ net_shutdown(void)
 int
 net_init(void)
 {
+    unsigned int i;
+
+    for (i = 0; i < NET_WORKER_MAX; i++) {
+        workers[i].index = i;
+        mutex_init(&workers[i].mutex);
+        sched_ctx_init(&workers[i].ctx);
+    }
+    /* NOTE: the frames are preallocated by net_run(), when the number of the queues is known */
+    if (memory_pool_init(NET_POOL_SMALL_CAPACITY, 0) == -1) {
+        errorf("memory_pool_init() failure");
+        return -1;
+    }
     if (intr_init() == -1) {
         errorf("intr_init() failure");
         return -1;
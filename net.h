@@ -6,6 +6,8 @@
 #include <sys/time.h>
 #include <signal.h>
 
+#include "pbuf.h"
+
 #ifndef IFNAMSIZ
 #define IFNAMSIZ 16
 #endif
@@ -22,6 +24,10 @@
 
 #define NET_DEVICE_ADDR_LEN 16
 
+#define NET_DEVICE_OFFLOAD_RX_CSUM 0x0001 /* verifies the TCP/UDP checksum of received packets (PBUF_FLAG_CSUM_VALID) */
+#define NET_DEVICE_OFFLOAD_TX_CSUM 0x0002 /* fills in the checksum of the packets sent (PBUF_FLAG_CSUM_PARTIAL) */
+#define NET_DEVICE_OFFLOAD_TSO     0x0004 /* splits a TCP segment larger than MTU by itself (pb->gso_size), requires TX_CSUM */
+
 #define NET_DEVICE_IS_UP(x) ((x)->flags & NET_DEVICE_FLAG_UP)
 #define NET_DEVICE_STATE(x) (NET_DEVICE_IS_UP(x) ? "up" : "down")
 
@@ -37,7 +43,83 @@
 
 #define NET_IRQ_SHARED 0x0001
 
+/* readiness of a pcb (see tcp_poll(), udp_poll()) */
+#define NET_POLL_IN  0x0001
+#define NET_POLL_OUT 0x0004
+#define NET_POLL_ERR 0x0008
+#define NET_POLL_HUP 0x0010
+
+/* NOTE: the user command fails with EAGAIN instead of sleeping, for the call only (see MSG_DONTWAIT) */
+#define NET_MSG_DONTWAIT 0x0040
+
+/* the changes of the readiness are notified to the watches (see tcp_watch(), udp_watch(), and platform.h) */
+struct sched_watch;
+struct sched_poller;
+
+/*
+ * NOTE: the control entries are preallocated at net_init(), override at build time (e.g. CFLAGS=-DNET_POOL_SMALL_CAPACITY=8192).
+ *       the holders draw from the class within their own limits:
+ *         UDP receive queues (an entry per datagram, UDP_RCVBUF_DEFAULT, 64 KB, up to 512 per socket)
+ *         TCP retransmission queues (an entry per segment in flight, TCP_SNDBUF_DEFAULT, 64 KB, about 45 per connection)
+ *         TCP out of order queues (TCP_OOO_ENTRY_MAX, 16 per connection)
+ *       unlike the frames, the class falls back to the heap when used up, a segment is never sent
+ *       without its retransmission entry because of a few busy sockets.
+ */
+#ifndef NET_POOL_SMALL_CAPACITY
+#define NET_POOL_SMALL_CAPACITY 4096
+#endif
+/*
+ * NOTE: the frames are preallocated at net_run() for the queues in use (see net_pool_frame_capacity()),
+ *       the input queues of the protocols and the transmit queues of the devices can never take the pool
+ *       by themselves. on top of them, NET_POOL_FRAME_RESERVE is kept for the holders bounded by their own
+ *       limits that may keep frames for long:
+ *         ARP pending packets (ARP_PENDING_TOTAL_MAX, 512)
+ *         IP reassembly (IP_REASS_MEM_MAX, 256 KB, about 128 frames)
+ *         UDP receive queues (UDP_RCVBUF_DEFAULT, 64 KB, about 32 frames per socket)
+ *         TCP out of order queues (TCP_OOO_ENTRY_MAX, 16 frames per connection)
+ *       the last two grow with the sockets, raise the reserve for many of them being backlogged at once.
+ */
+#ifndef NET_POOL_FRAME_RESERVE
+#define NET_POOL_FRAME_RESERVE 1024
+#endif
+
+/* NOTE: frames handed up at most by a device per poll (see net_device_schedule()) */
+#ifndef NET_DEVICE_POLL_BUDGET
+#define NET_DEVICE_POLL_BUDGET 64
+#endif
+
+/* results of the GRO handler (see net_protocol_set_gro()) */
+#define NET_GRO_OTHER  0 /* another flow */
+#define NET_GRO_MERGED 1 /* merged into the held one (pb is left to the caller to free) */
+#define NET_GRO_FLUSH  2 /* the same flow but not to be merged, the held one goes first */
+#define NET_GRO_SCAN   8 /* the held packets tried for a packet at most */
+
+/* NOTE: frames queued at most on a device with transmit_batch, and handed down at most per call (see net_device_queue()) */
+#ifndef NET_DEVICE_TXQ_LEN
+#define NET_DEVICE_TXQ_LEN 256
+#endif
+#define NET_DEVICE_TX_BATCH 64
+
+/* NOTE: number of the protocol workers, 0 means to process the packets in the softirq context */
+#ifndef NET_WORKER_NUM
+#define NET_WORKER_NUM 0
+#endif
+#define NET_WORKER_MAX 16
+#if NET_WORKER_NUM > NET_WORKER_MAX
+#error "NET_WORKER_NUM exceeds NET_WORKER_MAX"
+#endif
+
+/* NOTE: packets held at most in an input queue of a protocol (per worker), the ones beyond are dropped */
+#ifndef NET_PROTOCOL_QUEUE_LEN
+#define NET_PROTOCOL_QUEUE_LEN 1024
+#endif
+#if NET_PROTOCOL_QUEUE_LEN & (NET_PROTOCOL_QUEUE_LEN - 1)
+#error "NET_PROTOCOL_QUEUE_LEN must be a power of 2 (the size of the ring)"
+#endif
+
 struct net_device; /* forward declaration */
+struct net_device_txq; /* see net.c */
+struct stats_dev; /* see stats.h */
 
 struct net_iface {
     struct net_iface *next;
@@ -49,8 +131,9 @@ struct net_iface {
 struct net_device_ops {
     int (*open)(struct net_device *dev);
     int (*close)(struct net_device *dev);
-    int (*transmit)(struct net_device *dev, uint16_t type, const uint8_t *data, size_t len, const void *dst);
-    int (*poll)(struct net_device *dev);
+    int (*transmit)(struct net_device *dev, uint16_t type, struct pbuf *pb, const void *dst); /* NOTE: consumes pb */
+    int (*poll)(struct net_device *dev, int budget); /* NOTE: hands up at most budget frames, returns the number */
+    int (*transmit_batch)(struct net_device *dev, struct pbuf **pbs, int num); /* NOTE: pbs are whole frames, consumes pbs, returns the number sent */
 };
 
 struct net_device {
@@ -61,6 +144,7 @@ struct net_device {
     uint16_t type;
     uint16_t mtu;
     uint16_t flags;
+    uint16_t offload; /* NOTE: may be cleared before net_run() to disable the offloads */
     uint16_t hlen; /* header length */
     uint16_t alen; /* address length */
     uint8_t addr[NET_DEVICE_ADDR_LEN];
@@ -69,6 +153,9 @@ struct net_device {
         uint8_t broadcast[NET_DEVICE_ADDR_LEN];
     };
     struct net_device_ops *ops;
+    int scheduled; /* NOTE: to be polled, the interrupts are ignored meanwhile (see net_device_schedule()) */
+    struct net_device_txq *txq; /* NOTE: allocated at the registration if the device has transmit_batch */
+    struct stats_dev *stats; /* NOTE: allocated at the registration, STATS_SLOT_NUM entries (see stats.h) */
     void *priv;
 };
 
@@ -76,33 +163,52 @@ extern struct net_device *
 net_device_alloc(void (*setup)(struct net_device *dev));
 extern int
 net_device_register(struct net_device *dev);
+extern struct net_device *
+net_device_get(unsigned int index);
 extern int
 net_device_add_iface(struct net_device *dev, struct net_iface *iface);
 extern struct net_iface *
 net_device_get_iface(struct net_device *dev, int family);
 extern int
-net_device_output(struct net_device *dev, uint16_t type, const uint8_t *data, size_t len, const void *dst);
+net_device_output(struct net_device *dev, uint16_t type, struct pbuf *pb, const void *dst);
+extern void
+net_device_schedule(struct net_device *dev);
+extern int
+net_device_queue(struct net_device *dev, struct pbuf *pb);
+
+extern void
+net_tx_begin(void);
+extern void
+net_tx_end(void);
 
 extern int
-net_input_handler(uint16_t type, const uint8_t *data, size_t len, struct net_device *dev);
+net_input_handler(uint16_t type, struct pbuf *pb, struct net_device *dev);
+extern int
+net_input_handler_batch(struct pbuf **pbs, int num, struct net_device *dev);
 
 extern int
-net_protocol_register(const char *name, uint16_t type, void (*handler)(const uint8_t *data, size_t len, struct net_device *dev));
+net_protocol_register(const char *name, uint16_t type, void (*handler)(struct pbuf *pb, struct net_device *dev));
+extern int
+net_protocol_set_hash(uint16_t type, uint32_t (*hash)(const struct pbuf *pb));
+extern int
+net_protocol_set_gso(uint16_t type, struct pbuf *(*gso)(struct pbuf *pb, uint16_t offload));
+extern int
+net_protocol_set_gro(uint16_t type, int (*gro)(struct pbuf **head, struct pbuf *pb));
 extern char *
 net_protocol_name(uint16_t type);
 extern int
-net_protocol_handler(void);
-
-extern int
-net_timer_register(const char *name, struct timeval interval, void (*handler)(void));
+net_protocol_queue_len(uint16_t type);
 extern int
-net_timer_handler(void);
+net_protocol_handler(void);
 
 extern int
 net_event_subscribe(void (*handler)(void *arg), void *arg);
 extern int
 net_event_handler(void);
 
+extern int
+net_worker_setup(unsigned int num);
+
 extern int
 net_interrupt(void);
 extern int
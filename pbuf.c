@@ -0,0 +1,163 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "platform.h"
+
+#include "util.h"
+#include "pbuf.h"
+
+struct pbuf *
+pbuf_alloc(size_t len)
+{
+    return pbuf_alloc_headroom(PBUF_HEADROOM, len);
+}
+
+struct pbuf *
+pbuf_alloc_headroom(size_t headroom, size_t len)
+{
+    struct pbuf *pb;
+    size_t size;
+
+    size = headroom + MAX(len, PBUF_DATA_SIZE_MIN);
+    pb = memory_pool_alloc(sizeof(*pb) + size);
+    if (!pb) {
+        errorf("memory_pool_alloc() failure");
+        return NULL;
+    }
+    pb->next = NULL;
+    pb->ref = 1;
+    pb->dev = NULL;
+    pb->type = 0;
+    pb->flags = 0;
+    pb->gso_size = 0;
+    pb->frags = NULL;
+    pb->release = NULL;
+    pb->data = pb->head + headroom;
+    pb->len = len;
+    pb->size = size;
+    return pb;
+}
+
+struct pbuf *
+pbuf_ref(struct pbuf *pb)
+{
+    __atomic_add_fetch(&pb->ref, 1, __ATOMIC_RELAXED);
+    return pb;
+}
+
+void
+pbuf_free(struct pbuf *pb)
+{
+    struct pbuf *frag;
+
+    if (!pb) {
+        return;
+    }
+    if (__atomic_sub_fetch(&pb->ref, 1, __ATOMIC_ACQ_REL) == 0) {
+        while (pb->frags) {
+            frag = pb->frags;
+            pb->frags = frag->next;
+            pbuf_free(frag);
+        }
+        if (pb->release) {
+            pb->release(pb);
+            return;
+        }
+        memory_pool_free(pb);
+    }
+}
+
+size_t
+pbuf_headroom(const struct pbuf *pb)
+{
+    return pb->data - pb->head;
+}
+
+size_t
+pbuf_tailroom(const struct pbuf *pb)
+{
+    return pb->size - pbuf_headroom(pb) - pb->len;
+}
+
+/* prepend len bytes (e.g. a header) in front of the data */
+uint8_t *
+pbuf_push(struct pbuf *pb, size_t len)
+{
+    if (pbuf_headroom(pb) < len) {
+        errorf("no headroom, headroom=%zu, len=%zu", pbuf_headroom(pb), len);
+        return NULL;
+    }
+    pb->data -= len;
+    pb->len += len;
+    return pb->data;
+}
+
+/* strip len bytes (e.g. a header) from the front of the data */
+uint8_t *
+pbuf_pull(struct pbuf *pb, size_t len)
+{
+    if (pb->len < len) {
+        return NULL;
+    }
+    pb->data += len;
+    pb->len -= len;
+    return pb->data;
+}
+
+/* append len bytes after the data, returns a pointer to the appended area */
+uint8_t *
+pbuf_put(struct pbuf *pb, size_t len)
+{
+    uint8_t *tail;
+
+    if (pbuf_tailroom(pb) < len) {
+        return NULL;
+    }
+    tail = pb->data + pb->len;
+    pb->len += len;
+    return tail;
+}
+
+/* cut the data down to len bytes */
+int
+pbuf_trim(struct pbuf *pb, size_t len)
+{
+    if (pb->len < len) {
+        return -1;
+    }
+    pb->len = len;
+    return 0;
+}
+
+/*
+ * Checksum Offload
+ *
+ * NOTE: the checksum field holds the sum of the pseudo header (see cksum16_pseudo()), the rest of the
+ *       checksum is computed over [data ... data+len) by the device or by pbuf_csum_finish().
+ */
+
+/* NOTE: offset is the one of the checksum field from data */
+void
+pbuf_csum_partial(struct pbuf *pb, size_t offset)
+{
+    pb->csum_start = pb->data - pb->head;
+    pb->csum_offset = offset;
+    pb->flags |= PBUF_FLAG_CSUM_PARTIAL;
+}
+
+void
+pbuf_csum_finish(struct pbuf *pb)
+{
+    uint8_t *start;
+    uint16_t sum;
+
+    if (!(pb->flags & PBUF_FLAG_CSUM_PARTIAL)) {
+        return;
+    }
+    start = pb->head + pb->csum_start;
+    sum = cksum16((uint16_t *)start, pb->data + pb->len - start, 0);
+    memcpy(start + pb->csum_offset, &sum, sizeof(sum));
+    pb->flags &= ~PBUF_FLAG_CSUM_PARTIAL;
+}
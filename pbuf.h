@@ -0,0 +1,69 @@
+#ifndef PBUF_H
+#define PBUF_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* link(14) + IP header(max 60) + TCP header(max 60), rounded up */
+#define PBUF_HEADROOM 144
+/* NOTE: enough tailroom to pad out the minimum Ethernet frame */
+#define PBUF_DATA_SIZE_MIN 64
+
+#define PBUF_FLAG_CSUM_PARTIAL 0x01 /* TX: the checksum from csum_start to the end is left to be filled in */
+#define PBUF_FLAG_CSUM_VALID   0x02 /* RX: the checksum of the transport layer has been verified */
+
+struct net_device; /* forward declaration */
+
+/*
+ * Packet Buffer
+ *
+ * NOTE: [head ... data) is the headroom that lower layers prepend their headers into,
+ *       [data ... data+len) is the valid data, the rest up to size is the tailroom.
+ */
+struct pbuf {
+    struct pbuf *next; /* NOTE: free for use by the current owner */
+    unsigned int ref;
+    struct net_device *dev;
+    uint16_t type;
+    uint16_t flags;
+    uint16_t csum_start; /* CSUM_PARTIAL: offset from head where the checksummed area starts */
+    uint16_t csum_offset; /* CSUM_PARTIAL: offset of the checksum field from csum_start */
+    uint16_t gso_size; /* TX: the payload is to be split into segments of this size (see net_device_output()), 0 if not
+                          RX: the size of the segments merged into this (see net_gro()), 0 if not */
+    struct pbuf *frags; /* RX: the frames merged into this by GRO (linked by next), freed with this, NULL if not */
+    uint8_t *data;
+    size_t len;
+    size_t size;
+    uint64_t queued; /* RX: the time pushed into the protocol queue (see stats_clock()) */
+    void (*release)(struct pbuf *pb); /* NOTE: NULL if from pbuf_alloc(), otherwise gives the memory back to the owner (e.g. a driver frame) */
+    uint8_t head[];
+};
+
+extern struct pbuf *
+pbuf_alloc(size_t len);
+extern struct pbuf *
+pbuf_alloc_headroom(size_t headroom, size_t len);
+extern struct pbuf *
+pbuf_ref(struct pbuf *pb);
+extern void
+pbuf_free(struct pbuf *pb);
+
+extern size_t
+pbuf_headroom(const struct pbuf *pb);
+extern size_t
+pbuf_tailroom(const struct pbuf *pb);
+extern uint8_t *
+pbuf_push(struct pbuf *pb, size_t len);
+extern uint8_t *
+pbuf_pull(struct pbuf *pb, size_t len);
+extern uint8_t *
+pbuf_put(struct pbuf *pb, size_t len);
+extern int
+pbuf_trim(struct pbuf *pb, size_t len);
+
+extern void
+pbuf_csum_partial(struct pbuf *pb, size_t offset);
+extern void
+pbuf_csum_finish(struct pbuf *pb);
+
+#endif
@@ -1,4 +1,4 @@
-#define _GNU_SOURCE /* for F_SETSIG */
+#define _GNU_SOURCE /* for sendmmsg() */
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -9,7 +9,7 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/ioctl.h>
-#include <sys/poll.h>
+#include <sys/mman.h>
 #include <linux/if.h>
 #include <linux/if_ether.h>
 #include <linux/if_packet.h>
@@ -24,10 +24,39 @@
 
 #define ETHER_PCAP_IRQ (SIGRTMIN+3)
 
+/* NOTE: use the mmap rings (TPACKET_V3) if available, override at build time (e.g. CFLAGS=-DETHER_PCAP_RING=0) */
+#ifndef ETHER_PCAP_RING
+#define ETHER_PCAP_RING 1
+#endif
+
+#define ETHER_PCAP_FRAME_SIZE    2048
+#define ETHER_PCAP_RX_BLOCK_SIZE (1 << 16)
+#define ETHER_PCAP_RX_BLOCK_NUM  32
+#define ETHER_PCAP_RX_BLOCK_TMO  1 /* ms, a block partially filled is handed over after this */
+#define ETHER_PCAP_TX_BLOCK_SIZE (1 << 16)
+#define ETHER_PCAP_TX_BLOCK_NUM  8
+#define ETHER_PCAP_TX_FRAME_NUM  (ETHER_PCAP_TX_BLOCK_SIZE / ETHER_PCAP_FRAME_SIZE * ETHER_PCAP_TX_BLOCK_NUM)
+/* NOTE: the frame to send follows the header (see tpacket_parse_header() in the kernel) */
+#define ETHER_PCAP_TX_DATA_OFFSET (TPACKET3_HDRLEN - sizeof(struct sockaddr_ll))
+
+/*
+ * NOTE: RX is a ring of blocks filled by the kernel, each block holds a batch of frames.
+ *       TX is a ring of frames filled by us, the kernel sends all the frames requested at one sendto(2).
+ */
+struct ether_pcap_ring {
+    uint8_t *map; /* RX blocks followed by TX frames, NULL if not used */
+    size_t size;
+    unsigned int rx_block; /* the next block to be consumed */
+    uint32_t rx_pkt; /* frames of the block already consumed (within the budget) */
+    struct tpacket3_hdr *rx_hdr; /* the next frame of the block */
+    unsigned int tx_frame; /* the next frame to be filled, NOTE: one thread at a time transmits (see net_device_queue()) */
+};
+
 struct ether_pcap {
     char name[IFNAMSIZ];
     int fd;
     unsigned int irq;
+    struct ether_pcap_ring ring;
 };
 
 #define PRIV(x) ((struct ether_pcap *)x->priv)
@@ -54,6 +83,73 @@ ether_pcap_addr(struct net_device *dev) {
     return 0;
 }
 
+static int
+ether_pcap_ring_setup(struct net_device *dev)
+{
+    struct ether_pcap *pcap;
+    struct tpacket_req3 rx = {}, tx = {};
+    int val;
+
+    pcap = PRIV(dev);
+    val = TPACKET_V3;
+    if (setsockopt(pcap->fd, SOL_PACKET, PACKET_VERSION, &val, sizeof(val)) == -1) {
+        warnf("setsockopt(PACKET_VERSION): %s, dev=%s", strerror(errno), dev->name);
+        return -1;
+    }
+    rx.tp_block_size = ETHER_PCAP_RX_BLOCK_SIZE;
+    rx.tp_block_nr = ETHER_PCAP_RX_BLOCK_NUM;
+    rx.tp_frame_size = ETHER_PCAP_FRAME_SIZE;
+    rx.tp_frame_nr = rx.tp_block_size / rx.tp_frame_size * rx.tp_block_nr;
+    rx.tp_retire_blk_tov = ETHER_PCAP_RX_BLOCK_TMO;
+    if (setsockopt(pcap->fd, SOL_PACKET, PACKET_RX_RING, &rx, sizeof(rx)) == -1) {
+        warnf("setsockopt(PACKET_RX_RING): %s, dev=%s", strerror(errno), dev->name);
+        return -1;
+    }
+    tx.tp_block_size = ETHER_PCAP_TX_BLOCK_SIZE;
+    tx.tp_block_nr = ETHER_PCAP_TX_BLOCK_NUM;
+    tx.tp_frame_size = ETHER_PCAP_FRAME_SIZE;
+    tx.tp_frame_nr = ETHER_PCAP_TX_FRAME_NUM;
+    if (setsockopt(pcap->fd, SOL_PACKET, PACKET_TX_RING, &tx, sizeof(tx)) == -1) {
+        warnf("setsockopt(PACKET_TX_RING): %s, dev=%s", strerror(errno), dev->name);
+        return -1;
+    }
+    /* NOTE: skip a malformed frame instead of stopping the transmission at it */
+    val = 1;
+    setsockopt(pcap->fd, SOL_PACKET, PACKET_LOSS, &val, sizeof(val));
+    pcap->ring.size = (size_t)rx.tp_block_size * rx.tp_block_nr + (size_t)tx.tp_block_size * tx.tp_block_nr;
+    pcap->ring.map = mmap(NULL, pcap->ring.size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, pcap->fd, 0);
+    if (pcap->ring.map == MAP_FAILED) {
+        warnf("mmap: %s, dev=%s", strerror(errno), dev->name);
+        pcap->ring.map = NULL;
+        return -1;
+    }
+    pcap->ring.rx_block = 0;
+    pcap->ring.rx_pkt = 0;
+    pcap->ring.rx_hdr = NULL;
+    pcap->ring.tx_frame = 0;
+    return 0;
+}
+
+static int
+ether_pcap_close(struct net_device *dev)
+{
+    struct ether_pcap *pcap;
+    uint8_t *map;
+    int fd;
+
+    pcap = PRIV(dev);
+    /* NOTE: cleared first, the isr may still run (close(2) of a packet socket takes a while) */
+    map = pcap->ring.map;
+    fd = pcap->fd;
+    pcap->ring.map = NULL;
+    pcap->fd = -1;
+    close(fd);
+    if (map) {
+        munmap(map, pcap->ring.size);
+    }
+    return 0;
+}
+
 static int
 ether_pcap_open(struct net_device *dev)
 {
@@ -68,10 +164,21 @@ ether_pcap_open(struct net_device *dev)
         errorf("socket: %s, dev=%s", strerror(errno), dev->name);
         return -1;
     }
+    /* NOTE: the rings are set up before bind(2), no frame is received outside of them */
+    if (ETHER_PCAP_RING && ether_pcap_ring_setup(dev) == -1) {
+        /* NOTE: start over with a new socket instead of undoing (the version sticks to the socket) */
+        warnf("mmap ring not available, fall back to read/write, dev=%s", dev->name);
+        close(pcap->fd);
+        pcap->fd = socket(PF_PACKET, SOCK_RAW, hton16(ETH_P_ALL));
+        if (pcap->fd == -1) {
+            errorf("socket: %s, dev=%s", strerror(errno), dev->name);
+            return -1;
+        }
+    }
     strncpy(ifr.ifr_name, pcap->name, sizeof(ifr.ifr_name)-1);
     if (ioctl(pcap->fd, SIOCGIFINDEX, &ifr) == -1) {
         errorf("ioctl(SIOCGIFINDEX): %s, dev=%s", strerror(errno), dev->name);
-        close(pcap->fd);
+        ether_pcap_close(dev);
         return -1;
     }
     addr.sll_family = AF_PACKET;
@@ -79,65 +186,118 @@ ether_pcap_open(struct net_device *dev)
     addr.sll_ifindex = ifr.ifr_ifindex;
     if (bind(pcap->fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
         errorf("bind: %s, dev=%s", strerror(errno), dev->name);
-        close(pcap->fd);
+        ether_pcap_close(dev);
         return -1;
     }
     if (ioctl(pcap->fd, SIOCGIFFLAGS, &ifr) == -1) {
         errorf("ioctl(SIOCGIFFLAGS): %s, dev=%s", strerror(errno), dev->name);
-        close(pcap->fd);
+        ether_pcap_close(dev);
         return -1;
     }
     ifr.ifr_flags = ifr.ifr_flags | IFF_PROMISC;
     if (ioctl(pcap->fd, SIOCSIFFLAGS, &ifr) == -1) {
         errorf("ioctl(SIOCSIFFLAGS): %s, dev=%s", strerror(errno), dev->name);
-        close(pcap->fd);
+        ether_pcap_close(dev);
         return -1;
     }
-    /* Set Asynchronous I/O signal delivery destination */
-    if (fcntl(pcap->fd, F_SETOWN, getpid()) == -1) {
-        errorf("fcntl(F_SETOWN): %s, dev=%s", strerror(errno), dev->name);
-        close(pcap->fd);
-        return -1;
-    }
-    /* Enable Asynchronous I/O */
-    if (fcntl(pcap->fd, F_SETFL, O_ASYNC) == -1) {
-        errorf("fcntl(F_SETFL): %s, dev=%s", strerror(errno), dev->name);
-        close(pcap->fd);
-        return -1;
-    }
-    /* Use other signal instead of SIGIO */
-    if (fcntl(pcap->fd, F_SETSIG, pcap->irq) == -1) {
-        errorf("fcntl(F_SETSIG): %s, dev=%s", strerror(errno), dev->name);
-        close(pcap->fd);
+    if (intr_watch_fd(pcap->irq, dev, pcap->fd) == -1) {
+        errorf("intr_watch_fd() failure, dev=%s", dev->name);
+        ether_pcap_close(dev);
         return -1;
     }
     if (memcmp(dev->addr, ETHER_ADDR_ANY, ETHER_ADDR_LEN) == 0) {
         if (ether_pcap_addr(dev) == -1) {
             errorf("ether_pcap_addr() failure, dev=%s", dev->name);
-            close(pcap->fd);
+            ether_pcap_close(dev);
             return -1;
         }
     }
     return 0;
 };
 
+/* NOTE: the frames are sent at one sendmmsg(2) */
 static int
-ether_pcap_close(struct net_device *dev)
+ether_pcap_write_batch(struct net_device *dev, struct pbuf **pbs, int num)
 {
-    close(PRIV(dev)->fd);
-    return 0;
+    struct mmsghdr msgs[NET_DEVICE_TX_BATCH] = {};
+    struct iovec iovs[NET_DEVICE_TX_BATCH];
+    int i, ret, sent = 0;
+
+    for (i = 0; i < num; i++) {
+        iovs[i].iov_base = pbs[i]->data;
+        iovs[i].iov_len = pbs[i]->len;
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    while (sent < num) {
+        ret = sendmmsg(PRIV(dev)->fd, msgs + sent, num - sent, 0);
+        if (ret == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            errorf("sendmmsg: %s, dev=%s", strerror(errno), dev->name);
+            break;
+        }
+        sent += ret;
+    }
+    return sent;
 }
 
-static ssize_t
-ether_pcap_write(struct net_device *dev, const uint8_t *frame, size_t flen)
+/* NOTE: the frames are put on the TX ring, and the kernel sends them all at one sendto(2) */
+static int
+ether_pcap_ring_write_batch(struct net_device *dev, struct pbuf **pbs, int num)
 {
-    return write(PRIV(dev)->fd, frame, flen);
+    struct ether_pcap *pcap;
+    struct tpacket3_hdr *hdr;
+    uint32_t status;
+    int i, sent = 0;
+
+    pcap = PRIV(dev);
+    for (i = 0; i < num; i++) {
+        if (pbs[i]->len > ETHER_PCAP_FRAME_SIZE - ETHER_PCAP_TX_DATA_OFFSET) {
+            errorf("too long, dev=%s, len=%zu", dev->name, pbs[i]->len);
+            continue;
+        }
+        hdr = (struct tpacket3_hdr *)(pcap->ring.map + (size_t)ETHER_PCAP_RX_BLOCK_SIZE * ETHER_PCAP_RX_BLOCK_NUM
+            + (size_t)pcap->ring.tx_frame * ETHER_PCAP_FRAME_SIZE);
+        status = __atomic_load_n(&hdr->tp_status, __ATOMIC_ACQUIRE);
+        if (status != TP_STATUS_AVAILABLE && status != TP_STATUS_WRONG_FORMAT) {
+            errorf("tx ring is full, dev=%s", dev->name);
+            break;
+        }
+        memcpy((uint8_t *)hdr + ETHER_PCAP_TX_DATA_OFFSET, pbs[i]->data, pbs[i]->len);
+        hdr->tp_len = pbs[i]->len;
+        hdr->tp_next_offset = 0;
+        __atomic_store_n(&hdr->tp_status, TP_STATUS_SEND_REQUEST, __ATOMIC_RELEASE);
+        pcap->ring.tx_frame = (pcap->ring.tx_frame + 1) % ETHER_PCAP_TX_FRAME_NUM;
+        sent++;
+    }
+    if (sent && sendto(pcap->fd, NULL, 0, MSG_DONTWAIT, NULL, 0) == -1 && errno != EAGAIN && errno != ENOBUFS) {
+        errorf("sendto: %s, dev=%s", strerror(errno), dev->name);
+    }
+    return sent;
 }
 
 int
-ether_pcap_transmit(struct net_device *dev, uint16_t type, const uint8_t *buf, size_t len, const void *dst)
+ether_pcap_transmit(struct net_device *dev, uint16_t type, struct pbuf *pb, const void *dst)
 {
-    return ether_transmit_helper(dev, type, buf, len, dst, ether_pcap_write);
+    return ether_queue_helper(dev, type, pb, dst);
+}
+
+static int
+ether_pcap_transmit_batch(struct net_device *dev, struct pbuf **pbs, int num)
+{
+    int i, sent;
+
+    if (PRIV(dev)->ring.map) {
+        sent = ether_pcap_ring_write_batch(dev, pbs, num);
+    } else {
+        sent = ether_pcap_write_batch(dev, pbs, num);
+    }
+    for (i = 0; i < num; i++) {
+        pbuf_free(pbs[i]);
+    }
+    return sent;
 }
 
 static ssize_t
@@ -145,39 +305,107 @@ ether_pcap_read(struct net_device *dev, uint8_t *buf, size_t size)
 {
     ssize_t len;
 
-    len = read(PRIV(dev)->fd, buf, size);
+    /* NOTE: must not block, called until no more frames (see ether_poll_helper()) */
+    len = recv(PRIV(dev)->fd, buf, size, MSG_DONTWAIT);
     if (len <= 0) {
-        if (len == -1 && errno != EINTR) {
-            errorf("read: %s, dev=%s", strerror(errno), dev->name);
+        if (len == -1 && errno != EINTR && errno != EAGAIN) {
+            errorf("recv: %s, dev=%s", strerror(errno), dev->name);
         }
         return -1;
     }
     return len;
 }
 
+static struct pbuf *
+ether_pcap_ring_input(struct net_device *dev, struct tpacket3_hdr *hdr)
+{
+    struct sockaddr_ll *sll;
+    struct pbuf *pb;
+
+    sll = (struct sockaddr_ll *)((uint8_t *)hdr + TPACKET_ALIGN(sizeof(*hdr)));
+    if (sll->sll_pkttype == PACKET_OUTGOING) {
+        /* sent by ourselves */
+        return NULL;
+    }
+    if (hdr->tp_snaplen != hdr->tp_len || hdr->tp_snaplen > ETHER_FRAME_SIZE_MAX) {
+        errorf("too long, dev=%s, len=%u", dev->name, hdr->tp_len);
+        return NULL;
+    }
+    pb = pbuf_alloc(hdr->tp_snaplen);
+    if (!pb) {
+        errorf("pbuf_alloc() failure");
+        return NULL;
+    }
+    memcpy(pb->data, (uint8_t *)hdr + hdr->tp_mac, hdr->tp_snaplen);
+    /* NOTE: CSUMNOTREADY is a frame from this host with the checksum left to the hardware, the data is intact */
+    if ((dev->offload & NET_DEVICE_OFFLOAD_RX_CSUM) && (hdr->tp_status & (TP_STATUS_CSUM_VALID | TP_STATUS_CSUMNOTREADY))) {
+        pb->flags |= PBUF_FLAG_CSUM_VALID;
+    }
+    return pb;
+}
+
+/*
+ * NOTE: consume the blocks handed over by the kernel, no syscall per frame.
+ *       a block may be left in the middle when the budget runs out, it goes back to the kernel once all the frames are consumed.
+ */
 static int
-ether_pcap_isr(unsigned int irq, void *id)
+ether_pcap_ring_poll(struct net_device *dev, int budget)
 {
-    struct net_device *dev = (struct net_device *)id;
-    struct pollfd pfd;
-    int ret;
-
-    pfd.fd = PRIV(dev)->fd;
-    pfd.events = POLLIN;
-    while (1) {
-        ret = poll(&pfd, 1, 0);
-        if (ret == -1) {
-            if (errno == EINTR) {
-                continue;
+    struct ether_pcap *pcap;
+    struct tpacket_block_desc *block;
+    struct pbuf *pbs[NET_DEVICE_POLL_BUDGET];
+    int num = 0, done = 0;
+
+    pcap = PRIV(dev);
+    budget = MIN(budget, NET_DEVICE_POLL_BUDGET);
+    while (pcap->ring.map && done < budget) {
+        block = (struct tpacket_block_desc *)(pcap->ring.map + (size_t)pcap->ring.rx_block * ETHER_PCAP_RX_BLOCK_SIZE);
+        if (!(__atomic_load_n(&block->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER)) {
+            break;
+        }
+        if (!pcap->ring.rx_hdr) {
+            pcap->ring.rx_hdr = (struct tpacket3_hdr *)((uint8_t *)block + block->hdr.bh1.offset_to_first_pkt);
+        }
+        while (pcap->ring.rx_pkt < block->hdr.bh1.num_pkts && done < budget) {
+            pbs[num] = ether_pcap_ring_input(dev, pcap->ring.rx_hdr);
+            if (pbs[num]) {
+                num++;
             }
-            errorf("poll: %s, dev=%s", strerror(errno), dev->name);
-            return -1;
+            done++;
+            pcap->ring.rx_hdr = (struct tpacket3_hdr *)((uint8_t *)pcap->ring.rx_hdr + pcap->ring.rx_hdr->tp_next_offset);
+            pcap->ring.rx_pkt++;
         }
-        if (ret == 0) {
+        if (pcap->ring.rx_pkt < block->hdr.bh1.num_pkts) {
             break;
         }
-        ether_poll_helper(dev, ether_pcap_read);
+        /* NOTE: give the block back to the kernel */
+        pcap->ring.rx_pkt = 0;
+        pcap->ring.rx_hdr = NULL;
+        __atomic_store_n(&block->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+        pcap->ring.rx_block = (pcap->ring.rx_block + 1) % ETHER_PCAP_RX_BLOCK_NUM;
+    }
+    if (num) {
+        ether_input_helper(dev, pbs, num);
+    }
+    return done;
+}
+
+static int
+ether_pcap_poll(struct net_device *dev, int budget)
+{
+    if (PRIV(dev)->ring.map) {
+        return ether_pcap_ring_poll(dev, budget);
     }
+    if (PRIV(dev)->fd == -1) {
+        return 0;
+    }
+    return ether_poll_helper(dev, ether_pcap_read, budget);
+}
+
+static int
+ether_pcap_isr(unsigned int irq, void *id)
+{
+    net_device_schedule((struct net_device *)id);
     return 0;
 }
 
@@ -185,6 +413,8 @@ static struct net_device_ops ether_pcap_ops = {
     .open = ether_pcap_open,
     .close = ether_pcap_close,
     .transmit = ether_pcap_transmit,
+    .poll = ether_pcap_poll,
+    .transmit_batch = ether_pcap_transmit_batch,
 };
 
 struct net_device *
@@ -205,6 +435,8 @@ ether_pcap_init(const char *name, const char *addr)
         }
     }
     dev->ops = &ether_pcap_ops;
+    /* NOTE: only with the mmap rings, the kernel reports the checksum verified (TP_STATUS_CSUM_VALID) per frame */
+    dev->offload = NET_DEVICE_OFFLOAD_RX_CSUM;
     pcap = memory_alloc(sizeof(*pcap));
     if (!pcap) {
         errorf("memory_alloc() failure");
@@ -1,4 +1,3 @@
-#define _GNU_SOURCE /* for F_SETSIG */
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -9,9 +8,10 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/ioctl.h>
-#include <sys/poll.h>
+#include <sys/uio.h>
 #include <linux/if.h>
 #include <linux/if_tun.h>
+#include <linux/virtio_net.h>
 
 #include "platform.h"
 
@@ -25,10 +25,16 @@
 
 #define ETHER_TAP_IRQ (SIGRTMIN+2)
 
+/* NOTE: a virtio_net_hdr goes with each frame for the offloads (checksum and TSO), override at build time (e.g. CFLAGS=-DETHER_TAP_VNET_HDR=0) */
+#ifndef ETHER_TAP_VNET_HDR
+#define ETHER_TAP_VNET_HDR 1
+#endif
+
 struct ether_tap {
     char name[IFNAMSIZ];
     int fd;
     unsigned int irq;
+    int vnet_hdr;
 };
 
 #define PRIV(x) ((struct ether_tap *)x->priv)
@@ -68,30 +74,34 @@ ether_tap_open(struct net_device *dev)
         return -1;
     }
     strncpy(ifr.ifr_name, tap->name, sizeof(ifr.ifr_name)-1);
-    ifr.ifr_flags = IFF_TAP | IFF_NO_PI;
+    ifr.ifr_flags = IFF_TAP | IFF_NO_PI | (ETHER_TAP_VNET_HDR ? IFF_VNET_HDR : 0);
     if (ioctl(tap->fd, TUNSETIFF, &ifr) == -1) {
-        errorf("ioctl(TUNSETIFF): %s, dev=%s", strerror(errno), dev->name);
-        close(tap->fd);
-        return -1;
+        if (!(ifr.ifr_flags & IFF_VNET_HDR)) {
+            errorf("ioctl(TUNSETIFF): %s, dev=%s", strerror(errno), dev->name);
+            close(tap->fd);
+            return -1;
+        }
+        warnf("ioctl(TUNSETIFF): %s, fall back to no offloads, dev=%s", strerror(errno), dev->name);
+        ifr.ifr_flags &= ~IFF_VNET_HDR;
+        dev->offload = 0;
+        if (ioctl(tap->fd, TUNSETIFF, &ifr) == -1) {
+            errorf("ioctl(TUNSETIFF): %s, dev=%s", strerror(errno), dev->name);
+            close(tap->fd);
+            return -1;
+        }
     }
-    /* Set Asynchronous I/O signal delivery destination */
-    if (fcntl(tap->fd, F_SETOWN, getpid()) == -1) {
-        errorf("fcntl(F_SETOWN): %s, dev=%s", strerror(errno), dev->name);
+    tap->vnet_hdr = (ifr.ifr_flags & IFF_VNET_HDR) ? 1 : 0;
+    if (intr_watch_fd(tap->irq, dev, tap->fd) == -1) {
+        errorf("intr_watch_fd() failure, dev=%s", dev->name);
         close(tap->fd);
         return -1;
     }
-    /* Enable Asynchronous I/O */
-    if (fcntl(tap->fd, F_SETFL, O_ASYNC) == -1) {
+    /* NOTE: read until nothing is left (see ether_tap_poll()), writes to a tap never block */
+    if (fcntl(tap->fd, F_SETFL, fcntl(tap->fd, F_GETFL) | O_NONBLOCK) == -1) {
         errorf("fcntl(F_SETFL): %s, dev=%s", strerror(errno), dev->name);
         close(tap->fd);
         return -1;
     }
-    /* Use other signal instead of SIGIO */
-    if (fcntl(tap->fd, F_SETSIG, tap->irq) == -1) {
-        errorf("fcntl(F_SETSIG): %s, dev=%s", strerror(errno), dev->name);
-        close(tap->fd);
-        return -1;
-    }
     if (memcmp(dev->addr, ETHER_ADDR_ANY, ETHER_ADDR_LEN) == 0) {
         if (ether_tap_addr(dev) == -1) {
             errorf("ether_tap_addr() failure, dev=%s", dev->name);
@@ -109,16 +119,61 @@ ether_tap_close(struct net_device *dev)
     return 0;
 }
 
-static ssize_t
-ether_tap_write(struct net_device *dev, const uint8_t *frame, size_t flen)
+int
+ether_tap_transmit(struct net_device *dev, uint16_t type, struct pbuf *pb, const void *dst)
 {
-    return write(PRIV(dev)->fd, frame, flen);
+    return ether_queue_helper(dev, type, pb, dst);
 }
 
-int
-ether_tap_transmit(struct net_device *dev, uint16_t type, const uint8_t *buf, size_t len, const void *dst)
+/*
+ * NOTE: the checksum left to the device (PBUF_FLAG_CSUM_PARTIAL) and the segmentation (pb->gso_size)
+ *       are done by the kernel. the fields are in the native byte order (the legacy virtio format).
+ */
+static void
+ether_tap_vnet_hdr(struct virtio_net_hdr *vh, const struct pbuf *pb)
 {
-    return ether_transmit_helper(dev, type, buf, len, dst, ether_tap_write);
+    memset(vh, 0, sizeof(*vh));
+    if (pb->flags & PBUF_FLAG_CSUM_PARTIAL) {
+        vh->flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+        vh->csum_start = pb->head + pb->csum_start - pb->data;
+        vh->csum_offset = pb->csum_offset;
+        if (pb->gso_size) {
+            vh->gso_type = VIRTIO_NET_HDR_GSO_TCPV4;
+            vh->gso_size = pb->gso_size;
+            /* NOTE: up to the end of the TCP header (the data offset field) */
+            vh->hdr_len = vh->csum_start + ((pb->data[vh->csum_start + 12] >> 4) << 2);
+        }
+    }
+}
+
+/* NOTE: a write(2) is a frame for the tap device (one writev(2) would be joined into one), written in a row */
+static int
+ether_tap_transmit_batch(struct net_device *dev, struct pbuf **pbs, int num)
+{
+    struct virtio_net_hdr vh;
+    struct iovec iov[2];
+    ssize_t ret;
+    int i, sent = 0;
+
+    for (i = 0; i < num; i++) {
+        if (PRIV(dev)->vnet_hdr) {
+            ether_tap_vnet_hdr(&vh, pbs[i]);
+            iov[0].iov_base = &vh;
+            iov[0].iov_len = sizeof(vh);
+            iov[1].iov_base = pbs[i]->data;
+            iov[1].iov_len = pbs[i]->len;
+            ret = writev(PRIV(dev)->fd, iov, 2);
+        } else {
+            ret = write(PRIV(dev)->fd, pbs[i]->data, pbs[i]->len);
+        }
+        if (ret == -1) {
+            errorf("write: %s, dev=%s", strerror(errno), dev->name);
+        } else {
+            sent++;
+        }
+        pbuf_free(pbs[i]);
+    }
+    return sent;
 }
 
 static ssize_t
@@ -128,7 +183,7 @@ ether_tap_read(struct net_device *dev, uint8_t *buf, size_t size)
 
     len = read(PRIV(dev)->fd, buf, size);
     if (len <= 0) {
-        if (len == -1 && errno != EINTR) {
+        if (len == -1 && errno != EINTR && errno != EAGAIN) {
             errorf("read: %s, dev=%s", strerror(errno), dev->name);
         }
         return -1;
@@ -136,29 +191,62 @@ ether_tap_read(struct net_device *dev, uint8_t *buf, size_t size)
     return len;
 }
 
+/* NOTE: ether_poll_helper() with the virtio_net_hdr in front of each frame */
 static int
-ether_tap_isr(unsigned int irq, void *id)
+ether_tap_vnet_poll(struct net_device *dev, int budget)
 {
-    struct net_device *dev = (struct net_device *)id;
-    struct pollfd pfd;
-    int ret;
-
-    pfd.fd = PRIV(dev)->fd;
-    pfd.events = POLLIN;
-    while (1) {
-        ret = poll(&pfd, 1, 0);
-        if (ret == -1) {
-            if (errno == EINTR) {
-                continue;
-            }
-            errorf("poll: %s, dev=%s", strerror(errno), dev->name);
-            return -1;
+    struct virtio_net_hdr vh;
+    struct iovec iov[2];
+    struct pbuf *pb, *pbs[NET_DEVICE_POLL_BUDGET];
+    ssize_t len;
+    int num = 0;
+
+    budget = MIN(budget, NET_DEVICE_POLL_BUDGET);
+    while (num < budget) {
+        pb = pbuf_alloc(ETHER_FRAME_SIZE_MAX);
+        if (!pb) {
+            errorf("pbuf_alloc() failure");
+            break;
         }
-        if (ret == 0) {
+        iov[0].iov_base = &vh;
+        iov[0].iov_len = sizeof(vh);
+        iov[1].iov_base = pb->data;
+        iov[1].iov_len = pb->len;
+        len = readv(PRIV(dev)->fd, iov, 2);
+        if (len < (ssize_t)sizeof(vh)) {
+            if (len == -1 && errno != EINTR && errno != EAGAIN) {
+                errorf("readv: %s, dev=%s", strerror(errno), dev->name);
+            }
+            pbuf_free(pb);
             break;
         }
-        ether_poll_helper(dev, ether_tap_read);
+        pbuf_trim(pb, len - sizeof(vh));
+        /* NOTE: NEEDS_CSUM is a frame from this host with the checksum left to the device, the data is intact */
+        if ((dev->offload & NET_DEVICE_OFFLOAD_RX_CSUM) && (vh.flags & (VIRTIO_NET_HDR_F_DATA_VALID | VIRTIO_NET_HDR_F_NEEDS_CSUM))) {
+            pb->flags |= PBUF_FLAG_CSUM_VALID;
+        }
+        pbs[num++] = pb;
     }
+    if (num) {
+        ether_input_helper(dev, pbs, num);
+    }
+    return num;
+}
+
+static int
+ether_tap_poll(struct net_device *dev, int budget)
+{
+    if (PRIV(dev)->vnet_hdr) {
+        return ether_tap_vnet_poll(dev, budget);
+    }
+    return ether_poll_helper(dev, ether_tap_read, budget);
+}
+
+static int
+ether_tap_isr(unsigned int irq, void *id)
+{
+    /* NOTE: the frames are read in ether_tap_poll() */
+    net_device_schedule((struct net_device *)id);
     return 0;
 }
 
@@ -166,6 +254,8 @@ static struct net_device_ops ether_tap_ops = {
     .open = ether_tap_open,
     .close = ether_tap_close,
     .transmit = ether_tap_transmit,
+    .poll = ether_tap_poll,
+    .transmit_batch = ether_tap_transmit_batch,
 };
 
 struct net_device *
@@ -186,6 +276,9 @@ ether_tap_init(const char *name, const char *addr)
         }
     }
     dev->ops = &ether_tap_ops;
+#if ETHER_TAP_VNET_HDR
+    dev->offload = NET_DEVICE_OFFLOAD_RX_CSUM | NET_DEVICE_OFFLOAD_TX_CSUM | NET_DEVICE_OFFLOAD_TSO;
+#endif
     tap = memory_alloc(sizeof(*tap));
     if (!tap) {
         errorf("memory_alloc() failure");
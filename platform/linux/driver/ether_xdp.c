@@ -0,0 +1,634 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/if.h>
+#include <linux/if_link.h>
+#include <linux/if_xdp.h>
+#include <linux/bpf.h>
+
+#include "platform.h"
+
+#include "util.h"
+#include "net.h"
+#include "ether.h"
+
+#include "driver/ether_xdp.h"
+
+#ifndef AF_XDP
+#define AF_XDP 44
+#endif
+#ifndef SOL_XDP
+#define SOL_XDP 283
+#endif
+
+#define ETHER_XDP_IRQ (SIGRTMIN+4)
+
+#define ETHER_XDP_FRAME_SIZE   2048
+#define ETHER_XDP_FRAME_NUM    4096
+#define ETHER_XDP_RX_FRAME_NUM (ETHER_XDP_FRAME_NUM / 2) /* the rest is for TX */
+#define ETHER_XDP_TX_FRAME_NUM (ETHER_XDP_FRAME_NUM - ETHER_XDP_RX_FRAME_NUM)
+/* NOTE: as large as the frames of each direction, the rings never overflow */
+#define ETHER_XDP_RING_SIZE    2048
+#define ETHER_XDP_QUEUE_MAX    64 /* entries of the XSKMAP */
+
+struct ether_xdp_ring {
+    uint32_t *producer;
+    uint32_t *consumer;
+    uint32_t *flags;
+    void *descs;
+    uint32_t cached; /* our side of the ring (the producer or the consumer index) */
+    void *map;
+    size_t size;
+};
+
+/*
+ * NOTE: a UMEM frame, the kernel writes a received frame at XDP_PACKET_HEADROOM from the start (behind pb).
+ *       handed up to the stack as is, and given back to the fill ring when pb is freed (see ether_xdp_release()).
+ */
+struct ether_xdp_frame {
+    struct net_device *dev;
+    struct pbuf pb;
+};
+
+struct ether_xdp {
+    char name[IFNAMSIZ];
+    unsigned int queue;
+    int fd;
+    int map_fd;
+    int prog_fd;
+    int link_fd;
+    unsigned int irq;
+    uint8_t *umem;
+    struct ether_xdp_ring rx;
+    struct ether_xdp_ring tx;
+    struct ether_xdp_ring fill;
+    struct ether_xdp_ring comp;
+    int need_wakeup;
+    mutex_t fill_lock;
+    mutex_t tx_lock;
+    uint64_t tx_free[ETHER_XDP_TX_FRAME_NUM];
+    unsigned int tx_free_num;
+};
+
+#define PRIV(x) ((struct ether_xdp *)x->priv)
+
+static int
+ether_xdp_bpf(int cmd, union bpf_attr *attr)
+{
+    return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+static int
+ether_xdp_addr(struct net_device *dev) {
+    int soc;
+    struct ifreq ifr = {};
+
+    soc = socket(AF_INET, SOCK_DGRAM, 0);
+    if (soc == -1) {
+        errorf("socket: %s, dev=%s", strerror(errno), dev->name);
+        return -1;
+    }
+    ifr.ifr_addr.sa_family = AF_INET;
+    strncpy(ifr.ifr_name, PRIV(dev)->name, sizeof(ifr.ifr_name)-1);
+    if (ioctl(soc, SIOCGIFHWADDR, &ifr) == -1) {
+        errorf("ioctl(SIOCGIFHWADDR): %s, dev=%s", strerror(errno), dev->name);
+        close(soc);
+        return -1;
+    }
+    memcpy(dev->addr, ifr.ifr_hwaddr.sa_data, ETHER_ADDR_LEN);
+    close(soc);
+    return 0;
+}
+
+static int
+ether_xdp_ifindex(struct net_device *dev, int promisc)
+{
+    int soc;
+    struct ifreq ifr = {};
+
+    soc = socket(AF_INET, SOCK_DGRAM, 0);
+    if (soc == -1) {
+        errorf("socket: %s, dev=%s", strerror(errno), dev->name);
+        return -1;
+    }
+    strncpy(ifr.ifr_name, PRIV(dev)->name, sizeof(ifr.ifr_name)-1);
+    if (promisc) {
+        if (ioctl(soc, SIOCGIFFLAGS, &ifr) == -1) {
+            errorf("ioctl(SIOCGIFFLAGS): %s, dev=%s", strerror(errno), dev->name);
+            close(soc);
+            return -1;
+        }
+        ifr.ifr_flags = ifr.ifr_flags | IFF_PROMISC;
+        if (ioctl(soc, SIOCSIFFLAGS, &ifr) == -1) {
+            errorf("ioctl(SIOCSIFFLAGS): %s, dev=%s", strerror(errno), dev->name);
+            close(soc);
+            return -1;
+        }
+    }
+    if (ioctl(soc, SIOCGIFINDEX, &ifr) == -1) {
+        errorf("ioctl(SIOCGIFINDEX): %s, dev=%s", strerror(errno), dev->name);
+        close(soc);
+        return -1;
+    }
+    close(soc);
+    return ifr.ifr_ifindex;
+}
+
+/* NOTE: return bpf_redirect_map(&xsks, ctx->rx_queue_index, XDP_PASS); (the queues not bound go to the kernel) */
+static int
+ether_xdp_prog_load(struct net_device *dev)
+{
+    struct ether_xdp *xdp;
+    union bpf_attr attr;
+    struct bpf_insn insns[] = {
+        {.code = BPF_LDX | BPF_W | BPF_MEM, .dst_reg = BPF_REG_2, .src_reg = BPF_REG_1, .off = offsetof(struct xdp_md, rx_queue_index)},
+        {.code = BPF_LD | BPF_DW | BPF_IMM, .dst_reg = BPF_REG_1, .src_reg = BPF_PSEUDO_MAP_FD}, /* imm: the map fd */
+        {.code = 0}, /* the upper half of the 64-bit immediate */
+        {.code = BPF_ALU64 | BPF_MOV | BPF_K, .dst_reg = BPF_REG_3, .imm = XDP_PASS},
+        {.code = BPF_JMP | BPF_CALL, .imm = BPF_FUNC_redirect_map},
+        {.code = BPF_JMP | BPF_EXIT},
+    };
+    char log[1024] = {};
+
+    xdp = PRIV(dev);
+    memset(&attr, 0, sizeof(attr));
+    attr.map_type = BPF_MAP_TYPE_XSKMAP;
+    attr.key_size = sizeof(uint32_t);
+    attr.value_size = sizeof(uint32_t);
+    attr.max_entries = ETHER_XDP_QUEUE_MAX;
+    xdp->map_fd = ether_xdp_bpf(BPF_MAP_CREATE, &attr);
+    if (xdp->map_fd == -1) {
+        errorf("bpf(BPF_MAP_CREATE): %s, dev=%s", strerror(errno), dev->name);
+        return -1;
+    }
+    insns[1].imm = xdp->map_fd;
+    memset(&attr, 0, sizeof(attr));
+    attr.prog_type = BPF_PROG_TYPE_XDP;
+    attr.insns = (uint64_t)(uintptr_t)insns;
+    attr.insn_cnt = sizeof(insns) / sizeof(insns[0]);
+    attr.license = (uint64_t)(uintptr_t)"GPL";
+    attr.log_buf = (uint64_t)(uintptr_t)log;
+    attr.log_size = sizeof(log);
+    attr.log_level = 1;
+    xdp->prog_fd = ether_xdp_bpf(BPF_PROG_LOAD, &attr);
+    if (xdp->prog_fd == -1) {
+        errorf("bpf(BPF_PROG_LOAD): %s, dev=%s, log=%s", strerror(errno), dev->name, log);
+        return -1;
+    }
+    return 0;
+}
+
+/* NOTE: the program is detached when the link is closed */
+static int
+ether_xdp_prog_attach(struct net_device *dev, int ifindex)
+{
+    struct ether_xdp *xdp;
+    union bpf_attr attr;
+    uint32_t key, val;
+
+    xdp = PRIV(dev);
+    key = xdp->queue;
+    val = xdp->fd;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = xdp->map_fd;
+    attr.key = (uint64_t)(uintptr_t)&key;
+    attr.value = (uint64_t)(uintptr_t)&val;
+    attr.flags = BPF_ANY;
+    if (ether_xdp_bpf(BPF_MAP_UPDATE_ELEM, &attr) == -1) {
+        errorf("bpf(BPF_MAP_UPDATE_ELEM): %s, dev=%s", strerror(errno), dev->name);
+        return -1;
+    }
+    memset(&attr, 0, sizeof(attr));
+    attr.link_create.prog_fd = xdp->prog_fd;
+    attr.link_create.target_ifindex = ifindex;
+    attr.link_create.attach_type = BPF_XDP;
+    attr.link_create.flags = XDP_FLAGS_DRV_MODE;
+    xdp->link_fd = ether_xdp_bpf(BPF_LINK_CREATE, &attr);
+    if (xdp->link_fd == -1) {
+        /* NOTE: the driver does not support XDP, run it in the generic (copy) mode */
+        attr.link_create.flags = XDP_FLAGS_SKB_MODE;
+        xdp->link_fd = ether_xdp_bpf(BPF_LINK_CREATE, &attr);
+        if (xdp->link_fd == -1) {
+            errorf("bpf(BPF_LINK_CREATE): %s, dev=%s", strerror(errno), dev->name);
+            return -1;
+        }
+        infof("generic XDP mode, dev=%s", dev->name);
+    }
+    return 0;
+}
+
+static int
+ether_xdp_ring_map(struct ether_xdp_ring *ring, int fd, struct xdp_ring_offset *off, off_t pgoff, size_t desc_size)
+{
+    ring->size = off->desc + ETHER_XDP_RING_SIZE * desc_size;
+    ring->map = mmap(NULL, ring->size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, pgoff);
+    if (ring->map == MAP_FAILED) {
+        errorf("mmap: %s", strerror(errno));
+        ring->map = NULL;
+        return -1;
+    }
+    ring->producer = (uint32_t *)((uint8_t *)ring->map + off->producer);
+    ring->consumer = (uint32_t *)((uint8_t *)ring->map + off->consumer);
+    ring->flags = (uint32_t *)((uint8_t *)ring->map + off->flags);
+    ring->descs = (uint8_t *)ring->map + off->desc;
+    ring->cached = 0;
+    return 0;
+}
+
+static void
+ether_xdp_ring_unmap(struct ether_xdp_ring *ring)
+{
+    if (ring->map) {
+        munmap(ring->map, ring->size);
+        ring->map = NULL;
+    }
+}
+
+/* NOTE: must be called with fill_lock held */
+static void
+ether_xdp_fill(struct ether_xdp *xdp, uint64_t addr)
+{
+    uint64_t *descs = xdp->fill.descs;
+
+    descs[xdp->fill.cached & (ETHER_XDP_RING_SIZE - 1)] = addr;
+    xdp->fill.cached++;
+    __atomic_store_n(xdp->fill.producer, xdp->fill.cached, __ATOMIC_RELEASE);
+}
+
+static void
+ether_xdp_release(struct pbuf *pb)
+{
+    struct ether_xdp_frame *frame;
+    struct ether_xdp *xdp;
+
+    frame = (struct ether_xdp_frame *)((uint8_t *)pb - offsetof(struct ether_xdp_frame, pb));
+    xdp = PRIV(frame->dev);
+    mutex_lock(&xdp->fill_lock);
+    if (xdp->fd != -1) {
+        ether_xdp_fill(xdp, (uint8_t *)frame - xdp->umem);
+    }
+    mutex_unlock(&xdp->fill_lock);
+}
+
+static int
+ether_xdp_socket(struct net_device *dev, int ifindex)
+{
+    struct ether_xdp *xdp;
+    struct xdp_umem_reg reg = {};
+    struct xdp_mmap_offsets off;
+    struct sockaddr_xdp addr = {};
+    socklen_t optlen;
+    int size = ETHER_XDP_RING_SIZE;
+    unsigned int i;
+
+    xdp = PRIV(dev);
+    xdp->fd = socket(AF_XDP, SOCK_RAW, 0);
+    if (xdp->fd == -1) {
+        errorf("socket: %s, dev=%s", strerror(errno), dev->name);
+        return -1;
+    }
+    if (!xdp->umem) {
+        xdp->umem = mmap(NULL, (size_t)ETHER_XDP_FRAME_SIZE * ETHER_XDP_FRAME_NUM,
+            PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+        if (xdp->umem == MAP_FAILED) {
+            errorf("mmap: %s, dev=%s", strerror(errno), dev->name);
+            xdp->umem = NULL;
+            return -1;
+        }
+    }
+    reg.addr = (uint64_t)(uintptr_t)xdp->umem;
+    reg.len = (uint64_t)ETHER_XDP_FRAME_SIZE * ETHER_XDP_FRAME_NUM;
+    reg.chunk_size = ETHER_XDP_FRAME_SIZE;
+    reg.headroom = 0;
+    if (setsockopt(xdp->fd, SOL_XDP, XDP_UMEM_REG, &reg, sizeof(reg)) == -1) {
+        errorf("setsockopt(XDP_UMEM_REG): %s, dev=%s", strerror(errno), dev->name);
+        return -1;
+    }
+    if (setsockopt(xdp->fd, SOL_XDP, XDP_UMEM_FILL_RING, &size, sizeof(size)) == -1 ||
+        setsockopt(xdp->fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &size, sizeof(size)) == -1 ||
+        setsockopt(xdp->fd, SOL_XDP, XDP_RX_RING, &size, sizeof(size)) == -1 ||
+        setsockopt(xdp->fd, SOL_XDP, XDP_TX_RING, &size, sizeof(size)) == -1) {
+        errorf("setsockopt(XDP_*_RING): %s, dev=%s", strerror(errno), dev->name);
+        return -1;
+    }
+    optlen = sizeof(off);
+    if (getsockopt(xdp->fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &optlen) == -1) {
+        errorf("getsockopt(XDP_MMAP_OFFSETS): %s, dev=%s", strerror(errno), dev->name);
+        return -1;
+    }
+    if (ether_xdp_ring_map(&xdp->rx, xdp->fd, &off.rx, XDP_PGOFF_RX_RING, sizeof(struct xdp_desc)) == -1 ||
+        ether_xdp_ring_map(&xdp->tx, xdp->fd, &off.tx, XDP_PGOFF_TX_RING, sizeof(struct xdp_desc)) == -1 ||
+        ether_xdp_ring_map(&xdp->fill, xdp->fd, &off.fr, XDP_UMEM_PGOFF_FILL_RING, sizeof(uint64_t)) == -1 ||
+        ether_xdp_ring_map(&xdp->comp, xdp->fd, &off.cr, XDP_UMEM_PGOFF_COMPLETION_RING, sizeof(uint64_t)) == -1) {
+        errorf("ether_xdp_ring_map() failure, dev=%s", dev->name);
+        return -1;
+    }
+    /* NOTE: the RX frames are given to the kernel before any frame can arrive */
+    mutex_lock(&xdp->fill_lock);
+    for (i = 0; i < ETHER_XDP_RX_FRAME_NUM; i++) {
+        ether_xdp_fill(xdp, (uint64_t)i * ETHER_XDP_FRAME_SIZE);
+    }
+    mutex_unlock(&xdp->fill_lock);
+    for (i = 0; i < ETHER_XDP_TX_FRAME_NUM; i++) {
+        xdp->tx_free[i] = (uint64_t)(ETHER_XDP_RX_FRAME_NUM + i) * ETHER_XDP_FRAME_SIZE;
+    }
+    xdp->tx_free_num = ETHER_XDP_TX_FRAME_NUM;
+    addr.sxdp_family = AF_XDP;
+    addr.sxdp_ifindex = ifindex;
+    addr.sxdp_queue_id = xdp->queue;
+    addr.sxdp_flags = XDP_USE_NEED_WAKEUP;
+    xdp->need_wakeup = 1;
+    if (bind(xdp->fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        /* NOTE: before Linux 5.4, kick at every transmission */
+        addr.sxdp_flags = 0;
+        xdp->need_wakeup = 0;
+        if (bind(xdp->fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+            errorf("bind: %s, dev=%s, queue=%u", strerror(errno), dev->name, xdp->queue);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int
+ether_xdp_close(struct net_device *dev)
+{
+    struct ether_xdp *xdp;
+    int fd;
+
+    xdp = PRIV(dev);
+    if (xdp->link_fd != -1) {
+        close(xdp->link_fd);
+        xdp->link_fd = -1;
+    }
+    if (xdp->prog_fd != -1) {
+        close(xdp->prog_fd);
+        xdp->prog_fd = -1;
+    }
+    if (xdp->map_fd != -1) {
+        close(xdp->map_fd);
+        xdp->map_fd = -1;
+    }
+    /* NOTE: cleared first, the frames may still be freed by the stack or the isr may still run */
+    mutex_lock(&xdp->fill_lock);
+    mutex_lock(&xdp->tx_lock);
+    fd = xdp->fd;
+    xdp->fd = -1;
+    mutex_unlock(&xdp->tx_lock);
+    mutex_unlock(&xdp->fill_lock);
+    if (fd != -1) {
+        close(fd);
+    }
+    ether_xdp_ring_unmap(&xdp->rx);
+    ether_xdp_ring_unmap(&xdp->tx);
+    ether_xdp_ring_unmap(&xdp->fill);
+    ether_xdp_ring_unmap(&xdp->comp);
+    /* NOTE: the UMEM is kept, the stack may still hold the frames received */
+    return 0;
+}
+
+static int
+ether_xdp_open(struct net_device *dev)
+{
+    struct ether_xdp *xdp;
+    int ifindex, promisc;
+
+    xdp = PRIV(dev);
+    promisc = memcmp(dev->addr, ETHER_ADDR_ANY, ETHER_ADDR_LEN) != 0;
+    ifindex = ether_xdp_ifindex(dev, promisc);
+    if (ifindex == -1) {
+        return -1;
+    }
+    if (ether_xdp_socket(dev, ifindex) == -1 || ether_xdp_prog_load(dev) == -1 || ether_xdp_prog_attach(dev, ifindex) == -1) {
+        ether_xdp_close(dev);
+        return -1;
+    }
+    if (intr_watch_fd(xdp->irq, dev, xdp->fd) == -1) {
+        errorf("intr_watch_fd() failure, dev=%s", dev->name);
+        ether_xdp_close(dev);
+        return -1;
+    }
+    if (!promisc) {
+        if (ether_xdp_addr(dev) == -1) {
+            errorf("ether_xdp_addr() failure, dev=%s", dev->name);
+            ether_xdp_close(dev);
+            return -1;
+        }
+    }
+    debugf("bound, dev=%s, name=%s, queue=%u", dev->name, xdp->name, xdp->queue);
+    return 0;
+}
+
+/* NOTE: must be called with tx_lock held */
+static void
+ether_xdp_complete(struct ether_xdp *xdp)
+{
+    uint64_t *descs = xdp->comp.descs;
+    uint32_t prod;
+
+    prod = __atomic_load_n(xdp->comp.producer, __ATOMIC_ACQUIRE);
+    if (prod == xdp->comp.cached) {
+        return;
+    }
+    while (xdp->comp.cached != prod) {
+        xdp->tx_free[xdp->tx_free_num++] = descs[xdp->comp.cached & (ETHER_XDP_RING_SIZE - 1)];
+        xdp->comp.cached++;
+    }
+    __atomic_store_n(xdp->comp.consumer, xdp->comp.cached, __ATOMIC_RELEASE);
+}
+
+/* NOTE: must be called with tx_lock held */
+static void
+ether_xdp_kick(struct net_device *dev)
+{
+    struct ether_xdp *xdp;
+
+    xdp = PRIV(dev);
+    if (xdp->need_wakeup && !(__atomic_load_n(xdp->tx.flags, __ATOMIC_ACQUIRE) & XDP_RING_NEED_WAKEUP)) {
+        return;
+    }
+    if (sendto(xdp->fd, NULL, 0, MSG_DONTWAIT, NULL, 0) == -1) {
+        if (errno != EAGAIN && errno != EBUSY && errno != ENOBUFS) {
+            errorf("sendto: %s, dev=%s", strerror(errno), dev->name);
+        }
+    }
+}
+
+static int
+ether_xdp_transmit(struct net_device *dev, uint16_t type, struct pbuf *pb, const void *dst)
+{
+    return ether_queue_helper(dev, type, pb, dst);
+}
+
+/* NOTE: the frames are put on the TX ring and published at once, one kick for them all */
+static int
+ether_xdp_transmit_batch(struct net_device *dev, struct pbuf **pbs, int num)
+{
+    struct ether_xdp *xdp;
+    struct xdp_desc *desc;
+    uint64_t addr;
+    int i, sent = 0;
+
+    xdp = PRIV(dev);
+    mutex_lock(&xdp->tx_lock);
+    for (i = 0; i < num && xdp->fd != -1; i++) {
+        if (pbs[i]->len > ETHER_XDP_FRAME_SIZE) {
+            errorf("too long, dev=%s, len=%zu", dev->name, pbs[i]->len);
+            continue;
+        }
+        ether_xdp_complete(xdp);
+        if (!xdp->tx_free_num) {
+            /* NOTE: the completions may wait for a kick */
+            __atomic_store_n(xdp->tx.producer, xdp->tx.cached, __ATOMIC_RELEASE);
+            ether_xdp_kick(dev);
+            ether_xdp_complete(xdp);
+            if (!xdp->tx_free_num) {
+                errorf("no free frame, dev=%s", dev->name);
+                break;
+            }
+        }
+        addr = xdp->tx_free[--xdp->tx_free_num];
+        memcpy(xdp->umem + addr, pbs[i]->data, pbs[i]->len);
+        desc = &((struct xdp_desc *)xdp->tx.descs)[xdp->tx.cached & (ETHER_XDP_RING_SIZE - 1)];
+        desc->addr = addr;
+        desc->len = pbs[i]->len;
+        desc->options = 0;
+        xdp->tx.cached++;
+        sent++;
+    }
+    if (sent && xdp->fd != -1) {
+        __atomic_store_n(xdp->tx.producer, xdp->tx.cached, __ATOMIC_RELEASE);
+        ether_xdp_kick(dev);
+    }
+    mutex_unlock(&xdp->tx_lock);
+    for (i = 0; i < num; i++) {
+        pbuf_free(pbs[i]);
+    }
+    return sent;
+}
+
+/* NOTE: the received frames are handed up in place, no copy and no syscall */
+static int
+ether_xdp_poll(struct net_device *dev, int budget)
+{
+    struct ether_xdp *xdp;
+    struct xdp_desc *desc;
+    struct ether_xdp_frame *frame;
+    struct pbuf *pb, *pbs[NET_DEVICE_POLL_BUDGET];
+    uint64_t base;
+    uint32_t prod;
+    int num = 0, done = 0;
+
+    xdp = PRIV(dev);
+    if (xdp->fd == -1) {
+        return 0;
+    }
+    budget = MIN(budget, NET_DEVICE_POLL_BUDGET);
+    prod = __atomic_load_n(xdp->rx.producer, __ATOMIC_ACQUIRE);
+    while (xdp->rx.cached != prod && done < budget) {
+        desc = &((struct xdp_desc *)xdp->rx.descs)[xdp->rx.cached & (ETHER_XDP_RING_SIZE - 1)];
+        base = desc->addr & ~(uint64_t)(ETHER_XDP_FRAME_SIZE - 1);
+        frame = (struct ether_xdp_frame *)(xdp->umem + base);
+        frame->dev = dev;
+        pb = &frame->pb;
+        pb->next = NULL;
+        pb->ref = 1;
+        pb->dev = NULL;
+        pb->type = 0;
+        pb->flags = 0;
+        pb->gso_size = 0;
+        pb->frags = NULL;
+        pb->data = xdp->umem + desc->addr;
+        pb->len = desc->len;
+        pb->size = ETHER_XDP_FRAME_SIZE - offsetof(struct ether_xdp_frame, pb.head);
+        pb->release = ether_xdp_release;
+        xdp->rx.cached++;
+        done++;
+        if (pb->data < pb->head) {
+            errorf("no room for the packet buffer, dev=%s, offset=%u", dev->name, (unsigned int)(desc->addr - base));
+            ether_xdp_release(pb);
+            continue;
+        }
+        pbs[num++] = pb;
+    }
+    if (!done) {
+        return 0;
+    }
+    /* NOTE: the descriptors are copied out, give the slots back at once */
+    __atomic_store_n(xdp->rx.consumer, xdp->rx.cached, __ATOMIC_RELEASE);
+    if (num) {
+        ether_input_helper(dev, pbs, num);
+    }
+    return done;
+}
+
+static int
+ether_xdp_isr(unsigned int irq, void *id)
+{
+    net_device_schedule((struct net_device *)id);
+    return 0;
+}
+
+static struct net_device_ops ether_xdp_ops = {
+    .open = ether_xdp_open,
+    .close = ether_xdp_close,
+    .transmit = ether_xdp_transmit,
+    .poll = ether_xdp_poll,
+    .transmit_batch = ether_xdp_transmit_batch,
+};
+
+/* NOTE: binds the queue of the interface, one device per queue */
+struct net_device *
+ether_xdp_init(const char *name, const char *addr, unsigned int queue)
+{
+    struct net_device *dev;
+    struct ether_xdp *xdp;
+
+    if (queue >= ETHER_XDP_QUEUE_MAX) {
+        errorf("too large queue, queue=%u", queue);
+        return NULL;
+    }
+    dev = net_device_alloc(ether_setup_helper);
+    if (!dev) {
+        errorf("net_device_alloc() failure");
+        return NULL;
+    }
+    if (addr) {
+        if (ether_addr_pton(addr, dev->addr) == -1) {
+            errorf("invalid address, addr=%s", addr);
+            return NULL;
+        }
+    }
+    dev->ops = &ether_xdp_ops;
+    xdp = memory_alloc(sizeof(*xdp));
+    if (!xdp) {
+        errorf("memory_alloc() failure");
+        return NULL;
+    }
+    strncpy(xdp->name, name, sizeof(xdp->name)-1);
+    xdp->queue = queue;
+    xdp->fd = -1;
+    xdp->map_fd = -1;
+    xdp->prog_fd = -1;
+    xdp->link_fd = -1;
+    xdp->irq = ETHER_XDP_IRQ;
+    mutex_init(&xdp->fill_lock);
+    mutex_init(&xdp->tx_lock);
+    dev->priv = xdp;
+    if (net_device_register(dev) == -1) {
+        errorf("net_device_register() failure");
+        memory_free(xdp);
+        return NULL;
+    }
+    intr_request_irq(xdp->irq, ether_xdp_isr, NET_IRQ_SHARED, dev->name, dev);
+    debugf("ethernet device initialized, dev=%s", dev->name);
+    return dev;
+}
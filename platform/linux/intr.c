@@ -1,5 +1,8 @@
+#define _GNU_SOURCE /* for F_SETSIG */
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
 #include <time.h>
 #include <errno.h>
 #include <signal.h>
@@ -9,6 +12,7 @@
 
 #include "util.h"
 #include "net.h"
+#include "timer.h"
 
 struct irq_entry {
     struct irq_entry *next;
@@ -22,6 +26,8 @@ struct irq_entry {
 sigset_t sigmask;
 struct irq_entry *irq_vec;
 
+static timer_t timer_id;
+
 int
 intr_request_irq(unsigned int irq, int (*handler)(unsigned int irq, void *dev), int flags, const char *name, void *dev)
 {
@@ -52,16 +58,38 @@ intr_request_irq(unsigned int irq, int (*handler)(unsigned int irq, void *dev),
     return 0;
 }
 
-static int
-intr_timer_setup(struct itimerspec *interval)
+/* NOTE: the signal backend delivers readiness of fd as signal irq (via O_ASYNC and F_SETSIG) */
+int
+intr_watch_fd(unsigned int irq, void *dev, int fd)
 {
-    timer_t id;
-
-    if (timer_create(CLOCK_REALTIME, NULL, &id) == -1) {
-        errorf("timer_create: %s", strerror(errno));
+    /* Set Asynchronous I/O signal delivery destination */
+    if (fcntl(fd, F_SETOWN, getpid()) == -1) {
+        errorf("fcntl(F_SETOWN): %s", strerror(errno));
+        return -1;
+    }
+    /* Use other signal instead of SIGIO (NOTE: before enabling, SIGIO kills the process if anything is pending) */
+    if (fcntl(fd, F_SETSIG, irq) == -1) {
+        errorf("fcntl(F_SETSIG): %s", strerror(errno));
+        return -1;
+    }
+    /* Enable Asynchronous I/O */
+    if (fcntl(fd, F_SETFL, O_ASYNC) == -1) {
+        errorf("fcntl(F_SETFL): %s", strerror(errno));
         return -1;
     }
-    if (timer_settime(id, 0, interval, NULL) == -1) {
+    return 0;
+}
+
+/* NOTE: process-directed SIGALRM, taken by sigwait() in intr_thread() */
+int
+intr_timer_set(uint64_t expire)
+{
+    struct itimerspec spec = {};
+
+    /* NOTE: zero disarms the timer, the time already passed fires it at once */
+    spec.it_value.tv_sec = expire / 1000000000;
+    spec.it_value.tv_nsec = MAX(expire % 1000000000, 1);
+    if (timer_settime(timer_id, TIMER_ABSTIME, &spec, NULL) == -1) {
         errorf("timer_settime: %s", strerror(errno));
         return -1;
     }
@@ -71,14 +99,9 @@ intr_timer_setup(struct itimerspec *interval)
 static void *
 intr_thread(void *arg)
 {
-    struct timespec ts = {0, 1000000}; // 1ms
-    struct itimerspec interval = {ts, ts};
     int sig, err;
     struct irq_entry *entry;
 
-    if (intr_timer_setup(&interval) == -1) {
-        return NULL;
-    }
     while (1) {
         err = sigwait(&sigmask, &sig);
         if (err) {
@@ -95,6 +118,12 @@ intr_thread(void *arg)
         case SIGALRM:
             net_timer_handler();
             break;
+        case SIGIO:
+            /* NOTE: the queue of the realtime signals overflowed, which of the fds is not known */
+            for (entry = irq_vec; entry; entry = entry->next) {
+                entry->handler(entry->irq, entry->dev);
+            }
+            break;
         default:
             for (entry = irq_vec; entry; entry = entry->next) {
                 if (entry->irq == (unsigned int)sig) {
@@ -131,9 +160,25 @@ intr_run(void)
 int
 intr_init(void)
 {
+    sigset_t alrm;
+    int err;
+
     sigemptyset(&sigmask);
     sigaddset(&sigmask, SIGUSR1);
     sigaddset(&sigmask, SIGUSR2);
     sigaddset(&sigmask, SIGALRM);
+    sigaddset(&sigmask, SIGIO);
+    /* NOTE: a timer may be armed before intr_run(), SIGALRM must not kill the process then */
+    sigemptyset(&alrm);
+    sigaddset(&alrm, SIGALRM);
+    err = pthread_sigmask(SIG_BLOCK, &alrm, NULL);
+    if (err) {
+        errorf("pthread_sigmask() %s", strerror(err));
+        return -1;
+    }
+    if (timer_create(CLOCK_MONOTONIC, NULL, &timer_id) == -1) {
+        errorf("timer_create: %s", strerror(errno));
+        return -1;
+    }
     return 0;
 }
@@ -0,0 +1,235 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+#include "platform.h"
+
+#include "util.h"
+#include "net.h"
+#include "timer.h"
+
+/*
+ * Interrupt (epoll backend)
+ *
+ * NOTE: Devices register their file descriptors with the epoll instance, the softirq and
+ *       the event are eventfds, and the timer is a timerfd (one-shot, see intr_timer_set()).
+ *       selected with `make INTR=epoll`.
+ */
+
+#define INTR_EPOLL_EVENTS_MAX 16
+
+struct irq_entry {
+    struct irq_entry *next;
+    unsigned int irq;
+    int (*handler)(unsigned int irq, void *dev);
+    int flags;
+    char name[16];
+    void *dev;
+    int fd;
+};
+
+static struct irq_entry *irq_vec;
+
+static int epfd = -1;
+static int softirq_fd = -1;
+static int event_fd = -1;
+static int timer_fd = -1;
+static int softirq_pending;
+
+/* NOTE: tags for the internal descriptors, device descriptors carry their irq_entry */
+static int softirq_tag, event_tag, timer_tag;
+
+int
+intr_request_irq(unsigned int irq, int (*handler)(unsigned int irq, void *dev), int flags, const char *name, void *dev)
+{
+    struct irq_entry *entry;
+
+    debugf("irq=%u, handler=%p, flags=%d, name=%s, dev=%p", irq, handler, flags, name, dev);
+    for (entry = irq_vec; entry; entry = entry->next) {
+        if (entry->irq == irq) {
+            if (entry->flags ^ NET_IRQ_SHARED || flags ^ NET_IRQ_SHARED) {
+                errorf("conflicts with already registered IRQs");
+                return -1;
+            }
+        }
+    }
+    entry = memory_alloc(sizeof(*entry));
+    if (!entry) {
+        errorf("memory_alloc() failure");
+        return -1;
+    }
+    entry->irq = irq;
+    entry->handler = handler;
+    entry->flags = flags;
+    strncpy(entry->name, name, sizeof(entry->name)-1);
+    entry->dev = dev;
+    entry->fd = -1;
+    entry->next = irq_vec;
+    irq_vec = entry;
+    debugf("registered: irq=%u, name=%s", irq, name);
+    return 0;
+}
+
+static int
+intr_epoll_add(int fd, void *ptr)
+{
+    struct epoll_event ev = {};
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = ptr;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        errorf("epoll_ctl: %s, fd=%d", strerror(errno), fd);
+        return -1;
+    }
+    return 0;
+}
+
+int
+intr_watch_fd(unsigned int irq, void *dev, int fd)
+{
+    struct irq_entry *entry;
+
+    for (entry = irq_vec; entry; entry = entry->next) {
+        if (entry->irq == irq && entry->dev == dev) {
+            entry->fd = fd;
+            return intr_epoll_add(fd, entry);
+        }
+    }
+    errorf("irq not registered, irq=%u", irq);
+    return -1;
+}
+
+void
+raise_softirq(void)
+{
+    uint64_t val = 1;
+
+    /* NOTE: coalesce wakeups, only the first raise after the last dispatch writes the eventfd */
+    if (__atomic_exchange_n(&softirq_pending, 1, __ATOMIC_SEQ_CST)) {
+        return;
+    }
+    if (write(softirq_fd, &val, sizeof(val)) == -1) {
+        errorf("write: %s", strerror(errno));
+    }
+}
+
+/* NOTE: write(2) is a signal safety function. see signal-safety(7). */
+int
+raise_event(void)
+{
+    uint64_t val = 1;
+
+    return write(event_fd, &val, sizeof(val)) == -1 ? -1 : 0;
+}
+
+static void
+intr_drain(int fd)
+{
+    uint64_t val;
+
+    /* NOTE: eventfd/timerfd counters are read as one 8-byte value */
+    if (read(fd, &val, sizeof(val)) == -1 && errno != EAGAIN) {
+        errorf("read: %s, fd=%d", strerror(errno), fd);
+    }
+}
+
+int
+intr_timer_set(uint64_t expire)
+{
+    struct itimerspec spec = {};
+
+    /* NOTE: zero disarms the timer, the time already passed fires it at once */
+    spec.it_value.tv_sec = expire / 1000000000;
+    spec.it_value.tv_nsec = MAX(expire % 1000000000, 1);
+    if (timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &spec, NULL) == -1) {
+        errorf("timerfd_settime: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static void *
+intr_thread(void *arg)
+{
+    struct epoll_event events[INTR_EPOLL_EVENTS_MAX];
+    struct irq_entry *entry;
+    int n, i;
+
+    while (1) {
+        n = epoll_wait(epfd, events, countof(events), -1);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            errorf("epoll_wait: %s", strerror(errno));
+            break;
+        }
+        for (i = 0; i < n; i++) {
+            if (events[i].data.ptr == &softirq_tag) {
+                intr_drain(softirq_fd);
+                __atomic_store_n(&softirq_pending, 0, __ATOMIC_SEQ_CST);
+                net_protocol_handler();
+            } else if (events[i].data.ptr == &event_tag) {
+                intr_drain(event_fd);
+                net_event_handler();
+            } else if (events[i].data.ptr == &timer_tag) {
+                intr_drain(timer_fd);
+                net_timer_handler();
+            } else {
+                entry = events[i].data.ptr;
+                debugf("irq=%d, name=%s", entry->irq, entry->name);
+                entry->handler(entry->irq, entry->dev);
+            }
+        }
+    }
+    return NULL;
+}
+
+static pthread_t tid;
+
+int
+intr_run(void)
+{
+    int err;
+
+    err = pthread_create(&tid, NULL, intr_thread, NULL);
+    if (err) {
+        errorf("pthread_create() %s", strerror(err));
+        return -1;
+    }
+    return 0;
+}
+
+int
+intr_init(void)
+{
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd == -1) {
+        errorf("epoll_create1: %s", strerror(errno));
+        return -1;
+    }
+    softirq_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (softirq_fd == -1 || event_fd == -1) {
+        errorf("eventfd: %s", strerror(errno));
+        return -1;
+    }
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timer_fd == -1) {
+        errorf("timerfd_create: %s", strerror(errno));
+        return -1;
+    }
+    if (intr_epoll_add(softirq_fd, &softirq_tag) == -1 ||
+        intr_epoll_add(event_fd, &event_tag) == -1 ||
+        intr_epoll_add(timer_fd, &timer_tag) == -1) {
+        return -1;
+    }
+    return 0;
+}
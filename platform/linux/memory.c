@@ -0,0 +1,241 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "platform.h"
+
+#include "util.h"
+
+/*
+ * Memory Pool
+ *
+ * NOTE: Fixed-size blocks are preallocated per size class at memory_pool_init() and
+ *       handed out through a per-thread cache, which refills from (and flushes to)
+ *       the global depot in batches so that the depot mutex is taken once per batch.
+ *       Only the small class falls back to the heap when used up, the frame class is bounded.
+ */
+
+#define MEMORY_POOL_CLASS_SMALL 0
+#define MEMORY_POOL_CLASS_FRAME 1
+#define MEMORY_POOL_CLASS_NUM 2
+#define MEMORY_POOL_CLASS_HEAP MEMORY_POOL_CLASS_NUM /* fallback: not pooled */
+
+#define MEMORY_POOL_BATCH 32
+#define MEMORY_POOL_CACHE_MAX (MEMORY_POOL_BATCH * 2)
+
+/* NOTE: the header keeps the user area 16-byte aligned */
+struct memory_block {
+    struct memory_block *next;
+    unsigned int class;
+    unsigned int magic;
+};
+
+#define MEMORY_BLOCK_MAGIC 0x6d706f6f /* "mpoo" */
+
+struct memory_class {
+    size_t size; /* including the block header */
+    mutex_t mutex;
+    struct memory_block *free;
+    size_t num; /* number of blocks in the depot */
+    size_t capacity;
+    uint8_t *area;
+};
+
+struct memory_cache {
+    struct memory_block *free;
+    size_t num;
+};
+
+static struct memory_class classes[MEMORY_POOL_CLASS_NUM] = {
+    [MEMORY_POOL_CLASS_SMALL] = {.size = MEMORY_POOL_SMALL_SIZE, .mutex = MUTEX_INITIALIZER}, /* control entries */
+    [MEMORY_POOL_CLASS_FRAME] = {.size = MEMORY_POOL_FRAME_SIZE, .mutex = MUTEX_INITIALIZER}, /* packet buffers (Ethernet MTU frames) */
+};
+
+static __thread struct memory_cache caches[MEMORY_POOL_CLASS_NUM];
+static __thread int cache_registered;
+static pthread_key_t cache_key;
+static pthread_once_t cache_key_once = PTHREAD_ONCE_INIT;
+
+static void
+memory_cache_flush(struct memory_class *class, struct memory_cache *cache, size_t num)
+{
+    struct memory_block *head, *tail;
+    size_t n;
+
+    if (!cache->num || !num) {
+        return;
+    }
+    head = tail = cache->free;
+    for (n = 1; n < num && tail->next; n++) {
+        tail = tail->next;
+    }
+    cache->free = tail->next;
+    cache->num -= n;
+    mutex_lock(&class->mutex);
+    tail->next = class->free;
+    class->free = head;
+    class->num += n;
+    mutex_unlock(&class->mutex);
+}
+
+static void
+memory_cache_destructor(void *arg)
+{
+    int i;
+
+    (void)arg;
+    /* NOTE: return the blocks cached by the exiting thread to the depot */
+    for (i = 0; i < MEMORY_POOL_CLASS_NUM; i++) {
+        memory_cache_flush(&classes[i], &caches[i], caches[i].num);
+    }
+}
+
+static void
+memory_cache_key_create(void)
+{
+    pthread_key_create(&cache_key, memory_cache_destructor);
+}
+
+static void
+memory_cache_register(void)
+{
+    pthread_once(&cache_key_once, memory_cache_key_create);
+    pthread_setspecific(cache_key, caches);
+    cache_registered = 1;
+}
+
+static int
+memory_cache_refill(struct memory_class *class, struct memory_cache *cache)
+{
+    struct memory_block *block;
+    size_t n;
+
+    mutex_lock(&class->mutex);
+    for (n = 0; n < MEMORY_POOL_BATCH && class->free; n++) {
+        block = class->free;
+        class->free = block->next;
+        block->next = cache->free;
+        cache->free = block;
+    }
+    class->num -= n;
+    mutex_unlock(&class->mutex);
+    cache->num += n;
+    return n ? 0 : -1;
+}
+
+static unsigned int
+memory_pool_class(size_t size)
+{
+    unsigned int i;
+
+    for (i = 0; i < MEMORY_POOL_CLASS_NUM; i++) {
+        if (classes[i].capacity && sizeof(struct memory_block) + size <= classes[i].size) {
+            return i;
+        }
+    }
+    return MEMORY_POOL_CLASS_HEAP;
+}
+
+/* NOTE: unlike memory_alloc(), the returned memory is not zero-filled */
+void *
+memory_pool_alloc(size_t size)
+{
+    unsigned int index;
+    struct memory_cache *cache;
+    struct memory_block *block;
+
+    index = memory_pool_class(size);
+    if (index != MEMORY_POOL_CLASS_HEAP) {
+        if (!cache_registered) {
+            memory_cache_register();
+        }
+        cache = &caches[index];
+        if (!cache->free && memory_cache_refill(&classes[index], cache) == -1) {
+            if (index != MEMORY_POOL_CLASS_SMALL) {
+                /* NOTE: the frames are bounded, do not fall back to the heap */
+                return NULL;
+            }
+            /* NOTE: the control entries do (their holders are bounded by their own limits, see net.h) */
+            index = MEMORY_POOL_CLASS_HEAP;
+        }
+    }
+    if (index == MEMORY_POOL_CLASS_HEAP) {
+        block = malloc(sizeof(*block) + size);
+        if (!block) {
+            return NULL;
+        }
+    } else {
+        block = cache->free;
+        cache->free = block->next;
+        cache->num--;
+    }
+    block->next = NULL;
+    block->class = index;
+    block->magic = MEMORY_BLOCK_MAGIC;
+    return block + 1;
+}
+
+void
+memory_pool_free(void *ptr)
+{
+    struct memory_block *block;
+    struct memory_cache *cache;
+
+    if (!ptr) {
+        return;
+    }
+    block = (struct memory_block *)ptr - 1;
+    if (block->magic != MEMORY_BLOCK_MAGIC) {
+        errorf("invalid block, ptr=%p", ptr);
+        return;
+    }
+    block->magic = 0;
+    if (block->class == MEMORY_POOL_CLASS_HEAP) {
+        free(block);
+        return;
+    }
+    if (!cache_registered) {
+        memory_cache_register();
+    }
+    cache = &caches[block->class];
+    block->next = cache->free;
+    cache->free = block;
+    cache->num++;
+    if (cache->num > MEMORY_POOL_CACHE_MAX) {
+        memory_cache_flush(&classes[block->class], cache, MEMORY_POOL_BATCH);
+    }
+}
+
+/* NOTE: must not be call after net_run() */
+int
+memory_pool_init(size_t small, size_t frame)
+{
+    size_t capacity[MEMORY_POOL_CLASS_NUM] = {small, frame};
+    struct memory_class *class;
+    struct memory_block *block;
+    size_t n;
+    int i;
+
+    for (i = 0; i < MEMORY_POOL_CLASS_NUM; i++) {
+        class = &classes[i];
+        if (class->area || !capacity[i]) {
+            continue;
+        }
+        /* NOTE: malloc instead of calloc, the blocks do not need to be zero-filled */
+        class->area = malloc(class->size * capacity[i]);
+        if (!class->area) {
+            errorf("malloc() failure, size=%zu, capacity=%zu", class->size, capacity[i]);
+            return -1;
+        }
+        for (n = 0; n < capacity[i]; n++) {
+            block = (struct memory_block *)(class->area + class->size * n);
+            block->next = class->free;
+            class->free = block;
+        }
+        class->num = class->capacity = capacity[i];
+        infof("preallocated: size=%zu, capacity=%zu", class->size, class->capacity);
+    }
+    return 0;
+}
@@ -2,6 +2,7 @@
 #define PLATFORM_H
 
 #include <stdlib.h>
+#include <stdint.h>
 #include <pthread.h>
 #include <time.h>
 #include <signal.h>
@@ -24,6 +25,20 @@ memory_free(void *ptr)
     free(ptr);
 }
 
+/*
+ * Memory Pool (for the per-packet hot path)
+ */
+
+#define MEMORY_POOL_SMALL_SIZE 128  /* queue entries and other control structures */
+#define MEMORY_POOL_FRAME_SIZE 2048 /* struct pbuf + headroom + Ethernet MTU frame */
+
+extern void *
+memory_pool_alloc(size_t size);
+extern void
+memory_pool_free(void *ptr);
+extern int
+memory_pool_init(size_t small, size_t frame);
+
 /*
  * Mutex
  */
@@ -50,17 +65,68 @@ mutex_unlock(mutex_t *mutex)
     return pthread_mutex_unlock(mutex);
 }
 
+/*
+ * Reader-Writer Lock
+ */
+
+typedef pthread_rwlock_t rwlock_t;
+
+#define RWLOCK_INITIALIZER PTHREAD_RWLOCK_INITIALIZER
+
+static inline int
+rwlock_rdlock(rwlock_t *rwlock)
+{
+    return pthread_rwlock_rdlock(rwlock);
+}
+
+static inline int
+rwlock_wrlock(rwlock_t *rwlock)
+{
+    return pthread_rwlock_wrlock(rwlock);
+}
+
+static inline int
+rwlock_unlock(rwlock_t *rwlock)
+{
+    return pthread_rwlock_unlock(rwlock);
+}
+
 /*
  * Scheduler
  */
 
+struct sched_watch;
+
 struct sched_ctx {
     pthread_cond_t cond;
     int interrupted;
     int wc; /* wait count */
+    struct sched_watch *watches; /* NOTE: protected by the mutex the sleepers use (the lock of the pcb) */
+};
+
+#define SCHED_CTX_INITIALIZER {PTHREAD_COND_INITIALIZER, 0, 0, NULL}
+
+/*
+ * NOTE: readiness notification (for sock_poll()), the waiter attaches a watch for each object of its interest
+ *       to the context of the object, sched_wakeup() queues only the watches of that context to their pollers.
+ */
+struct sched_poller {
+    mutex_t mutex;
+    pthread_cond_t cond;
+    struct sched_watch *ready; /* the watches woken up since the last sched_poller_take() */
+    int interrupted;
 };
 
-#define SCHED_CTX_INITIALIZER {PTHREAD_COND_INITIALIZER, 0, 0}
+struct sched_watch {
+    struct sched_watch *next;
+    struct sched_watch **pprev;
+    struct sched_ctx *ctx; /* NOTE: NULL once detached (or the context is destroyed) */
+    mutex_t *lock; /* the mutex protecting ctx */
+    struct sched_poller *poller;
+    struct sched_watch *ready_next;
+    struct sched_watch **ready_pprev; /* NOTE: NULL unless on the ready list of the poller */
+    void *arg;
+};
 
 extern int
 sched_ctx_init(struct sched_ctx *ctx);
@@ -73,6 +139,34 @@ sched_wakeup(struct sched_ctx *ctx);
 extern int
 sched_interrupt(struct sched_ctx *ctx);
 
+extern int
+sched_poller_init(struct sched_poller *poller);
+extern int
+sched_poller_destroy(struct sched_poller *poller);
+extern int
+sched_poller_wait(struct sched_poller *poller, const struct timespec *abstime);
+extern struct sched_watch *
+sched_poller_take(struct sched_poller *poller);
+/* NOTE: must be called with the lock held, with a new (zeroed) or detached watch, check the state after attaching */
+extern void
+sched_watch_attach(struct sched_watch *watch, struct sched_poller *poller, struct sched_ctx *ctx, mutex_t *lock, void *arg);
+extern void
+sched_watch_detach(struct sched_watch *watch);
+
+/*
+ * Thread
+ */
+
+typedef pthread_t thread_t;
+
+/* NOTE: cpu < 0 means no affinity */
+extern int
+thread_create(thread_t *thread, void *(*func)(void *arg), void *arg, int cpu);
+extern int
+thread_join(thread_t thread);
+extern int
+thread_cpu_num(void);
+
 /*
  * Interrupt
  */
@@ -80,14 +174,38 @@ sched_interrupt(struct sched_ctx *ctx);
 extern int
 intr_request_irq(unsigned int irq, int (*handler)(unsigned int irq, void *id), int flags, const char *name, void *dev);
 extern int
+intr_watch_fd(unsigned int irq, void *dev, int fd);
+/* NOTE: one-shot at expire (nanoseconds, CLOCK_MONOTONIC), calls net_timer_handler() then (replaces the previous one) */
+extern int
+intr_timer_set(uint64_t expire);
+extern int
 intr_run(void);
 extern int
 intr_init(void);
 
+#ifdef INTR_EPOLL
+
+/* see intr_epoll.c */
+extern void
+raise_softirq(void);
+extern int
+raise_event(void);
+
+#else
+
 static inline void
 raise_softirq(void)
 {
     kill(getpid(), SIGUSR1);
 }
 
+static inline int
+raise_event(void)
+{
+    /* getpid(2) and kill(2) are signal safety functions. see signal-safety(7). */
+    return kill(getpid(), SIGUSR2);
+}
+
+#endif
+
 #endif
@@ -4,19 +4,59 @@
 
 #include "platform.h"
 
+/* NOTE: queues the watches of the context to their pollers (the caller holds the lock of the context) */
+static void
+sched_watch_notify(struct sched_ctx *ctx, int interrupted)
+{
+    struct sched_watch *watch;
+    struct sched_poller *poller;
+
+    for (watch = ctx->watches; watch; watch = watch->next) {
+        poller = watch->poller;
+        mutex_lock(&poller->mutex);
+        if (!watch->ready_pprev) {
+            watch->ready_next = poller->ready;
+            if (poller->ready) {
+                poller->ready->ready_pprev = &watch->ready_next;
+            }
+            poller->ready = watch;
+            watch->ready_pprev = &poller->ready;
+        }
+        if (interrupted) {
+            poller->interrupted = 1;
+        }
+        pthread_cond_signal(&poller->cond);
+        mutex_unlock(&poller->mutex);
+    }
+}
+
 int
 sched_ctx_init(struct sched_ctx *ctx)
 {
     pthread_cond_init(&ctx->cond, NULL);
     ctx->interrupted = 0;
     ctx->wc = 0;
+    ctx->watches = NULL;
     return 0;
 }
 
+/* NOTE: the watchers are notified and the watches are detached, the context may be reused for another object */
 int
 sched_ctx_destroy(struct sched_ctx *ctx)
 {
-    return pthread_cond_destroy(&ctx->cond);
+    struct sched_watch *watch;
+    int ret;
+
+    ret = pthread_cond_destroy(&ctx->cond);
+    if (ret) {
+        return ret;
+    }
+    sched_watch_notify(ctx, 0);
+    while ((watch = ctx->watches) != NULL) {
+        ctx->watches = watch->next;
+        watch->ctx = NULL;
+    }
+    return 0;
 }
 
 int
@@ -48,6 +88,7 @@ sched_sleep(struct sched_ctx *ctx, mutex_t *mutex, const struct timespec *abstim
 int
 sched_wakeup(struct sched_ctx *ctx)
 {
+    sched_watch_notify(ctx, 0);
     return pthread_cond_broadcast(&ctx->cond);
 }
 
@@ -55,5 +96,117 @@ int
 sched_interrupt(struct sched_ctx *ctx)
 {
     ctx->interrupted = 1;
+    sched_watch_notify(ctx, 1);
     return pthread_cond_broadcast(&ctx->cond);
 }
+
+int
+sched_poller_init(struct sched_poller *poller)
+{
+    mutex_init(&poller->mutex);
+    pthread_cond_init(&poller->cond, NULL);
+    poller->ready = NULL;
+    poller->interrupted = 0;
+    return 0;
+}
+
+/* NOTE: all the watches must be detached before */
+int
+sched_poller_destroy(struct sched_poller *poller)
+{
+    pthread_cond_destroy(&poller->cond);
+    return pthread_mutex_destroy(&poller->mutex);
+}
+
+/* NOTE: returns 0 if some watch is ready, ETIMEDOUT on the timeout, or -1 (EINTR) if a watched context is interrupted */
+int
+sched_poller_wait(struct sched_poller *poller, const struct timespec *abstime)
+{
+    int ret = 0;
+
+    mutex_lock(&poller->mutex);
+    while (!poller->ready && !poller->interrupted) {
+        if (abstime) {
+            ret = pthread_cond_timedwait(&poller->cond, &poller->mutex, abstime);
+        } else {
+            ret = pthread_cond_wait(&poller->cond, &poller->mutex);
+        }
+        if (ret == ETIMEDOUT) {
+            break;
+        }
+    }
+    if (poller->interrupted) {
+        poller->interrupted = 0;
+        mutex_unlock(&poller->mutex);
+        errno = EINTR;
+        return -1;
+    }
+    mutex_unlock(&poller->mutex);
+    return poller->ready ? 0 : ETIMEDOUT;
+}
+
+/* NOTE: returns one of the ready watches (removed from the ready list), or NULL */
+struct sched_watch *
+sched_poller_take(struct sched_poller *poller)
+{
+    struct sched_watch *watch;
+
+    mutex_lock(&poller->mutex);
+    watch = poller->ready;
+    if (watch) {
+        poller->ready = watch->ready_next;
+        if (poller->ready) {
+            poller->ready->ready_pprev = &poller->ready;
+        }
+        watch->ready_pprev = NULL;
+    }
+    mutex_unlock(&poller->mutex);
+    return watch;
+}
+
+void
+sched_watch_attach(struct sched_watch *watch, struct sched_poller *poller, struct sched_ctx *ctx, mutex_t *lock, void *arg)
+{
+    watch->ctx = ctx;
+    watch->lock = lock;
+    watch->poller = poller;
+    watch->ready_next = NULL;
+    watch->ready_pprev = NULL;
+    watch->arg = arg;
+    watch->next = ctx->watches;
+    if (ctx->watches) {
+        ctx->watches->pprev = &watch->next;
+    }
+    ctx->watches = watch;
+    watch->pprev = &ctx->watches;
+}
+
+/* NOTE: must be called without the lock, the watch may be attached again after that */
+void
+sched_watch_detach(struct sched_watch *watch)
+{
+    struct sched_poller *poller = watch->poller;
+
+    if (!poller) {
+        return;
+    }
+    mutex_lock(watch->lock);
+    if (watch->ctx) {
+        *watch->pprev = watch->next;
+        if (watch->next) {
+            watch->next->pprev = watch->pprev;
+        }
+        watch->ctx = NULL;
+    }
+    mutex_unlock(watch->lock);
+    mutex_lock(&poller->mutex);
+    if (watch->ready_pprev) {
+        *watch->ready_pprev = watch->ready_next;
+        if (watch->ready_next) {
+            watch->ready_next->ready_pprev = watch->ready_pprev;
+        }
+        watch->ready_pprev = NULL;
+    }
+    mutex_unlock(&poller->mutex);
+    watch->poller = NULL;
+}
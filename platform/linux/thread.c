@@ -0,0 +1,54 @@
+#define _GNU_SOURCE /* for pthread_attr_setaffinity_np() */
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include "platform.h"
+
+#include "util.h"
+
+int
+thread_create(thread_t *thread, void *(*func)(void *arg), void *arg, int cpu)
+{
+    pthread_attr_t attr;
+    cpu_set_t set;
+    int err;
+
+    pthread_attr_init(&attr);
+    if (cpu >= 0) {
+        CPU_ZERO(&set);
+        CPU_SET(cpu % thread_cpu_num(), &set);
+        pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+    }
+    err = pthread_create(thread, &attr, func, arg);
+    pthread_attr_destroy(&attr);
+    if (err) {
+        errorf("pthread_create() %s", strerror(err));
+        return -1;
+    }
+    return 0;
+}
+
+int
+thread_join(thread_t thread)
+{
+    int err;
+
+    err = pthread_join(thread, NULL);
+    if (err) {
+        errorf("pthread_join() %s", strerror(err));
+        return -1;
+    }
+    return 0;
+}
+
+int
+thread_cpu_num(void)
+{
+    long n;
+
+    n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+}
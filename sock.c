@@ -1,16 +1,21 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <string.h>
+#include <time.h>
+#include <errno.h>
+
+#include "platform.h"
 
 #include "util.h"
 #include "net.h"
 #include "ip.h"
 #include "udp.h"
 #include "tcp.h"
+#include "tcp_cong.h"
 
 #include "sock.h"
 
-static struct sock socks[128];
+static struct sock socks[SOCK_MAX];
 
 int
 sockaddr_pton(const char *p, struct sockaddr *n, size_t size)
@@ -46,14 +51,16 @@ sockaddr_ntop(const struct sockaddr *n, char *p, size_t size)
     return NULL;
 }
 
+/* NOTE: the entry is claimed atomically, no lock is shared by the sockets */
 static struct sock *
 sock_alloc(void)
 {
     struct sock *entry;
+    int unused;
 
     for (entry = socks; entry < tailof(socks); entry++) {
-        if (!entry->used) {
-            entry->used = 1;
+        unused = 0;
+        if (__atomic_compare_exchange_n(&entry->used, &unused, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
             return entry;
         }
     }
@@ -63,7 +70,11 @@ sock_alloc(void)
 static int
 sock_free(struct sock *s)
 {
-    memset(s, 0, sizeof(*s));
+    s->family = 0;
+    s->type = 0;
+    s->desc = 0;
+    s->flags = 0;
+    __atomic_store_n(&s->used, 0, __ATOMIC_RELEASE);
     return 0;
 }
 
@@ -134,7 +145,7 @@ sock_close(int id)
 }
 
 ssize_t
-sock_recvfrom(int id, void *buf, size_t n, struct sockaddr *addr, int *addrlen)
+sock_recvfrom_flags(int id, void *buf, size_t n, int flags, struct sockaddr *addr, int *addrlen)
 {
     struct sock *s;
     struct ip_endpoint ep;
@@ -149,7 +160,7 @@ sock_recvfrom(int id, void *buf, size_t n, struct sockaddr *addr, int *addrlen)
     }
     switch (s->family) {
     case AF_INET:
-        ret = udp_recvfrom(s->desc, (uint8_t *)buf, n, &ep);
+        ret = udp_recvfrom(s->desc, (uint8_t *)buf, n, &ep, flags);
         if (ret != -1) {
             ((struct sockaddr_in *)addr)->sin_addr = ep.addr;
             ((struct sockaddr_in *)addr)->sin_port = ep.port;
@@ -159,6 +170,12 @@ sock_recvfrom(int id, void *buf, size_t n, struct sockaddr *addr, int *addrlen)
     return -1;
 }
 
+ssize_t
+sock_recvfrom(int id, void *buf, size_t n, struct sockaddr *addr, int *addrlen)
+{
+    return sock_recvfrom_flags(id, buf, n, 0, addr, addrlen);
+}
+
 ssize_t
 sock_sendto(int id, const void *buf, size_t n, const struct sockaddr *addr, int addrlen)
 {
@@ -181,6 +198,86 @@ sock_sendto(int id, const void *buf, size_t n, const struct sockaddr *addr, int
     return -1;
 }
 
+/* NOTE: returns the number of messages received, up to UDP_MMSG_MAX by one call */
+int
+sock_recvmmsg(int id, struct mmsghdr *msgvec, unsigned int vlen)
+{
+    struct sock *s;
+    struct udp_msg msgs[UDP_MMSG_MAX];
+    int n, i;
+
+    s = sock_get(id);
+    if (!s) {
+        return -1;
+    }
+    if (s->type != SOCK_DGRAM) {
+        return -1;
+    }
+    switch (s->family) {
+    case AF_INET:
+        n = MIN(vlen, UDP_MMSG_MAX);
+        for (i = 0; i < n; i++) {
+            msgs[i].buf = msgvec[i].msg_buf;
+            msgs[i].size = msgvec[i].msg_size;
+        }
+        n = udp_recvmmsg(s->desc, msgs, n, 0);
+        for (i = 0; i < n; i++) {
+            msgvec[i].msg_len = msgs[i].len;
+            if (msgvec[i].msg_name) {
+                ((struct sockaddr_in *)msgvec[i].msg_name)->sin_family = AF_INET;
+                ((struct sockaddr_in *)msgvec[i].msg_name)->sin_addr = msgs[i].foreign.addr;
+                ((struct sockaddr_in *)msgvec[i].msg_name)->sin_port = msgs[i].foreign.port;
+                msgvec[i].msg_namelen = sizeof(struct sockaddr_in);
+            }
+        }
+        return n;
+    }
+    return -1;
+}
+
+/* NOTE: returns the number of messages sent, stops at the first failure */
+int
+sock_sendmmsg(int id, struct mmsghdr *msgvec, unsigned int vlen)
+{
+    struct sock *s;
+    struct udp_msg msgs[UDP_MMSG_MAX];
+    unsigned int done = 0;
+    int n, i, ret;
+
+    s = sock_get(id);
+    if (!s) {
+        return -1;
+    }
+    if (s->type != SOCK_DGRAM) {
+        return -1;
+    }
+    switch (s->family) {
+    case AF_INET:
+        while (done < vlen) {
+            n = MIN(vlen - done, UDP_MMSG_MAX);
+            for (i = 0; i < n; i++) {
+                msgs[i].buf = msgvec[done + i].msg_buf;
+                msgs[i].len = msgvec[done + i].msg_size;
+                msgs[i].foreign.addr = ((struct sockaddr_in *)msgvec[done + i].msg_name)->sin_addr;
+                msgs[i].foreign.port = ((struct sockaddr_in *)msgvec[done + i].msg_name)->sin_port;
+            }
+            ret = udp_sendmmsg(s->desc, msgs, n);
+            if (ret == -1) {
+                break;
+            }
+            for (i = 0; i < ret; i++) {
+                msgvec[done + i].msg_len = msgs[i].len;
+            }
+            done += ret;
+            if (ret < n) {
+                break;
+            }
+        }
+        return done ? (int)done : -1;
+    }
+    return -1;
+}
+
 int
 sock_bind(int id, const struct sockaddr *addr, int addrlen)
 {
@@ -232,7 +329,7 @@ sock_listen(int id, int backlog)
 }
 
 int
-sock_accept(int id, struct sockaddr *addr, int *addrlen)
+sock_accept_flags(int id, struct sockaddr *addr, int *addrlen, int flags)
 {
     struct sock *s, *new_s;
     struct ip_endpoint ep;
@@ -247,7 +344,7 @@ sock_accept(int id, struct sockaddr *addr, int *addrlen)
     }
     switch (s->family) {
     case AF_INET:
-        ret = tcp_accept(s->desc, &ep);
+        ret = tcp_accept(s->desc, &ep, flags);
         if (ret == -1) {
             return -1;
         }
@@ -255,6 +352,13 @@ sock_accept(int id, struct sockaddr *addr, int *addrlen)
         ((struct sockaddr_in *)addr)->sin_addr = ep.addr;
         ((struct sockaddr_in *)addr)->sin_port = ep.port;
         new_s = sock_alloc();
+        if (!new_s) {
+            /* NOTE: the socket table is full, the connection is not left behind without a socket */
+            errorf("sock_alloc() failure");
+            tcp_close(ret);
+            errno = ENFILE;
+            return -1;
+        }
         new_s->family = s->family;
         new_s->type = s->type;
         new_s->desc = ret;
@@ -264,7 +368,13 @@ sock_accept(int id, struct sockaddr *addr, int *addrlen)
 }
 
 int
-sock_connect(int id, const struct sockaddr *addr, int addrlen)
+sock_accept(int id, struct sockaddr *addr, int *addrlen)
+{
+    return sock_accept_flags(id, addr, addrlen, 0);
+}
+
+int
+sock_connect_flags(int id, const struct sockaddr *addr, int addrlen, int flags)
 {
     struct sock *s;
     struct ip_endpoint ep;
@@ -280,13 +390,19 @@ sock_connect(int id, const struct sockaddr *addr, int addrlen)
     case AF_INET:
         ep.addr = ((struct sockaddr_in *)addr)->sin_addr;
         ep.port = ((struct sockaddr_in *)addr)->sin_port;
-        return tcp_connect(s->desc, &ep);
+        return tcp_connect(s->desc, &ep, flags);
     }
     return -1;
 }
 
+int
+sock_connect(int id, const struct sockaddr *addr, int addrlen)
+{
+    return sock_connect_flags(id, addr, addrlen, 0);
+}
+
 ssize_t
-sock_recv(int id, void *buf, size_t n)
+sock_recv_flags(int id, void *buf, size_t n, int flags)
 {
     struct sock *s;
 
@@ -299,13 +415,19 @@ sock_recv(int id, void *buf, size_t n)
     }
     switch (s->family) {
     case AF_INET:
-        return tcp_receive(s->desc, (uint8_t *)buf, n);
+        return tcp_receive(s->desc, (uint8_t *)buf, n, flags);
     }
     return -1;
 }
 
 ssize_t
-sock_send(int id, const void *buf, size_t n)
+sock_recv(int id, void *buf, size_t n)
+{
+    return sock_recv_flags(id, buf, n, 0);
+}
+
+ssize_t
+sock_send_flags(int id, const void *buf, size_t n, int flags)
 {
     struct sock *s;
 
@@ -318,7 +440,490 @@ sock_send(int id, const void *buf, size_t n)
     }
     switch (s->family) {
     case AF_INET:
-        return tcp_send(s->desc, (uint8_t *)buf, n);
+        return tcp_send(s->desc, (uint8_t *)buf, n, flags);
+    }
+    return -1;
+}
+
+ssize_t
+sock_send(int id, const void *buf, size_t n)
+{
+    return sock_send_flags(id, buf, n, 0);
+}
+
+/* NOTE: the integer options, mapped to the ones of the TCP layer */
+static int
+sock_tcp_opt(int level, int optname)
+{
+    switch (level) {
+    case SOL_SOCKET:
+        switch (optname) {
+        case SO_SNDBUF:
+            return TCP_OPT_SNDBUF;
+        case SO_RCVBUF:
+            return TCP_OPT_RCVBUF;
+        }
+        break;
+    case IPPROTO_TCP:
+        switch (optname) {
+        case TCP_NODELAY:
+            return TCP_OPT_NODELAY;
+        case TCP_CORK:
+            return TCP_OPT_CORK;
+        case TCP_QUICKACK:
+            return TCP_OPT_QUICKACK;
+        }
+        break;
+    }
+    return -1;
+}
+
+int
+sock_setsockopt(int id, int level, int optname, const void *optval, int optlen)
+{
+    struct sock *s;
+    char name[TCP_CONG_NAME_MAX];
+    int opt;
+
+    s = sock_get(id);
+    if (!s) {
+        return -1;
+    }
+    if (s->type == SOCK_DGRAM && level == SOL_SOCKET && optname == SO_RCVBUF) {
+        if (optlen != sizeof(int)) {
+            return -1;
+        }
+        return udp_setopt(s->desc, UDP_OPT_RCVBUF, *(const int *)optval);
+    }
+    if (s->type != SOCK_STREAM) {
+        return -1;
+    }
+    if (level == IPPROTO_TCP && optname == TCP_CONGESTION) {
+        if (optlen <= 0 || optlen >= (int)sizeof(name)) {
+            return -1;
+        }
+        memcpy(name, optval, optlen);
+        name[optlen] = '\0';
+        return tcp_set_congestion(s->desc, name);
+    }
+    if (optlen != sizeof(int)) {
+        return -1;
+    }
+    opt = sock_tcp_opt(level, optname);
+    if (opt == -1) {
+        return -1;
+    }
+    return tcp_setopt(s->desc, opt, *(const int *)optval);
+}
+
+int
+sock_getsockopt(int id, int level, int optname, void *optval, int *optlen)
+{
+    struct sock *s;
+    char name[TCP_CONG_NAME_MAX];
+    struct tcp_info info;
+    int opt;
+
+    s = sock_get(id);
+    if (!s) {
+        return -1;
+    }
+    if (s->type == SOCK_DGRAM && level == SOL_SOCKET && optname == SO_RCVBUF) {
+        if (*optlen < (int)sizeof(int)) {
+            return -1;
+        }
+        *optlen = sizeof(int);
+        return udp_getopt(s->desc, UDP_OPT_RCVBUF, (int *)optval);
+    }
+    if (s->type != SOCK_STREAM) {
+        return -1;
+    }
+    if (level == IPPROTO_TCP && optname == TCP_CONGESTION) {
+        if (tcp_get_congestion(s->desc, name, sizeof(name)) == -1) {
+            return -1;
+        }
+        *optlen = MIN(*optlen, (int)strlen(name) + 1);
+        memcpy(optval, name, *optlen);
+        return 0;
+    }
+    if (level == IPPROTO_TCP && optname == TCP_INFO) {
+        if (tcp_get_info(s->desc, &info) == -1) {
+            return -1;
+        }
+        *optlen = MIN(*optlen, (int)sizeof(info));
+        memcpy(optval, &info, *optlen);
+        return 0;
+    }
+    if (*optlen < (int)sizeof(int)) {
+        return -1;
+    }
+    opt = sock_tcp_opt(level, optname);
+    if (opt == -1) {
+        return -1;
+    }
+    *optlen = sizeof(int);
+    return tcp_getopt(s->desc, opt, (int *)optval);
+}
+
+int
+sock_fcntl(int id, int cmd, int arg)
+{
+    struct sock *s;
+    int nonblock, ret = -1;
+
+    s = sock_get(id);
+    if (!s || !s->used) {
+        return -1;
+    }
+    switch (cmd) {
+    case F_GETFL:
+        return s->flags;
+    case F_SETFL:
+        nonblock = (arg & O_NONBLOCK) ? 1 : 0;
+        switch (s->type) {
+        case SOCK_STREAM:
+            ret = tcp_setopt(s->desc, TCP_OPT_NONBLOCK, nonblock);
+            break;
+        case SOCK_DGRAM:
+            ret = udp_setopt(s->desc, UDP_OPT_NONBLOCK, nonblock);
+            break;
+        }
+        if (ret == -1) {
+            return -1;
+        }
+        s->flags = arg & O_NONBLOCK;
+        return 0;
+    }
+    return -1;
+}
+
+static int
+sock_poll_events(int id)
+{
+    struct sock *s;
+
+    s = sock_get(id);
+    if (!s || !s->used) {
+        return POLLNVAL;
+    }
+    switch (s->type) {
+    case SOCK_STREAM:
+        return tcp_poll(s->desc);
+    case SOCK_DGRAM:
+        return udp_poll(s->desc);
+    }
+    return POLLNVAL;
+}
+
+int
+sock_watch(int id, struct sched_watch *watch, struct sched_poller *poller, void *arg)
+{
+    struct sock *s;
+
+    s = sock_get(id);
+    if (!s || !s->used) {
+        return -1;
+    }
+    switch (s->type) {
+    case SOCK_STREAM:
+        return tcp_watch(s->desc, watch, poller, arg);
+    case SOCK_DGRAM:
+        return udp_watch(s->desc, watch, poller, arg);
+    }
+    return -1;
+}
+
+static short
+sock_poll_revents(struct pollfd *pfd)
+{
+    if (pfd->fd < 0) {
+        return 0;
+    }
+    /* NOTE: errors are always reported */
+    return sock_poll_events(pfd->fd) & (pfd->events | POLLERR | POLLHUP | POLLNVAL);
+}
+
+static int
+sock_poll_scan(struct pollfd *fds, int nfds)
+{
+    int i, n = 0;
+
+    for (i = 0; i < nfds; i++) {
+        fds[i].revents = sock_poll_revents(&fds[i]);
+        if (fds[i].revents) {
+            n++;
+        }
+    }
+    return n;
+}
+
+static void
+sock_abstime(struct timespec *abstime, int timeout)
+{
+    clock_gettime(CLOCK_REALTIME, abstime);
+    abstime->tv_sec += timeout / 1000;
+    abstime->tv_nsec += (timeout % 1000) * 1000000;
+    if (abstime->tv_nsec >= 1000000000) {
+        abstime->tv_sec++;
+        abstime->tv_nsec -= 1000000000;
+    }
+}
+
+/*
+ * NOTE: timeout in milliseconds (-1: infinite, 0: no wait), same as poll(2).
+ *       while waiting, a watch is attached to each socket, only the sockets woken up are checked again.
+ */
+int
+sock_poll(struct pollfd *fds, int nfds, int timeout)
+{
+    struct timespec abstime;
+    struct sched_poller poller;
+    struct sched_watch *watches, *watch;
+    struct pollfd *pfd;
+    int i, n, ret;
+
+    n = sock_poll_scan(fds, nfds);
+    if (n || !timeout || nfds <= 0) {
+        return n;
+    }
+    if (timeout > 0) {
+        sock_abstime(&abstime, timeout);
+    }
+    watches = memory_alloc(sizeof(*watches) * nfds);
+    if (!watches) {
+        errorf("memory_alloc() failure");
+        return -1;
+    }
+    sched_poller_init(&poller);
+    for (i = 0; i < nfds; i++) {
+        if (fds[i].fd >= 0) {
+            /* NOTE: a socket which cannot be watched (e.g. closed) is reported by the next scan */
+            sock_watch(fds[i].fd, &watches[i], &poller, &fds[i]);
+        }
     }
+    /* NOTE: scanned again, the changes before attaching are not notified */
+    n = sock_poll_scan(fds, nfds);
+    while (!n) {
+        ret = sched_poller_wait(&poller, timeout > 0 ? &abstime : NULL);
+        if (ret) {
+            n = ret == -1 ? -1 : 0;
+            break;
+        }
+        while ((watch = sched_poller_take(&poller)) != NULL) {
+            pfd = watch->arg;
+            if (!pfd->revents) {
+                pfd->revents = sock_poll_revents(pfd);
+                if (pfd->revents) {
+                    n++;
+                }
+            }
+        }
+    }
+    for (i = 0; i < nfds; i++) {
+        sched_watch_detach(&watches[i]);
+    }
+    sched_poller_destroy(&poller);
+    memory_free(watches);
+    return n;
+}
+
+/* NOTE: an interest of sock_epoll, checked only while on the ready list */
+struct sock_epoll_item {
+    struct sched_watch watch;
+    int fd;
+    struct epoll_event event;
+    int ready; /* on the ready list */
+    struct sock_epoll_item *prev;
+    struct sock_epoll_item *next;
+};
+
+struct sock_epoll {
+    struct sched_poller poller;
+    struct sock_epoll_item *items[countof(socks)]; /* indexed by fd */
+    struct sock_epoll_item *head; /* the ready list, the items notified since the last check or reported by it */
+    struct sock_epoll_item *tail;
+    int ready_num;
+};
+
+static void
+sock_epoll_ready_push(struct sock_epoll *ep, struct sock_epoll_item *item)
+{
+    if (item->ready) {
+        return;
+    }
+    item->ready = 1;
+    item->next = NULL;
+    item->prev = ep->tail;
+    if (ep->tail) {
+        ep->tail->next = item;
+    } else {
+        ep->head = item;
+    }
+    ep->tail = item;
+    ep->ready_num++;
+}
+
+static void
+sock_epoll_ready_remove(struct sock_epoll *ep, struct sock_epoll_item *item)
+{
+    if (!item->ready) {
+        return;
+    }
+    item->ready = 0;
+    if (item->prev) {
+        item->prev->next = item->next;
+    } else {
+        ep->head = item->next;
+    }
+    if (item->next) {
+        item->next->prev = item->prev;
+    } else {
+        ep->tail = item->prev;
+    }
+    ep->ready_num--;
+}
+
+static void
+sock_epoll_item_free(struct sock_epoll *ep, struct sock_epoll_item *item)
+{
+    sched_watch_detach(&item->watch);
+    sock_epoll_ready_remove(ep, item);
+    ep->items[item->fd] = NULL;
+    memory_free(item);
+}
+
+struct sock_epoll *
+sock_epoll_create(void)
+{
+    struct sock_epoll *ep;
+
+    ep = memory_alloc(sizeof(*ep));
+    if (!ep) {
+        errorf("memory_alloc() failure");
+        return NULL;
+    }
+    sched_poller_init(&ep->poller);
+    return ep;
+}
+
+void
+sock_epoll_close(struct sock_epoll *ep)
+{
+    int i;
+
+    for (i = 0; i < (int)countof(ep->items); i++) {
+        if (ep->items[i]) {
+            sock_epoll_item_free(ep, ep->items[i]);
+        }
+    }
+    sched_poller_destroy(&ep->poller);
+    memory_free(ep);
+}
+
+int
+sock_epoll_ctl(struct sock_epoll *ep, int op, int fd, struct epoll_event *event)
+{
+    struct sock_epoll_item *item;
+
+    if (fd < 0 || fd >= (int)countof(ep->items)) {
+        errno = EBADF;
+        return -1;
+    }
+    item = ep->items[fd];
+    switch (op) {
+    case EPOLL_CTL_ADD:
+        if (item) {
+            errno = EEXIST;
+            return -1;
+        }
+        item = memory_alloc(sizeof(*item));
+        if (!item) {
+            errorf("memory_alloc() failure");
+            errno = ENOMEM;
+            return -1;
+        }
+        item->fd = fd;
+        item->event = *event;
+        if (sock_watch(fd, &item->watch, &ep->poller, item) == -1) {
+            memory_free(item);
+            errno = EBADF;
+            return -1;
+        }
+        ep->items[fd] = item;
+        /* NOTE: checked by the next sock_epoll_wait(), the changes before attaching are not notified */
+        sock_epoll_ready_push(ep, item);
+        return 0;
+    case EPOLL_CTL_MOD:
+        if (!item) {
+            errno = ENOENT;
+            return -1;
+        }
+        item->event = *event;
+        sock_epoll_ready_push(ep, item);
+        return 0;
+    case EPOLL_CTL_DEL:
+        if (!item) {
+            errno = ENOENT;
+            return -1;
+        }
+        sock_epoll_item_free(ep, item);
+        return 0;
+    }
+    errno = EINVAL;
     return -1;
 }
+
+/*
+ * NOTE: level-triggered, timeout in milliseconds (-1: infinite, 0: no wait), same as epoll_wait(2).
+ *       only the items on the ready list are checked, a reported one stays there (moved to the tail),
+ *       one not ready any more leaves it until the next notification.
+ */
+int
+sock_epoll_wait(struct sock_epoll *ep, struct epoll_event *events, int maxevents, int timeout)
+{
+    struct timespec abstime;
+    struct sched_watch *watch;
+    struct sock_epoll_item *item;
+    int num, n = 0, revents, ret;
+
+    if (maxevents <= 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (timeout > 0) {
+        sock_abstime(&abstime, timeout);
+    }
+    while (1) {
+        while ((watch = sched_poller_take(&ep->poller)) != NULL) {
+            sock_epoll_ready_push(ep, watch->arg);
+        }
+        for (num = ep->ready_num; num && n < maxevents; num--) {
+            item = ep->head;
+            sock_epoll_ready_remove(ep, item);
+            revents = sock_poll_events(item->fd);
+            if (revents & POLLNVAL) {
+                /* NOTE: closed without EPOLL_CTL_DEL, forgotten silently as epoll(7) does */
+                sock_epoll_item_free(ep, item);
+                continue;
+            }
+            /* NOTE: errors are always reported */
+            revents &= item->event.events | EPOLLERR | EPOLLHUP;
+            if (revents) {
+                events[n].events = revents;
+                events[n].data = item->event.data;
+                n++;
+                sock_epoll_ready_push(ep, item);
+            }
+        }
+        if (n || !timeout) {
+            return n;
+        }
+        ret = sched_poller_wait(&ep->poller, timeout > 0 ? &abstime : NULL);
+        if (ret == -1) {
+            return -1;
+        }
+        if (ret == ETIMEDOUT) {
+            return 0;
+        }
+    }
+}
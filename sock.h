@@ -22,15 +22,56 @@
 #define IPPROTO_TCP 0
 #define IPPROTO_UDP 0
 
+#define SOL_SOCKET 1
+
+#define SO_SNDBUF 7
+#define SO_RCVBUF 8
+
+/* level IPPROTO_TCP */
+#define TCP_NODELAY 1
+#define TCP_CORK 3
+#define TCP_INFO 11 /* struct tcp_info (tcp.h), read only */
+#define TCP_QUICKACK 12
+#define TCP_CONGESTION 13
+
 #define INADDR_ANY ((ip_addr_t)0)
 
+/* sock_fcntl() */
+#define F_GETFL 3
+#define F_SETFL 4
+
+#define O_NONBLOCK 04000
+
+/* sock_*_flags(), for the call only (O_NONBLOCK of the socket is not changed) */
+#define MSG_DONTWAIT NET_MSG_DONTWAIT
+
+/* sock_poll() */
+#define POLLIN   NET_POLL_IN
+#define POLLOUT  NET_POLL_OUT
+#define POLLERR  NET_POLL_ERR
+#define POLLHUP  NET_POLL_HUP
+#define POLLNVAL 0x0020
+
+/* sock_epoll_ctl() */
+#define EPOLL_CTL_ADD 1
+#define EPOLL_CTL_DEL 2
+#define EPOLL_CTL_MOD 3
+
+#define EPOLLIN  POLLIN
+#define EPOLLOUT POLLOUT
+#define EPOLLERR POLLERR
+#define EPOLLHUP POLLHUP
+
 #define SOCKADDR_STR_LEN IP_ENDPOINT_STR_LEN
 
+#define SOCK_MAX 4096 /* NOTE: enough for multiplexing thousands of connections with sock_poll() */
+
 struct sock {
     int used;
     int family;
     int type;
     int desc;
+    int flags; /* O_NONBLOCK */
 };
 
 struct sockaddr {
@@ -44,6 +85,36 @@ struct sockaddr_in {
     ip_addr_t sin_addr;
 };
 
+struct pollfd {
+    int fd;
+    short events;
+    short revents;
+};
+
+union epoll_data {
+    void *ptr;
+    int fd;
+    uint32_t u32;
+    uint64_t u64;
+};
+
+struct epoll_event {
+    uint32_t events;
+    union epoll_data data;
+};
+
+/* NOTE: the interest list and the ready list of a sock_epoll are used by one application thread */
+struct sock_epoll;
+
+/* for sock_sendmmsg() and sock_recvmmsg(), a flattened version of the one in Linux (single buffer) */
+struct mmsghdr {
+    void *msg_buf;
+    size_t msg_size; /* the length to send, or the size of the receive buffer */
+    struct sockaddr *msg_name;
+    int msg_namelen;
+    unsigned int msg_len; /* the number of bytes sent or received */
+};
+
 #define IFNAMSIZ 16
 
 extern int
@@ -60,6 +131,10 @@ sock_recvfrom(int id, void *buf, size_t n, struct sockaddr *addr, int *addrlen);
 extern ssize_t
 sock_sendto(int id, const void *buf, size_t n, const struct sockaddr *addr, int addrlen);
 extern int
+sock_recvmmsg(int id, struct mmsghdr *msgvec, unsigned int vlen);
+extern int
+sock_sendmmsg(int id, struct mmsghdr *msgvec, unsigned int vlen);
+extern int
 sock_bind(int id, const struct sockaddr *addr, int addrlen);
 extern int
 sock_listen(int id, int backlog);
@@ -71,5 +146,35 @@ extern ssize_t
 sock_recv(int id, void *buf, size_t n);
 extern ssize_t
 sock_send(int id, const void *buf, size_t n);
+/* NOTE: the same as the ones above with the flags (MSG_DONTWAIT) */
+extern ssize_t
+sock_recvfrom_flags(int id, void *buf, size_t n, int flags, struct sockaddr *addr, int *addrlen);
+extern int
+sock_accept_flags(int id, struct sockaddr *addr, int *addrlen, int flags);
+extern int
+sock_connect_flags(int id, const struct sockaddr *addr, int addrlen, int flags);
+extern ssize_t
+sock_recv_flags(int id, void *buf, size_t n, int flags);
+extern ssize_t
+sock_send_flags(int id, const void *buf, size_t n, int flags);
+extern int
+sock_setsockopt(int id, int level, int optname, const void *optval, int optlen);
+extern int
+sock_getsockopt(int id, int level, int optname, void *optval, int *optlen);
+extern int
+sock_fcntl(int id, int cmd, int arg);
+extern int
+sock_poll(struct pollfd *fds, int nfds, int timeout);
+/* NOTE: for sock_ring (see tcp_watch(), udp_watch()) */
+extern int
+sock_watch(int id, struct sched_watch *watch, struct sched_poller *poller, void *arg);
+extern struct sock_epoll *
+sock_epoll_create(void);
+extern int
+sock_epoll_ctl(struct sock_epoll *ep, int op, int fd, struct epoll_event *event);
+extern int
+sock_epoll_wait(struct sock_epoll *ep, struct epoll_event *events, int maxevents, int timeout);
+extern void
+sock_epoll_close(struct sock_epoll *ep);
 
 #endif
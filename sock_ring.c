@@ -0,0 +1,407 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+
+#include "platform.h"
+
+#include "util.h"
+#include "sock.h"
+#include "sock_ring.h"
+
+/* an operation submitted but not completed yet */
+struct sock_ring_op {
+    struct sock_sqe sqe;
+    int started; /* CONNECT: the SYN has been sent, waiting for the result */
+    struct sock_ring_op *next; /* in the queue of the socket, or the free list */
+};
+
+/*
+ * NOTE: a socket with operations in flight, the watch is attached while any is queued.
+ *       the operations in each direction are retried from the head when the socket is woken up.
+ */
+struct sock_ring_file {
+    int fd;
+    struct sched_watch watch;
+    struct sock_ring_op *head[2];
+    struct sock_ring_op *tail[2];
+};
+
+struct sock_ring {
+    unsigned int sq_entries;
+    unsigned int sq_head; /* NOTE: advanced by sock_ring_submit() */
+    unsigned int sq_tail; /* NOTE: advanced by sock_ring_get_sqe() */
+    struct sock_sqe *sqes;
+    unsigned int cq_entries;
+    unsigned int cq_head; /* NOTE: advanced by sock_ring_cqe_seen() */
+    unsigned int cq_tail;
+    struct sock_cqe *cqes;
+    struct sock_ring_op *ops;
+    struct sock_ring_op *free;
+    unsigned int op_num; /* in flight */
+    struct sched_poller poller;
+    struct sock_ring_file *files[SOCK_MAX]; /* indexed by fd */
+};
+
+struct sock_ring *
+sock_ring_open(unsigned int entries)
+{
+    struct sock_ring *ring;
+    unsigned int n = 1, i;
+
+    if (!entries || entries > SOCK_RING_ENTRIES_MAX) {
+        errorf("out of range, entries=%u", entries);
+        return NULL;
+    }
+    /* NOTE: rounded up to a power of two, the indexes are masked */
+    while (n < entries) {
+        n <<= 1;
+    }
+    ring = memory_alloc(sizeof(*ring));
+    if (!ring) {
+        errorf("memory_alloc() failure");
+        return NULL;
+    }
+    ring->sq_entries = n;
+    /* NOTE: the completion queue is twice as large, more operations can be in flight than queued */
+    ring->cq_entries = n * 2;
+    ring->sqes = memory_alloc(sizeof(*ring->sqes) * ring->sq_entries);
+    ring->cqes = memory_alloc(sizeof(*ring->cqes) * ring->cq_entries);
+    ring->ops = memory_alloc(sizeof(*ring->ops) * ring->cq_entries);
+    sched_poller_init(&ring->poller);
+    if (!ring->sqes || !ring->cqes || !ring->ops) {
+        errorf("memory_alloc() failure");
+        sock_ring_close(ring);
+        return NULL;
+    }
+    for (i = 0; i < ring->cq_entries; i++) {
+        ring->ops[i].next = ring->free;
+        ring->free = &ring->ops[i];
+    }
+    return ring;
+}
+
+static void
+sock_ring_file_free(struct sock_ring *ring, struct sock_ring_file *file)
+{
+    sched_watch_detach(&file->watch);
+    ring->files[file->fd] = NULL;
+    memory_free(file);
+}
+
+/* NOTE: the operations not completed yet are discarded */
+void
+sock_ring_close(struct sock_ring *ring)
+{
+    int i;
+
+    for (i = 0; i < (int)countof(ring->files); i++) {
+        if (ring->files[i]) {
+            sock_ring_file_free(ring, ring->files[i]);
+        }
+    }
+    memory_free(ring->sqes);
+    memory_free(ring->cqes);
+    memory_free(ring->ops);
+    sched_poller_destroy(&ring->poller);
+    memory_free(ring);
+}
+
+struct sock_sqe *
+sock_ring_get_sqe(struct sock_ring *ring)
+{
+    struct sock_sqe *sqe;
+
+    if (ring->sq_tail - ring->sq_head == ring->sq_entries) {
+        /* full, submit first */
+        return NULL;
+    }
+    sqe = &ring->sqes[ring->sq_tail & (ring->sq_entries - 1)];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_tail++;
+    return sqe;
+}
+
+static void
+sock_ring_complete(struct sock_ring *ring, struct sock_sqe *sqe, ssize_t res)
+{
+    struct sock_cqe *cqe;
+
+    /* NOTE: never overflows, sock_ring_submit() limits the operations in flight */
+    cqe = &ring->cqes[ring->cq_tail & (ring->cq_entries - 1)];
+    cqe->user_data = sqe->user_data;
+    cqe->res = res;
+    ring->cq_tail++;
+}
+
+static ssize_t
+sock_ring_result(ssize_t ret)
+{
+    if (ret == -1) {
+        return errno ? -errno : -EIO;
+    }
+    return ret;
+}
+
+/* NOTE: operations on the same socket in the same direction complete in the submission order */
+static int
+sock_ring_op_class(int op)
+{
+    switch (op) {
+    case SOCK_RING_OP_RECV:
+    case SOCK_RING_OP_RECVFROM:
+    case SOCK_RING_OP_ACCEPT:
+        return 0;
+    case SOCK_RING_OP_SEND:
+    case SOCK_RING_OP_SENDTO:
+    case SOCK_RING_OP_CONNECT:
+        return 1;
+    }
+    return -1;
+}
+
+/* NOTE: returns 1 if completed, 0 if it would block (kept in the ring) */
+static int
+sock_ring_issue(struct sock_ring *ring, struct sock_ring_op *op)
+{
+    struct sock_sqe *sqe = &op->sqe;
+    struct sockaddr_in dummy;
+    struct pollfd pfd;
+    int addrlen = sizeof(dummy);
+    ssize_t ret = 0;
+
+    /* NOTE: never sleeps, the mode of the socket (O_NONBLOCK) is left to the application */
+    errno = 0;
+    switch (sqe->op) {
+    case SOCK_RING_OP_NOP:
+        break;
+    case SOCK_RING_OP_RECV:
+        ret = sock_recv_flags(sqe->fd, sqe->buf, sqe->len, MSG_DONTWAIT);
+        break;
+    case SOCK_RING_OP_SEND:
+        ret = sock_send_flags(sqe->fd, sqe->buf, sqe->len, MSG_DONTWAIT);
+        break;
+    case SOCK_RING_OP_RECVFROM:
+        ret = sock_recvfrom_flags(sqe->fd, sqe->buf, sqe->len, MSG_DONTWAIT,
+            sqe->addr ? sqe->addr : (struct sockaddr *)&dummy, sqe->addrlen ? sqe->addrlen : &addrlen);
+        break;
+    case SOCK_RING_OP_SENDTO:
+        ret = sock_sendto(sqe->fd, sqe->buf, sqe->len, sqe->addr, sqe->addrlen ? *sqe->addrlen : 0);
+        break;
+    case SOCK_RING_OP_ACCEPT:
+        ret = sock_accept_flags(sqe->fd,
+            sqe->addr ? sqe->addr : (struct sockaddr *)&dummy, sqe->addrlen ? sqe->addrlen : &addrlen, MSG_DONTWAIT);
+        break;
+    case SOCK_RING_OP_CONNECT:
+        if (!op->started) {
+            ret = sock_connect_flags(sqe->fd, sqe->addr, sqe->addrlen ? *sqe->addrlen : 0, MSG_DONTWAIT);
+            if (ret == -1 && errno == EINPROGRESS) {
+                op->started = 1;
+                return 0;
+            }
+            ret = ret == -1 ? -1 : 0;
+            break;
+        }
+        pfd.fd = sqe->fd;
+        pfd.events = POLLOUT;
+        sock_poll(&pfd, 1, 0);
+        if (!pfd.revents) {
+            return 0;
+        }
+        if (pfd.revents & (POLLERR | POLLHUP | POLLNVAL)) {
+            sock_ring_complete(ring, sqe, -ECONNREFUSED);
+            return 1;
+        }
+        break;
+    default:
+        sock_ring_complete(ring, sqe, -EINVAL);
+        return 1;
+    }
+    if (ret == -1 && errno == EAGAIN) {
+        return 0;
+    }
+    sock_ring_complete(ring, sqe, sock_ring_result(ret));
+    return 1;
+}
+
+static void
+sock_ring_op_free(struct sock_ring *ring, struct sock_ring_op *op)
+{
+    op->next = ring->free;
+    ring->free = op;
+    ring->op_num--;
+}
+
+/* NOTE: retry the operations at the heads of the queues, the socket is forgotten once all are completed */
+static void
+sock_ring_file_process(struct sock_ring *ring, struct sock_ring_file *file)
+{
+    struct sock_ring_op *op;
+    int class;
+
+    for (class = 0; class < 2; class++) {
+        while ((op = file->head[class]) != NULL) {
+            if (!sock_ring_issue(ring, op)) {
+                break;
+            }
+            file->head[class] = op->next;
+            if (!file->head[class]) {
+                file->tail[class] = NULL;
+            }
+            sock_ring_op_free(ring, op);
+        }
+    }
+    if (!file->head[0] && !file->head[1]) {
+        sock_ring_file_free(ring, file);
+    }
+}
+
+/* NOTE: the watch is attached before the first try, a change after that is not missed */
+static struct sock_ring_file *
+sock_ring_file_get(struct sock_ring *ring, int fd)
+{
+    struct sock_ring_file *file;
+
+    if (fd < 0 || fd >= (int)countof(ring->files)) {
+        return NULL;
+    }
+    file = ring->files[fd];
+    if (file) {
+        return file;
+    }
+    file = memory_alloc(sizeof(*file));
+    if (!file) {
+        errorf("memory_alloc() failure");
+        return NULL;
+    }
+    file->fd = fd;
+    if (sock_watch(fd, &file->watch, &ring->poller, file) == -1) {
+        memory_free(file);
+        return NULL;
+    }
+    ring->files[fd] = file;
+    return file;
+}
+
+static void
+sock_ring_queue(struct sock_ring *ring, struct sock_ring_op *op)
+{
+    struct sock_ring_file *file;
+    int class;
+
+    class = sock_ring_op_class(op->sqe.op);
+    if (class == -1) {
+        /* NOTE: NOP (or an unknown one) completes at once */
+        sock_ring_issue(ring, op);
+        sock_ring_op_free(ring, op);
+        return;
+    }
+    file = sock_ring_file_get(ring, op->sqe.fd);
+    if (!file) {
+        /* NOTE: cannot be watched (e.g. released by the peer), the result of the try is reported */
+        if (!sock_ring_issue(ring, op)) {
+            sock_ring_complete(ring, &op->sqe, -EBADF);
+        }
+        sock_ring_op_free(ring, op);
+        return;
+    }
+    op->next = NULL;
+    if (file->tail[class]) {
+        /* NOTE: waits for the earlier ones, retried when they are completed */
+        file->tail[class]->next = op;
+        file->tail[class] = op;
+        return;
+    }
+    file->head[class] = file->tail[class] = op;
+    sock_ring_file_process(ring, file);
+}
+
+/* NOTE: retry the operations on the sockets woken up since the last call */
+static void
+sock_ring_process(struct sock_ring *ring)
+{
+    struct sched_watch *watch;
+
+    while ((watch = sched_poller_take(&ring->poller)) != NULL) {
+        sock_ring_file_process(ring, watch->arg);
+    }
+}
+
+/* NOTE: returns the number of entries submitted, the rest stays in the queue while too many are in flight */
+int
+sock_ring_submit(struct sock_ring *ring)
+{
+    struct sock_ring_op *op;
+    int n = 0;
+
+    sock_ring_process(ring);
+    while (ring->sq_head != ring->sq_tail) {
+        if (ring->op_num + (ring->cq_tail - ring->cq_head) >= ring->cq_entries) {
+            break;
+        }
+        op = ring->free;
+        ring->free = op->next;
+        ring->op_num++;
+        op->sqe = ring->sqes[ring->sq_head & (ring->sq_entries - 1)];
+        op->started = 0;
+        ring->sq_head++;
+        sock_ring_queue(ring, op);
+        n++;
+    }
+    return n;
+}
+
+/*
+ * NOTE: wait until at least min completions are available, timeout in milliseconds (-1: infinite, 0: no wait).
+ *       returns the number of completions available (may be less than min on the timeout), -1 if interrupted.
+ */
+int
+sock_ring_wait(struct sock_ring *ring, unsigned int min, int timeout)
+{
+    struct timespec abstime;
+    int ret;
+
+    if (timeout > 0) {
+        clock_gettime(CLOCK_REALTIME, &abstime);
+        abstime.tv_sec += timeout / 1000;
+        abstime.tv_nsec += (timeout % 1000) * 1000000;
+        if (abstime.tv_nsec >= 1000000000) {
+            abstime.tv_sec++;
+            abstime.tv_nsec -= 1000000000;
+        }
+    }
+    min = MIN(min, ring->op_num + (ring->cq_tail - ring->cq_head));
+    while (1) {
+        sock_ring_process(ring);
+        if (ring->cq_tail - ring->cq_head >= min || !timeout) {
+            break;
+        }
+        ret = sched_poller_wait(&ring->poller, timeout > 0 ? &abstime : NULL);
+        if (ret == -1) {
+            return -1;
+        }
+        if (ret == ETIMEDOUT) {
+            sock_ring_process(ring);
+            break;
+        }
+    }
+    return ring->cq_tail - ring->cq_head;
+}
+
+struct sock_cqe *
+sock_ring_peek_cqe(struct sock_ring *ring)
+{
+    if (ring->cq_head == ring->cq_tail) {
+        return NULL;
+    }
+    return &ring->cqes[ring->cq_head & (ring->cq_entries - 1)];
+}
+
+void
+sock_ring_cqe_seen(struct sock_ring *ring)
+{
+    if (ring->cq_head != ring->cq_tail) {
+        ring->cq_head++;
+    }
+}
@@ -0,0 +1,65 @@
+#ifndef SOCK_RING_H
+#define SOCK_RING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "sock.h"
+
+#define SOCK_RING_OP_NOP      0
+#define SOCK_RING_OP_RECV     1
+#define SOCK_RING_OP_SEND     2
+#define SOCK_RING_OP_RECVFROM 3
+#define SOCK_RING_OP_SENDTO   4
+#define SOCK_RING_OP_ACCEPT   5
+#define SOCK_RING_OP_CONNECT  6
+
+#define SOCK_RING_ENTRIES_MAX 4096
+
+/*
+ * Submission/Completion Ring
+ *
+ * NOTE: The application queues operations with sock_ring_get_sqe() and sock_ring_submit(), and
+ *       reaps the results with sock_ring_wait() and sock_ring_peek_cqe(). An operation that cannot
+ *       complete right away is kept in the ring and retried only when its socket is woken up (the
+ *       same watch as sock_poll()), no thread is needed per operation. A ring is used by one
+ *       application thread, the operations never sleep (MSG_DONTWAIT), the mode of the sockets
+ *       (O_NONBLOCK) is not changed.
+ */
+
+/* submission queue entry, the buffers (and addr) must stay valid until the completion */
+struct sock_sqe {
+    int op;
+    int fd;
+    void *buf;
+    size_t len;
+    struct sockaddr *addr; /* RECVFROM, SENDTO, ACCEPT, CONNECT */
+    int *addrlen;
+    uint64_t user_data;
+};
+
+/* completion queue entry */
+struct sock_cqe {
+    uint64_t user_data;
+    ssize_t res; /* the return value of the operation, or -errno */
+};
+
+struct sock_ring;
+
+extern struct sock_ring *
+sock_ring_open(unsigned int entries);
+extern void
+sock_ring_close(struct sock_ring *ring);
+extern struct sock_sqe *
+sock_ring_get_sqe(struct sock_ring *ring);
+extern int
+sock_ring_submit(struct sock_ring *ring);
+extern int
+sock_ring_wait(struct sock_ring *ring, unsigned int min, int timeout);
+extern struct sock_cqe *
+sock_ring_peek_cqe(struct sock_ring *ring);
+extern void
+sock_ring_cqe_seen(struct sock_ring *ring);
+
+#endif
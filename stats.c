@@ -0,0 +1,245 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "platform.h"
+
+#include "util.h"
+#include "net.h"
+#include "stats.h"
+
+struct stats_slot stats_slots[STATS_SLOT_NUM];
+__thread unsigned int stats_self;
+
+static unsigned int slot_next;
+
+static const char *names[STATS_NUM] = {
+    [STATS_NET_IN_UNKNOWN_PROTOS] = "net.InUnknownProtos",
+    [STATS_NET_IN_DROPS]          = "net.InDrops",
+    [STATS_NET_GRO_MERGED]        = "net.GroMerged",
+    [STATS_NET_GSO_SEGMENTS]      = "net.GsoSegments",
+    [STATS_ARP_IN_REQUESTS]       = "arp.InRequests",
+    [STATS_ARP_IN_REPLIES]        = "arp.InReplies",
+    [STATS_ARP_IN_ERRORS]         = "arp.InErrors",
+    [STATS_ARP_OUT_REQUESTS]      = "arp.OutRequests",
+    [STATS_ARP_OUT_REPLIES]       = "arp.OutReplies",
+    [STATS_ARP_MISSES]            = "arp.Misses",
+    [STATS_ARP_TIMEOUTS]          = "arp.Timeouts",
+    [STATS_ARP_PENDING_DROPS]     = "arp.PendingDrops",
+    [STATS_IP_IN_RECEIVES]        = "ip.InReceives",
+    [STATS_IP_IN_HDR_ERRORS]      = "ip.InHdrErrors",
+    [STATS_IP_IN_ADDR_ERRORS]     = "ip.InAddrErrors",
+    [STATS_IP_IN_UNKNOWN_PROTOS]  = "ip.InUnknownProtos",
+    [STATS_IP_IN_DELIVERS]        = "ip.InDelivers",
+    [STATS_IP_OUT_REQUESTS]       = "ip.OutRequests",
+    [STATS_IP_OUT_NO_ROUTES]      = "ip.OutNoRoutes",
+    [STATS_IP_OUT_DISCARDS]       = "ip.OutDiscards",
+    [STATS_IP_REASM_REQDS]        = "ip.ReasmReqds",
+    [STATS_IP_REASM_OKS]          = "ip.ReasmOKs",
+    [STATS_IP_REASM_FAILS]        = "ip.ReasmFails",
+    [STATS_IP_FRAG_OKS]           = "ip.FragOKs",
+    [STATS_IP_FRAG_FAILS]         = "ip.FragFails",
+    [STATS_IP_FRAG_CREATES]       = "ip.FragCreates",
+    [STATS_ICMP_IN_MSGS]          = "icmp.InMsgs",
+    [STATS_ICMP_IN_ERRORS]        = "icmp.InErrors",
+    [STATS_ICMP_OUT_MSGS]         = "icmp.OutMsgs",
+    [STATS_ICMP_OUT_ERRORS]       = "icmp.OutErrors",
+    [STATS_UDP_IN_DATAGRAMS]      = "udp.InDatagrams",
+    [STATS_UDP_NO_PORTS]          = "udp.NoPorts",
+    [STATS_UDP_IN_ERRORS]         = "udp.InErrors",
+    [STATS_UDP_IN_CSUM_ERRORS]    = "udp.InCsumErrors",
+    [STATS_UDP_RCVBUF_ERRORS]     = "udp.RcvbufErrors",
+    [STATS_UDP_OUT_DATAGRAMS]     = "udp.OutDatagrams",
+    [STATS_TCP_ACTIVE_OPENS]      = "tcp.ActiveOpens",
+    [STATS_TCP_PASSIVE_OPENS]     = "tcp.PassiveOpens",
+    [STATS_TCP_ATTEMPT_FAILS]     = "tcp.AttemptFails",
+    [STATS_TCP_ESTAB_RESETS]      = "tcp.EstabResets",
+    [STATS_TCP_IN_SEGS]           = "tcp.InSegs",
+    [STATS_TCP_OUT_SEGS]          = "tcp.OutSegs",
+    [STATS_TCP_RETRANS_SEGS]      = "tcp.RetransSegs",
+    [STATS_TCP_IN_ERRS]           = "tcp.InErrs",
+    [STATS_TCP_IN_CSUM_ERRORS]    = "tcp.InCsumErrors",
+    [STATS_TCP_OUT_RSTS]          = "tcp.OutRsts",
+    [STATS_TCP_FAST_RETRANS]      = "tcp.FastRetrans",
+    [STATS_TCP_TIMEOUTS]          = "tcp.Timeouts",
+    [STATS_TCP_PAWS_DROPS]        = "tcp.PAWSDrops",
+};
+
+static const char *dev_names[STATS_DEV_NUM] = {
+    [STATS_DEV_RX_PACKETS] = "rx_packets",
+    [STATS_DEV_RX_BYTES]   = "rx_bytes",
+    [STATS_DEV_RX_DROPS]   = "rx_drops",
+    [STATS_DEV_TX_PACKETS] = "tx_packets",
+    [STATS_DEV_TX_BYTES]   = "tx_bytes",
+    [STATS_DEV_TX_ERRORS]  = "tx_errors",
+};
+
+static const char *hist_names[STATS_HIST_NUM] = {
+    [STATS_HIST_SOFTIRQ]   = "softirq (ns)",
+    [STATS_HIST_QUEUE]     = "queue residence (ns)",
+    [STATS_HIST_QUEUE_LEN] = "queue length",
+};
+
+unsigned int
+stats_slot_assign(void)
+{
+    unsigned int index;
+
+    index = __atomic_fetch_add(&slot_next, 1, __ATOMIC_RELAXED) % STATS_SLOT_NUM;
+    stats_self = index + 1;
+    return index;
+}
+
+/* NOTE: nanoseconds (CLOCK_MONOTONIC, vDSO) */
+uint64_t
+stats_clock(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static unsigned int
+stats_hist_bucket(uint64_t value)
+{
+    unsigned int msb, shift;
+
+    if (value < (1 << STATS_HIST_SUB_BITS)) {
+        return value;
+    }
+    msb = 63 - __builtin_clzll(value);
+    if (msb > STATS_HIST_MSB_MAX) {
+        return STATS_HIST_BUCKETS - 1;
+    }
+    shift = msb - STATS_HIST_SUB_BITS;
+    return (shift + 1) << STATS_HIST_SUB_BITS | ((value >> shift) & ((1 << STATS_HIST_SUB_BITS) - 1));
+}
+
+/* NOTE: the lowest value of the bucket */
+uint64_t
+stats_hist_value(unsigned int bucket)
+{
+    unsigned int shift;
+
+    if (bucket < (1 << STATS_HIST_SUB_BITS)) {
+        return bucket;
+    }
+    shift = (bucket >> STATS_HIST_SUB_BITS) - 1;
+    return (uint64_t)((bucket & ((1 << STATS_HIST_SUB_BITS) - 1)) | (1 << STATS_HIST_SUB_BITS)) << shift;
+}
+
+void
+stats_hist_record(unsigned int id, uint64_t value)
+{
+    struct stats_slot *slot;
+
+    slot = &stats_slots[stats_slot()];
+    __atomic_fetch_add(&slot->hist[id][stats_hist_bucket(value)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&slot->hist_count[id], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&slot->hist_sum[id], value, __ATOMIC_RELAXED);
+}
+
+struct stats_dev *
+stats_dev_alloc(void)
+{
+    struct stats_dev *stats;
+
+    stats = aligned_alloc(STATS_CACHELINE_SIZE, sizeof(*stats) * STATS_SLOT_NUM);
+    if (!stats) {
+        return NULL;
+    }
+    memset(stats, 0, sizeof(*stats) * STATS_SLOT_NUM);
+    return stats;
+}
+
+/* NOTE: the counters are not taken at once, each of them may be a little behind the others */
+void
+stats_get(uint64_t *counters)
+{
+    unsigned int i, id;
+
+    memset(counters, 0, sizeof(*counters) * STATS_NUM);
+    for (i = 0; i < STATS_SLOT_NUM; i++) {
+        for (id = 0; id < STATS_NUM; id++) {
+            counters[id] += __atomic_load_n(&stats_slots[i].counters[id], __ATOMIC_RELAXED);
+        }
+    }
+}
+
+void
+stats_dev_get(struct net_device *dev, uint64_t *counters)
+{
+    unsigned int i, id;
+
+    memset(counters, 0, sizeof(*counters) * STATS_DEV_NUM);
+    for (i = 0; i < STATS_SLOT_NUM; i++) {
+        for (id = 0; id < STATS_DEV_NUM; id++) {
+            counters[id] += __atomic_load_n(&dev->stats[i].counters[id], __ATOMIC_RELAXED);
+        }
+    }
+}
+
+void
+stats_hist_get(unsigned int id, struct stats_hist *hist)
+{
+    unsigned int i, b;
+
+    memset(hist, 0, sizeof(*hist));
+    for (i = 0; i < STATS_SLOT_NUM; i++) {
+        for (b = 0; b < STATS_HIST_BUCKETS; b++) {
+            hist->buckets[b] += __atomic_load_n(&stats_slots[i].hist[id][b], __ATOMIC_RELAXED);
+        }
+        hist->sum += __atomic_load_n(&stats_slots[i].hist_sum[id], __ATOMIC_RELAXED);
+    }
+    /* NOTE: counted from the buckets to be consistent with them */
+    for (b = 0; b < STATS_HIST_BUCKETS; b++) {
+        hist->count += hist->buckets[b];
+    }
+}
+
+/* NOTE: the highest value of the bucket the percentile (0-100) falls in, 0 if empty */
+uint64_t
+stats_hist_percentile(const struct stats_hist *hist, double percentile)
+{
+    uint64_t rank, seen = 0;
+    unsigned int b;
+
+    if (!hist->count) {
+        return 0;
+    }
+    rank = (uint64_t)(hist->count * percentile / 100);
+    if (rank >= hist->count) {
+        rank = hist->count - 1;
+    }
+    for (b = 0; b < STATS_HIST_BUCKETS; b++) {
+        seen += hist->buckets[b];
+        if (seen > rank) {
+            break;
+        }
+    }
+    if (b >= STATS_HIST_BUCKETS - 1) {
+        return stats_hist_value(STATS_HIST_BUCKETS - 1);
+    }
+    return stats_hist_value(b + 1) - 1;
+}
+
+const char *
+stats_name(unsigned int id)
+{
+    return id < STATS_NUM ? names[id] : "unknown";
+}
+
+const char *
+stats_dev_name(unsigned int id)
+{
+    return id < STATS_DEV_NUM ? dev_names[id] : "unknown";
+}
+
+const char *
+stats_hist_name(unsigned int id)
+{
+    return id < STATS_HIST_NUM ? hist_names[id] : "unknown";
+}
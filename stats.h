@@ -0,0 +1,167 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "net.h"
+
+/*
+ * Statistics
+ *
+ * NOTE: the counters are kept in slots padded to the cache line, a thread takes its own slot on the first use
+ *       (the threads beyond STATS_SLOT_NUM share them). the slots are summed up only when queried.
+ */
+
+#ifndef STATS_SLOT_NUM
+#define STATS_SLOT_NUM 16
+#endif
+#define STATS_CACHELINE_SIZE 64
+
+/* counters of the layers (MIB-II style, see stats_name()) */
+#define STATS_NET_IN_UNKNOWN_PROTOS  0 /* frames of a type no protocol is registered for */
+#define STATS_NET_IN_DROPS           1 /* frames not queued to the protocol */
+#define STATS_NET_GRO_MERGED         2 /* packets merged into another one (see net_gro()) */
+#define STATS_NET_GSO_SEGMENTS       3 /* segments split in software (see net_device_output_gso()) */
+#define STATS_ARP_IN_REQUESTS        4
+#define STATS_ARP_IN_REPLIES         5
+#define STATS_ARP_IN_ERRORS          6
+#define STATS_ARP_OUT_REQUESTS       7
+#define STATS_ARP_OUT_REPLIES        8
+#define STATS_ARP_MISSES             9 /* lookups without a resolved entry */
+#define STATS_ARP_TIMEOUTS          10 /* entries deleted without any reply */
+#define STATS_ARP_PENDING_DROPS     11 /* packets dropped while waiting for the resolution */
+#define STATS_IP_IN_RECEIVES        12
+#define STATS_IP_IN_HDR_ERRORS      13 /* including the checksum errors */
+#define STATS_IP_IN_ADDR_ERRORS     14 /* not for us */
+#define STATS_IP_IN_UNKNOWN_PROTOS  15
+#define STATS_IP_IN_DELIVERS        16
+#define STATS_IP_OUT_REQUESTS       17
+#define STATS_IP_OUT_NO_ROUTES      18
+#define STATS_IP_OUT_DISCARDS       19
+#define STATS_IP_REASM_REQDS        20 /* fragments received */
+#define STATS_IP_REASM_OKS          21
+#define STATS_IP_REASM_FAILS        22 /* datagrams discarded (overlaps, timeouts, evictions) */
+#define STATS_IP_FRAG_OKS           23
+#define STATS_IP_FRAG_FAILS         24
+#define STATS_IP_FRAG_CREATES       25
+#define STATS_ICMP_IN_MSGS          26
+#define STATS_ICMP_IN_ERRORS        27
+#define STATS_ICMP_OUT_MSGS         28
+#define STATS_ICMP_OUT_ERRORS       29
+#define STATS_UDP_IN_DATAGRAMS      30
+#define STATS_UDP_NO_PORTS          31
+#define STATS_UDP_IN_ERRORS         32 /* including the checksum errors */
+#define STATS_UDP_IN_CSUM_ERRORS    33
+#define STATS_UDP_RCVBUF_ERRORS     34
+#define STATS_UDP_OUT_DATAGRAMS     35
+#define STATS_TCP_ACTIVE_OPENS      36
+#define STATS_TCP_PASSIVE_OPENS     37
+#define STATS_TCP_ATTEMPT_FAILS     38
+#define STATS_TCP_ESTAB_RESETS      39
+#define STATS_TCP_IN_SEGS           40
+#define STATS_TCP_OUT_SEGS          41
+#define STATS_TCP_RETRANS_SEGS      42
+#define STATS_TCP_IN_ERRS           43 /* including the checksum errors */
+#define STATS_TCP_IN_CSUM_ERRORS    44
+#define STATS_TCP_OUT_RSTS          45
+#define STATS_TCP_FAST_RETRANS      46
+#define STATS_TCP_TIMEOUTS          47 /* retransmission timeouts */
+#define STATS_TCP_PAWS_DROPS        48 /* segments with an old timestamp (RFC 7323 PAWS) */
+#define STATS_NUM                   49
+
+/* counters of a device */
+#define STATS_DEV_RX_PACKETS 0
+#define STATS_DEV_RX_BYTES   1
+#define STATS_DEV_RX_DROPS   2
+#define STATS_DEV_TX_PACKETS 3
+#define STATS_DEV_TX_BYTES   4
+#define STATS_DEV_TX_ERRORS  5
+#define STATS_DEV_NUM        6
+
+/* histograms */
+#define STATS_HIST_SOFTIRQ   0 /* nanoseconds to run the protocol queues once (a softirq or a round of a worker) */
+#define STATS_HIST_QUEUE     1 /* nanoseconds a packet stayed in the protocol queue */
+#define STATS_HIST_QUEUE_LEN 2 /* packets in the protocol queue, sampled on each push */
+#define STATS_HIST_NUM       3
+
+/*
+ * NOTE: log-linear buckets (HDR histogram style), 2^SUB_BITS buckets for each power of 2, the values below
+ *       2^(SUB_BITS+1) are exact and the others within 1/2^SUB_BITS. the values beyond 2^(MSB_MAX+1) are clamped.
+ */
+#define STATS_HIST_SUB_BITS 4
+#define STATS_HIST_MSB_MAX  39 /* about 18 minutes in nanoseconds */
+#define STATS_HIST_BUCKETS  ((STATS_HIST_MSB_MAX - STATS_HIST_SUB_BITS + 2) << STATS_HIST_SUB_BITS)
+
+struct stats_slot {
+    uint64_t counters[STATS_NUM];
+    uint64_t hist_count[STATS_HIST_NUM];
+    uint64_t hist_sum[STATS_HIST_NUM];
+    uint64_t hist[STATS_HIST_NUM][STATS_HIST_BUCKETS];
+} __attribute__((aligned(STATS_CACHELINE_SIZE)));
+
+struct stats_dev {
+    uint64_t counters[STATS_DEV_NUM];
+} __attribute__((aligned(STATS_CACHELINE_SIZE)));
+
+/* NOTE: a snapshot summed up from the slots */
+struct stats_hist {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t buckets[STATS_HIST_BUCKETS];
+};
+
+extern struct stats_slot stats_slots[STATS_SLOT_NUM];
+extern __thread unsigned int stats_self; /* NOTE: index of the slot + 1, 0 until the first use */
+
+extern unsigned int
+stats_slot_assign(void);
+
+static inline unsigned int
+stats_slot(void)
+{
+    return stats_self ? stats_self - 1 : stats_slot_assign();
+}
+
+/* NOTE: relaxed, no ordering with the others (an atomic add on the own cache line is not contended) */
+static inline void
+stats_add(unsigned int id, uint64_t n)
+{
+    __atomic_fetch_add(&stats_slots[stats_slot()].counters[id], n, __ATOMIC_RELAXED);
+}
+
+#define stats_inc(id) stats_add((id), 1)
+
+static inline void
+stats_dev_add(struct net_device *dev, unsigned int id, uint64_t n)
+{
+    __atomic_fetch_add(&dev->stats[stats_slot()].counters[id], n, __ATOMIC_RELAXED);
+}
+
+#define stats_dev_inc(dev, id) stats_dev_add((dev), (id), 1)
+
+extern uint64_t
+stats_clock(void);
+extern void
+stats_hist_record(unsigned int id, uint64_t value);
+
+extern struct stats_dev *
+stats_dev_alloc(void);
+extern void
+stats_get(uint64_t *counters);
+extern void
+stats_dev_get(struct net_device *dev, uint64_t *counters);
+extern void
+stats_hist_get(unsigned int id, struct stats_hist *hist);
+extern uint64_t
+stats_hist_value(unsigned int bucket);
+extern uint64_t
+stats_hist_percentile(const struct stats_hist *hist, double percentile);
+extern const char *
+stats_name(unsigned int id);
+extern const char *
+stats_dev_name(unsigned int id);
+extern const char *
+stats_hist_name(unsigned int id);
+
+#endif
@@ -1,9 +1,9 @@
 #include <stdio.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
-#include <sys/time.h>
 
 #include "platform.h"
 
@@ -11,6 +11,10 @@
 #include "net.h"
 #include "ip.h"
 #include "tcp.h"
+#include "tcp_cong.h"
+#include "trace.h"
+#include "stats.h"
+#include "timer.h"
 
 #define TCP_FLG_FIN 0x01
 #define TCP_FLG_SYN 0x02
@@ -22,7 +26,25 @@
 #define TCP_FLG_IS(x, y) ((x & 0x3f) == (y))
 #define TCP_FLG_ISSET(x, y) ((x & 0x3f) & (y) ? 1 : 0)
 
-#define TCP_PCB_SIZE 16
+#define TCP_OPT_KIND_EOL       0
+#define TCP_OPT_KIND_NOP       1
+#define TCP_OPT_KIND_MSS       2
+#define TCP_OPT_KIND_WSCALE    3
+#define TCP_OPT_KIND_SACK_PERM 4
+#define TCP_OPT_KIND_SACK      5
+#define TCP_OPT_KIND_TIMESTAMP 8
+
+#define TCP_OPT_TIMESTAMP_LEN 12 /* aligned with two NOPs */
+
+#define TCP_OPT_LEN_MAX 40
+/* NOTE: the payload of a GSO segment at most, the IP total length must fit in 16 bits */
+#define TCP_GSO_SIZE_MAX (IP_PAYLOAD_SIZE_MAX - sizeof(struct tcp_hdr) - TCP_OPT_LEN_MAX)
+#define TCP_WSCALE_MAX 14 /* RFC 7323 (2.3) */
+#define TCP_SACK_BLOCK_MAX 4
+
+#define TCP_PCB_SIZE_MIN 16
+#define TCP_PCB_SIZE_MAX 65536
+#define TCP_PCB_HASH_SIZE 64 /* initial number of buckets (grows) */
 
 #define TCP_PCB_MODE_RFC793 1
 #define TCP_PCB_MODE_SOCKET 2
@@ -40,21 +62,55 @@
 #define TCP_PCB_STATE_CLOSE_WAIT  10
 #define TCP_PCB_STATE_LAST_ACK    11
 
-#define TCP_DEFAULT_RTO 200000 /* micro seconds */
+#define TCP_CLOCK_GRANULARITY 10000 /* micro seconds (the clock granularity G of RFC 6298, a floor of the variance term) */
+#define TCP_RTO_INITIAL 1000000 /* micro seconds */
+#define TCP_RTO_MIN       20000 /* micro seconds */
+#define TCP_RTO_MAX    60000000 /* micro seconds */
 #define TCP_RETRANSMIT_DEADLINE 12 /* seconds */
 #define TCP_TIMEWAIT_SEC 30 /* substitute for 2MSL */
+#define TCP_PAWS_IDLE (24 * 24 * 60 * 60) /* seconds (RFC 7323 5.5), TS.Recent is invalid after the idle time */
+
+#define TCP_DEFAULT_MSS 536
+#define TCP_PERSIST_INTERVAL 500000 /* micro seconds (zero window probe) */
+#define TCP_DELACK_TIMEOUT 40000 /* micro seconds (RFC 1122 (4.2.3.2): must be less than 0.5 seconds) */
+#define TCP_BUF_SHRINK_DELAY 10000 /* micro seconds, an emptied buffer is freed if it stays empty for this */
+
+/* NOTE: the buffers are allocated on demand and grow up to the per-connection limits */
+#define TCP_BUF_SIZE_MIN    2048
+#define TCP_RCVBUF_DEFAULT 65535
+#define TCP_RCVBUF_MAX     (16 * 1024 * 1024) /* NOTE: window scaling allows up to 1 GB */
+#define TCP_SNDBUF_DEFAULT 65536
+#define TCP_SNDBUF_MAX     (16 * 1024 * 1024)
+
+#define TCP_PCB_FLAG_FIN_QUEUED 0x0001 /* FIN is sent after the buffered data */
+#define TCP_PCB_FLAG_FIN_SENT   0x0002
+#define TCP_PCB_FLAG_SACK_OK    0x0004 /* SACK-permitted option exchanged */
+#define TCP_PCB_FLAG_RECOVERY   0x0008 /* in the fast recovery */
+#define TCP_PCB_FLAG_TS_OK      0x0010 /* timestamps option exchanged */
+#define TCP_PCB_FLAG_LOSS       0x0020 /* the recovery was started by the retransmission timeout */
+#define TCP_PCB_FLAG_WS_OK      0x0040 /* window scale option exchanged */
+#define TCP_PCB_FLAG_QUICKACK   0x0080 /* acknowledge every segment immediately (no delayed ACK) */
+#define TCP_PCB_FLAG_NODELAY    0x0100 /* disable Nagle's algorithm */
+#define TCP_PCB_FLAG_CORK       0x0200 /* send only full-sized segments until uncorked */
+#define TCP_PCB_FLAG_NONBLOCK   0x0400 /* user commands fail with EAGAIN instead of sleeping */
+
+#define TCP_DUPACK_THRESH 3
+
+#define TCP_QUEUE_FLAG_SACKED  0x01
+#define TCP_QUEUE_FLAG_RETRANS 0x02 /* retransmitted in the current recovery */
+#define TCP_QUEUE_FLAG_RESENT  0x04 /* retransmitted at least once (Karn's algorithm) */
+
+#define TCP_OOO_ENTRY_MAX 16
+
+/* NOTE: sequence numbers are compared modulo 2^32 (RFC 793 3.3), a and b must be within 2^31 of each other */
+#define TCP_SEQ_LT(a, b) ((int32_t)((uint32_t)(a) - (uint32_t)(b)) < 0)
+#define TCP_SEQ_LE(a, b) ((int32_t)((uint32_t)(a) - (uint32_t)(b)) <= 0)
+#define TCP_SEQ_GT(a, b) ((int32_t)((uint32_t)(a) - (uint32_t)(b)) > 0)
+#define TCP_SEQ_GE(a, b) ((int32_t)((uint32_t)(a) - (uint32_t)(b)) >= 0)
 
 #define TCP_SOURCE_PORT_MIN 49152
 #define TCP_SOURCE_PORT_MAX 65535
 
-struct pseudo_hdr {
-    uint32_t src;
-    uint32_t dst;
-    uint8_t zero;
-    uint8_t protocol;
-    uint16_t len;
-};
-
 struct tcp_hdr {
     uint16_t src;
     uint16_t dst;
@@ -67,58 +123,147 @@ struct tcp_hdr {
     uint16_t up;
 };
 
+struct tcp_sack_block {
+    uint32_t left;
+    uint32_t right;
+};
+
 struct tcp_segment_info {
     uint32_t seq;
     uint32_t ack;
     uint16_t len;
-    uint16_t wnd;
+    uint32_t wnd; /* NOTE: scaled (RFC 7323) */
     uint16_t up;
+    /* options */
+    uint16_t mss; /* 0 if not present */
+    int wscale; /* -1 if not present */
+    int sack_perm;
+    int sack_num;
+    struct tcp_sack_block sack[TCP_SACK_BLOCK_MAX];
+    int ts;
+    uint32_t tsval;
+    uint32_t tsecr;
+    size_t staged; /* the payload already copied to the tail of the receive buffer (see tcp_input_stage()) */
+};
+
+/* NOTE: circular buffer, the valid data is [head ... head+len) modulo size */
+struct tcp_buf {
+    uint8_t *data; /* NOTE: NULL until the first use, released when idle */
+    size_t size; /* allocated */
+    size_t head; /* offset of the first byte */
+    size_t len; /* used */
+    size_t limit; /* upper limit of size (SO_RCVBUF/SO_SNDBUF) */
+};
+
+/* NOTE: a range of out of order data [seq ... end), the data itself is stored in the receive buffer */
+struct tcp_ooo_entry {
+    struct tcp_ooo_entry *next;
+    uint32_t seq;
+    uint32_t end;
 };
 
 struct tcp_pcb {
-    int state;
+    int id;
+    mutex_t lock; /* NOTE: kept (and unlocked) while the pcb is free */
+    unsigned int gen; /* NOTE: incremented when rehashed or released, changed with both locks held */
+    struct net_timer timer; /* NOTE: kept while the pcb is free, runs at the earliest of the deadlines (see tcp_timer()) */
+    int state; /* NOTE: the fields from here are cleared on release */
     int mode; /* user command mode */
     struct ip_endpoint local;
     struct ip_endpoint foreign;
+    struct ip_dst dst; /* NOTE: the route and the link address to the foreign, see ip_dst_lookup_cached() */
     struct {
         uint32_t nxt;
         uint32_t una;
-        uint16_t wnd;
+        uint32_t wnd;
         uint16_t up;
         uint32_t wl1;
         uint32_t wl2;
+        uint8_t wscale; /* shift count announced by the peer */
     } snd;
     uint32_t iss;
     struct {
         uint32_t nxt;
-        uint16_t wnd;
+        uint32_t wnd;
         uint16_t up;
+        uint32_t adv; /* last advertised window */
+        uint8_t wscale; /* shift count announced by us */
     } rcv;
     uint32_t irs;
     uint16_t mtu;
-    uint16_t mss;
-    uint8_t buf[65535]; /* receive buffer */
+    uint16_t mss; /* MSS for sending (the smaller of ours and the one announced by the peer) */
+    int flags;
+    struct tcp_buf rbuf; /* receive buffer (received, not yet read by the user) */
+    struct tcp_buf sbuf; /* send buffer (starts at SND.UNA: unacknowledged and unsent data) */
+    struct tcp_ooo_entry *ooo; /* out of order queue (sorted by seq, not overlapped) */
+    int ooo_num;
+    uint32_t ooo_last; /* the most recently queued out of order segment, reported in the first SACK block */
+    int dupacks;
+    uint32_t retrans; /* segments retransmitted */
+    uint32_t recover; /* SND.NXT when the fast recovery started (RFC 6582) */
+    uint32_t sack_high; /* highest sequence number SACKed by the peer */
+    uint32_t srtt; /* micro seconds */
+    uint32_t rttvar; /* micro seconds */
+    uint32_t rto; /* micro seconds */
+    uint64_t timer_expire; /* NOTE: the timer is armed at this (0 while running or not armed), see tcp_timer_schedule() */
+    uint64_t rtx_timer; /* NOTE: one retransmission timer per connection, cleared while nothing is outstanding */
+    uint32_t ts_recent;
+    uint64_t ts_recent_age; /* NOTE: when ts_recent was updated, see tcp_paws_reject() */
+    size_t ack_pending; /* bytes received but not acknowledged yet */
+    uint16_t rcv_mss; /* largest segment received, to tell full-sized segments */
+    uint64_t delack; /* NOTE: deadline of the delayed ACK, cleared while no ACK is pending */
+    struct tcp_cong_ops *cc; /* congestion control algorithm */
+    struct tcp_cong cong;
+    uint64_t persist;
+    uint64_t shrink; /* NOTE: the buffers are freed at this if still empty, see tcp_buf_shrink_schedule() */
     struct sched_ctx ctx;
-    struct queue_head queue; /* retransmit queue */
-    struct timeval tw_timer;
+    struct list_head queue; /* retransmit queue (struct tcp_queue_entry) */
+    uint64_t tw_timer;
     struct tcp_pcb *parent;
-    struct queue_head backlog;
+    struct list_head backlog; /* established connections not accepted yet (linked by backlog_node) */
+    struct list_node backlog_node; /* in the backlog of the parent */
+    struct tcp_pcb *next; /* free list */
+    struct hash_node node; /* connection table (keyed by the local port and the foreign endpoint) */
+    struct hash_node bind_node; /* bind table (keyed by the local port) */
 };
 
+/* NOTE: the data is not copied, it is resent from the send buffer */
 struct tcp_queue_entry {
-    struct timeval first;
-    struct timeval last;
-    unsigned int rto; /* micro seconds */
+    struct list_node node;
+    uint64_t first;
     uint32_t seq;
     uint8_t flg;
+    uint8_t flags; /* scoreboard */
     size_t len;
 };
 
-static mutex_t mutex = MUTEX_INITIALIZER;
-static struct tcp_pcb pcbs[TCP_PCB_SIZE];
+/* NOTE: the element of the node taken from pcb->queue and pcb->backlog, NULL for NULL */
+static inline struct tcp_queue_entry *
+tcp_queue_entry_of(struct list_node *node)
+{
+    return node ? containerof(node, struct tcp_queue_entry, node) : NULL;
+}
+
+static inline struct tcp_pcb *
+tcp_backlog_pcb(struct list_node *node)
+{
+    return node ? containerof(node, struct tcp_pcb, backlog_node) : NULL;
+}
+
+/*
+ * NOTE: table_lock protects the tables below (pcbs, pcb_free, conn_table and bind_table) and the endpoints of
+ *       the PCBs. it is taken after the lock of a PCB, never the other way around. the lock of a listener is
+ *       taken before the ones of the connections accepted from it.
+ */
+static rwlock_t table_lock = RWLOCK_INITIALIZER;
+static struct tcp_pcb **pcbs; /* indexed by id, grows up to TCP_PCB_SIZE_MAX */
+static int pcb_num, pcb_capacity;
+static struct tcp_pcb *pcb_free; /* NOTE: released PCBs are kept and reused with their id */
+static struct hash_table conn_table;
+static struct hash_table bind_table;
 
 static ssize_t
-tcp_output_segment(uint32_t seq, uint32_t ack, uint8_t flg, uint16_t wnd, uint8_t *data, size_t len, struct ip_endpoint *local, struct ip_endpoint *foreign);
+tcp_output_segment(uint32_t seq, uint32_t ack, uint8_t flg, uint16_t wnd, uint8_t *opt, size_t optlen, struct tcp_buf *buf, size_t off, size_t len, struct ip_endpoint *local, struct ip_endpoint *foreign, struct ip_dst *dst, uint16_t gso_size);
 
 static char *
 tcp_flg_ntoa(uint8_t flg)
@@ -140,6 +285,9 @@ tcp_dump(const uint8_t *data, size_t len)
 {
     struct tcp_hdr *hdr;
 
+    if (!LOG_ENABLED(DEBUG)) {
+        return;
+    }
     flockfile(stderr);
     hdr = (struct tcp_hdr *)data;
     fprintf(stderr, "        src: %u\n", ntoh16(hdr->src));
@@ -160,243 +308,1629 @@ tcp_dump(const uint8_t *data, size_t len)
 /*
  * TCP Protocol Control Block (PCB)
  *
- * NOTE: TCP PCB functions must be called after mutex locked
+ * NOTE: TCP PCB functions must be called after the lock of the PCB taken (tcp_pcb_alloc() and tcp_pcb_get()
+ *       return the PCB locked), tcp_pcb_hash(), tcp_pcb_select() and tcp_pcb_select_port() also with table_lock
  */
 
+static int
+tcp_pcb_table_grow(void)
+{
+    struct tcp_pcb **table;
+    int capacity;
+
+    if (pcb_capacity >= TCP_PCB_SIZE_MAX) {
+        return -1;
+    }
+    capacity = pcb_capacity ? pcb_capacity * 2 : TCP_PCB_SIZE_MIN;
+    table = memory_alloc(sizeof(*table) * capacity);
+    if (!table) {
+        errorf("memory_alloc() failure");
+        return -1;
+    }
+    if (pcbs) {
+        memcpy(table, pcbs, sizeof(*table) * pcb_num);
+        memory_free(pcbs);
+    }
+    pcbs = table;
+    pcb_capacity = capacity;
+    return 0;
+}
+
+static void
+tcp_timer(void *arg);
+
 static struct tcp_pcb *
 tcp_pcb_alloc(void)
 {
     struct tcp_pcb *pcb;
 
-    for (pcb = pcbs; pcb < tailof(pcbs); pcb++) {
-        if (pcb->state == TCP_PCB_STATE_FREE) {
-            pcb->state = TCP_PCB_STATE_CLOSED;
-            sched_ctx_init(&pcb->ctx);
+    rwlock_wrlock(&table_lock);
+    if (pcb_free) {
+        pcb = pcb_free;
+        pcb_free = pcb->next;
+        pcb->next = NULL;
+    } else {
+        if (pcb_num == pcb_capacity && tcp_pcb_table_grow() == -1) {
+            rwlock_unlock(&table_lock);
+            return NULL;
+        }
+        pcb = memory_alloc(sizeof(*pcb));
+        if (!pcb) {
+            errorf("memory_alloc() failure");
+            rwlock_unlock(&table_lock);
+            return NULL;
+        }
+        mutex_init(&pcb->lock);
+        net_timer_init(&pcb->timer, tcp_timer, pcb);
+        pcb->id = pcb_num;
+        pcbs[pcb_num++] = pcb;
+    }
+    rwlock_unlock(&table_lock);
+    /* NOTE: still FREE until locked, a stale tcp_pcb_get() does not see it half initialized */
+    mutex_lock(&pcb->lock);
+    pcb->state = TCP_PCB_STATE_CLOSED;
+    pcb->rbuf.limit = TCP_RCVBUF_DEFAULT;
+    pcb->sbuf.limit = TCP_SNDBUF_DEFAULT;
+    pcb->rto = TCP_RTO_INITIAL;
+    pcb->cc = tcp_cong_default();
+    sched_ctx_init(&pcb->ctx);
+    return pcb;
+}
+
+static uint32_t
+tcp_pcb_conn_hash(uint16_t port, struct ip_endpoint *foreign)
+{
+    /* NOTE: the local address is not hashed, it may be IP_ADDR_ANY */
+    return hash32(foreign->addr ^ hash32(((uint32_t)port << 16) | foreign->port));
+}
+
+/* NOTE: must be called whenever the local/foreign endpoints of the PCB are changed */
+static void
+tcp_pcb_hash(struct tcp_pcb *pcb)
+{
+    pcb->gen++;
+    hash_table_remove(&conn_table, &pcb->node);
+    hash_table_remove(&bind_table, &pcb->bind_node);
+    if (!pcb->local.port) {
+        return;
+    }
+    if (!pcb->parent) {
+        /* NOTE: the connections accepted from a listener share its local port, do not own it */
+        hash_table_insert(&bind_table, &pcb->bind_node, hash32(pcb->local.port));
+    }
+    if (pcb->foreign.port) {
+        hash_table_insert(&conn_table, &pcb->node, tcp_pcb_conn_hash(pcb->local.port, &pcb->foreign));
+    }
+}
+
+static void
+tcp_pcb_release(struct tcp_pcb *pcb)
+{
+    struct tcp_queue_entry *entry;
+    struct tcp_pcb *est;
+    struct tcp_ooo_entry *ooo;
+    char ep1[IP_ENDPOINT_STR_LEN];
+    char ep2[IP_ENDPOINT_STR_LEN];
+
+    /* NOTE: wake up the waiters (they release it) and also tell sock_poll() the pcb is gone */
+    sched_wakeup(&pcb->ctx);
+    if (sched_ctx_destroy(&pcb->ctx) == -1) {
+        return;
+    }
+    while ((entry = tcp_queue_entry_of(list_pop(&pcb->queue))) != NULL) {
+        memory_pool_free(entry);
+    }
+    while ((est = tcp_backlog_pcb(list_pop(&pcb->backlog))) != NULL) {
+        mutex_lock(&est->lock);
+        tcp_pcb_release(est);
+        mutex_unlock(&est->lock);
+    }
+    while ((ooo = pcb->ooo) != NULL) {
+        pcb->ooo = ooo->next;
+        memory_pool_free(ooo);
+    }
+    debugf("released, local=%s, foreign=%s",
+        ip_endpoint_ntop(&pcb->local, ep1, sizeof(ep1)), ip_endpoint_ntop(&pcb->foreign, ep2, sizeof(ep2)));
+    memory_free(pcb->rbuf.data);
+    memory_free(pcb->sbuf.data);
+    /* NOTE: the handler about to run (if any) finds the pcb free or reused, see tcp_timer() */
+    net_timer_cancel(&pcb->timer);
+    rwlock_wrlock(&table_lock);
+    hash_table_remove(&conn_table, &pcb->node);
+    hash_table_remove(&bind_table, &pcb->bind_node);
+    memset(&pcb->state, 0, sizeof(*pcb) - offsetof(struct tcp_pcb, state));
+    pcb->gen++;
+    pcb->next = pcb_free;
+    pcb_free = pcb;
+    rwlock_unlock(&table_lock);
+}
+
+static struct tcp_pcb *
+tcp_pcb_select(struct ip_endpoint *local, struct ip_endpoint *foreign)
+{
+    struct hash_node *node;
+    struct tcp_pcb *pcb, *listen_pcb = NULL;
+    uint32_t hash;
+
+    if (foreign) {
+        hash = tcp_pcb_conn_hash(local->port, foreign);
+        for (node = hash_table_lookup(&conn_table, hash); node; node = node->next) {
+            if (node->hash != hash) {
+                continue;
+            }
+            pcb = containerof(node, struct tcp_pcb, node);
+            if ((pcb->local.addr == IP_ADDR_ANY || pcb->local.addr == local->addr) && pcb->local.port == local->port) {
+                if (pcb->foreign.addr == foreign->addr && pcb->foreign.port == foreign->port) {
+                    return pcb;
+                }
+            }
+        }
+    }
+    hash = hash32(local->port);
+    for (node = hash_table_lookup(&bind_table, hash); node; node = node->next) {
+        if (node->hash != hash) {
+            continue;
+        }
+        pcb = containerof(node, struct tcp_pcb, bind_node);
+        if ((pcb->local.addr == IP_ADDR_ANY || pcb->local.addr == local->addr) && pcb->local.port == local->port) {
+            if (!foreign) {
+                return pcb;
+            }
+            if (pcb->state == TCP_PCB_STATE_LISTEN) {
+                if (pcb->foreign.addr == IP_ADDR_ANY && pcb->foreign.port == 0) {
+                    /* LISTENed with wildcard foreign address/port, prefer the one bound to the address */
+                    if (!listen_pcb || pcb->local.addr != IP_ADDR_ANY) {
+                        listen_pcb = pcb;
+                    }
+                }
+            }
+        }
+    }
+    return listen_pcb;
+}
+
+/* NOTE: the pcb found is returned locked, it may have been rehashed or released while waiting for the lock */
+static struct tcp_pcb *
+tcp_pcb_select_lock(struct ip_endpoint *local, struct ip_endpoint *foreign)
+{
+    struct tcp_pcb *pcb;
+    unsigned int gen;
+
+    while (1) {
+        rwlock_rdlock(&table_lock);
+        pcb = tcp_pcb_select(local, foreign);
+        if (!pcb) {
+            rwlock_unlock(&table_lock);
+            return NULL;
+        }
+        gen = pcb->gen;
+        rwlock_unlock(&table_lock);
+        mutex_lock(&pcb->lock);
+        if (pcb->gen == gen) {
             return pcb;
         }
+        mutex_unlock(&pcb->lock);
+    }
+}
+
+/* NOTE: PCBs are never freed (the memory is reused), the pointer stays valid after table_lock released */
+static struct tcp_pcb *
+tcp_pcb_lookup(int id)
+{
+    struct tcp_pcb *pcb = NULL;
+
+    rwlock_rdlock(&table_lock);
+    if (id >= 0 && id < pcb_num) {
+        pcb = pcbs[id];
+    }
+    rwlock_unlock(&table_lock);
+    return pcb;
+}
+
+/* NOTE: the pcb is returned locked */
+static struct tcp_pcb *
+tcp_pcb_get(int id)
+{
+    struct tcp_pcb *pcb;
+
+    pcb = tcp_pcb_lookup(id);
+    if (!pcb) {
+        /* out of range */
+        return NULL;
+    }
+    mutex_lock(&pcb->lock);
+    if (pcb->state == TCP_PCB_STATE_FREE) {
+        mutex_unlock(&pcb->lock);
+        return NULL;
+    }
+    return pcb;
+}
+
+static int
+tcp_pcb_id(struct tcp_pcb *pcb)
+{
+    return pcb->id;
+}
+
+/* NOTE: the ports are tried in turn from where the last search stopped */
+static uint16_t
+tcp_pcb_select_port(ip_addr_t addr)
+{
+    static uint32_t next = TCP_SOURCE_PORT_MIN;
+    struct ip_endpoint local;
+    uint32_t p, n;
+
+    local.addr = addr;
+    for (n = 0; n <= TCP_SOURCE_PORT_MAX - TCP_SOURCE_PORT_MIN; n++) {
+        p = next;
+        next = (p == TCP_SOURCE_PORT_MAX) ? TCP_SOURCE_PORT_MIN : p + 1;
+        local.port = hton16(p);
+        if (!tcp_pcb_select(&local, NULL)) {
+            return local.port;
+        }
+    }
+    return 0;
+}
+
+/*
+ * TCP Timer
+ *
+ * NOTE: one timer per PCB, armed at the earliest of the deadlines (retransmission, delayed ACK, persist,
+ *       time-wait and buffer shrink). a deadline moved later does not touch the wheel, the timer runs at
+ *       the old one and finds the next (see tcp_timer()). must be called after the lock of the PCB taken.
+ */
+
+static void
+tcp_timer_schedule(struct tcp_pcb *pcb, uint64_t deadline)
+{
+    if (pcb->timer_expire && pcb->timer_expire <= deadline) {
+        return;
+    }
+    pcb->timer_expire = deadline;
+    net_timer_arm(&pcb->timer, deadline);
+}
+
+/* NOTE: arms the timer at the earliest deadline set */
+static void
+tcp_timer_update(struct tcp_pcb *pcb)
+{
+    uint64_t deadlines[] = { pcb->rtx_timer, pcb->delack, pcb->persist, pcb->shrink, pcb->tw_timer };
+    uint64_t next = 0;
+    size_t i;
+
+    for (i = 0; i < countof(deadlines); i++) {
+        if (deadlines[i] && (!next || deadlines[i] < next)) {
+            next = deadlines[i];
+        }
+    }
+    if (!next) {
+        pcb->timer_expire = 0;
+        net_timer_cancel(&pcb->timer);
+        return;
+    }
+    pcb->timer_expire = next;
+    net_timer_arm(&pcb->timer, next);
+}
+
+/*
+ * TCP Buffer
+ *
+ * NOTE: TCP Buffer functions must be called after mutex locked
+ */
+
+/* copy len bytes starting at off (relative to the head) out of the buffer, the copy may span the wrap point */
+static void
+tcp_buf_peek(struct tcp_buf *buf, size_t off, uint8_t *dst, size_t len)
+{
+    size_t pos, n;
+
+    if (!len) {
+        return;
+    }
+    pos = (buf->head + off) % buf->size;
+    n = MIN(len, buf->size - pos);
+    memcpy(dst, buf->data + pos, n);
+    memcpy(dst + n, buf->data, len - n);
+}
+
+/* NOTE: tcp_buf_peek() that also returns the sum (not complemented) of the data copied, see cksum16_copy() */
+static uint16_t
+tcp_buf_peek_cksum(struct tcp_buf *buf, size_t off, uint8_t *dst, size_t len)
+{
+    size_t pos, n;
+    uint16_t sum;
+
+    if (!len) {
+        return 0;
+    }
+    pos = (buf->head + off) % buf->size;
+    n = MIN(len, buf->size - pos);
+    sum = cksum16_copy(dst, buf->data + pos, n, 0);
+    return cksum16_add(sum, cksum16_copy(dst + n, buf->data, len - n, 0), n);
+}
+
+static int
+tcp_buf_reserve(struct tcp_buf *buf, size_t len)
+{
+    uint8_t *data;
+    size_t size;
+
+    if (buf->len + len <= buf->size) {
+        return 0;
+    }
+    if (buf->len + len > buf->limit) {
+        return -1;
+    }
+    /* NOTE: size may be above the limit when the limit was lowered */
+    size = buf->size ? buf->size : TCP_BUF_SIZE_MIN;
+    while (size < buf->len + len) {
+        size <<= 1;
+    }
+    size = MIN(size, buf->limit);
+    data = memory_alloc(size);
+    if (!data) {
+        errorf("memory_alloc() failure, size=%zu", size);
+        return -1;
+    }
+    if (buf->data) {
+        /* NOTE: unwrap the whole area into the new one, it may hold the data beyond len (see tcp_buf_write()) */
+        tcp_buf_peek(buf, 0, data, buf->size);
+        memory_free(buf->data);
+    }
+    buf->data = data;
+    buf->size = size;
+    buf->head = 0;
+    return 0;
+}
+
+static int
+tcp_buf_append(struct tcp_buf *buf, const uint8_t *data, size_t len)
+{
+    size_t tail, n;
+
+    if (!len) {
+        return 0;
+    }
+    if (tcp_buf_reserve(buf, len) == -1) {
+        return -1;
+    }
+    tail = (buf->head + buf->len) % buf->size;
+    n = MIN(len, buf->size - tail);
+    memcpy(buf->data + tail, data, n);
+    memcpy(buf->data, data + n, len - n);
+    buf->len += len;
+    return 0;
+}
+
+/* store len bytes at off (relative to the head) without making them valid, off may be beyond len */
+static int
+tcp_buf_write(struct tcp_buf *buf, size_t off, const uint8_t *data, size_t len)
+{
+    size_t pos, n;
+
+    if (!len) {
+        return 0;
+    }
+    if (off + len > buf->len && tcp_buf_reserve(buf, off + len - buf->len) == -1) {
+        return -1;
+    }
+    pos = (buf->head + off) % buf->size;
+    n = MIN(len, buf->size - pos);
+    memcpy(buf->data + pos, data, n);
+    memcpy(buf->data, data + n, len - n);
+    return 0;
+}
+
+/* NOTE: tcp_buf_write() into the area already reserved that returns the sum (not complemented), see cksum16_copy() */
+static uint16_t
+tcp_buf_write_cksum(struct tcp_buf *buf, size_t off, const uint8_t *data, size_t len)
+{
+    size_t pos, n;
+    uint16_t sum;
+
+    if (!len) {
+        return 0;
+    }
+    pos = (buf->head + off) % buf->size;
+    n = MIN(len, buf->size - pos);
+    sum = cksum16_copy(buf->data + pos, data, n, 0);
+    return cksum16_add(sum, cksum16_copy(buf->data, data + n, len - n, 0), n);
+}
+
+/* remove len bytes from the front */
+static void
+tcp_buf_consume(struct tcp_buf *buf, size_t len)
+{
+    len = MIN(len, buf->len);
+    if (!len) {
+        return;
+    }
+    /* NOTE: the head is not rewound when it becomes empty, the data beyond len must stay in place */
+    buf->head = (buf->head + len) % buf->size;
+    buf->len -= len;
+}
+
+/*
+ * TCP Out of Order Queue
+ *
+ * NOTE: out of order data is stored in the receive buffer at the position that it
+ *       will occupy, and only the ranges are queued. ranges are coalesced on insert.
+ */
+
+static int
+tcp_ooo_insert(struct tcp_pcb *pcb, uint32_t seq, uint8_t *data, size_t len)
+{
+    struct tcp_ooo_entry *prev = NULL, *cur, *next, *entry;
+    uint32_t end;
+
+    end = seq + len;
+    for (cur = pcb->ooo; cur && TCP_SEQ_LT(cur->end, seq); cur = cur->next) {
+        prev = cur;
+    }
+    if (!cur || TCP_SEQ_LT(end, cur->seq)) {
+        if (pcb->ooo_num >= TCP_OOO_ENTRY_MAX) {
+            debugf("too many holes, drop seq=%u, len=%zu", seq, len);
+            return -1;
+        }
+    }
+    if (tcp_buf_write(&pcb->rbuf, pcb->rbuf.len + (seq - pcb->rcv.nxt), data, len) == -1) {
+        errorf("tcp_buf_write() failure");
+        return -1;
+    }
+    if (!cur || TCP_SEQ_LT(end, cur->seq)) {
+        entry = memory_pool_alloc(sizeof(*entry));
+        if (!entry) {
+            errorf("memory_pool_alloc() failure");
+            return -1;
+        }
+        entry->seq = seq;
+        entry->end = end;
+        entry->next = cur;
+        if (prev) {
+            prev->next = entry;
+        } else {
+            pcb->ooo = entry;
+        }
+        pcb->ooo_num++;
+        return 0;
+    }
+    /* overlapped or adjacent, merge into cur and the following ones */
+    if (TCP_SEQ_LT(seq, cur->seq)) {
+        cur->seq = seq;
+    }
+    if (TCP_SEQ_GT(end, cur->end)) {
+        cur->end = end;
+    }
+    while ((next = cur->next) && TCP_SEQ_LE(next->seq, cur->end)) {
+        if (TCP_SEQ_GT(next->end, cur->end)) {
+            cur->end = next->end;
+        }
+        cur->next = next->next;
+        memory_pool_free(next);
+        pcb->ooo_num--;
+    }
+    return 0;
+}
+
+/* move the ranges that became contiguous to RCV.NXT into the valid data */
+static void
+tcp_ooo_deliver(struct tcp_pcb *pcb)
+{
+    struct tcp_ooo_entry *entry;
+
+    while ((entry = pcb->ooo) && TCP_SEQ_LE(entry->seq, pcb->rcv.nxt)) {
+        if (TCP_SEQ_GT(entry->end, pcb->rcv.nxt)) {
+            debugf("reassembled, seq=%u, len=%u", pcb->rcv.nxt, entry->end - pcb->rcv.nxt);
+            pcb->rbuf.len += entry->end - pcb->rcv.nxt;
+            pcb->rcv.nxt = entry->end;
+        }
+        pcb->ooo = entry->next;
+        memory_pool_free(entry);
+        pcb->ooo_num--;
+    }
+}
+
+/* NOTE: called from the timer (see tcp_buf_shrink_schedule()), an idle connection does not hold the memory */
+static void
+tcp_buf_shrink(struct tcp_buf *buf)
+{
+    if (buf->data && !buf->len) {
+        memory_free(buf->data);
+        buf->data = NULL;
+        buf->size = 0;
+        buf->head = 0;
+    }
+}
+
+/* NOTE: an emptied buffer is not freed at once, it may be filled again soon */
+static void
+tcp_buf_shrink_schedule(struct tcp_pcb *pcb)
+{
+    if (pcb->shrink) {
+        return;
+    }
+    if ((pcb->rbuf.data && !pcb->rbuf.len) || (pcb->sbuf.data && !pcb->sbuf.len)) {
+        pcb->shrink = net_timer_clock() + NET_TIMER_USEC(TCP_BUF_SHRINK_DELAY);
+        tcp_timer_schedule(pcb, pcb->shrink);
+    }
+}
+
+static uint32_t
+tcp_rcv_wnd(struct tcp_pcb *pcb)
+{
+    size_t max;
+
+    if (pcb->rbuf.len >= pcb->rbuf.limit) {
+        return 0;
+    }
+    /* NOTE: the largest window representable in the 16-bit field */
+    max = (size_t)UINT16_MAX << ((pcb->flags & TCP_PCB_FLAG_WS_OK) ? pcb->rcv.wscale : 0);
+    return MIN(pcb->rbuf.limit - pcb->rbuf.len, max);
+}
+
+/* the value of the window field (RFC 7323 (2.3): the window in SYN segments is never scaled) */
+static uint16_t
+tcp_wnd_field(struct tcp_pcb *pcb, uint8_t flg)
+{
+    if (TCP_FLG_ISSET(flg, TCP_FLG_SYN) || !(pcb->flags & TCP_PCB_FLAG_WS_OK)) {
+        return MIN(pcb->rcv.wnd, UINT16_MAX);
+    }
+    return MIN(pcb->rcv.wnd >> pcb->rcv.wscale, UINT16_MAX);
+}
+
+/* NOTE: every segment carries the ACK, the delayed one is no longer needed */
+static void
+tcp_ack_sent(struct tcp_pcb *pcb)
+{
+    pcb->rcv.adv = pcb->rcv.wnd;
+    pcb->ack_pending = 0;
+    pcb->delack = 0;
+}
+
+/* NOTE: the shift count to announce, chosen to cover the receive buffer limit at the time of SYN */
+static uint8_t
+tcp_wscale_select(struct tcp_pcb *pcb)
+{
+    uint8_t shift = 0;
+
+    while (shift < TCP_WSCALE_MAX && ((size_t)UINT16_MAX << shift) < pcb->rbuf.limit) {
+        shift++;
+    }
+    return shift;
+}
+
+/* the MSS to announce, derived from the MTU of the outgoing interface */
+static uint16_t
+tcp_local_mss(struct tcp_pcb *pcb)
+{
+    struct ip_iface *iface;
+
+    iface = ip_route_get_iface(pcb->local.addr);
+    if (!iface) {
+        return TCP_DEFAULT_MSS;
+    }
+    return NET_IFACE(iface)->dev->mtu - (IP_HDR_SIZE_MIN + sizeof(struct tcp_hdr));
+}
+
+static uint16_t
+tcp_pcb_mss(struct tcp_pcb *pcb)
+{
+    if (!pcb->mss) {
+        pcb->mss = tcp_local_mss(pcb);
+    }
+    return pcb->mss;
+}
+
+/* NOTE: process the options that only appear in SYN segments */
+static void
+tcp_syn_options(struct tcp_pcb *pcb, struct tcp_segment_info *seg)
+{
+    /* RFC 9293 (3.7.1): the default MSS is 536 if the option is not received */
+    pcb->mss = MIN(tcp_local_mss(pcb), seg->mss ? seg->mss : TCP_DEFAULT_MSS);
+    if (seg->wscale >= 0) {
+        pcb->flags |= TCP_PCB_FLAG_WS_OK;
+        pcb->snd.wscale = MIN(seg->wscale, TCP_WSCALE_MAX);
+    } else {
+        pcb->rcv.wscale = 0;
+    }
+    if (seg->sack_perm) {
+        pcb->flags |= TCP_PCB_FLAG_SACK_OK;
+    }
+    if (seg->ts) {
+        pcb->flags |= TCP_PCB_FLAG_TS_OK;
+        pcb->ts_recent = seg->tsval;
+        pcb->ts_recent_age = net_timer_clock();
+    }
+}
+
+/* NOTE: the payload size of data segments (SMSS), the timestamps option takes a part of the MSS */
+static uint16_t
+tcp_pcb_smss(struct tcp_pcb *pcb)
+{
+    return tcp_pcb_mss(pcb) - ((pcb->flags & TCP_PCB_FLAG_TS_OK) ? TCP_OPT_TIMESTAMP_LEN : 0);
+}
+
+/* number of bytes in the send buffer that have been sent but not acknowledged yet */
+static size_t
+tcp_sbuf_inflight(struct tcp_pcb *pcb)
+{
+    size_t n;
+
+    n = pcb->snd.nxt - pcb->snd.una;
+    if (n && (pcb->flags & TCP_PCB_FLAG_FIN_SENT)) {
+        n--; /* FIN consumes one sequence number */
+    }
+    return MIN(n, pcb->sbuf.len);
+}
+
+/*
+ * TCP RTT Estimation (RFC 6298)
+ */
+
+static uint32_t
+tcp_ts_now(void)
+{
+    /* NOTE: RFC 7323 (5.4): the timestamp clock ticks in milli seconds (1ms to 1s), it wraps in about 49 days */
+    return (uint32_t)(net_timer_clock() / NET_TIMER_MSEC(1));
+}
+
+static void
+tcp_rtt_update(struct tcp_pcb *pcb, uint32_t rtt)
+{
+    uint32_t delta;
+
+    if (!pcb->srtt) {
+        pcb->srtt = MAX(rtt, 1);
+        pcb->rttvar = rtt / 2;
+    } else {
+        delta = pcb->srtt > rtt ? pcb->srtt - rtt : rtt - pcb->srtt;
+        pcb->rttvar = (3 * pcb->rttvar + delta) / 4;
+        pcb->srtt = MAX((7 * pcb->srtt + rtt) / 8, 1);
+    }
+    pcb->rto = pcb->srtt + MAX(TCP_CLOCK_GRANULARITY, 4 * pcb->rttvar);
+    pcb->rto = MIN(MAX(pcb->rto, TCP_RTO_MIN), TCP_RTO_MAX);
+    pcb->cong.srtt = pcb->srtt;
+    debugf("rtt=%u, srtt=%u, rttvar=%u, rto=%u", rtt, pcb->srtt, pcb->rttvar, pcb->rto);
+}
+
+/*
+ * NOTE: RTTM (RFC 7323), the ACK echoes the timestamp of the segment that it acknowledges, also when retransmitted.
+ *       the timestamp clock is coarser than the RTT, used only where Karn's algorithm gives no sample.
+ */
+static void
+tcp_rtt_sample_ts(struct tcp_pcb *pcb, struct tcp_segment_info *seg)
+{
+    uint32_t rtt;
+
+    if (!(pcb->flags & TCP_PCB_FLAG_TS_OK) || !seg || !seg->ts || !seg->tsecr) {
+        return;
+    }
+    rtt = tcp_ts_now() - seg->tsecr;
+    if ((int32_t)rtt < 0) {
+        return;
+    }
+    tcp_rtt_update(pcb, (uint32_t)MIN((uint64_t)rtt * 1000, TCP_RTO_MAX));
+}
+
+static void
+tcp_rtx_timer_restart(struct tcp_pcb *pcb, uint64_t now)
+{
+    pcb->rtx_timer = now + NET_TIMER_USEC(pcb->rto);
+    tcp_timer_schedule(pcb, pcb->rtx_timer);
+}
+
+/*
+ * TCP Congestion Control
+ */
+
+/* NOTE: called when the connection is established, the SMSS is settled by then */
+static void
+tcp_cong_start(struct tcp_pcb *pcb)
+{
+    struct tcp_cong *cong = &pcb->cong;
+
+    cong->mss = tcp_pcb_smss(pcb);
+    /* RFC 6928: initial window */
+    cong->cwnd = MIN(10 * cong->mss, MAX(2 * cong->mss, 14600));
+    cong->ssthresh = UINT32_MAX;
+    cong->srtt = pcb->srtt;
+    pcb->cc->init(cong);
+    debugf("cc=%s, cwnd=%u, mss=%u", pcb->cc->name, cong->cwnd, cong->mss);
+}
+
+/*
+ * TCP Retransmit
+ *
+ * NOTE: TCP Retransmit functions must be called after mutex locked
+ */
+
+/* NOTE: an entry per segment of SMSS (GSO), all or nothing, a segment must not be sent without its entry */
+static int
+tcp_retransmit_queue_add(struct tcp_pcb *pcb, uint32_t seq, uint8_t flg, size_t len, size_t smss)
+{
+    struct list_head entries;
+    struct tcp_queue_entry *entry;
+    uint64_t now;
+    size_t n = 0;
+
+    list_init(&entries);
+    now = net_timer_clock();
+    do {
+        entry = memory_pool_alloc(sizeof(*entry));
+        if (!entry) {
+            errorf("memory_pool_alloc() failure");
+            while ((entry = tcp_queue_entry_of(list_pop(&entries))) != NULL) {
+                memory_pool_free(entry);
+            }
+            return -1;
+        }
+        entry->seq = seq + n;
+        entry->flg = n + smss < len ? flg & ~TCP_FLG_PSH : flg;
+        entry->flags = 0;
+        entry->len = MIN(smss, len - n);
+        entry->first = now;
+        list_push(&entries, &entry->node);
+        n += smss;
+    } while (n < len);
+    while ((entry = tcp_queue_entry_of(list_pop(&entries))) != NULL) {
+        list_push(&pcb->queue, &entry->node);
+    }
+    if (!pcb->rtx_timer) {
+        tcp_rtx_timer_restart(pcb, now);
+    }
+    return 0;
+}
+
+/* NOTE: seg is the ACK that made progress (NULL if not to be sampled with the timestamps option) */
+static void
+tcp_retransmit_queue_cleanup(struct tcp_pcb *pcb, struct tcp_segment_info *seg)
+{
+    struct tcp_queue_entry *entry;
+    uint64_t now, sent = 0;
+    int removed = 0;
+
+    while ((entry = tcp_queue_entry_of(list_peek(&pcb->queue)))) {
+        if (TCP_SEQ_GT(entry->seq + entry->len + (TCP_FLG_ISSET(entry->flg, TCP_FLG_SYN | TCP_FLG_FIN) ? 1 : 0), pcb->snd.una)) {
+            /* NOTE: not (or partially) acknowledged yet */
+            break;
+        }
+        list_pop(&pcb->queue);
+        debugf("remove, seq=%u, flags=%s, len=%u", entry->seq, tcp_flg_ntoa(entry->flg), entry->len);
+        if (!(entry->flags & TCP_QUEUE_FLAG_RESENT)) {
+            /* NOTE: Karn's algorithm, a retransmitted segment gives an ambiguous sample */
+            sent = entry->first;
+        }
+        memory_pool_free(entry);
+        removed = 1;
+    }
+    now = net_timer_clock();
+    if (sent) {
+        tcp_rtt_update(pcb, (now - sent) / 1000);
+    } else if (removed) {
+        tcp_rtt_sample_ts(pcb, seg);
+    }
+    /* RFC 6298 (5.2), (5.3) */
+    if (!list_peek(&pcb->queue)) {
+        pcb->rtx_timer = 0;
+    } else {
+        tcp_rtx_timer_restart(pcb, now);
+    }
+    return;
+}
+
+static size_t
+tcp_output_options(struct tcp_pcb *pcb, uint8_t flg, uint8_t *opt, size_t room);
+static void
+tcp_retransmit_queue_clear_retrans(void *arg, struct list_node *node);
+
+static void
+tcp_retransmit_queue_resend(struct tcp_pcb *pcb, struct tcp_queue_entry *entry)
+{
+    uint8_t opt[TCP_OPT_LEN_MAX];
+    size_t optlen;
+    uint32_t seq;
+    size_t len;
+
+    seq = entry->seq;
+    len = entry->len;
+    if (len && TCP_SEQ_LT(seq, pcb->snd.una)) {
+        /* partially acknowledged */
+        len -= pcb->snd.una - seq;
+        seq = pcb->snd.una;
+    }
+    optlen = tcp_output_options(pcb, entry->flg, opt, tcp_pcb_mss(pcb) - len);
+    tcp_ack_sent(pcb);
+    tcp_output_segment(seq, pcb->rcv.nxt, entry->flg, tcp_wnd_field(pcb, entry->flg), opt, optlen, &pcb->sbuf, seq - pcb->snd.una, len, &pcb->local, &pcb->foreign, &pcb->dst, 0);
+    entry->flags |= TCP_QUEUE_FLAG_RESENT;
+    pcb->retrans++;
+    stats_inc(STATS_TCP_RETRANS_SEGS);
+}
+
+static int
+tcp_output_data(struct tcp_pcb *pcb);
+
+/* NOTE: the retransmission timer expired, resend the earliest segment not acknowledged (RFC 6298 (5.4)-(5.6)) */
+static void
+tcp_retransmit_timer(struct tcp_pcb *pcb, uint64_t now)
+{
+    struct tcp_queue_entry *entry;
+
+    if (!pcb->rtx_timer || now < pcb->rtx_timer) {
+        return;
+    }
+    entry = tcp_queue_entry_of(list_peek(&pcb->queue));
+    if (!entry) {
+        pcb->rtx_timer = 0;
+        /* NOTE: armed for the data left unsent (see tcp_output_defer()) */
+        tcp_output_data(pcb);
+        return;
+    }
+    if (now - entry->first >= NET_TIMER_SEC(TCP_RETRANSMIT_DEADLINE)) {
+        if (pcb->state == TCP_PCB_STATE_SYN_SENT || pcb->state == TCP_PCB_STATE_SYN_RECEIVED) {
+            stats_inc(STATS_TCP_ATTEMPT_FAILS);
+        }
+        pcb->state = TCP_PCB_STATE_CLOSED;
+        pcb->rtx_timer = 0; /* NOTE: given up, released by the user */
+        sched_wakeup(&pcb->ctx);
+        return;
+    }
+    debugf("timeout, seq=%u, rto=%u", entry->seq, pcb->rto);
+    stats_inc(STATS_TCP_TIMEOUTS);
+    if (pcb->cong.mss && !(pcb->flags & TCP_PCB_FLAG_LOSS)) {
+        /* RFC 5681 (3.1): the loss window */
+        pcb->cong.ssthresh = pcb->cc->ssthresh(&pcb->cong, tcp_sbuf_inflight(pcb));
+        pcb->cong.cwnd = pcb->cong.mss;
+    }
+    /* NOTE: the rest of the window is repaired by the partial ACKs (RFC 6582) */
+    pcb->flags |= TCP_PCB_FLAG_RECOVERY | TCP_PCB_FLAG_LOSS;
+    pcb->recover = pcb->snd.nxt;
+    pcb->dupacks = 0;
+    list_foreach(&pcb->queue, tcp_retransmit_queue_clear_retrans, NULL);
+    entry->flags |= TCP_QUEUE_FLAG_RETRANS;
+    tcp_retransmit_queue_resend(pcb, entry);
+    pcb->rto = MIN(pcb->rto * 2, TCP_RTO_MAX);
+    tcp_rtx_timer_restart(pcb, now);
+}
+
+struct tcp_sack_update_arg {
+    struct tcp_pcb *pcb;
+    struct tcp_segment_info *seg;
+};
+
+static void
+tcp_retransmit_queue_sack(void *arg, struct list_node *node)
+{
+    struct tcp_sack_update_arg *sarg;
+    struct tcp_queue_entry *entry;
+    int i;
+
+    sarg = (struct tcp_sack_update_arg *)arg;
+    entry = tcp_queue_entry_of(node);
+    if (!entry->len || (entry->flags & TCP_QUEUE_FLAG_SACKED)) {
+        return;
+    }
+    for (i = 0; i < sarg->seg->sack_num; i++) {
+        if (TCP_SEQ_LE(sarg->seg->sack[i].left, entry->seq) && TCP_SEQ_LE(entry->seq + entry->len, sarg->seg->sack[i].right)) {
+            entry->flags |= TCP_QUEUE_FLAG_SACKED;
+            return;
+        }
+    }
+}
+
+/* NOTE: mark the entries covered by the SACK blocks (RFC 2018), these are not retransmitted */
+static void
+tcp_retransmit_queue_sack_update(struct tcp_pcb *pcb, struct tcp_segment_info *seg)
+{
+    struct tcp_sack_update_arg arg = {pcb, seg};
+    struct tcp_sack_block *block;
+    int i, n = 0;
+
+    for (i = 0; i < seg->sack_num; i++) {
+        block = &seg->sack[i];
+        /* discard the bogus blocks */
+        if (TCP_SEQ_GE(block->left, block->right) || TCP_SEQ_LT(block->left, pcb->snd.una) || TCP_SEQ_GT(block->right, pcb->snd.nxt)) {
+            continue;
+        }
+        seg->sack[n++] = *block;
+        if (TCP_SEQ_GT(block->right, pcb->sack_high)) {
+            pcb->sack_high = block->right;
+        }
+    }
+    seg->sack_num = n;
+    if (n) {
+        list_foreach(&pcb->queue, tcp_retransmit_queue_sack, &arg);
+    }
+}
+
+struct tcp_hole_arg {
+    struct tcp_pcb *pcb;
+    struct tcp_queue_entry *hole;
+};
+
+static void
+tcp_retransmit_queue_hole(void *arg, struct list_node *node)
+{
+    struct tcp_hole_arg *harg;
+    struct tcp_queue_entry *entry;
+    struct tcp_pcb *pcb;
+
+    harg = (struct tcp_hole_arg *)arg;
+    entry = tcp_queue_entry_of(node);
+    pcb = harg->pcb;
+    if (harg->hole || (entry->flags & (TCP_QUEUE_FLAG_SACKED | TCP_QUEUE_FLAG_RETRANS))) {
+        return;
+    }
+    if ((pcb->flags & TCP_PCB_FLAG_SACK_OK) && entry->seq != pcb->snd.una && TCP_SEQ_GE(entry->seq, pcb->sack_high)) {
+        /* NOTE: nothing above has been SACKed, not regarded as lost yet */
+        return;
+    }
+    harg->hole = entry;
+}
+
+/* retransmit the first segment regarded as lost, returns 0 if there is no such segment */
+static int
+tcp_retransmit_queue_repair(struct tcp_pcb *pcb)
+{
+    struct tcp_hole_arg arg = {pcb, NULL};
+
+    list_foreach(&pcb->queue, tcp_retransmit_queue_hole, &arg);
+    if (!arg.hole) {
+        return 0;
+    }
+    debugf("fast retransmit, seq=%u, len=%zu", arg.hole->seq, arg.hole->len);
+    arg.hole->flags |= TCP_QUEUE_FLAG_RETRANS;
+    tcp_retransmit_queue_resend(pcb, arg.hole);
+    return 1;
+}
+
+static void
+tcp_retransmit_queue_clear_retrans(void *arg, struct list_node *node)
+{
+    (void)arg;
+    tcp_queue_entry_of(node)->flags &= ~TCP_QUEUE_FLAG_RETRANS;
+}
+
+/*
+ * NOTE: fast retransmit and fast recovery (RFC 5681, NewReno: RFC 6582). with SACK, the
+ *       segments to repair are picked from the scoreboard (RFC 6675), one per duplicate ACK.
+ *       [acked] is the number of bytes newly acknowledged by the segment.
+ */
+static void
+tcp_fast_retransmit(struct tcp_pcb *pcb, struct tcp_segment_info *seg, uint32_t acked)
+{
+    struct tcp_cong *cong = &pcb->cong;
+    uint32_t inflight;
+
+    inflight = tcp_sbuf_inflight(pcb);
+    if (acked) {
+        if (!(pcb->flags & TCP_PCB_FLAG_RECOVERY)) {
+            pcb->dupacks = 0;
+            pcb->cc->cong_avoid(cong, acked);
+            return;
+        }
+        if (TCP_SEQ_GE(pcb->snd.una, pcb->recover)) {
+            debugf("exit recovery, una=%u", pcb->snd.una);
+            if (!(pcb->flags & TCP_PCB_FLAG_LOSS)) {
+                /* deflate the window (RFC 6582 (3.2) step 3) */
+                cong->cwnd = MIN(cong->ssthresh, MAX(inflight, cong->mss) + cong->mss);
+            }
+            pcb->flags &= ~(TCP_PCB_FLAG_RECOVERY | TCP_PCB_FLAG_LOSS);
+            pcb->dupacks = 0;
+            return;
+        }
+        if (pcb->flags & TCP_PCB_FLAG_LOSS) {
+            /* NOTE: after the timeout, the window restarts from the slow start */
+            pcb->cc->cong_avoid(cong, acked);
+        } else {
+            /* partial acknowledgment, deflate by the amount acknowledged (RFC 6582 (3.2) step 5) */
+            cong->cwnd = cong->cwnd > acked ? cong->cwnd - acked : 0;
+            if (acked >= cong->mss) {
+                cong->cwnd += cong->mss;
+            }
+            cong->cwnd = MAX(cong->cwnd, cong->mss);
+        }
+        /* the segment at SND.UNA is lost as well */
+        tcp_retransmit_queue_repair(pcb);
+        return;
+    }
+    /* RFC 5681: the definition of a duplicate acknowledgment */
+    if (seg->ack != pcb->snd.una || seg->len || seg->wnd != pcb->snd.wnd || pcb->snd.nxt == pcb->snd.una) {
+        return;
+    }
+    pcb->dupacks++;
+    if (pcb->flags & TCP_PCB_FLAG_RECOVERY) {
+        if (!(pcb->flags & TCP_PCB_FLAG_LOSS)) {
+            /* inflate the window, a segment has left the network */
+            cong->cwnd += cong->mss;
+        }
+        if (pcb->flags & TCP_PCB_FLAG_SACK_OK) {
+            tcp_retransmit_queue_repair(pcb);
+        }
+        return;
+    }
+    if (pcb->dupacks < TCP_DUPACK_THRESH) {
+        return;
+    }
+    cong->ssthresh = pcb->cc->ssthresh(cong, inflight);
+    cong->cwnd = cong->ssthresh + TCP_DUPACK_THRESH * cong->mss;
+    debugf("enter fast recovery, una=%u, nxt=%u, cwnd=%u, ssthresh=%u", pcb->snd.una, pcb->snd.nxt, cong->cwnd, cong->ssthresh);
+    stats_inc(STATS_TCP_FAST_RETRANS);
+    pcb->flags |= TCP_PCB_FLAG_RECOVERY;
+    pcb->recover = pcb->snd.nxt;
+    list_foreach(&pcb->queue, tcp_retransmit_queue_clear_retrans, NULL);
+    tcp_retransmit_queue_repair(pcb);
+}
+
+static void
+tcp_set_timewait_timer(struct tcp_pcb *pcb)
+{
+    pcb->tw_timer = net_timer_clock() + NET_TIMER_SEC(TCP_TIMEWAIT_SEC);
+    tcp_timer_schedule(pcb, pcb->tw_timer);
+    debugf("start time_wait timer: %d seconds", TCP_TIMEWAIT_SEC);
+}
+
+/*
+ * TCP Options
+ */
+
+static int
+tcp_parse_options(const uint8_t *opt, size_t len, struct tcp_segment_info *seg)
+{
+    uint32_t val[2];
+    int i, n;
+
+    while (len) {
+        if (opt[0] == TCP_OPT_KIND_EOL) {
+            break;
+        }
+        if (opt[0] == TCP_OPT_KIND_NOP) {
+            opt++;
+            len--;
+            continue;
+        }
+        if (len < 2 || opt[1] < 2 || opt[1] > len) {
+            errorf("malformed option, kind=%u", opt[0]);
+            return -1;
+        }
+        switch (opt[0]) {
+        case TCP_OPT_KIND_MSS:
+            if (opt[1] == 4) {
+                seg->mss = (opt[2] << 8) | opt[3];
+            }
+            break;
+        case TCP_OPT_KIND_WSCALE:
+            if (opt[1] == 3) {
+                seg->wscale = opt[2];
+            }
+            break;
+        case TCP_OPT_KIND_SACK_PERM:
+            seg->sack_perm = 1;
+            break;
+        case TCP_OPT_KIND_TIMESTAMP:
+            if (opt[1] != 10) {
+                break;
+            }
+            memcpy(val, opt + 2, sizeof(val));
+            seg->ts = 1;
+            seg->tsval = ntoh32(val[0]);
+            seg->tsecr = ntoh32(val[1]);
+            break;
+        case TCP_OPT_KIND_SACK:
+            n = (opt[1] - 2) / sizeof(val);
+            for (i = 0; i < n && seg->sack_num < TCP_SACK_BLOCK_MAX; i++) {
+                memcpy(val, opt + 2 + sizeof(val) * i, sizeof(val));
+                seg->sack[seg->sack_num].left = ntoh32(val[0]);
+                seg->sack[seg->sack_num].right = ntoh32(val[1]);
+                seg->sack_num++;
+            }
+            break;
+        default:
+            /* ignore: unknown options */
+            break;
+        }
+        len -= opt[1];
+        opt += opt[1];
+    }
+    return 0;
+}
+
+static size_t
+tcp_output_sack_block(uint8_t *p, struct tcp_ooo_entry *entry)
+{
+    uint32_t val[2];
+
+    val[0] = hton32(entry->seq);
+    val[1] = hton32(entry->end);
+    memcpy(p, val, sizeof(val));
+    return sizeof(val);
+}
+
+/* NOTE: build the options for the segment, room limits the length (the payload takes the rest of the MSS) */
+static size_t
+tcp_output_options(struct tcp_pcb *pcb, uint8_t flg, uint8_t *opt, size_t room)
+{
+    struct tcp_ooo_entry *entry, *first = NULL;
+    size_t len = 0, sack;
+    uint32_t val[2];
+    uint16_t mss;
+    int n = 0, syn, offer;
+
+    room = MIN(room, TCP_OPT_LEN_MAX);
+    syn = TCP_FLG_ISSET(flg, TCP_FLG_SYN);
+    /* NOTE: SYN offers always, SYN+ACK replies only to the offer */
+    offer = syn && !TCP_FLG_ISSET(flg, TCP_FLG_ACK);
+    if (syn) {
+        mss = tcp_local_mss(pcb);
+        opt[len++] = TCP_OPT_KIND_MSS;
+        opt[len++] = 4;
+        opt[len++] = mss >> 8;
+        opt[len++] = mss & 0xff;
+    }
+    if (syn && (offer || (pcb->flags & TCP_PCB_FLAG_WS_OK))) {
+        opt[len++] = TCP_OPT_KIND_NOP;
+        opt[len++] = TCP_OPT_KIND_WSCALE;
+        opt[len++] = 3;
+        opt[len++] = pcb->rcv.wscale;
+    }
+    if (syn && (offer || (pcb->flags & TCP_PCB_FLAG_SACK_OK))) {
+        opt[len++] = TCP_OPT_KIND_NOP;
+        opt[len++] = TCP_OPT_KIND_NOP;
+        opt[len++] = TCP_OPT_KIND_SACK_PERM;
+        opt[len++] = 2;
+    }
+    /* NOTE: once exchanged, the timestamps option is sent in every segment (RFC 7323) */
+    if (offer || (pcb->flags & TCP_PCB_FLAG_TS_OK)) {
+        opt[len++] = TCP_OPT_KIND_NOP;
+        opt[len++] = TCP_OPT_KIND_NOP;
+        opt[len++] = TCP_OPT_KIND_TIMESTAMP;
+        opt[len++] = 10;
+        val[0] = hton32(tcp_ts_now());
+        val[1] = hton32(pcb->ts_recent);
+        memcpy(opt + len, val, sizeof(val));
+        len += sizeof(val);
+    }
+    if (syn) {
+        return len;
+    }
+    if ((pcb->flags & TCP_PCB_FLAG_SACK_OK) && pcb->ooo && room >= len + 4 + 8) {
+        opt[len++] = TCP_OPT_KIND_NOP;
+        opt[len++] = TCP_OPT_KIND_NOP;
+        sack = len;
+        opt[len++] = TCP_OPT_KIND_SACK;
+        len++; /* length (fill in later) */
+        /* RFC 2018: the first block contains the most recently received segment */
+        for (entry = pcb->ooo; entry; entry = entry->next) {
+            if (TCP_SEQ_LE(entry->seq, pcb->ooo_last) && TCP_SEQ_LT(pcb->ooo_last, entry->end)) {
+                first = entry;
+                len += tcp_output_sack_block(opt + len, first);
+                n++;
+                break;
+            }
+        }
+        for (entry = pcb->ooo; entry && n < TCP_SACK_BLOCK_MAX && len + 8 <= room; entry = entry->next) {
+            if (entry != first) {
+                len += tcp_output_sack_block(opt + len, entry);
+                n++;
+            }
+        }
+        opt[sack + 1] = 2 + 8 * n;
+    }
+    return len;
+}
+
+/* NOTE: the payload is len bytes at off in buf (may be NULL if len is 0), dst is the one cached in the pcb (may be NULL) */
+static ssize_t
+tcp_output_segment(uint32_t seq, uint32_t ack, uint8_t flg, uint16_t wnd, uint8_t *opt, size_t optlen, struct tcp_buf *buf, size_t off, size_t len, struct ip_endpoint *local, struct ip_endpoint *foreign, struct ip_dst *dst, uint16_t gso_size)
+{
+    struct pbuf *pb;
+    struct tcp_hdr *hdr;
+    struct ip_dst route;
+    uint16_t total, psum, sum = 0;
+    int offload;
+    char ep1[IP_ENDPOINT_STR_LEN];
+    char ep2[IP_ENDPOINT_STR_LEN];
+
+    if (!dst) {
+        /* NOTE: no connection to cache it (e.g. RST) */
+        dst = &route;
+        dst->iface = NULL;
+    }
+    if (ip_dst_lookup_cached(dst, local->addr, foreign->addr) == -1) {
+        errorf("ip_dst_lookup_cached() failure");
+        return -1;
+    }
+    offload = NET_IFACE(dst->iface)->dev->offload & NET_DEVICE_OFFLOAD_TX_CSUM;
+    if (len <= gso_size) {
+        gso_size = 0;
+    }
+    pb = pbuf_alloc(sizeof(*hdr) + optlen + len);
+    if (!pb) {
+        errorf("pbuf_alloc() failure");
+        return -1;
+    }
+    hdr = (struct tcp_hdr *)pb->data;
+    hdr->src = local->port;
+    hdr->dst = foreign->port;
+    hdr->seq = hton32(seq);
+    hdr->ack = hton32(ack);
+    hdr->off = ((sizeof(*hdr) + optlen) >> 2) << 4;
+    hdr->flg = flg;
+    hdr->wnd = hton16(wnd);
+    hdr->sum = 0;
+    hdr->up = 0;
+    memcpy(hdr + 1, opt, optlen);
+    total = sizeof(*hdr) + optlen + len;
+    psum = cksum16_pseudo(local->addr, foreign->addr, IP_PROTOCOL_TCP, total);
+    if (offload || gso_size) {
+        tcp_buf_peek(buf, off, (uint8_t *)(hdr + 1) + optlen, len);
+        /* NOTE: completed by the device, or for each segment (see tcp_gso_segment()) */
+        hdr->sum = psum;
+        pbuf_csum_partial(pb, offsetof(struct tcp_hdr, sum));
+        pb->gso_size = gso_size;
+    } else {
+        /* NOTE: the payload is summed while copied, the header (at an even length) is summed on top of it */
+        sum = tcp_buf_peek_cksum(buf, off, (uint8_t *)(hdr + 1) + optlen, len);
+        hdr->sum = cksum16((uint16_t *)hdr, sizeof(*hdr) + optlen, (uint32_t)psum + sum);
+    }
+    debugf("%s => %s, len=%zu (payload=%zu)",
+        ip_endpoint_ntop(local, ep1, sizeof(ep1)), ip_endpoint_ntop(foreign, ep2, sizeof(ep2)), total, len);
+    tcp_dump((uint8_t *)hdr, total);
+    /* NOTE: including the retransmitted ones, a GSO packet counts as the segments it is split into */
+    stats_add(STATS_TCP_OUT_SEGS, gso_size && len > gso_size ? (len + gso_size - 1) / gso_size : 1);
+    if (TCP_FLG_ISSET(flg, TCP_FLG_RST)) {
+        stats_inc(STATS_TCP_OUT_RSTS);
+    }
+    tracef(TRACE_EVENT_TCP_OUTPUT, (uint32_t)ntoh16(local->port) << 16 | ntoh16(foreign->port),
+        seq, ack, (uint32_t)flg << 16 | (uint16_t)len);
+    if (ip_output_dst(IP_PROTOCOL_TCP, pb, dst) == -1) {
+        return -1;
     }
-    return NULL;
+    return len;
 }
 
-static void
-tcp_pcb_release(struct tcp_pcb *pcb)
+/*
+ * NOTE: splits a GSO segment (pb->data is at the TCP header) into gso_size each, the header is copied
+ *       to each segment with the sequence number and the checksum updated. PSH and FIN go to the last one.
+ */
+static struct pbuf *
+tcp_gso_segment(struct pbuf *pb, ip_addr_t src, ip_addr_t dst, uint16_t offload)
 {
-    struct queue_entry *entry;
-    struct tcp_pcb *est;
-    char ep1[IP_ENDPOINT_STR_LEN];
-    char ep2[IP_ENDPOINT_STR_LEN];
+    struct tcp_hdr *hdr, *shdr;
+    struct pbuf *segs = NULL, **nextp = &segs, *seg;
+    size_t hlen, plen, off, n;
+    uint32_t seq;
+    uint16_t psum, sum;
 
-    if (sched_ctx_destroy(&pcb->ctx) == -1) {
-        sched_wakeup(&pcb->ctx);
-        return;
-    }
-    while ((entry = queue_pop(&pcb->queue)) != NULL) {
-        memory_free(entry);
+    hdr = (struct tcp_hdr *)pb->data;
+    hlen = (hdr->off >> 4) << 2;
+    plen = pb->len - hlen;
+    seq = ntoh32(hdr->seq);
+    for (off = 0; off < plen; off += n) {
+        n = MIN(pb->gso_size, plen - off);
+        seg = pbuf_alloc(hlen + n);
+        if (!seg) {
+            errorf("pbuf_alloc() failure");
+            break;
+        }
+        *nextp = seg;
+        nextp = &seg->next;
+        shdr = (struct tcp_hdr *)seg->data;
+        memcpy(shdr, hdr, hlen);
+        shdr->seq = hton32(seq + off);
+        if (off + n < plen) {
+            shdr->flg &= ~(TCP_FLG_PSH | TCP_FLG_FIN);
+        }
+        psum = cksum16_pseudo(src, dst, IP_PROTOCOL_TCP, hlen + n);
+        if (offload & NET_DEVICE_OFFLOAD_TX_CSUM) {
+            memcpy((uint8_t *)shdr + hlen, pb->data + hlen + off, n);
+            shdr->sum = psum;
+            pbuf_csum_partial(seg, offsetof(struct tcp_hdr, sum));
+        } else {
+            sum = cksum16_copy((uint8_t *)shdr + hlen, pb->data + hlen + off, n, 0);
+            shdr->sum = 0;
+            shdr->sum = cksum16((uint16_t *)shdr, hlen, (uint32_t)psum + sum);
+        }
     }
-    while ((est = queue_pop(&pcb->backlog)) != NULL) {
-        tcp_pcb_release(est);
+    if (off < plen) {
+        for (; segs; segs = seg) {
+            seg = segs->next;
+            pbuf_free(segs);
+        }
+        return NULL;
     }
-    debugf("released, local=%s, foreign=%s",
-        ip_endpoint_ntop(&pcb->local, ep1, sizeof(ep1)), ip_endpoint_ntop(&pcb->foreign, ep2, sizeof(ep2)));
-    memset(pcb, 0, sizeof(*pcb));
+    return segs;
 }
 
-static struct tcp_pcb *
-tcp_pcb_select(struct ip_endpoint *local, struct ip_endpoint *foreign)
+/*
+ * NOTE: GRO, pb is chained to head (see pbuf.frags) if it is the next data of the same connection with the same
+ *       header (except the sequence number, PSH and the window). both are at the IP header (hlen), see ip_gro().
+ *       nothing is copied nor verified here, pb is pulled to its TCP header and tcp_input() takes the chain.
+ */
+static int
+tcp_gro(struct pbuf **head, struct pbuf *pb, size_t hlen, ip_addr_t src, ip_addr_t dst)
 {
-    struct tcp_pcb *pcb, *listen_pcb = NULL;
-
-    for (pcb = pcbs; pcb < tailof(pcbs); pcb++) {
-        if ((pcb->local.addr == IP_ADDR_ANY || pcb->local.addr == local->addr) && pcb->local.port == local->port) {
-            if (!foreign) {
-                return pcb;
-            }
-            if (pcb->foreign.addr == foreign->addr && pcb->foreign.port == foreign->port) {
-                return pcb;
-            }
-            if (pcb->state == TCP_PCB_STATE_LISTEN) {
-                if (pcb->foreign.addr == IP_ADDR_ANY && pcb->foreign.port == 0) {
-                    /* LISTENed with wildcard foreign address/port */
-                    listen_pcb = pcb;
-                }
-            }
-        }
-    }
-    return listen_pcb;
+    struct pbuf *last;
+    struct tcp_hdr *hdr, *hdr2, *lhdr;
+    size_t thlen, len, len2, llen, total;
+    struct pbuf **p;
+
+    (void)src;
+    (void)dst;
+    if ((*head)->len < hlen + sizeof(*hdr) || pb->len < hlen + sizeof(*hdr)) {
+        return NET_GRO_FLUSH;
+    }
+    hdr = (struct tcp_hdr *)((*head)->data + hlen);
+    hdr2 = (struct tcp_hdr *)(pb->data + hlen);
+    if (hdr->src != hdr2->src || hdr->dst != hdr2->dst) {
+        return NET_GRO_OTHER;
+    }
+    thlen = (hdr->off >> 4) << 2;
+    if (thlen < sizeof(*hdr) || thlen != (size_t)((hdr2->off >> 4) << 2) ||
+        (*head)->len <= hlen + thlen || pb->len <= hlen + thlen) {
+        return NET_GRO_FLUSH;
+    }
+    len = (*head)->len - hlen - thlen;
+    len2 = pb->len - hlen - thlen;
+    /* NOTE: the chained frames are already at their TCP header */
+    last = NULL;
+    for (p = &(*head)->frags; *p; p = &(*p)->next) {
+        last = *p;
+    }
+    lhdr = last ? (struct tcp_hdr *)last->data : hdr;
+    llen = last ? last->len - thlen : len;
+    total = ntoh32(lhdr->seq) + llen - ntoh32(hdr->seq);
+    /* NOTE: PSH (and a segment smaller than the first one) ends the merge */
+    if (lhdr->flg != TCP_FLG_ACK || (hdr2->flg & ~TCP_FLG_PSH) != TCP_FLG_ACK ||
+        hdr->ack != hdr2->ack || memcmp(hdr + 1, hdr2 + 1, thlen - sizeof(*hdr)) != 0 ||
+        ntoh32(hdr2->seq) != ntoh32(lhdr->seq) + llen) {
+        return NET_GRO_FLUSH;
+    }
+    if (llen != len || len2 > len) {
+        return NET_GRO_FLUSH;
+    }
+    /* NOTE: the aggregate stays within a datagram, as if it was received at once */
+    if (hlen + thlen + total + len2 > IP_TOTAL_SIZE_MAX) {
+        return NET_GRO_FLUSH;
+    }
+    /* NOTE: referred by the chain, the caller drops its own reference */
+    pbuf_pull(pb, hlen);
+    pb->next = NULL;
+    *p = pbuf_ref(pb);
+    (*head)->gso_size = len;
+    return NET_GRO_MERGED;
 }
 
-static struct tcp_pcb *
-tcp_pcb_get(int id)
+/* NOTE: the payload is len bytes at off in the send buffer, split into SMSS each if larger (GSO) */
+static ssize_t
+tcp_output(struct tcp_pcb *pcb, uint8_t flg, size_t off, size_t len)
 {
-    struct tcp_pcb *pcb;
+    uint32_t seq;
+    uint8_t opt[TCP_OPT_LEN_MAX];
+    size_t optlen, smss;
 
-    if (id < 0 || id >= (int)countof(pcbs)) {
-        /* out of range */
-        return NULL;
+    seq = pcb->snd.nxt;
+    if (TCP_FLG_ISSET(flg, TCP_FLG_SYN)) {
+        seq = pcb->iss;
     }
-    pcb = &pcbs[id];
-    if (pcb->state == TCP_PCB_STATE_FREE) {
-        return NULL;
+    smss = tcp_pcb_smss(pcb);
+    /* NOTE: GSO, the segments split later are retransmitted (and SACKed) one by one as usual */
+    if (TCP_FLG_ISSET(flg, TCP_FLG_SYN | TCP_FLG_FIN) || len) {
+        if (tcp_retransmit_queue_add(pcb, seq, flg, len, smss) == -1) {
+            /* NOTE: not sent, it would never be retransmitted */
+            errno = ENOMEM;
+            return -1;
+        }
     }
-    return pcb;
+    optlen = tcp_output_options(pcb, flg, opt, tcp_pcb_mss(pcb) - MIN(len, smss));
+    tcp_ack_sent(pcb);
+    return tcp_output_segment(seq, pcb->rcv.nxt, flg, tcp_wnd_field(pcb, flg), opt, optlen, &pcb->sbuf, off, len, &pcb->local, &pcb->foreign, &pcb->dst, smss);
 }
 
+/*
+ * Nagle's algorithm (RFC 1122 (4.2.3.4), RFC 9293 (3.7.4))
+ * NOTE: whether a segment smaller than SMSS may be sent now, otherwise it is held while
+ *       data is in flight (and coalesced with the data written afterwards).
+ */
 static int
-tcp_pcb_id(struct tcp_pcb *pcb)
+tcp_nagle_ok(struct tcp_pcb *pcb, size_t len, size_t unsent, size_t inflight)
 {
-    return indexof(pcbs, pcb);
+    if (pcb->flags & TCP_PCB_FLAG_FIN_QUEUED) {
+        return 1;
+    }
+    if ((pcb->flags & TCP_PCB_FLAG_CORK) && len == unsent) {
+        /* NOTE: the application is going to write more (not applied to the window limited one) */
+        return 0;
+    }
+    return (pcb->flags & TCP_PCB_FLAG_NODELAY) || !inflight;
 }
 
-/*
- * TCP Retransmit
- *
- * NOTE: TCP Retransmit functions must be called after mutex locked
- */
+static void
+tcp_persist(struct tcp_pcb *pcb, uint64_t now);
+
+/* NOTE: no retransmission entry for the segment, left in the send buffer and retried by the next ACK or the timer */
+static void
+tcp_output_defer(struct tcp_pcb *pcb)
+{
+    if (!pcb->rtx_timer) {
+        tcp_rtx_timer_restart(pcb, net_timer_clock());
+    }
+}
 
+/* NOTE: transmit the unsent data in the send buffer as far as the send window allows */
 static int
-tcp_retransmit_queue_add(struct tcp_pcb *pcb, uint32_t seq, uint8_t flg, uint8_t *data, size_t len)
+tcp_output_data(struct tcp_pcb *pcb)
 {
-    struct tcp_queue_entry *entry;
+    size_t inflight, unsent, swnd, wnd, smss, len;
+    uint8_t flg;
 
-    entry = memory_alloc(sizeof(*entry) + len);
-    if (!entry) {
-        errorf("memory_alloc() failure");
-        return -1;
+    switch (pcb->state) {
+    case TCP_PCB_STATE_ESTABLISHED:
+    case TCP_PCB_STATE_CLOSE_WAIT:
+    case TCP_PCB_STATE_FIN_WAIT1:
+    case TCP_PCB_STATE_LAST_ACK:
+        break;
+    default:
+        return 0;
     }
-    entry->rto = TCP_DEFAULT_RTO;
-    entry->seq = seq;
-    entry->flg = flg;
-    entry->len = len;
-    memcpy(entry + 1, data, entry->len);
-    gettimeofday(&entry->first, NULL);
-    entry->last = entry->first;
-    if (!queue_push(&pcb->queue, entry)) {
-        errorf("queue_push() failure");
-        memory_free(entry);
-        return -1;
+    /* NOTE: the segments sent in a row are handed down to the device together */
+    net_tx_begin();
+    while (1) {
+        inflight = tcp_sbuf_inflight(pcb);
+        unsent = pcb->sbuf.len - inflight;
+        if (!unsent) {
+            break;
+        }
+        /* NOTE: limited by both the peer (flow control) and the network (congestion control) */
+        swnd = MIN(pcb->snd.wnd, pcb->cong.cwnd);
+        wnd = swnd > inflight ? swnd - inflight : 0;
+        if (!wnd) {
+            /* NOTE: wait for the window update, the peer is probed if it closed the window (see tcp_persist()) */
+            if (!pcb->snd.wnd) {
+                tcp_persist(pcb, net_timer_clock());
+            }
+            break;
+        }
+        smss = tcp_pcb_smss(pcb);
+        len = MIN(MIN(smss, unsent), wnd);
+        if (len < smss && !tcp_nagle_ok(pcb, len, unsent, inflight)) {
+            break;
+        }
+        if (len == smss && smss * 2 <= TCP_GSO_SIZE_MAX) {
+            /* NOTE: the full-sized segments in a row are built as one (see tcp_gso_segment()) */
+            len = MIN(MIN(unsent, wnd), TCP_GSO_SIZE_MAX);
+            len -= len % smss;
+        }
+        /* NOTE: push only when the segment empties the send buffer */
+        flg = TCP_FLG_ACK | (len == unsent ? TCP_FLG_PSH : 0);
+        if (tcp_output(pcb, flg, inflight, len) == -1) {
+            if (errno == ENOMEM) {
+                tcp_output_defer(pcb);
+                break;
+            }
+            errorf("tcp_output() failure");
+            net_tx_end();
+            return -1;
+        }
+        pcb->snd.nxt += len;
+    }
+    if ((pcb->flags & TCP_PCB_FLAG_FIN_QUEUED) && !(pcb->flags & TCP_PCB_FLAG_FIN_SENT) && !unsent) {
+        if (tcp_output(pcb, TCP_FLG_ACK | TCP_FLG_FIN, 0, 0) == -1 && errno == ENOMEM) {
+            tcp_output_defer(pcb);
+        } else {
+            pcb->snd.nxt++;
+            pcb->flags |= TCP_PCB_FLAG_FIN_SENT;
+        }
     }
+    net_tx_end();
     return 0;
 }
 
+/* NOTE: queue FIN, it is sent after all the data in the send buffer */
 static void
-tcp_retransmit_queue_cleanup(struct tcp_pcb *pcb)
+tcp_output_fin(struct tcp_pcb *pcb)
 {
-    struct tcp_queue_entry *entry;
-
-    while ((entry = queue_peek(&pcb->queue))) {
-        if (entry->seq >= pcb->snd.una) {
-            break;
-        }
-        entry = queue_pop(&pcb->queue);
-        debugf("remove, seq=%u, flags=%s, len=%u", entry->seq, tcp_flg_ntoa(entry->flg), entry->len);
-        memory_free(entry);
-    }
-    return;
+    pcb->flags |= TCP_PCB_FLAG_FIN_QUEUED;
+    tcp_output_data(pcb);
 }
 
+/* NOTE: zero window probe, a segment with an old sequence number elicits an ACK with the current window */
 static void
-tcp_retransmit_queue_emit(void *arg, void *data)
+tcp_persist(struct tcp_pcb *pcb, uint64_t now)
 {
-    struct tcp_pcb *pcb;
-    struct tcp_queue_entry *entry;
-    struct timeval now, diff, timeout;
+    uint8_t opt[TCP_OPT_LEN_MAX];
+    size_t optlen;
 
-    pcb = (struct tcp_pcb *)arg;
-    entry = (struct tcp_queue_entry *)data;
-    gettimeofday(&now, NULL);
-    timersub(&now, &entry->first, &diff);
-    if (diff.tv_sec >= TCP_RETRANSMIT_DEADLINE) {
-        pcb->state = TCP_PCB_STATE_CLOSED;
-        sched_wakeup(&pcb->ctx);
+    if (pcb->snd.wnd || pcb->snd.nxt != pcb->snd.una || !pcb->sbuf.len) {
+        pcb->persist = 0;
         return;
     }
-    timeout = entry->last;
-    timeval_add_usec(&timeout, entry->rto);
-    if (timercmp(&now, &timeout, >)) {
-        tcp_output_segment(entry->seq, pcb->rcv.nxt, entry->flg, pcb->rcv.wnd, (uint8_t *)(entry+1), entry->len, &pcb->local, &pcb->foreign);
-        entry->last = now;
-        entry->rto *= 2;
+    if (!pcb->persist) {
+        pcb->persist = now + NET_TIMER_USEC(TCP_PERSIST_INTERVAL);
+        tcp_timer_schedule(pcb, pcb->persist);
+        return;
+    }
+    if (now >= pcb->persist) {
+        debugf("zero window probe");
+        optlen = tcp_output_options(pcb, TCP_FLG_ACK, opt, TCP_OPT_LEN_MAX);
+        tcp_ack_sent(pcb);
+        tcp_output_segment(pcb->snd.una - 1, pcb->rcv.nxt, TCP_FLG_ACK, tcp_wnd_field(pcb, TCP_FLG_ACK), opt, optlen, NULL, 0, 0, &pcb->local, &pcb->foreign, &pcb->dst, 0);
+        pcb->persist = now + NET_TIMER_USEC(TCP_PERSIST_INTERVAL);
+        tcp_timer_schedule(pcb, pcb->persist);
     }
 }
 
+/*
+ * Delayed ACK (RFC 1122 (4.2.3.2), RFC 5681 (4.2))
+ * NOTE: acknowledge at least every second full-sized segment, otherwise wait for a segment
+ *       to piggyback on (data or window update) until the timer expires.
+ */
 static void
-tcp_set_timewait_timer(struct tcp_pcb *pcb)
+tcp_ack_schedule(struct tcp_pcb *pcb, size_t len, int immediate)
 {
-    gettimeofday(&pcb->tw_timer, NULL);
-    pcb->tw_timer.tv_sec += TCP_TIMEWAIT_SEC;
-    debugf("start time_wait timer: %d seconds", TCP_TIMEWAIT_SEC);
+    pcb->rcv_mss = MAX(pcb->rcv_mss, MIN(len, tcp_local_mss(pcb)));
+    pcb->ack_pending += len;
+    /* NOTE: also when half of the buffer is waiting, not to stall the sender with a small window */
+    if (immediate || (pcb->flags & TCP_PCB_FLAG_QUICKACK) ||
+        pcb->ack_pending >= MIN(2 * (size_t)pcb->rcv_mss, pcb->rbuf.limit / 2)) {
+        tcp_output(pcb, TCP_FLG_ACK, 0, 0);
+        return;
+    }
+    if (!pcb->delack) {
+        pcb->delack = net_timer_clock() + NET_TIMER_USEC(TCP_DELACK_TIMEOUT);
+        tcp_timer_schedule(pcb, pcb->delack);
+    }
 }
 
-static ssize_t
-tcp_output_segment(uint32_t seq, uint32_t ack, uint8_t flg, uint16_t wnd, uint8_t *data, size_t len, struct ip_endpoint *local, struct ip_endpoint *foreign)
+static void
+tcp_delack_timer(struct tcp_pcb *pcb, uint64_t now)
 {
-    uint8_t buf[IP_PAYLOAD_SIZE_MAX] = {};
-    struct tcp_hdr *hdr;
-    struct pseudo_hdr pseudo;
-    uint16_t psum;
-    uint16_t total;
-    char ep1[IP_ENDPOINT_STR_LEN];
-    char ep2[IP_ENDPOINT_STR_LEN];
-
-    hdr = (struct tcp_hdr *)buf;
-    hdr->src = local->port;
-    hdr->dst = foreign->port;
-    hdr->seq = hton32(seq);
-    hdr->ack = hton32(ack);
-    hdr->off = (sizeof(*hdr) >> 2) << 4;
-    hdr->flg = flg;
-    hdr->wnd = hton16(wnd);
-    hdr->sum = 0;
-    hdr->up = 0;
-    memcpy(hdr + 1, data, len);
-    pseudo.src = local->addr;
-    pseudo.dst = foreign->addr;
-    pseudo.zero = 0;
-    pseudo.protocol = IP_PROTOCOL_TCP;
-    total = sizeof(*hdr) + len;
-    pseudo.len = hton16(total);
-    psum = ~cksum16((uint16_t *)&pseudo, sizeof(pseudo), 0);
-    hdr->sum = cksum16((uint16_t *)hdr, total, psum);
-    debugf("%s => %s, len=%zu (payload=%zu)",
-        ip_endpoint_ntop(local, ep1, sizeof(ep1)), ip_endpoint_ntop(foreign, ep2, sizeof(ep2)), total, len);
-    tcp_dump((uint8_t *)hdr, total);
-    if (ip_output(IP_PROTOCOL_TCP, (uint8_t *)hdr, total, local->addr, foreign->addr) == -1) {
-        return -1;
+    if (pcb->delack && now >= pcb->delack) {
+        debugf("delayed ACK, pending=%zu", pcb->ack_pending);
+        tcp_output(pcb, TCP_FLG_ACK, 0, 0);
     }
-    return len;
 }
 
-static ssize_t
-tcp_output(struct tcp_pcb *pcb, uint8_t flg, uint8_t *data, size_t len)
+/*
+ * rfc793 - section 3.9 [Event Processing > SEGMENT ARRIVES]
+ * NOTE: the pcb is locked by the caller, *est is set when a connection to be queued to its listener is established
+ */
+/*
+ * NOTE: PAWS (RFC 7323 5.3), a segment with a timestamp older than TS.Recent is a duplicate from the past,
+ *       unless TS.Recent got stale while the connection was idle (then it is taken as invalid).
+ */
+static int
+tcp_paws_reject(struct tcp_pcb *pcb, struct tcp_segment_info *seg, uint8_t flags)
 {
-    uint32_t seq;
-
-    seq = pcb->snd.nxt;
-    if (TCP_FLG_ISSET(flg, TCP_FLG_SYN)) {
-        seq = pcb->iss;
+    if (!(pcb->flags & TCP_PCB_FLAG_TS_OK) || !seg->ts || TCP_FLG_ISSET(flags, TCP_FLG_RST)) {
+        return 0;
     }
-    if (TCP_FLG_ISSET(flg, TCP_FLG_SYN | TCP_FLG_FIN) || len) {
-        tcp_retransmit_queue_add(pcb, seq, flg, data, len);
+    if ((int32_t)(seg->tsval - pcb->ts_recent) >= 0) {
+        return 0;
+    }
+    if (net_timer_clock() - pcb->ts_recent_age > NET_TIMER_SEC(TCP_PAWS_IDLE)) {
+        pcb->ts_recent = seg->tsval;
+        pcb->ts_recent_age = net_timer_clock();
+        return 0;
     }
-    return tcp_output_segment(seq, pcb->rcv.nxt, flg, pcb->rcv.wnd, data, len, &pcb->local, &pcb->foreign);
+    return 1;
 }
 
-/* rfc793 - section 3.9 [Event Processing > SEGMENT ARRIVES] */
 static void
-tcp_segment_arrives(struct tcp_segment_info *seg, uint8_t flags, uint8_t *data, size_t len, struct ip_endpoint *local, struct ip_endpoint *foreign)
+tcp_segment_arrives(struct tcp_pcb *pcb, struct tcp_pcb **est, struct tcp_segment_info *seg, uint8_t flags, uint8_t *data, size_t len, struct ip_endpoint *local, struct ip_endpoint *foreign)
 {
-    struct tcp_pcb *pcb, *new_pcb;
+    struct tcp_pcb *new_pcb = NULL;
     int acceptable = 0;
+    int hole;
+    uint32_t acked, offset;
 
-    pcb = tcp_pcb_select(local, foreign);
     if (!pcb || pcb->state == TCP_PCB_STATE_CLOSED) {
         if (TCP_FLG_ISSET(flags, TCP_FLG_RST)) {
             return;
         }
         if (!TCP_FLG_ISSET(flags, TCP_FLG_ACK)) {
-            tcp_output_segment(0, seg->seq + seg->len, TCP_FLG_RST | TCP_FLG_ACK, 0, NULL, 0, local, foreign);
+            tcp_output_segment(0, seg->seq + seg->len, TCP_FLG_RST | TCP_FLG_ACK, 0, NULL, 0, NULL, 0, 0, local, foreign, NULL, 0);
         } else {
-            tcp_output_segment(seg->ack, 0, TCP_FLG_RST, 0, NULL, 0, local, foreign);
+            tcp_output_segment(seg->ack, 0, TCP_FLG_RST, 0, NULL, 0, NULL, 0, 0, local, foreign, NULL, 0);
         }
         return;
     }
@@ -412,7 +1946,7 @@ tcp_segment_arrives(struct tcp_segment_info *seg, uint8_t flags, uint8_t *data,
          * second check for an ACK
          */
         if (TCP_FLG_ISSET(flags, TCP_FLG_ACK)) {
-            tcp_output_segment(seg->ack, 0, TCP_FLG_RST, 0, NULL, 0, local, foreign);
+            tcp_output_segment(seg->ack, 0, TCP_FLG_RST, 0, NULL, 0, NULL, 0, 0, local, foreign, NULL, 0);
             return;
         }
         /*
@@ -429,18 +1963,31 @@ tcp_segment_arrives(struct tcp_segment_info *seg, uint8_t flags, uint8_t *data,
                 }
                 new_pcb->mode = TCP_PCB_MODE_SOCKET;
                 new_pcb->parent = pcb;
+                new_pcb->rbuf.limit = pcb->rbuf.limit;
+                new_pcb->sbuf.limit = pcb->sbuf.limit;
+                new_pcb->cc = pcb->cc;
+                new_pcb->flags = pcb->flags & (TCP_PCB_FLAG_NODELAY | TCP_PCB_FLAG_CORK);
                 pcb = new_pcb;
             }
+            rwlock_wrlock(&table_lock);
             pcb->local = *local;
             pcb->foreign = *foreign;
-            pcb->rcv.wnd = sizeof(pcb->buf);
+            tcp_pcb_hash(pcb);
+            rwlock_unlock(&table_lock);
             pcb->rcv.nxt = seg->seq + 1;
             pcb->irs = seg->seq;
+            pcb->rcv.wscale = tcp_wscale_select(pcb);
+            tcp_syn_options(pcb, seg);
+            pcb->rcv.wnd = tcp_rcv_wnd(pcb);
             pcb->iss = random();
-            tcp_output(pcb, TCP_FLG_SYN | TCP_FLG_ACK, NULL, 0);
+            tcp_output(pcb, TCP_FLG_SYN | TCP_FLG_ACK, 0, 0);
             pcb->snd.nxt = pcb->iss + 1;
             pcb->snd.una = pcb->iss;
             pcb->state = TCP_PCB_STATE_SYN_RECEIVED;
+            stats_inc(STATS_TCP_PASSIVE_OPENS);
+            if (new_pcb) {
+                mutex_unlock(&new_pcb->lock);
+            }
             /* ignore: Note that any other incoming control or data (combined with SYN) will be processed
                         in the SYN-RECEIVED state, but processing of SYN and ACK  should not be repeated */
             return;
@@ -455,11 +2002,11 @@ tcp_segment_arrives(struct tcp_segment_info *seg, uint8_t flags, uint8_t *data,
          * first check the ACK bit
          */
         if (TCP_FLG_ISSET(flags, TCP_FLG_ACK)) {
-            if (seg->ack <= pcb->iss || seg->ack > pcb->snd.nxt) {
-                tcp_output_segment(seg->ack, 0, TCP_FLG_RST, 0, NULL, 0, local, foreign);
+            if (TCP_SEQ_LE(seg->ack, pcb->iss) || TCP_SEQ_GT(seg->ack, pcb->snd.nxt)) {
+                tcp_output_segment(seg->ack, 0, TCP_FLG_RST, 0, NULL, 0, NULL, 0, 0, local, foreign, NULL, 0);
                 return;
             }
-            if (pcb->snd.una <= seg->ack && seg->ack <= pcb->snd.nxt) {
+            if (TCP_SEQ_LE(pcb->snd.una, seg->ack) && TCP_SEQ_LE(seg->ack, pcb->snd.nxt)) {
                 acceptable = 1;
             }
         }
@@ -469,6 +2016,7 @@ tcp_segment_arrives(struct tcp_segment_info *seg, uint8_t flags, uint8_t *data,
         if (TCP_FLG_ISSET(flags, TCP_FLG_RST)) {
             if (acceptable) {
                 errorf("connection reset");
+                stats_inc(STATS_TCP_ATTEMPT_FAILS);
                 pcb->state = TCP_PCB_STATE_CLOSED;
                 tcp_pcb_release(pcb);
             }
@@ -484,13 +2032,16 @@ tcp_segment_arrives(struct tcp_segment_info *seg, uint8_t flags, uint8_t *data,
         if (TCP_FLG_ISSET(flags, TCP_FLG_SYN)) {
             pcb->rcv.nxt = seg->seq + 1;
             pcb->irs = seg->seq;
+            tcp_syn_options(pcb, seg);
+            pcb->rcv.wnd = tcp_rcv_wnd(pcb);
             if (acceptable) {
                 pcb->snd.una = seg->ack;
-                tcp_retransmit_queue_cleanup(pcb);
+                tcp_retransmit_queue_cleanup(pcb, seg);
             }
-            if (pcb->snd.una > pcb->iss) {
+            if (TCP_SEQ_GT(pcb->snd.una, pcb->iss)) {
                 pcb->state = TCP_PCB_STATE_ESTABLISHED;
-                tcp_output(pcb, TCP_FLG_ACK, NULL, 0);
+                tcp_cong_start(pcb);
+                tcp_output(pcb, TCP_FLG_ACK, 0, 0);
                 /* NOTE: not specified in the RFC793, but send window initialization required */
                 pcb->snd.wnd = seg->wnd;
                 pcb->snd.wl1 = seg->seq;
@@ -500,7 +2051,7 @@ tcp_segment_arrives(struct tcp_segment_info *seg, uint8_t flags, uint8_t *data,
                 return;
             } else {
                 pcb->state = TCP_PCB_STATE_SYN_RECEIVED;
-                tcp_output(pcb, TCP_FLG_SYN | TCP_FLG_ACK, NULL, 0);
+                tcp_output(pcb, TCP_FLG_SYN | TCP_FLG_ACK, 0, 0);
                 /* ignore: If there are other controls or text in the segment, queue them for processing after the ESTABLISHED state has been reached */
                 return;
             }
@@ -514,6 +2065,10 @@ tcp_segment_arrives(struct tcp_segment_info *seg, uint8_t flags, uint8_t *data,
     /*
      * Otherwise
      */
+    /* RFC 7323 (2.3): the window field in a segment without SYN is scaled */
+    if ((pcb->flags & TCP_PCB_FLAG_WS_OK) && !TCP_FLG_ISSET(flags, TCP_FLG_SYN)) {
+        seg->wnd <<= pcb->snd.wscale;
+    }
     /*
      * first check sequence number
      */
@@ -526,13 +2081,18 @@ tcp_segment_arrives(struct tcp_segment_info *seg, uint8_t flags, uint8_t *data,
     case TCP_PCB_STATE_CLOSING:
     case TCP_PCB_STATE_LAST_ACK:
     case TCP_PCB_STATE_TIME_WAIT:
+        if (tcp_paws_reject(pcb, seg, flags)) {
+            stats_inc(STATS_TCP_PAWS_DROPS);
+            tcp_output(pcb, TCP_FLG_ACK, 0, 0);
+            return;
+        }
         if (!seg->len) {
             if (!pcb->rcv.wnd) {
                 if (seg->seq == pcb->rcv.nxt) {
                     acceptable = 1;
                 }
             } else {
-                if (pcb->rcv.nxt <= seg->seq && seg->seq < pcb->rcv.nxt + pcb->rcv.wnd) {
+                if (TCP_SEQ_LE(pcb->rcv.nxt, seg->seq) && TCP_SEQ_LT(seg->seq, pcb->rcv.nxt + pcb->rcv.wnd)) {
                     acceptable = 1;
                 }
             }
@@ -540,18 +2100,23 @@ tcp_segment_arrives(struct tcp_segment_info *seg, uint8_t flags, uint8_t *data,
             if (!pcb->rcv.wnd) {
                 /* not acceptable */
             } else {
-                if ((pcb->rcv.nxt <= seg->seq && seg->seq < pcb->rcv.nxt + pcb->rcv.wnd) ||
-                    (pcb->rcv.nxt <= seg->seq + seg->len - 1 && seg->seq + seg->len - 1 < pcb->rcv.nxt + pcb->rcv.wnd)) {
+                if ((TCP_SEQ_LE(pcb->rcv.nxt, seg->seq) && TCP_SEQ_LT(seg->seq, pcb->rcv.nxt + pcb->rcv.wnd)) ||
+                    (TCP_SEQ_LE(pcb->rcv.nxt, seg->seq + seg->len - 1) && TCP_SEQ_LT(seg->seq + seg->len - 1, pcb->rcv.nxt + pcb->rcv.wnd))) {
                     acceptable = 1;
                 }
             }
         }
         if (!acceptable) {
             if (!TCP_FLG_ISSET(flags, TCP_FLG_RST)) {
-                tcp_output(pcb, TCP_FLG_ACK, NULL, 0);
+                tcp_output(pcb, TCP_FLG_ACK, 0, 0);
             }
             return;
         }
+        /* RFC 7323: the timestamp to echo, RCV.NXT stands in for Last.ACK.sent */
+        if ((pcb->flags & TCP_PCB_FLAG_TS_OK) && seg->ts && TCP_SEQ_LE(seg->seq, pcb->rcv.nxt) && (int32_t)(seg->tsval - pcb->ts_recent) >= 0) {
+            pcb->ts_recent = seg->tsval;
+            pcb->ts_recent_age = net_timer_clock();
+        }
         /*
          * In the following it is assumed that the segment is the idealized
          * segment that begins at RCV.NXT and does not exceed the window.
@@ -568,6 +2133,7 @@ tcp_segment_arrives(struct tcp_segment_info *seg, uint8_t flags, uint8_t *data,
     switch (pcb->state) {
     case TCP_PCB_STATE_SYN_RECEIVED:
         if (TCP_FLG_ISSET(flags, TCP_FLG_RST)) {
+            stats_inc(STATS_TCP_ATTEMPT_FAILS);
             pcb->state = TCP_PCB_STATE_CLOSED;
             tcp_pcb_release(pcb);
             return;
@@ -579,6 +2145,9 @@ tcp_segment_arrives(struct tcp_segment_info *seg, uint8_t flags, uint8_t *data,
     case TCP_PCB_STATE_CLOSE_WAIT:
         if (TCP_FLG_ISSET(flags, TCP_FLG_RST)) {
             errorf("connection reset");
+            if (pcb->state == TCP_PCB_STATE_ESTABLISHED || pcb->state == TCP_PCB_STATE_CLOSE_WAIT) {
+                stats_inc(STATS_TCP_ESTAB_RESETS);
+            }
             pcb->state = TCP_PCB_STATE_CLOSED;
             tcp_pcb_release(pcb);
             return;
@@ -610,7 +2179,7 @@ tcp_segment_arrives(struct tcp_segment_info *seg, uint8_t flags, uint8_t *data,
     case TCP_PCB_STATE_LAST_ACK:
     case TCP_PCB_STATE_TIME_WAIT:
         if (TCP_FLG_ISSET(flags, TCP_FLG_SYN)) {
-            tcp_output(pcb, TCP_FLG_RST, NULL, 0);
+            tcp_output(pcb, TCP_FLG_RST, 0, 0);
             errorf("connection reset");
             pcb->state = TCP_PCB_STATE_CLOSED;
             tcp_pcb_release(pcb);
@@ -626,15 +2195,16 @@ tcp_segment_arrives(struct tcp_segment_info *seg, uint8_t flags, uint8_t *data,
     }
     switch (pcb->state) {
     case TCP_PCB_STATE_SYN_RECEIVED:
-        if (pcb->snd.una <= seg->ack && seg->ack <= pcb->snd.nxt) {
+        if (TCP_SEQ_LE(pcb->snd.una, seg->ack) && TCP_SEQ_LE(seg->ack, pcb->snd.nxt)) {
             pcb->state = TCP_PCB_STATE_ESTABLISHED;
+            tcp_cong_start(pcb);
             sched_wakeup(&pcb->ctx);
             if (pcb->parent) {
-                queue_push(&pcb->parent->backlog, pcb);
-                sched_wakeup(&pcb->parent->ctx);
+                /* NOTE: queued to the listener after the lock of the pcb released (see tcp_pcb_enqueue) */
+                *est = pcb;
             }
         } else {
-            tcp_output_segment(seg->ack, 0, TCP_FLG_RST, 0, NULL, 0, local, foreign);
+            tcp_output_segment(seg->ack, 0, TCP_FLG_RST, 0, NULL, 0, NULL, 0, 0, local, foreign, NULL, 0);
             return;
         }
         /* fall through */
@@ -643,25 +2213,47 @@ tcp_segment_arrives(struct tcp_segment_info *seg, uint8_t flags, uint8_t *data,
     case TCP_PCB_STATE_FIN_WAIT2:
     case TCP_PCB_STATE_CLOSE_WAIT:
     case TCP_PCB_STATE_CLOSING:
-        if (pcb->snd.una < seg->ack && seg->ack <= pcb->snd.nxt) {
+        if (TCP_SEQ_LT(pcb->snd.una, seg->ack) && TCP_SEQ_LE(seg->ack, pcb->snd.nxt)) {
+            acked = seg->ack - pcb->snd.una;
+            if (pcb->snd.una == pcb->iss) {
+                acked--; /* SYN consumes one sequence number */
+            }
+            tcp_buf_consume(&pcb->sbuf, acked);
+            tcp_buf_shrink_schedule(pcb);
             pcb->snd.una = seg->ack;
-            tcp_retransmit_queue_cleanup(pcb);
-            /* ignore: Users should receive positive acknowledgments for buffers
-                        which have been SENT and fully acknowledged (i.e., SEND buffer should be returned with "ok" response) */
-            if (pcb->snd.wl1 < seg->seq || (pcb->snd.wl1 == seg->seq && pcb->snd.wl2 <= seg->ack)) {
+            tcp_retransmit_queue_cleanup(pcb, seg);
+            if (pcb->flags & TCP_PCB_FLAG_SACK_OK) {
+                tcp_retransmit_queue_sack_update(pcb, seg);
+            }
+            if (acked) {
+                /* NOTE: not for the ACK of our SYN */
+                tcp_fast_retransmit(pcb, seg, acked);
+            }
+            /* NOTE: wake up the sender waiting for space in the send buffer */
+            sched_wakeup(&pcb->ctx);
+        } else if (TCP_SEQ_LT(seg->ack, pcb->snd.una)) {
+            /* ignore */
+        } else if (TCP_SEQ_GT(seg->ack, pcb->snd.nxt)) {
+            tcp_output(pcb, TCP_FLG_ACK, 0, 0);
+            return;
+        } else {
+            if (pcb->flags & TCP_PCB_FLAG_SACK_OK) {
+                tcp_retransmit_queue_sack_update(pcb, seg);
+            }
+            tcp_fast_retransmit(pcb, seg, 0);
+        }
+        if (TCP_SEQ_LE(pcb->snd.una, seg->ack) && TCP_SEQ_LE(seg->ack, pcb->snd.nxt)) {
+            /* NOTE: update the send window also by a pure window update (SEG.ACK == SND.UNA) */
+            if (TCP_SEQ_LT(pcb->snd.wl1, seg->seq) || (pcb->snd.wl1 == seg->seq && TCP_SEQ_LE(pcb->snd.wl2, seg->ack))) {
                 pcb->snd.wnd = seg->wnd;
                 pcb->snd.wl1 = seg->seq;
                 pcb->snd.wl2 = seg->ack;
             }
-        } else if (seg->ack < pcb->snd.una) {
-            /* ignore */
-        } else if (seg->ack > pcb->snd.nxt) {
-            tcp_output(pcb, TCP_FLG_ACK, NULL, 0);
-            return;
         }
+        tcp_output_data(pcb);
         switch (pcb->state) {
         case TCP_PCB_STATE_FIN_WAIT1:
-            if (seg->ack == pcb->snd.nxt) {
+            if ((pcb->flags & TCP_PCB_FLAG_FIN_SENT) && seg->ack == pcb->snd.nxt) {
                 pcb->state = TCP_PCB_STATE_FIN_WAIT2;
             }
             break;
@@ -672,7 +2264,7 @@ tcp_segment_arrives(struct tcp_segment_info *seg, uint8_t flags, uint8_t *data,
             /* do nothing */
             break;
         case TCP_PCB_STATE_CLOSING:
-            if (seg->ack == pcb->snd.nxt) {
+            if ((pcb->flags & TCP_PCB_FLAG_FIN_SENT) && seg->ack == pcb->snd.nxt) {
                 pcb->state = TCP_PCB_STATE_TIME_WAIT;
                 /* NOTE: set 2MSL timer, although it is not explicitly stated in the RFC */
                 tcp_set_timewait_timer(pcb);
@@ -682,7 +2274,18 @@ tcp_segment_arrives(struct tcp_segment_info *seg, uint8_t flags, uint8_t *data,
         }
         break;
     case TCP_PCB_STATE_LAST_ACK:
-        if (seg->ack == pcb->snd.nxt) {
+        /* NOTE: the data buffered before the close may still be in flight */
+        if (TCP_SEQ_LT(pcb->snd.una, seg->ack) && TCP_SEQ_LE(seg->ack, pcb->snd.nxt)) {
+            tcp_buf_consume(&pcb->sbuf, seg->ack - pcb->snd.una);
+            tcp_buf_shrink_schedule(pcb);
+            pcb->snd.una = seg->ack;
+            tcp_retransmit_queue_cleanup(pcb, seg);
+        }
+        if (TCP_SEQ_LE(pcb->snd.una, seg->ack) && TCP_SEQ_LE(seg->ack, pcb->snd.nxt)) {
+            pcb->snd.wnd = seg->wnd;
+        }
+        tcp_output_data(pcb);
+        if ((pcb->flags & TCP_PCB_FLAG_FIN_SENT) && seg->ack == pcb->snd.nxt) {
             pcb->state = TCP_PCB_STATE_CLOSED;
             tcp_pcb_release(pcb);
         }
@@ -704,10 +2307,38 @@ tcp_segment_arrives(struct tcp_segment_info *seg, uint8_t flags, uint8_t *data,
     case TCP_PCB_STATE_FIN_WAIT1:
     case TCP_PCB_STATE_FIN_WAIT2:
         if (len) {
-            memcpy(pcb->buf + (sizeof(pcb->buf) - pcb->rcv.wnd), data, len);
-            pcb->rcv.nxt = seg->seq + seg->len;
-            pcb->rcv.wnd -= len;
-            tcp_output(pcb, TCP_FLG_ACK, NULL, 0);
+            if (TCP_SEQ_GT(seg->seq, pcb->rcv.nxt)) {
+                /* NOTE: queue the part inside the window, and send a duplicate ACK */
+                offset = seg->seq - pcb->rcv.nxt;
+                if (offset < pcb->rcv.wnd && tcp_ooo_insert(pcb, seg->seq, data, MIN(len, pcb->rcv.wnd - offset)) == 0) {
+                    pcb->ooo_last = seg->seq;
+                }
+                tcp_output(pcb, TCP_FLG_ACK, 0, 0);
+                return;
+            }
+            /* NOTE: trim off the part already received and the part outside the window */
+            offset = pcb->rcv.nxt - seg->seq;
+            if (offset >= len) {
+                /* NOTE: a duplicate, our ACK may have been lost */
+                tcp_output(pcb, TCP_FLG_ACK, 0, 0);
+                break;
+            }
+            data += offset;
+            len -= offset;
+            len = MIN(len, pcb->rcv.wnd);
+            if (seg->staged && !offset && len <= seg->staged) {
+                /* NOTE: already in place, just make it valid */
+                pcb->rbuf.len += len;
+            } else if (tcp_buf_append(&pcb->rbuf, data, len) == -1) {
+                errorf("tcp_buf_append() failure");
+                return;
+            }
+            pcb->rcv.nxt += len;
+            /* NOTE: RFC 5681 (4.2): a segment that fills (a part of) the gap is acknowledged immediately */
+            hole = pcb->ooo != NULL;
+            tcp_ooo_deliver(pcb);
+            pcb->rcv.wnd = tcp_rcv_wnd(pcb);
+            tcp_ack_schedule(pcb, len, hole);
             sched_wakeup(&pcb->ctx);
         }
         break;
@@ -730,8 +2361,14 @@ tcp_segment_arrives(struct tcp_segment_info *seg, uint8_t flags, uint8_t *data,
             /* drop segment */
             return;
         }
-        pcb->rcv.nxt = seg->seq + 1;
-        tcp_output(pcb, TCP_FLG_ACK, NULL, 0);
+        if (TCP_SEQ_GT(seg->seq + seg->len - 1, pcb->rcv.nxt)) {
+            /* NOTE: the preceding text has not been received (out of order or outside the window) */
+            return;
+        }
+        if (seg->seq + seg->len - 1 == pcb->rcv.nxt) {
+            pcb->rcv.nxt++; /* NOTE: otherwise, a retransmitted FIN */
+        }
+        tcp_output(pcb, TCP_FLG_ACK, 0, 0);
         switch (pcb->state) {
         case TCP_PCB_STATE_SYN_RECEIVED:
         case TCP_PCB_STATE_ESTABLISHED:
@@ -739,7 +2376,7 @@ tcp_segment_arrives(struct tcp_segment_info *seg, uint8_t flags, uint8_t *data,
             sched_wakeup(&pcb->ctx);
             break;
         case TCP_PCB_STATE_FIN_WAIT1:
-            if (seg->ack == pcb->snd.nxt) {
+            if ((pcb->flags & TCP_PCB_FLAG_FIN_SENT) && seg->ack == pcb->snd.nxt) {
                 pcb->state = TCP_PCB_STATE_TIME_WAIT;
                 tcp_set_timewait_timer(pcb);
             } else {
@@ -765,35 +2402,194 @@ tcp_segment_arrives(struct tcp_segment_info *seg, uint8_t flags, uint8_t *data,
             break;
         }
     }
-    return;
+    return;
+}
+
+/* NOTE: hands an established connection over to its listener, the listener is locked first */
+static void
+tcp_pcb_enqueue(struct tcp_pcb *parent, struct tcp_pcb *pcb, unsigned int gen)
+{
+    mutex_lock(&parent->lock);
+    mutex_lock(&pcb->lock);
+    if (pcb->gen == gen && pcb->parent == parent) {
+        if (parent->state == TCP_PCB_STATE_LISTEN && parent->local.port == pcb->local.port) {
+            list_push(&parent->backlog, &pcb->backlog_node);
+            sched_wakeup(&parent->ctx);
+        } else {
+            debugf("listener closed, reset the connection");
+            tcp_output(pcb, TCP_FLG_RST, 0, 0);
+            pcb->state = TCP_PCB_STATE_CLOSED;
+            tcp_pcb_release(pcb);
+        }
+    }
+    mutex_unlock(&pcb->lock);
+    mutex_unlock(&parent->lock);
+}
+
+/*
+ * NOTE: copy the payload of the segment expected next to the tail of the receive buffer while verifying
+ *       the checksum, it becomes valid in the seventh step (see tcp_segment_arrives()).
+ *       returns 1 if staged and verified, 0 otherwise (not staged or the checksum is bad, verify the whole segment)
+ */
+static int
+tcp_input_stage(struct tcp_pcb *pcb, struct tcp_segment_info *seg, struct tcp_hdr *hdr, size_t hlen, size_t len, uint16_t psum)
+{
+    struct tcp_buf *buf = &pcb->rbuf;
+    size_t plen = len - hlen;
+    uint16_t sum;
+
+    switch (pcb->state) {
+    case TCP_PCB_STATE_ESTABLISHED:
+    case TCP_PCB_STATE_FIN_WAIT1:
+    case TCP_PCB_STATE_FIN_WAIT2:
+        break;
+    default:
+        return 0;
+    }
+    /* NOTE: the out of order data is kept beyond len, not to be overwritten */
+    if (!plen || seg->seq != pcb->rcv.nxt || pcb->ooo || plen > pcb->rcv.wnd) {
+        return 0;
+    }
+    if (tcp_buf_reserve(buf, plen) == -1) {
+        return 0;
+    }
+    sum = ~cksum16((uint16_t *)hdr, hlen, psum);
+    sum = cksum16_add(sum, tcp_buf_write_cksum(buf, buf->len, (uint8_t *)hdr + hlen, plen), hlen);
+    if (sum != 0xffff) {
+        return 0;
+    }
+    seg->staged = plen;
+    return 1;
+}
+
+/*
+ * NOTE: the frames chained by GRO (see tcp_gro()) go as one segment if all of the payload is the data expected next,
+ *       each is copied to the receive buffer once while verifying the checksum (see tcp_input_stage()).
+ *       returns -1 if not taken (nothing is made valid), then they are processed one by one as received.
+ */
+static int
+tcp_input_merged(struct pbuf *pb, ip_addr_t src, ip_addr_t dst, struct ip_iface *iface)
+{
+    struct pbuf *frag;
+    struct tcp_hdr *hdr, *last;
+    struct ip_endpoint local, foreign;
+    struct tcp_segment_info seg;
+    struct tcp_pcb *pcb, *est = NULL, *parent = NULL;
+    struct tcp_buf *buf;
+    size_t hlen, plen, len = 0, num = 0;
+    uint16_t psum, sum;
+    uint8_t flg;
+    unsigned int gen = 0;
+    char addr1[IP_ADDR_STR_LEN];
+    char addr2[IP_ADDR_STR_LEN];
+
+    /* NOTE: the header lengths and the payloads have been checked by tcp_gro() */
+    hdr = (struct tcp_hdr *)pb->data;
+    hlen = (hdr->off >> 4) << 2;
+    if (src == IP_ADDR_BROADCAST || src == iface->broadcast || dst == IP_ADDR_BROADCAST || dst == iface->broadcast) {
+        return -1;
+    }
+    local.addr = dst;
+    local.port = hdr->dst;
+    foreign.addr = src;
+    foreign.port = hdr->src;
+    seg.mss = 0;
+    seg.wscale = -1;
+    seg.sack_perm = 0;
+    seg.sack_num = 0;
+    seg.ts = 0;
+    if (tcp_parse_options((uint8_t *)(hdr + 1), hlen - sizeof(*hdr), &seg) == -1) {
+        return -1;
+    }
+    last = hdr;
+    for (frag = pb; frag; frag = (frag == pb) ? pb->frags : frag->next) {
+        last = (struct tcp_hdr *)frag->data;
+        len += frag->len - hlen;
+        num++;
+    }
+    seg.seq = ntoh32(hdr->seq);
+    pcb = tcp_pcb_select_lock(&local, &foreign);
+    if (!pcb) {
+        return -1;
+    }
+    switch (pcb->state) {
+    case TCP_PCB_STATE_ESTABLISHED:
+    case TCP_PCB_STATE_FIN_WAIT1:
+    case TCP_PCB_STATE_FIN_WAIT2:
+        break;
+    default:
+        mutex_unlock(&pcb->lock);
+        return -1;
+    }
+    /* NOTE: the out of order data is kept beyond len, not to be overwritten */
+    buf = &pcb->rbuf;
+    if (seg.seq != pcb->rcv.nxt || pcb->ooo || len > pcb->rcv.wnd || tcp_buf_reserve(buf, len) == -1) {
+        mutex_unlock(&pcb->lock);
+        return -1;
+    }
+    seg.staged = 0;
+    for (frag = pb; frag; frag = (frag == pb) ? pb->frags : frag->next) {
+        plen = frag->len - hlen;
+        if (frag->flags & PBUF_FLAG_CSUM_VALID) {
+            tcp_buf_write(buf, buf->len + seg.staged, frag->data + hlen, plen);
+        } else {
+            psum = cksum16_pseudo(src, dst, IP_PROTOCOL_TCP, frag->len);
+            sum = ~cksum16((uint16_t *)frag->data, hlen, psum);
+            sum = cksum16_add(sum, tcp_buf_write_cksum(buf, buf->len + seg.staged, frag->data + hlen, plen), hlen);
+            if (sum != 0xffff) {
+                mutex_unlock(&pcb->lock);
+                return -1;
+            }
+        }
+        seg.staged += plen;
+    }
+    stats_add(STATS_TCP_IN_SEGS, num);
+    debugf("%s:%d => %s:%d, merged=%zu, payload=%zu",
+        ip_addr_ntop(src, addr1, sizeof(addr1)), ntoh16(hdr->src),
+        ip_addr_ntop(dst, addr2, sizeof(addr2)), ntoh16(hdr->dst),
+        num, len);
+    tracef(TRACE_EVENT_TCP_INPUT, (uint32_t)ntoh16(hdr->src) << 16 | ntoh16(hdr->dst),
+        ntoh32(hdr->seq), ntoh32(hdr->ack), (uint32_t)(hdr->flg | last->flg) << 16 | (uint16_t)len);
+    seg.ack = ntoh32(hdr->ack);
+    seg.len = len;
+    seg.wnd = ntoh16(last->wnd);
+    seg.up = 0;
+    flg = hdr->flg | last->flg;
+    /* NOTE: the payload is staged as a whole, data is never read beyond the head (see tcp_segment_arrives()) */
+    tcp_segment_arrives(pcb, &est, &seg, flg, (uint8_t *)hdr + hlen, len, &local, &foreign);
+    if (est) {
+        /* NOTE: cleared if released meanwhile */
+        parent = est->parent;
+        gen = est->gen;
+    }
+    mutex_unlock(&pcb->lock);
+    if (est && parent) {
+        tcp_pcb_enqueue(parent, est, gen);
+    }
+    return 0;
 }
 
 static void
-tcp_input(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct ip_iface *iface)
+tcp_input_segment(struct pbuf *pb, ip_addr_t src, ip_addr_t dst, struct ip_iface *iface)
 {
+    const uint8_t *data = pb->data;
+    size_t len = pb->len;
     struct tcp_hdr *hdr;
-    struct pseudo_hdr pseudo;
     uint16_t psum, hlen;
     char addr1[IP_ADDR_STR_LEN];
     char addr2[IP_ADDR_STR_LEN];
     struct ip_endpoint local, foreign;
     struct tcp_segment_info seg;
+    struct tcp_pcb *pcb, *est = NULL, *parent = NULL;
+    unsigned int gen = 0;
 
+    stats_inc(STATS_TCP_IN_SEGS);
     if (len < sizeof(*hdr)) {
         errorf("too short");
+        stats_inc(STATS_TCP_IN_ERRS);
         return;
     }
     hdr = (struct tcp_hdr *)data;
-    pseudo.src = src;
-    pseudo.dst = dst;
-    pseudo.zero = 0;
-    pseudo.protocol = IP_PROTOCOL_TCP;
-    pseudo.len = hton16(len);
-    psum = ~cksum16((uint16_t *)&pseudo, sizeof(pseudo), 0);
-    if (cksum16((uint16_t *)hdr, len, psum) != 0) {
-        errorf("checksum error: sum=0x%04x, verify=0x%04x", ntoh16(hdr->sum), ntoh16(cksum16((uint16_t *)hdr, len, -hdr->sum + psum)));
-        return;
-    }
     if (src == IP_ADDR_BROADCAST || src == iface->broadcast || dst == IP_ADDR_BROADCAST || dst == iface->broadcast) {
         errorf("only supports unicast, src=%s, dst=%s",
             ip_addr_ntop(src, addr1, sizeof(addr1)), ip_addr_ntop(dst, addr2, sizeof(addr2)));
@@ -809,6 +2605,23 @@ tcp_input(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct
     foreign.addr = src;
     foreign.port = hdr->src;
     hlen = (hdr->off >> 4) << 2;
+    if (hlen < sizeof(*hdr) || hlen > len) {
+        errorf("invalid header length, hlen=%u, len=%zu", hlen, len);
+        stats_inc(STATS_TCP_IN_ERRS);
+        return;
+    }
+    tracef(TRACE_EVENT_TCP_INPUT, (uint32_t)ntoh16(hdr->src) << 16 | ntoh16(hdr->dst),
+        ntoh32(hdr->seq), ntoh32(hdr->ack), (uint32_t)hdr->flg << 16 | (uint16_t)(len - hlen));
+    seg.mss = 0;
+    seg.wscale = -1;
+    seg.sack_perm = 0;
+    seg.sack_num = 0;
+    seg.ts = 0;
+    seg.staged = 0;
+    if (tcp_parse_options((uint8_t *)(hdr + 1), hlen - sizeof(*hdr), &seg) == -1) {
+        stats_inc(STATS_TCP_IN_ERRS);
+        return;
+    }
     seg.seq = ntoh32(hdr->seq);
     seg.ack = ntoh32(hdr->ack);
     seg.len = len - hlen;
@@ -820,64 +2633,128 @@ tcp_input(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct
     }
     seg.wnd = ntoh16(hdr->wnd);
     seg.up = ntoh16(hdr->up);
-    mutex_lock(&mutex);
-    tcp_segment_arrives(&seg, hdr->flg, (uint8_t *)hdr + hlen, len - hlen, &local, &foreign);
-    mutex_unlock(&mutex);
+    pcb = tcp_pcb_select_lock(&local, &foreign);
+    /* NOTE: verified after the lookup, the payload in order can be copied to the receive buffer at the same time */
+    if (!(pb->flags & PBUF_FLAG_CSUM_VALID)) {
+        psum = cksum16_pseudo(src, dst, IP_PROTOCOL_TCP, len);
+        if (!pcb || !tcp_input_stage(pcb, &seg, hdr, hlen, len, psum)) {
+            if (cksum16((uint16_t *)hdr, len, psum) != 0) {
+                errorf("checksum error: sum=0x%04x, verify=0x%04x", ntoh16(hdr->sum), ntoh16(cksum16((uint16_t *)hdr, len, -hdr->sum + psum)));
+                stats_inc(STATS_TCP_IN_ERRS);
+                stats_inc(STATS_TCP_IN_CSUM_ERRORS);
+                if (pcb) {
+                    mutex_unlock(&pcb->lock);
+                }
+                return;
+            }
+        }
+    }
+    tcp_segment_arrives(pcb, &est, &seg, hdr->flg, (uint8_t *)hdr + hlen, len - hlen, &local, &foreign);
+    if (est) {
+        /* NOTE: cleared if released meanwhile */
+        parent = est->parent;
+        gen = est->gen;
+    }
+    if (pcb) {
+        mutex_unlock(&pcb->lock);
+    }
+    if (est && parent) {
+        tcp_pcb_enqueue(parent, est, gen);
+    }
     return;
 }
 
 static void
-tcp_timer(void)
+tcp_input(struct pbuf *pb, ip_addr_t src, ip_addr_t dst, struct ip_iface *iface)
 {
-    struct tcp_pcb *pcb;
-    struct timeval now;
+    struct pbuf *frag;
+
+    if (!pb->frags) {
+        tcp_input_segment(pb, src, dst, iface);
+        return;
+    }
+    if (tcp_input_merged(pb, src, dst, iface) == 0) {
+        return;
+    }
+    tcp_input_segment(pb, src, dst, iface);
+    for (frag = pb->frags; frag; frag = frag->next) {
+        tcp_input_segment(frag, src, dst, iface);
+    }
+}
+
+/* NOTE: the timer of the pcb, runs the ones of the deadlines passed and is armed again at the next one */
+static void
+tcp_timer(void *arg)
+{
+    struct tcp_pcb *pcb = arg;
+    uint64_t now;
     char ep1[IP_ENDPOINT_STR_LEN];
     char ep2[IP_ENDPOINT_STR_LEN];
 
-    mutex_lock(&mutex);
-    gettimeofday(&now, NULL);
-    for (pcb = pcbs; pcb < tailof(pcbs); pcb++) {
-        if (pcb->state == TCP_PCB_STATE_FREE) {
-            continue;
-        }
-        if (pcb->state == TCP_PCB_STATE_TIME_WAIT) {
-            if (timercmp(&now, &pcb->tw_timer, >) != 0) {
-                debugf("timewait has elapsed, local=%s, foreign=%s",
-                    ip_endpoint_ntop(&pcb->local, ep1, sizeof(ep1)), ip_endpoint_ntop(&pcb->foreign, ep2, sizeof(ep2)));
-                tcp_pcb_release(pcb);
-                continue;
-            }
+    mutex_lock(&pcb->lock);
+    if (pcb->state == TCP_PCB_STATE_FREE) {
+        mutex_unlock(&pcb->lock);
+        return;
+    }
+    pcb->timer_expire = 0;
+    now = net_timer_clock();
+    if (pcb->state == TCP_PCB_STATE_TIME_WAIT && now >= pcb->tw_timer) {
+        debugf("timewait has elapsed, local=%s, foreign=%s",
+            ip_endpoint_ntop(&pcb->local, ep1, sizeof(ep1)), ip_endpoint_ntop(&pcb->foreign, ep2, sizeof(ep2)));
+        tcp_pcb_release(pcb);
+        mutex_unlock(&pcb->lock);
+        return;
+    }
+    tcp_retransmit_timer(pcb, now);
+    tcp_delack_timer(pcb, now);
+    tcp_persist(pcb, now);
+    if (pcb->shrink && now >= pcb->shrink) {
+        pcb->shrink = 0;
+        if (!pcb->ooo) {
+            tcp_buf_shrink(&pcb->rbuf);
         }
-        queue_foreach(&pcb->queue, tcp_retransmit_queue_emit, pcb);
+        tcp_buf_shrink(&pcb->sbuf);
     }
-    mutex_unlock(&mutex);
+    tcp_timer_update(pcb);
+    mutex_unlock(&pcb->lock);
 }
 
 static void
 event_handler(void *arg)
 {
     struct tcp_pcb *pcb;
+    int i;
 
-    mutex_lock(&mutex);
-    for (pcb = pcbs; pcb < tailof(pcbs); pcb++) {
+    for (i = 0; (pcb = tcp_pcb_lookup(i)) != NULL; i++) {
+        mutex_lock(&pcb->lock);
         if (pcb->state != TCP_PCB_STATE_FREE) {
             sched_interrupt(&pcb->ctx);
         }
+        mutex_unlock(&pcb->lock);
     }
-    mutex_unlock(&mutex);
 }
 
 int
 tcp_init(void)
 {
-    struct timeval interval = {0,100000};
-
+    if (hash_table_init(&conn_table, TCP_PCB_HASH_SIZE) == -1 || hash_table_init(&bind_table, TCP_PCB_HASH_SIZE) == -1) {
+        errorf("hash_table_init() failure");
+        return -1;
+    }
+    if (tcp_cong_init() == -1) {
+        errorf("tcp_cong_init() failure");
+        return -1;
+    }
     if (ip_protocol_register("TCP", IP_PROTOCOL_TCP, tcp_input) == -1) {
         errorf("ip_protocol_register() failure");
         return -1;
     }
-    if (net_timer_register("TCP Timer", interval, tcp_timer) == -1) {
-        errorf("net_timer_register() failure");
+    if (ip_protocol_set_gso(IP_PROTOCOL_TCP, tcp_gso_segment) == -1) {
+        errorf("ip_protocol_set_gso() failure");
+        return -1;
+    }
+    if (ip_protocol_set_gro(IP_PROTOCOL_TCP, tcp_gro) == -1) {
+        errorf("ip_protocol_set_gro() failure");
         return -1;
     }
     net_event_subscribe(event_handler, NULL);
@@ -896,66 +2773,74 @@ tcp_open_rfc793(struct ip_endpoint *local, struct ip_endpoint *foreign, int acti
     char ep2[IP_ENDPOINT_STR_LEN];
     int state, id;
 
-    mutex_lock(&mutex);
     pcb = tcp_pcb_alloc();
     if (!pcb) {
         errorf("tcp_pcb_alloc() failure");
-        mutex_unlock(&mutex);
         return -1;
     }
     pcb->mode = TCP_PCB_MODE_RFC793;
     if (!active) {
         debugf("passive open: local=%s, waiting for connection...", ip_endpoint_ntop(local, ep1, sizeof(ep1)));
+        rwlock_wrlock(&table_lock);
         pcb->local = *local;
         if (foreign) {
             pcb->foreign = *foreign;
         }
+        tcp_pcb_hash(pcb);
+        /* NOTE: tcp_pcb_select() looks at the state of the listeners */
         pcb->state = TCP_PCB_STATE_LISTEN;
+        rwlock_unlock(&table_lock);
     } else {
         debugf("active open: local=%s, foreign=%s, connecting...",
             ip_endpoint_ntop(local, ep1, sizeof(ep1)), ip_endpoint_ntop(foreign, ep2, sizeof(ep2)));
+        rwlock_wrlock(&table_lock);
         pcb->local = *local;
         pcb->foreign = *foreign;
-        pcb->rcv.wnd = sizeof(pcb->buf);
+        tcp_pcb_hash(pcb);
+        rwlock_unlock(&table_lock);
+        pcb->rcv.wscale = tcp_wscale_select(pcb);
+        pcb->rcv.wnd = tcp_rcv_wnd(pcb);
         pcb->iss = random();
-        if (tcp_output(pcb, TCP_FLG_SYN, NULL, 0) == -1) {
+        if (tcp_output(pcb, TCP_FLG_SYN, 0, 0) == -1) {
             errorf("tcp_output() failure");
             pcb->state = TCP_PCB_STATE_CLOSED;
             tcp_pcb_release(pcb);
-            mutex_unlock(&mutex);
+            mutex_unlock(&pcb->lock);
             return -1;
         }
         pcb->snd.una = pcb->iss;
         pcb->snd.nxt = pcb->iss + 1;
         pcb->state = TCP_PCB_STATE_SYN_SENT;
+        stats_inc(STATS_TCP_ACTIVE_OPENS);
     }
 AGAIN:
     state = pcb->state;
     /* waiting for state changed */
     while (pcb->state == state) {
-        if (sched_sleep(&pcb->ctx, &mutex, NULL) == -1) {
+        if (sched_sleep(&pcb->ctx, &pcb->lock, NULL) == -1) {
             debugf("interrupted");
             pcb->state = TCP_PCB_STATE_CLOSED;
             tcp_pcb_release(pcb);
-            mutex_unlock(&mutex);
+            mutex_unlock(&pcb->lock);
             errno = EINTR;
             return -1;
         }
     }
-    if (pcb->state != TCP_PCB_STATE_ESTABLISHED) {
+    /* NOTE: the FIN from the peer may have come before the wakeup, it was established anyway */
+    if (pcb->state != TCP_PCB_STATE_ESTABLISHED && pcb->state != TCP_PCB_STATE_CLOSE_WAIT) {
         if (pcb->state == TCP_PCB_STATE_SYN_RECEIVED) {
             goto AGAIN;
         }
         errorf("open error: %d", pcb->state);
         pcb->state = TCP_PCB_STATE_CLOSED;
         tcp_pcb_release(pcb);
-        mutex_unlock(&mutex);
+        mutex_unlock(&pcb->lock);
         return -1;
     }
     id = tcp_pcb_id(pcb);
     debugf("connection established: local=%s, foreign=%s",
         ip_endpoint_ntop(&pcb->local, ep1, sizeof(ep1)), ip_endpoint_ntop(&pcb->foreign, ep2, sizeof(ep2)));
-    mutex_unlock(&mutex);
+    mutex_unlock(&pcb->lock);
     return id;
 }
 
@@ -965,20 +2850,18 @@ tcp_state(int id)
     struct tcp_pcb *pcb;
     int state;
 
-    mutex_lock(&mutex);
     pcb = tcp_pcb_get(id);
     if (!pcb) {
         errorf("pcb not found");
-        mutex_unlock(&mutex);
         return -1;
     }
     if (pcb->mode != TCP_PCB_MODE_RFC793) {
         errorf("not opened in rfc793 mode");
-        mutex_unlock(&mutex);
+        mutex_unlock(&pcb->lock);
         return -1;
     }
     state = pcb->state;
-    mutex_unlock(&mutex);
+    mutex_unlock(&pcb->lock);
     return state;
 }
 
@@ -992,39 +2875,49 @@ tcp_open(void)
     struct tcp_pcb *pcb;
     int id;
 
-    mutex_lock(&mutex);
     pcb = tcp_pcb_alloc();
     if (!pcb) {
         errorf("tcp_pcb_alloc() failure");
-        mutex_unlock(&mutex);
         return -1;
     }
     pcb->mode = TCP_PCB_MODE_SOCKET;
     id = tcp_pcb_id(pcb);
-    mutex_unlock(&mutex);
+    mutex_unlock(&pcb->lock);
     return id;
 }
 
 int
-tcp_connect(int id, struct ip_endpoint *foreign)
+tcp_connect(int id, struct ip_endpoint *foreign, int flags)
 {
     struct tcp_pcb *pcb;
     struct ip_endpoint local;
     struct ip_iface *iface;
     char addr[IP_ADDR_STR_LEN];
-    int p;
     int state;
 
-    mutex_lock(&mutex);
     pcb = tcp_pcb_get(id);
     if (!pcb) {
         errorf("pcb not found");
-        mutex_unlock(&mutex);
         return -1;
     }
     if (pcb->mode != TCP_PCB_MODE_SOCKET) {
         errorf("not opened in socket mode");
-        mutex_unlock(&mutex);
+        mutex_unlock(&pcb->lock);
+        return -1;
+    }
+    switch (pcb->state) {
+    case TCP_PCB_STATE_CLOSED:
+        break;
+    case TCP_PCB_STATE_SYN_SENT:
+    case TCP_PCB_STATE_SYN_RECEIVED:
+        /* NOTE: a non-blocking connect in progress */
+        mutex_unlock(&pcb->lock);
+        errno = EALREADY;
+        return -1;
+    default:
+        errorf("already connected or listening");
+        mutex_unlock(&pcb->lock);
+        errno = EISCONN;
         return -1;
     }
     local.addr = pcb->local.addr;
@@ -1033,68 +2926,75 @@ tcp_connect(int id, struct ip_endpoint *foreign)
         iface = ip_route_get_iface(foreign->addr);
         if (!iface) {
             errorf("ip_route_get_iface() failure");
-            mutex_unlock(&mutex);
+            mutex_unlock(&pcb->lock);
             return -1;
         }
         debugf("select source address: %s", ip_addr_ntop(iface->unicast, addr, sizeof(addr)));
         local.addr = iface->unicast;
     }
+    rwlock_wrlock(&table_lock);
     if (!local.port) {
-        for (p = TCP_SOURCE_PORT_MIN; p <= TCP_SOURCE_PORT_MAX; p++) {
-            local.port = p;
-            if (!tcp_pcb_select(&local, foreign)) {
-                debugf("dinamic assign srouce port: %d", ntoh16(local.port));
-                pcb->local.port = local.port;
-                break;
-            }
-        }
+        local.port = tcp_pcb_select_port(local.addr);
         if (!local.port) {
             debugf("failed to dinamic assign srouce port");
-            mutex_unlock(&mutex);
+            rwlock_unlock(&table_lock);
+            mutex_unlock(&pcb->lock);
             return -1;
         }
+        debugf("dinamic assign srouce port: %d", ntoh16(local.port));
     }
     pcb->local.addr = local.addr;
     pcb->local.port = local.port;
     pcb->foreign.addr = foreign->addr;
     pcb->foreign.port = foreign->port;
-    pcb->rcv.wnd = sizeof(pcb->buf);
+    tcp_pcb_hash(pcb);
+    rwlock_unlock(&table_lock);
+    pcb->rcv.wscale = tcp_wscale_select(pcb);
+    pcb->rcv.wnd = tcp_rcv_wnd(pcb);
     pcb->iss = random();
-    if (tcp_output(pcb, TCP_FLG_SYN, NULL, 0) == -1) {
+    if (tcp_output(pcb, TCP_FLG_SYN, 0, 0) == -1) {
         errorf("tcp_output() failure");
         pcb->state = TCP_PCB_STATE_CLOSED;
         tcp_pcb_release(pcb);
-        mutex_unlock(&mutex);
+        mutex_unlock(&pcb->lock);
         return -1;
     }
     pcb->snd.una = pcb->iss;
     pcb->snd.nxt = pcb->iss + 1;
     pcb->state = TCP_PCB_STATE_SYN_SENT;
+    stats_inc(STATS_TCP_ACTIVE_OPENS);
+    if ((pcb->flags & TCP_PCB_FLAG_NONBLOCK) || (flags & NET_MSG_DONTWAIT)) {
+        /* NOTE: the completion is reported by tcp_poll() (writable, or an error if refused) */
+        mutex_unlock(&pcb->lock);
+        errno = EINPROGRESS;
+        return -1;
+    }
 AGAIN:
     state = pcb->state;
     // waiting for state changed
     while (pcb->state == state) {
-        if (sched_sleep(&pcb->ctx, &mutex, NULL) == -1) {
+        if (sched_sleep(&pcb->ctx, &pcb->lock, NULL) == -1) {
             debugf("interrupted");
             pcb->state = TCP_PCB_STATE_CLOSED;
             tcp_pcb_release(pcb);
-            mutex_unlock(&mutex);
+            mutex_unlock(&pcb->lock);
             errno = EINTR;
             return -1;
         }
     }
-    if (pcb->state != TCP_PCB_STATE_ESTABLISHED) {
+    /* NOTE: the FIN from the peer may have come before the wakeup, it was established anyway */
+    if (pcb->state != TCP_PCB_STATE_ESTABLISHED && pcb->state != TCP_PCB_STATE_CLOSE_WAIT) {
         if (pcb->state == TCP_PCB_STATE_SYN_RECEIVED) {
             goto AGAIN;
         }
         errorf("open error: %d", pcb->state);
         pcb->state = TCP_PCB_STATE_CLOSED;
         tcp_pcb_release(pcb);
-        mutex_unlock(&mutex);
+        mutex_unlock(&pcb->lock);
         return -1;
     }
     id = tcp_pcb_id(pcb);
-    mutex_unlock(&mutex);
+    mutex_unlock(&pcb->lock);
     return id;
 }
 
@@ -1104,27 +3004,29 @@ tcp_bind(int id, struct ip_endpoint *local)
     struct tcp_pcb *pcb, *exist;
     char ep[IP_ENDPOINT_STR_LEN];
 
-    mutex_lock(&mutex);
     pcb = tcp_pcb_get(id);
     if (!pcb) {
         errorf("pcb not found");
-        mutex_unlock(&mutex);
         return -1;
     }
     if (pcb->mode != TCP_PCB_MODE_SOCKET) {
         errorf("not opened in socket mode");
-        mutex_unlock(&mutex);
+        mutex_unlock(&pcb->lock);
         return -1;
     }
+    rwlock_wrlock(&table_lock);
     exist = tcp_pcb_select(local, NULL);
     if (exist) {
         errorf("already bound, exist=%s", ip_endpoint_ntop(&exist->local, ep, sizeof(ep)));
-        mutex_unlock(&mutex);
+        rwlock_unlock(&table_lock);
+        mutex_unlock(&pcb->lock);
         return -1;
     }
     pcb->local = *local;
+    tcp_pcb_hash(pcb);
+    rwlock_unlock(&table_lock);
     debugf("success: local=%s", ip_endpoint_ntop(&pcb->local, ep, sizeof(ep)));
-    mutex_unlock(&mutex);
+    mutex_unlock(&pcb->lock);
     return 0;
 }
 
@@ -1133,66 +3035,72 @@ tcp_listen(int id, int backlog)
 {
     struct tcp_pcb *pcb;
 
-    mutex_lock(&mutex);
     pcb = tcp_pcb_get(id);
     if (!pcb) {
         errorf("pcb not found");
-        mutex_unlock(&mutex);
         return -1;
     }
     if (pcb->mode != TCP_PCB_MODE_SOCKET) {
         errorf("not opened in socket mode");
-        mutex_unlock(&mutex);
+        mutex_unlock(&pcb->lock);
         return -1;
     }
+    /* NOTE: tcp_pcb_select() looks at the state of the listeners */
+    rwlock_wrlock(&table_lock);
     pcb->state = TCP_PCB_STATE_LISTEN;
+    rwlock_unlock(&table_lock);
     (void)backlog; // TODO: set backlog
-    mutex_unlock(&mutex);
+    mutex_unlock(&pcb->lock);
     return 0;
 }
 
 int
-tcp_accept(int id, struct ip_endpoint *foreign)
+tcp_accept(int id, struct ip_endpoint *foreign, int flags)
 {
     struct tcp_pcb *pcb, *new_pcb;
     int new_id;
 
-    mutex_lock(&mutex);
     pcb = tcp_pcb_get(id);
     if (!pcb) {
         errorf("pcb not found");
-        mutex_unlock(&mutex);
         return -1;
     }
     if (pcb->mode != TCP_PCB_MODE_SOCKET) {
         errorf("not opened in socket mode");
-        mutex_unlock(&mutex);
+        mutex_unlock(&pcb->lock);
         return -1;
     }
     if (pcb->state != TCP_PCB_STATE_LISTEN) {
         errorf("not in LISTEN state");
-        mutex_unlock(&mutex);
+        mutex_unlock(&pcb->lock);
         return -1;
     }
-    while (!(new_pcb = queue_pop(&pcb->backlog))) {
-        if (sched_sleep(&pcb->ctx, &mutex, NULL) == -1) {
+    while (!(new_pcb = tcp_backlog_pcb(list_pop(&pcb->backlog)))) {
+        if ((pcb->flags & TCP_PCB_FLAG_NONBLOCK) || (flags & NET_MSG_DONTWAIT)) {
+            mutex_unlock(&pcb->lock);
+            errno = EAGAIN;
+            return -1;
+        }
+        if (sched_sleep(&pcb->ctx, &pcb->lock, NULL) == -1) {
             debugf("interrupted");
-            mutex_unlock(&mutex);
+            mutex_unlock(&pcb->lock);
             errno = EINTR;
             return -1;
         }
         if (pcb->state == TCP_PCB_STATE_CLOSED) {
             debugf("closed");
             tcp_pcb_release(pcb);
-            mutex_unlock(&mutex);
+            mutex_unlock(&pcb->lock);
             return -1;
         }
     }
     if (foreign) {
+        mutex_lock(&new_pcb->lock);
         *foreign = new_pcb->foreign;
+        mutex_unlock(&new_pcb->lock);
     }
     new_id = tcp_pcb_id(new_pcb);
-    mutex_unlock(&mutex);
+    mutex_unlock(&pcb->lock);
     return new_id;
 }
 
@@ -1201,53 +3109,51 @@ tcp_accept(int id, struct ip_endpoint *foreign)
  */
 
 ssize_t
-tcp_send(int id, uint8_t *data, size_t len)
+tcp_send(int id, uint8_t *data, size_t len, int flags)
 {
     struct tcp_pcb *pcb;
     ssize_t sent = 0;
-    struct ip_iface *iface;
-    size_t mss, cap, slen;
+    size_t space, slen;
 
-    mutex_lock(&mutex);
     pcb = tcp_pcb_get(id);
     if (!pcb) {
         errorf("pcb not found");
-        mutex_unlock(&mutex);
         return -1;
     }
 RETRY:
     switch (pcb->state) {
     case TCP_PCB_STATE_CLOSED:
         errorf("connection does not exist");
-        mutex_unlock(&mutex);
+        mutex_unlock(&pcb->lock);
         return -1;
     case TCP_PCB_STATE_LISTEN:
         // ignore: change the connection from passive to active
         errorf("this connection is passive");
-        mutex_unlock(&mutex);
+        mutex_unlock(&pcb->lock);
         return -1;
     case TCP_PCB_STATE_SYN_SENT:
     case TCP_PCB_STATE_SYN_RECEIVED:
         // ignore: Queue the data for transmission after entering ESTABLISHED state
         errorf("insufficient resources");
-        mutex_unlock(&mutex);
+        mutex_unlock(&pcb->lock);
         return -1;
     case TCP_PCB_STATE_ESTABLISHED:
     case TCP_PCB_STATE_CLOSE_WAIT:
-        iface = ip_route_get_iface(pcb->local.addr);
-        if (!iface) {
-            errorf("iface not found");
-            mutex_unlock(&mutex);
-            return -1;
-        }
-        mss = NET_IFACE(iface)->dev->mtu - (IP_HDR_SIZE_MIN + sizeof(struct tcp_hdr));
         while (sent < (ssize_t)len) {
-            cap = pcb->snd.wnd - (pcb->snd.nxt - pcb->snd.una);
-            if (!cap) {
-                if (sched_sleep(&pcb->ctx, &mutex, NULL) == -1) {
+            space = pcb->sbuf.limit > pcb->sbuf.len ? pcb->sbuf.limit - pcb->sbuf.len : 0;
+            if (!space) {
+                if ((pcb->flags & TCP_PCB_FLAG_NONBLOCK) || (flags & NET_MSG_DONTWAIT)) {
+                    if (!sent) {
+                        mutex_unlock(&pcb->lock);
+                        errno = EAGAIN;
+                        return -1;
+                    }
+                    break;
+                }
+                if (sched_sleep(&pcb->ctx, &pcb->lock, NULL) == -1) {
                     debugf("interrupted");
                     if (!sent) {
-                        mutex_unlock(&mutex);
+                        mutex_unlock(&pcb->lock);
                         errno = EINTR;
                         return -1;
                     }
@@ -1255,16 +3161,20 @@ RETRY:
                 }
                 goto RETRY;
             }
-            slen = MIN(MIN(mss, len - sent), cap);
-            if (tcp_output(pcb, TCP_FLG_ACK | TCP_FLG_PSH, data + sent, slen) == -1) {
-                errorf("tcp_output() failure");
+            slen = MIN(space, len - sent);
+            if (tcp_buf_append(&pcb->sbuf, data + sent, slen) == -1) {
+                errorf("tcp_buf_append() failure");
+                mutex_unlock(&pcb->lock);
+                return sent ? sent : -1;
+            }
+            sent += slen;
+            if (tcp_output_data(pcb) == -1) {
+                errorf("tcp_output_data() failure");
                 pcb->state = TCP_PCB_STATE_CLOSED;
                 tcp_pcb_release(pcb);
-                mutex_unlock(&mutex);
+                mutex_unlock(&pcb->lock);
                 return -1;
             }
-            pcb->snd.nxt += slen;
-            sent += slen;
         }
         break;
     case TCP_PCB_STATE_FIN_WAIT1:
@@ -1273,51 +3183,54 @@ RETRY:
     case TCP_PCB_STATE_LAST_ACK:
     case TCP_PCB_STATE_TIME_WAIT:
         errorf("connection closing");
-        mutex_unlock(&mutex);
+        mutex_unlock(&pcb->lock);
         return -1;
     default:
         errorf("unknown state '%u'", pcb->state);
-        mutex_unlock(&mutex);
+        mutex_unlock(&pcb->lock);
         return -1;
     }
-    mutex_unlock(&mutex);
+    mutex_unlock(&pcb->lock);
     return sent;
 }
 
 ssize_t
-tcp_receive(int id, uint8_t *buf, size_t size)
+tcp_receive(int id, uint8_t *buf, size_t size, int flags)
 {
     struct tcp_pcb *pcb;
     size_t remain, len;
 
-    mutex_lock(&mutex);
     pcb = tcp_pcb_get(id);
     if (!pcb) {
         errorf("pcb not found");
-        mutex_unlock(&mutex);
         return -1;
     }
 RETRY:
     switch (pcb->state) {
     case TCP_PCB_STATE_CLOSED:
         errorf("connection does not exist");
-        mutex_unlock(&mutex);
+        mutex_unlock(&pcb->lock);
         return -1;
     case TCP_PCB_STATE_LISTEN:
     case TCP_PCB_STATE_SYN_SENT:
     case TCP_PCB_STATE_SYN_RECEIVED:
         /* ignore: Queue for processing after entering ESTABLISHED state */
         errorf("insufficient resources");
-        mutex_unlock(&mutex);
+        mutex_unlock(&pcb->lock);
         return -1;
     case TCP_PCB_STATE_ESTABLISHED:
     case TCP_PCB_STATE_FIN_WAIT1:
     case TCP_PCB_STATE_FIN_WAIT2:
-        remain = sizeof(pcb->buf) - pcb->rcv.wnd;
+        remain = pcb->rbuf.len;
         if (!remain) {
-            if (sched_sleep(&pcb->ctx, &mutex, NULL) == -1) {
+            if ((pcb->flags & TCP_PCB_FLAG_NONBLOCK) || (flags & NET_MSG_DONTWAIT)) {
+                mutex_unlock(&pcb->lock);
+                errno = EAGAIN;
+                return -1;
+            }
+            if (sched_sleep(&pcb->ctx, &pcb->lock, NULL) == -1) {
                 debugf("interrupted");
-                mutex_unlock(&mutex);
+                mutex_unlock(&pcb->lock);
                 errno = EINTR;
                 return -1;
             }
@@ -1325,7 +3238,7 @@ RETRY:
         }
         break;
     case TCP_PCB_STATE_CLOSE_WAIT:
-        remain = sizeof(pcb->buf) - pcb->rcv.wnd;
+        remain = pcb->rbuf.len;
         if (remain) {
             break;
         }
@@ -1334,37 +3247,329 @@ RETRY:
     case TCP_PCB_STATE_LAST_ACK:
     case TCP_PCB_STATE_TIME_WAIT:
         debugf("connection closing");
-        mutex_unlock(&mutex);
+        mutex_unlock(&pcb->lock);
         return 0;
     default:
         errorf("unknown state '%u'", pcb->state);
-        mutex_unlock(&mutex);
+        mutex_unlock(&pcb->lock);
         return -1;
     }
     len = MIN(size, remain);
-    memcpy(buf, pcb->buf, len);
-    memmove(pcb->buf, pcb->buf + len, remain - len);
-    pcb->rcv.wnd += len;
-    mutex_unlock(&mutex);
+    tcp_buf_peek(&pcb->rbuf, 0, buf, len);
+    tcp_buf_consume(&pcb->rbuf, len);
+    tcp_buf_shrink_schedule(pcb);
+    pcb->rcv.wnd = tcp_rcv_wnd(pcb);
+    /* NOTE: receiver side SWS avoidance, advertise the opened window only when it is worth it */
+    if (pcb->rcv.wnd > pcb->rcv.adv && (size_t)(pcb->rcv.wnd - pcb->rcv.adv) >= MIN(pcb->rbuf.limit / 2, tcp_pcb_mss(pcb))) {
+        tcp_output(pcb, TCP_FLG_ACK, 0, 0);
+    }
+    mutex_unlock(&pcb->lock);
     return len;
 }
 
+int
+tcp_setopt(int id, int opt, int val)
+{
+    struct tcp_pcb *pcb;
+    int flag;
+
+    pcb = tcp_pcb_get(id);
+    if (!pcb) {
+        errorf("pcb not found");
+        return -1;
+    }
+    switch (opt) {
+    case TCP_OPT_SNDBUF:
+        if (val < TCP_BUF_SIZE_MIN || val > TCP_SNDBUF_MAX) {
+            errorf("out of range, val=%d", val);
+            mutex_unlock(&pcb->lock);
+            return -1;
+        }
+        /* NOTE: the data already buffered is kept even if it exceeds the new limit */
+        pcb->sbuf.limit = val;
+        break;
+    case TCP_OPT_RCVBUF:
+        if (val < TCP_BUF_SIZE_MIN || val > TCP_RCVBUF_MAX) {
+            errorf("out of range, val=%d", val);
+            mutex_unlock(&pcb->lock);
+            return -1;
+        }
+        pcb->rbuf.limit = val;
+        pcb->rcv.wnd = tcp_rcv_wnd(pcb);
+        break;
+    case TCP_OPT_QUICKACK:
+        if (val) {
+            pcb->flags |= TCP_PCB_FLAG_QUICKACK;
+            if (pcb->ack_pending) {
+                tcp_output(pcb, TCP_FLG_ACK, 0, 0);
+            }
+        } else {
+            pcb->flags &= ~TCP_PCB_FLAG_QUICKACK;
+        }
+        break;
+    case TCP_OPT_NODELAY:
+    case TCP_OPT_CORK:
+        flag = (opt == TCP_OPT_NODELAY) ? TCP_PCB_FLAG_NODELAY : TCP_PCB_FLAG_CORK;
+        if (val) {
+            pcb->flags |= flag;
+        } else {
+            pcb->flags &= ~flag;
+        }
+        /* NOTE: push out the data held so far (e.g. uncorked) */
+        tcp_output_data(pcb);
+        break;
+    case TCP_OPT_NONBLOCK:
+        if (val) {
+            pcb->flags |= TCP_PCB_FLAG_NONBLOCK;
+        } else {
+            pcb->flags &= ~TCP_PCB_FLAG_NONBLOCK;
+        }
+        break;
+    default:
+        errorf("unsupported option, opt=%d", opt);
+        mutex_unlock(&pcb->lock);
+        return -1;
+    }
+    mutex_unlock(&pcb->lock);
+    return 0;
+}
+
+int
+tcp_getopt(int id, int opt, int *val)
+{
+    struct tcp_pcb *pcb;
+
+    pcb = tcp_pcb_get(id);
+    if (!pcb) {
+        errorf("pcb not found");
+        return -1;
+    }
+    switch (opt) {
+    case TCP_OPT_SNDBUF:
+        *val = pcb->sbuf.limit;
+        break;
+    case TCP_OPT_RCVBUF:
+        *val = pcb->rbuf.limit;
+        break;
+    case TCP_OPT_QUICKACK:
+        *val = (pcb->flags & TCP_PCB_FLAG_QUICKACK) ? 1 : 0;
+        break;
+    case TCP_OPT_NODELAY:
+        *val = (pcb->flags & TCP_PCB_FLAG_NODELAY) ? 1 : 0;
+        break;
+    case TCP_OPT_CORK:
+        *val = (pcb->flags & TCP_PCB_FLAG_CORK) ? 1 : 0;
+        break;
+    case TCP_OPT_NONBLOCK:
+        *val = (pcb->flags & TCP_PCB_FLAG_NONBLOCK) ? 1 : 0;
+        break;
+    default:
+        errorf("unsupported option, opt=%d", opt);
+        mutex_unlock(&pcb->lock);
+        return -1;
+    }
+    mutex_unlock(&pcb->lock);
+    return 0;
+}
+
+/* NOTE: the readiness for the user commands, a change is always followed by sched_wakeup() of the pcb */
+int
+tcp_poll(int id)
+{
+    struct tcp_pcb *pcb;
+    int events = 0;
+
+    pcb = tcp_pcb_get(id);
+    if (!pcb) {
+        /* NOTE: released by the peer (e.g. a refused non-blocking connect) */
+        return NET_POLL_ERR | NET_POLL_HUP;
+    }
+    switch (pcb->state) {
+    case TCP_PCB_STATE_LISTEN:
+        if (pcb->backlog.num) {
+            events |= NET_POLL_IN;
+        }
+        break;
+    case TCP_PCB_STATE_ESTABLISHED:
+    case TCP_PCB_STATE_CLOSE_WAIT:
+        if (pcb->sbuf.len < pcb->sbuf.limit) {
+            events |= NET_POLL_OUT;
+        }
+        /* fall through */
+    case TCP_PCB_STATE_FIN_WAIT1:
+    case TCP_PCB_STATE_FIN_WAIT2:
+        /* NOTE: the end of the stream is readable too (tcp_receive() returns 0) */
+        if (pcb->rbuf.len || pcb->state == TCP_PCB_STATE_CLOSE_WAIT) {
+            events |= NET_POLL_IN;
+        }
+        break;
+    case TCP_PCB_STATE_SYN_SENT:
+    case TCP_PCB_STATE_SYN_RECEIVED:
+        break;
+    case TCP_PCB_STATE_CLOSED:
+        events |= NET_POLL_ERR | NET_POLL_HUP;
+        break;
+    default:
+        events |= NET_POLL_HUP;
+        break;
+    }
+    mutex_unlock(&pcb->lock);
+    return events;
+}
+
+/* NOTE: attaches the watch to the pcb, the changes of the readiness are notified to the poller from now on */
+int
+tcp_watch(int id, struct sched_watch *watch, struct sched_poller *poller, void *arg)
+{
+    struct tcp_pcb *pcb;
+
+    pcb = tcp_pcb_get(id);
+    if (!pcb) {
+        return -1;
+    }
+    sched_watch_attach(watch, poller, &pcb->ctx, &pcb->lock, arg);
+    mutex_unlock(&pcb->lock);
+    return 0;
+}
+
+int
+tcp_set_congestion(int id, const char *name)
+{
+    struct tcp_pcb *pcb;
+    struct tcp_cong_ops *ops;
+
+    ops = tcp_cong_lookup(name);
+    if (!ops) {
+        errorf("congestion control not found, name=%s", name);
+        return -1;
+    }
+    pcb = tcp_pcb_get(id);
+    if (!pcb) {
+        errorf("pcb not found");
+        return -1;
+    }
+    if (pcb->cc != ops) {
+        pcb->cc = ops;
+        if (pcb->cong.mss) {
+            /* NOTE: switched on the fly, the window is taken over */
+            ops->init(&pcb->cong);
+        }
+    }
+    mutex_unlock(&pcb->lock);
+    return 0;
+}
+
+int
+tcp_get_congestion(int id, char *name, size_t size)
+{
+    struct tcp_pcb *pcb;
+
+    pcb = tcp_pcb_get(id);
+    if (!pcb) {
+        errorf("pcb not found");
+        return -1;
+    }
+    strncpy(name, pcb->cc->name, size - 1);
+    name[size - 1] = '\0';
+    mutex_unlock(&pcb->lock);
+    return 0;
+}
+
+static void
+tcp_pcb_info(struct tcp_pcb *pcb, struct tcp_info *info)
+{
+    memset(info, 0, sizeof(*info));
+    info->id = pcb->id;
+    info->state = pcb->state;
+    info->local = pcb->local;
+    info->foreign = pcb->foreign;
+    info->mss = pcb->mss;
+    info->cwnd = pcb->cong.cwnd;
+    info->ssthresh = pcb->cong.ssthresh;
+    info->srtt = pcb->srtt;
+    info->rttvar = pcb->rttvar;
+    info->rto = pcb->rto;
+    info->snd_wnd = pcb->snd.wnd;
+    info->rcv_wnd = pcb->rcv.wnd;
+    info->inflight = tcp_sbuf_inflight(pcb);
+    info->sndq = pcb->sbuf.len;
+    info->rcvq = pcb->rbuf.len;
+    info->retrans = pcb->retrans;
+    switch (pcb->state) {
+    case TCP_PCB_STATE_CLOSED:
+    case TCP_PCB_STATE_LISTEN:
+    case TCP_PCB_STATE_SYN_SENT:
+    case TCP_PCB_STATE_SYN_RECEIVED:
+        break;
+    default:
+        /* NOTE: SYN and FIN consume one sequence number each */
+        info->bytes_acked = pcb->snd.una - pcb->iss - 1;
+        if ((pcb->flags & TCP_PCB_FLAG_FIN_SENT) && pcb->snd.una == pcb->snd.nxt) {
+            info->bytes_acked--;
+        }
+        info->bytes_received = pcb->rcv.nxt - pcb->irs - 1;
+        switch (pcb->state) {
+        case TCP_PCB_STATE_CLOSE_WAIT:
+        case TCP_PCB_STATE_CLOSING:
+        case TCP_PCB_STATE_LAST_ACK:
+        case TCP_PCB_STATE_TIME_WAIT:
+            info->bytes_received--;
+            break;
+        }
+        break;
+    }
+}
+
+int
+tcp_get_info(int id, struct tcp_info *info)
+{
+    struct tcp_pcb *pcb;
+
+    pcb = tcp_pcb_get(id);
+    if (!pcb) {
+        errorf("pcb not found");
+        return -1;
+    }
+    tcp_pcb_info(pcb, info);
+    mutex_unlock(&pcb->lock);
+    return 0;
+}
+
+/* NOTE: the PCBs in use (up to size), each one is taken with its lock, not all of them at once */
+int
+tcp_get_info_all(struct tcp_info *infos, int size)
+{
+    struct tcp_pcb *pcb;
+    int id, num = 0;
+
+    for (id = 0; num < size; id++) {
+        pcb = tcp_pcb_lookup(id);
+        if (!pcb) {
+            break;
+        }
+        mutex_lock(&pcb->lock);
+        if (pcb->state != TCP_PCB_STATE_FREE) {
+            tcp_pcb_info(pcb, &infos[num++]);
+        }
+        mutex_unlock(&pcb->lock);
+    }
+    return num;
+}
+
 int
 tcp_close(int id)
 {
     struct tcp_pcb *pcb;
 
-    mutex_lock(&mutex);
     pcb = tcp_pcb_get(id);
     if (!pcb) {
         errorf("pcb not found");
-        mutex_unlock(&mutex);
         return -1;
     }
     switch (pcb->state) {
     case TCP_PCB_STATE_CLOSED:
         errorf("connection does not exist");
-        mutex_unlock(&mutex);
+        mutex_unlock(&pcb->lock);
         return -1;
     case TCP_PCB_STATE_LISTEN:
         pcb->state = TCP_PCB_STATE_CLOSED;
@@ -1373,34 +3578,32 @@ tcp_close(int id)
         pcb->state = TCP_PCB_STATE_CLOSED;
         break;
     case TCP_PCB_STATE_SYN_RECEIVED:
-        tcp_output(pcb, TCP_FLG_ACK | TCP_FLG_FIN, NULL, 0);
-        pcb->snd.nxt++;
         pcb->state = TCP_PCB_STATE_FIN_WAIT1;
+        tcp_output_fin(pcb);
         break;
     case TCP_PCB_STATE_ESTABLISHED:
-        tcp_output(pcb, TCP_FLG_ACK | TCP_FLG_FIN,  NULL, 0);
-        pcb->snd.nxt++;
+        /* NOTE: FIN follows the data remaining in the send buffer */
         pcb->state = TCP_PCB_STATE_FIN_WAIT1;
+        tcp_output_fin(pcb);
         break;
     case TCP_PCB_STATE_FIN_WAIT1:
     case TCP_PCB_STATE_FIN_WAIT2:
         errorf("connection closing");
-        mutex_unlock(&mutex);
+        mutex_unlock(&pcb->lock);
         return -1;
     case TCP_PCB_STATE_CLOSE_WAIT:
-        tcp_output(pcb, TCP_FLG_ACK | TCP_FLG_FIN, NULL, 0);
-        pcb->snd.nxt++;
         pcb->state = TCP_PCB_STATE_LAST_ACK; /* RFC793 says "enter CLOSING state", but it seems to be LAST-ACK state */
+        tcp_output_fin(pcb);
         break;
     case TCP_PCB_STATE_CLOSING:
     case TCP_PCB_STATE_LAST_ACK:
     case TCP_PCB_STATE_TIME_WAIT:
         errorf("connection closing");
-        mutex_unlock(&mutex);
+        mutex_unlock(&pcb->lock);
         return -1;
     default:
         errorf("unknown state '%u'", pcb->state);
-        mutex_unlock(&mutex);
+        mutex_unlock(&pcb->lock);
         return -1;
     }
     if (pcb->state == TCP_PCB_STATE_CLOSED) {
@@ -1408,6 +3611,6 @@ tcp_close(int id)
     } else {
         sched_wakeup(&pcb->ctx);
     }
-    mutex_unlock(&mutex);
+    mutex_unlock(&pcb->lock);
     return 0;
 }
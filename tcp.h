@@ -18,6 +18,35 @@
 #define TCP_STATE_CLOSE_WAIT  10
 #define TCP_STATE_LAST_ACK    11
 
+#define TCP_OPT_SNDBUF 1
+#define TCP_OPT_RCVBUF 2
+#define TCP_OPT_QUICKACK 3 /* NOTE: unlike Linux, stays in effect until cleared */
+#define TCP_OPT_NODELAY  4
+#define TCP_OPT_CORK     5 /* NOTE: unlike Linux, no 200ms limit on the held data */
+#define TCP_OPT_NONBLOCK 6
+
+/* NOTE: a snapshot of a connection (see tcp_get_info()), the counters of bytes wrap around at 2^32 */
+struct tcp_info {
+    int id;
+    int state;
+    struct ip_endpoint local;
+    struct ip_endpoint foreign;
+    uint32_t mss;
+    uint32_t cwnd; /* bytes */
+    uint32_t ssthresh;
+    uint32_t srtt; /* micro seconds */
+    uint32_t rttvar;
+    uint32_t rto;
+    uint32_t snd_wnd;
+    uint32_t rcv_wnd;
+    uint32_t inflight; /* bytes sent, not acknowledged yet */
+    uint32_t sndq; /* bytes in the send buffer (in flight and not sent yet) */
+    uint32_t rcvq; /* bytes received, not read yet */
+    uint32_t retrans; /* segments retransmitted */
+    uint32_t bytes_acked;
+    uint32_t bytes_received;
+};
+
 extern int
 tcp_init(void);
 
@@ -28,19 +57,35 @@ tcp_state(int id);
 extern int
 tcp_close(int id);
 extern ssize_t
-tcp_send(int id, uint8_t *data, size_t len);
+tcp_send(int id, uint8_t *data, size_t len, int flags);
 extern ssize_t
-tcp_receive(int id, uint8_t *buf, size_t size);
+tcp_receive(int id, uint8_t *buf, size_t size, int flags);
+extern int
+tcp_setopt(int id, int opt, int val);
+extern int
+tcp_getopt(int id, int opt, int *val);
+extern int
+tcp_poll(int id);
+extern int
+tcp_watch(int id, struct sched_watch *watch, struct sched_poller *poller, void *arg);
+extern int
+tcp_set_congestion(int id, const char *name);
+extern int
+tcp_get_congestion(int id, char *name, size_t size);
+extern int
+tcp_get_info(int id, struct tcp_info *info);
+extern int
+tcp_get_info_all(struct tcp_info *infos, int size);
 
 extern int
 tcp_open(void);
 extern int
 tcp_bind(int id, struct ip_endpoint *local);
 extern int
-tcp_connect(int id, struct ip_endpoint *foreign);
+tcp_connect(int id, struct ip_endpoint *foreign, int flags);
 extern int
 tcp_listen(int id, int backlog);
 extern int
-tcp_accept(int id, struct ip_endpoint *foreign);
+tcp_accept(int id, struct ip_endpoint *foreign, int flags);
 
 #endif
@@ -0,0 +1,235 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+#include "util.h"
+#include "tcp_cong.h"
+#include "timer.h"
+
+/* NOTE: the list is built by tcp_cong_init(), must not be modified after net_run() */
+static struct tcp_cong_ops *algorithms;
+static struct tcp_cong_ops *default_ops;
+
+int
+tcp_cong_register(struct tcp_cong_ops *ops)
+{
+    if (tcp_cong_lookup(ops->name)) {
+        errorf("already registered, name=%s", ops->name);
+        return -1;
+    }
+    ops->next = algorithms;
+    algorithms = ops;
+    infof("registered, name=%s", ops->name);
+    return 0;
+}
+
+struct tcp_cong_ops *
+tcp_cong_lookup(const char *name)
+{
+    struct tcp_cong_ops *ops;
+
+    for (ops = algorithms; ops; ops = ops->next) {
+        if (strncmp(ops->name, name, sizeof(ops->name)) == 0) {
+            return ops;
+        }
+    }
+    return NULL;
+}
+
+struct tcp_cong_ops *
+tcp_cong_default(void)
+{
+    return __atomic_load_n(&default_ops, __ATOMIC_ACQUIRE);
+}
+
+/* NOTE: applies to the connections opened afterwards */
+int
+tcp_cong_set_default(const char *name)
+{
+    struct tcp_cong_ops *ops;
+
+    ops = tcp_cong_lookup(name);
+    if (!ops) {
+        errorf("not found, name=%s", name);
+        return -1;
+    }
+    __atomic_store_n(&default_ops, ops, __ATOMIC_RELEASE);
+    infof("default congestion control: %s", ops->name);
+    return 0;
+}
+
+/*
+ * RFC 5681 (3.1) with Appropriate Byte Counting (RFC 3465, L=2*SMSS)
+ * NOTE: returns the part of acked left over after crossing ssthresh (for the congestion avoidance)
+ */
+uint32_t
+tcp_cong_slow_start(struct tcp_cong *cong, uint32_t acked)
+{
+    uint32_t n;
+
+    n = MIN(MIN(acked, 2 * cong->mss), cong->ssthresh - cong->cwnd);
+    cong->cwnd += n;
+    return acked - n;
+}
+
+/*
+ * NewReno (RFC 5681)
+ */
+
+struct tcp_newreno {
+    uint32_t bytes_acked; /* for the congestion avoidance, see RFC 5681 (3.1) */
+};
+
+static void
+tcp_newreno_init(struct tcp_cong *cong)
+{
+    struct tcp_newreno *ca = (struct tcp_newreno *)cong->priv;
+
+    ca->bytes_acked = 0;
+}
+
+static void
+tcp_newreno_cong_avoid(struct tcp_cong *cong, uint32_t acked)
+{
+    struct tcp_newreno *ca = (struct tcp_newreno *)cong->priv;
+
+    if (cong->cwnd < cong->ssthresh) {
+        acked = tcp_cong_slow_start(cong, acked);
+        if (!acked) {
+            return;
+        }
+    }
+    /* NOTE: one SMSS per RTT */
+    ca->bytes_acked += acked;
+    if (ca->bytes_acked >= cong->cwnd) {
+        ca->bytes_acked -= cong->cwnd;
+        cong->cwnd += cong->mss;
+    }
+}
+
+static uint32_t
+tcp_newreno_ssthresh(struct tcp_cong *cong, uint32_t inflight)
+{
+    struct tcp_newreno *ca = (struct tcp_newreno *)cong->priv;
+
+    ca->bytes_acked = 0;
+    return MAX(inflight / 2, 2 * cong->mss);
+}
+
+static struct tcp_cong_ops newreno = {
+    .name = "newreno",
+    .init = tcp_newreno_init,
+    .cong_avoid = tcp_newreno_cong_avoid,
+    .ssthresh = tcp_newreno_ssthresh,
+};
+
+/*
+ * CUBIC (RFC 9438)
+ *
+ * NOTE: windows are kept in segments (floating point) as in the RFC, time in seconds.
+ */
+
+#define TCP_CUBIC_C 0.4
+#define TCP_CUBIC_BETA 0.7
+
+struct tcp_cubic {
+    double w_max; /* window just before the last reduction */
+    double k; /* time to reach w_max */
+    double w_est; /* Reno-friendly window */
+    double frac; /* fraction of the increment not applied yet (bytes) */
+    uint64_t epoch; /* nanoseconds (see net_timer_clock()), start of the current congestion avoidance stage, cleared on reduction */
+};
+
+static void
+tcp_cubic_init(struct tcp_cong *cong)
+{
+    struct tcp_cubic *ca = (struct tcp_cubic *)cong->priv;
+
+    memset(ca, 0, sizeof(*ca));
+}
+
+static void
+tcp_cubic_cong_avoid(struct tcp_cong *cong, uint32_t acked)
+{
+    struct tcp_cubic *ca = (struct tcp_cubic *)cong->priv;
+    uint64_t now;
+    double cwnd, t, target, alpha, inc;
+
+    if (cong->cwnd < cong->ssthresh) {
+        acked = tcp_cong_slow_start(cong, acked);
+        if (!acked) {
+            return;
+        }
+    }
+    /* NOTE: monotonic, t must not jump when the wall clock is stepped */
+    now = net_timer_clock();
+    cwnd = (double)cong->cwnd / cong->mss;
+    if (!ca->epoch) {
+        ca->epoch = now;
+        if (ca->w_max <= cwnd) {
+            /* NOTE: no reduction yet (or already beyond), start probing from here */
+            ca->w_max = cwnd;
+            ca->k = 0;
+        } else {
+            ca->k = cbrt((ca->w_max - cwnd) / TCP_CUBIC_C);
+        }
+        ca->w_est = cwnd;
+        ca->frac = 0;
+    }
+    t = (now - ca->epoch) / 1000000000.0;
+    /* W_cubic(t + RTT) */
+    t += cong->srtt / 1000000.0 - ca->k;
+    target = TCP_CUBIC_C * t * t * t + ca->w_max;
+    target = MIN(MAX(target, cwnd), cwnd * 1.5);
+    /* Reno-friendly region */
+    alpha = 3.0 * (1.0 - TCP_CUBIC_BETA) / (1.0 + TCP_CUBIC_BETA);
+    ca->w_est += alpha * ((double)acked / cong->mss) / cwnd;
+    if (ca->w_est > target) {
+        target = ca->w_est;
+    }
+    /* NOTE: (target - cwnd) / cwnd per acknowledged segment */
+    inc = (target - cwnd) / cwnd * acked + ca->frac;
+    if (inc >= 1.0) {
+        cong->cwnd += (uint32_t)inc;
+        inc -= (uint32_t)inc;
+    }
+    ca->frac = inc;
+}
+
+static uint32_t
+tcp_cubic_ssthresh(struct tcp_cong *cong, uint32_t inflight)
+{
+    struct tcp_cubic *ca = (struct tcp_cubic *)cong->priv;
+    double cwnd;
+
+    cwnd = (double)cong->cwnd / cong->mss;
+    if (cwnd < ca->w_max) {
+        /* fast convergence */
+        ca->w_max = cwnd * (1.0 + TCP_CUBIC_BETA) / 2.0;
+    } else {
+        ca->w_max = cwnd;
+    }
+    ca->epoch = 0;
+    return MAX((uint32_t)(inflight * TCP_CUBIC_BETA), 2 * cong->mss);
+}
+
+static struct tcp_cong_ops cubic = {
+    .name = "cubic",
+    .init = tcp_cubic_init,
+    .cong_avoid = tcp_cubic_cong_avoid,
+    .ssthresh = tcp_cubic_ssthresh,
+};
+
+int
+tcp_cong_init(void)
+{
+    if (sizeof(struct tcp_newreno) > TCP_CONG_PRIV_SIZE || sizeof(struct tcp_cubic) > TCP_CONG_PRIV_SIZE) {
+        errorf("private area too small");
+        return -1;
+    }
+    if (tcp_cong_register(&newreno) == -1 || tcp_cong_register(&cubic) == -1) {
+        return -1;
+    }
+    return tcp_cong_set_default(TCP_CONG_DEFAULT);
+}
@@ -0,0 +1,51 @@
+#ifndef TCP_CONG_H
+#define TCP_CONG_H
+
+#include <stdint.h>
+
+#define TCP_CONG_NAME_MAX 16
+#define TCP_CONG_PRIV_SIZE 64
+
+#define TCP_CONG_DEFAULT "cubic"
+
+/*
+ * Congestion Control
+ *
+ * NOTE: The part of a connection that congestion control algorithms see. All sizes are in bytes.
+ *       The loss recovery itself (window inflation/deflation during the fast recovery) is common
+ *       and done by TCP, the algorithms decide how the window grows and how much it is reduced.
+ */
+struct tcp_cong {
+    uint32_t cwnd;
+    uint32_t ssthresh;
+    uint32_t mss; /* SMSS */
+    uint32_t srtt; /* micro seconds, 0 if not measured yet */
+    uint8_t priv[TCP_CONG_PRIV_SIZE]; /* NOTE: algorithm specific state */
+};
+
+struct tcp_cong_ops {
+    struct tcp_cong_ops *next;
+    char name[TCP_CONG_NAME_MAX];
+    void (*init)(struct tcp_cong *cong);
+    /* new data acknowledged outside the fast recovery (slow start and congestion avoidance) */
+    void (*cong_avoid)(struct tcp_cong *cong, uint32_t acked);
+    /* congestion detected (fast retransmit or retransmission timeout), returns the new ssthresh */
+    uint32_t (*ssthresh)(struct tcp_cong *cong, uint32_t inflight);
+};
+
+extern int
+tcp_cong_register(struct tcp_cong_ops *ops);
+extern struct tcp_cong_ops *
+tcp_cong_lookup(const char *name);
+extern struct tcp_cong_ops *
+tcp_cong_default(void);
+extern int
+tcp_cong_set_default(const char *name);
+
+extern uint32_t
+tcp_cong_slow_start(struct tcp_cong *cong, uint32_t acked);
+
+extern int
+tcp_cong_init(void);
+
+#endif
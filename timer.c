@@ -0,0 +1,318 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "platform.h"
+
+#include "util.h"
+#include "net.h"
+#include "timer.h"
+
+#define NET_TIMER_SLOT_MASK     (NET_TIMER_SLOTS - 1)
+#define NET_TIMER_INDEX_EXPIRED (NET_TIMER_LEVELS * NET_TIMER_SLOTS) /* on the expired list */
+#define NET_TIMER_RANGE         (1ULL << (NET_TIMER_SLOT_BITS * NET_TIMER_LEVELS)) /* ticks covered by the wheel */
+
+/* NOTE: protects all the fields below and the timers linked to them */
+static mutex_t mutex = MUTEX_INITIALIZER;
+static uint64_t tick; /* the next tick to be processed */
+static uint64_t programmed = UINT64_MAX; /* nanoseconds given to the platform timer, UINT64_MAX if none */
+static unsigned int num; /* in the slots (not counting the expired list) */
+static uint64_t bitmap[NET_TIMER_LEVELS]; /* NOTE: the slots not empty */
+static struct net_timer *slots[NET_TIMER_LEVELS][NET_TIMER_SLOTS];
+static struct net_timer *expired; /* taken from the wheel, waiting for the handler to run */
+static struct net_timer *running; /* the one whose handler is running */
+
+/* NOTE: nanoseconds (CLOCK_MONOTONIC, vDSO) */
+uint64_t
+net_timer_clock(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+net_timer_link(struct net_timer **head, struct net_timer *timer, int index)
+{
+    timer->next = *head;
+    if (*head) {
+        (*head)->pprev = &timer->next;
+    }
+    *head = timer;
+    timer->pprev = head;
+    timer->index = index;
+}
+
+/* NOTE: you must hold the mutex */
+static void
+net_timer_unlink(struct net_timer *timer)
+{
+    unsigned int level, slot;
+
+    *timer->pprev = timer->next;
+    if (timer->next) {
+        timer->next->pprev = timer->pprev;
+    }
+    if (timer->index != NET_TIMER_INDEX_EXPIRED) {
+        level = timer->index / NET_TIMER_SLOTS;
+        slot = timer->index % NET_TIMER_SLOTS;
+        num--;
+        if (!slots[level][slot]) {
+            bitmap[level] &= ~(1ULL << slot);
+        }
+    }
+    timer->next = NULL;
+    timer->pprev = NULL;
+}
+
+/* NOTE: you must hold the mutex, the level is chosen by the distance from the current tick */
+static void
+net_timer_place(struct net_timer *timer)
+{
+    uint64_t expire, delta;
+    unsigned int level, slot;
+
+    /* NOTE: rounded up, never run before the expiry */
+    expire = (timer->expire + NET_TIMER_TICK - 1) >> NET_TIMER_TICK_SHIFT;
+    if (expire < tick) {
+        expire = tick;
+    }
+    delta = expire - tick;
+    if (delta >= NET_TIMER_RANGE) {
+        /* NOTE: placed at the end of the wheel, placed again from there */
+        delta = NET_TIMER_RANGE - 1;
+        expire = tick + delta;
+    }
+    for (level = 0; level < NET_TIMER_LEVELS - 1; level++) {
+        if (delta < (1ULL << (NET_TIMER_SLOT_BITS * (level + 1)))) {
+            break;
+        }
+    }
+    slot = (expire >> (NET_TIMER_SLOT_BITS * level)) & NET_TIMER_SLOT_MASK;
+    net_timer_link(&slots[level][slot], timer, level * NET_TIMER_SLOTS + slot);
+    bitmap[level] |= 1ULL << slot;
+    num++;
+}
+
+/*
+ * NOTE: you must hold the mutex, the earliest tick something is to be done at (a timer expires or a slot is
+ *       cascaded), UINT64_MAX if the wheel is empty. the slot of the current tick of a level has been cascaded
+ *       already unless the tick is at the boundary of the level.
+ */
+static uint64_t
+net_timer_next(void)
+{
+    uint64_t next = UINT64_MAX, pos, bits, at;
+    unsigned int level, shift, start;
+
+    for (level = 0; level < NET_TIMER_LEVELS; level++) {
+        if (!bitmap[level]) {
+            continue;
+        }
+        shift = NET_TIMER_SLOT_BITS * level;
+        pos = tick >> shift;
+        if (tick & ((1ULL << shift) - 1)) {
+            pos++;
+        }
+        start = pos & NET_TIMER_SLOT_MASK;
+        bits = start ? (bitmap[level] >> start | bitmap[level] << (NET_TIMER_SLOTS - start)) : bitmap[level];
+        at = (pos + __builtin_ctzll(bits)) << shift;
+        if (at < next) {
+            next = at;
+        }
+    }
+    return next;
+}
+
+/* NOTE: you must hold the mutex, the platform timer is programmed only when it gets earlier */
+static void
+net_timer_program(void)
+{
+    uint64_t next;
+
+    next = net_timer_next();
+    if (next == UINT64_MAX) {
+        return;
+    }
+    next <<= NET_TIMER_TICK_SHIFT;
+    if (next < programmed) {
+        programmed = next;
+        intr_timer_set(next);
+    }
+}
+
+/* NOTE: you must hold the mutex */
+static void
+net_timer_cascade(unsigned int level, unsigned int slot)
+{
+    struct net_timer *timer;
+
+    while ((timer = slots[level][slot]) != NULL) {
+        net_timer_unlink(timer);
+        net_timer_place(timer);
+    }
+}
+
+/* NOTE: you must hold the mutex, moves the timers expired by now (in ticks) to the expired list */
+static void
+net_timer_advance(uint64_t now)
+{
+    uint64_t next;
+    unsigned int level, slot;
+    struct net_timer *timer;
+
+    while (tick <= now) {
+        next = net_timer_next();
+        if (next > now) {
+            /* NOTE: nothing to be done in the ticks between, skipped at once */
+            tick = now + 1;
+            break;
+        }
+        tick = next;
+        for (level = 1; level < NET_TIMER_LEVELS; level++) {
+            if (tick & ((1ULL << (NET_TIMER_SLOT_BITS * level)) - 1)) {
+                break;
+            }
+            net_timer_cascade(level, (tick >> (NET_TIMER_SLOT_BITS * level)) & NET_TIMER_SLOT_MASK);
+        }
+        slot = tick & NET_TIMER_SLOT_MASK;
+        while ((timer = slots[0][slot]) != NULL) {
+            net_timer_unlink(timer);
+            net_timer_link(&expired, timer, NET_TIMER_INDEX_EXPIRED);
+        }
+        tick++;
+    }
+}
+
+/* NOTE: you must hold the mutex */
+static void
+net_timer_add(struct net_timer *timer, uint64_t expire)
+{
+    if (timer->pprev) {
+        net_timer_unlink(timer);
+    }
+    timer->expire = expire;
+    if (!num) {
+        /* NOTE: the wheel has not moved while it was empty, placed from now not to be cascaded for nothing */
+        tick = MAX(tick, net_timer_clock() >> NET_TIMER_TICK_SHIFT);
+    }
+    net_timer_place(timer);
+    net_timer_program();
+}
+
+void
+net_timer_init(struct net_timer *timer, void (*handler)(void *arg), void *arg)
+{
+    timer->next = NULL;
+    timer->pprev = NULL;
+    timer->expire = 0;
+    timer->interval = 0;
+    timer->index = 0;
+    timer->handler = handler;
+    timer->arg = arg;
+}
+
+/* NOTE: one-shot at expire (nanoseconds, see net_timer_clock()), moved if already pending */
+void
+net_timer_arm(struct net_timer *timer, uint64_t expire)
+{
+    mutex_lock(&mutex);
+    timer->interval = 0;
+    net_timer_add(timer, expire);
+    mutex_unlock(&mutex);
+}
+
+/* NOTE: runs every interval (nanoseconds) from now until cancelled */
+void
+net_timer_arm_periodic(struct net_timer *timer, uint64_t interval)
+{
+    mutex_lock(&mutex);
+    timer->interval = interval;
+    net_timer_add(timer, net_timer_clock() + interval);
+    mutex_unlock(&mutex);
+}
+
+/* NOTE: arms the timer only if it is not pending or expires later (the handler finds the real deadline) */
+void
+net_timer_reduce(struct net_timer *timer, uint64_t expire)
+{
+    mutex_lock(&mutex);
+    if (!timer->pprev || expire < timer->expire) {
+        timer->interval = 0;
+        net_timer_add(timer, expire);
+    }
+    mutex_unlock(&mutex);
+}
+
+/*
+ * NOTE: returns -1 if the handler is running (or it is the caller), the owner of the timer must not be freed
+ *       then until the handler returns. otherwise the handler does not run after this.
+ */
+int
+net_timer_cancel(struct net_timer *timer)
+{
+    int ret;
+
+    mutex_lock(&mutex);
+    if (timer->pprev) {
+        net_timer_unlink(timer);
+    }
+    timer->interval = 0;
+    ret = (running == timer) ? -1 : 0;
+    mutex_unlock(&mutex);
+    return ret;
+}
+
+int
+net_timer_pending(struct net_timer *timer)
+{
+    int ret;
+
+    mutex_lock(&mutex);
+    ret = timer->pprev ? 1 : 0;
+    mutex_unlock(&mutex);
+    return ret;
+}
+
+/* NOTE: called in the interrupt thread when the platform timer fired (may be earlier or for nothing) */
+int
+net_timer_handler(void)
+{
+    struct net_timer *timer;
+    uint64_t now;
+    void (*handler)(void *arg);
+    void *arg;
+
+    net_tx_begin();
+    mutex_lock(&mutex);
+    programmed = UINT64_MAX;
+    while (1) {
+        now = net_timer_clock();
+        net_timer_advance(now >> NET_TIMER_TICK_SHIFT);
+        timer = expired;
+        if (!timer) {
+            break;
+        }
+        net_timer_unlink(timer);
+        if (timer->interval) {
+            /* NOTE: the runs missed (e.g. stopped in a debugger) are not made up for */
+            timer->expire += timer->interval;
+            if (timer->expire <= now) {
+                timer->expire = now + timer->interval;
+            }
+            net_timer_place(timer);
+        }
+        running = timer;
+        handler = timer->handler;
+        arg = timer->arg;
+        mutex_unlock(&mutex);
+        handler(arg);
+        mutex_lock(&mutex);
+        running = NULL;
+    }
+    net_timer_program();
+    mutex_unlock(&mutex);
+    net_tx_end();
+    return 0;
+}
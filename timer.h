@@ -0,0 +1,55 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdint.h>
+
+/*
+ * Timer (hierarchical timing wheel)
+ *
+ * NOTE: the timers are kept in NET_TIMER_LEVELS levels of NET_TIMER_SLOTS slots, a slot of level L covers
+ *       NET_TIMER_SLOTS^L ticks and is cascaded down to the lower levels when the time comes. nothing ticks,
+ *       the platform timer (see intr_timer_set()) is programmed at the next tick something is to be done at.
+ *       the handlers run one by one in the interrupt thread (see net_timer_handler()) without the lock of
+ *       the wheel held, they may arm and cancel the timers (including their own).
+ */
+
+#define NET_TIMER_TICK_SHIFT 14 /* nanoseconds per tick in log2 (about 16 micro seconds) */
+#define NET_TIMER_TICK       (1ULL << NET_TIMER_TICK_SHIFT)
+#define NET_TIMER_SLOT_BITS  6
+#define NET_TIMER_SLOTS      (1 << NET_TIMER_SLOT_BITS)
+#define NET_TIMER_LEVELS     6 /* 2^(14+36) nanoseconds (about 13 days), the later ones are cascaded again */
+
+#define NET_TIMER_MSEC(x) ((uint64_t)(x) * 1000000)
+#define NET_TIMER_USEC(x) ((uint64_t)(x) * 1000)
+#define NET_TIMER_SEC(x)  ((uint64_t)(x) * 1000000000)
+
+struct net_timer {
+    struct net_timer *next;
+    struct net_timer **pprev; /* NOTE: NULL while not pending */
+    uint64_t expire; /* nanoseconds (CLOCK_MONOTONIC, see net_timer_clock()) */
+    uint64_t interval; /* nanoseconds, re-armed by this before each run if not 0 */
+    int index; /* slot in the wheel (level * NET_TIMER_SLOTS + slot) */
+    void (*handler)(void *arg);
+    void *arg;
+};
+
+extern uint64_t
+net_timer_clock(void);
+
+extern void
+net_timer_init(struct net_timer *timer, void (*handler)(void *arg), void *arg);
+extern void
+net_timer_arm(struct net_timer *timer, uint64_t expire);
+extern void
+net_timer_arm_periodic(struct net_timer *timer, uint64_t interval);
+extern void
+net_timer_reduce(struct net_timer *timer, uint64_t expire);
+extern int
+net_timer_cancel(struct net_timer *timer);
+extern int
+net_timer_pending(struct net_timer *timer);
+
+extern int
+net_timer_handler(void);
+
+#endif
@@ -0,0 +1,197 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "platform.h"
+
+#include "util.h"
+#include "trace.h"
+
+struct trace_ring {
+    struct trace_ring *next;
+    uint32_t thread;
+    uint64_t head; /* NOTE: written by the owner thread only, the records before it are complete */
+    struct trace_record records[TRACE_RING_SIZE];
+};
+
+static mutex_t mutex = MUTEX_INITIALIZER; /* NOTE: protects rings (only to add and to walk) */
+static struct trace_ring *rings;
+static uint32_t ring_num;
+static __thread struct trace_ring *ring;
+
+static struct trace_ring *
+trace_ring_alloc(void)
+{
+    struct trace_ring *r;
+
+    r = memory_alloc(sizeof(*r));
+    if (!r) {
+        return NULL;
+    }
+    mutex_lock(&mutex);
+    r->thread = ring_num++;
+    r->next = rings;
+    rings = r;
+    mutex_unlock(&mutex);
+    return r;
+}
+
+/* NOTE: no lock, no syscall (vDSO clock) */
+void
+trace_record(uint32_t id, uint32_t a0, uint32_t a1, uint32_t a2, uint32_t a3)
+{
+    struct trace_record *rec;
+    struct timespec ts;
+    uint64_t head;
+
+    if (!ring) {
+        ring = trace_ring_alloc();
+        if (!ring) {
+            return;
+        }
+    }
+    head = ring->head;
+    rec = &ring->records[head & (TRACE_RING_SIZE - 1)];
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    rec->ts = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    rec->id = id;
+    rec->thread = ring->thread;
+    rec->args[0] = a0;
+    rec->args[1] = a1;
+    rec->args[2] = a2;
+    rec->args[3] = a3;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * NOTE: can be called while the others are recording, the records which may have been overwritten
+ *       during the copy are dropped (the one being written is head - TRACE_RING_SIZE at most).
+ */
+static size_t
+trace_ring_copy(struct trace_ring *r, struct trace_record *dst)
+{
+    uint64_t head, start, valid, i;
+
+    head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    start = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+    for (i = start; i < head; i++) {
+        dst[i - start] = r->records[i & (TRACE_RING_SIZE - 1)];
+    }
+    valid = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    valid = valid >= TRACE_RING_SIZE ? valid - TRACE_RING_SIZE + 1 : 0;
+    if (valid <= start) {
+        return head - start;
+    }
+    if (valid >= head) {
+        return 0;
+    }
+    memmove(dst, dst + (valid - start), sizeof(*dst) * (head - valid));
+    return head - valid;
+}
+
+int
+trace_dump(const char *path)
+{
+    FILE *fp;
+    struct trace_file_hdr hdr;
+    struct trace_ring *r;
+    struct trace_record *buf;
+    size_t n;
+
+    buf = memory_alloc(sizeof(*buf) * TRACE_RING_SIZE);
+    if (!buf) {
+        errorf("memory_alloc() failure");
+        return -1;
+    }
+    fp = fopen(path, "w");
+    if (!fp) {
+        errorf("fopen() failure, path=%s", path);
+        memory_free(buf);
+        return -1;
+    }
+    memcpy(hdr.magic, TRACE_FILE_MAGIC, sizeof(hdr.magic));
+    hdr.version = TRACE_FILE_VERSION;
+    hdr.record_size = sizeof(struct trace_record);
+    hdr.num = 0;
+    fwrite(&hdr, sizeof(hdr), 1, fp);
+    mutex_lock(&mutex);
+    for (r = rings; r; r = r->next) {
+        n = trace_ring_copy(r, buf);
+        hdr.num += fwrite(buf, sizeof(*buf), n, fp);
+    }
+    mutex_unlock(&mutex);
+    /* NOTE: the number is known at the end */
+    rewind(fp);
+    fwrite(&hdr, sizeof(hdr), 1, fp);
+    fclose(fp);
+    memory_free(buf);
+    infof("%u records, path=%s", hdr.num, path);
+    return 0;
+}
+
+static int
+trace_record_cmp(const void *a, const void *b)
+{
+    const struct trace_record *x = a, *y = b;
+
+    return (x->ts > y->ts) - (x->ts < y->ts);
+}
+
+/* NOTE: returns the records of all the threads sorted by the time, the caller frees it with memory_free() */
+struct trace_record *
+trace_load(const char *path, size_t *num)
+{
+    FILE *fp;
+    struct trace_file_hdr hdr;
+    struct trace_record *records;
+
+    fp = fopen(path, "r");
+    if (!fp) {
+        errorf("fopen() failure, path=%s", path);
+        return NULL;
+    }
+    if (fread(&hdr, sizeof(hdr), 1, fp) != 1 || memcmp(hdr.magic, TRACE_FILE_MAGIC, sizeof(hdr.magic)) != 0 ||
+        hdr.version != TRACE_FILE_VERSION || hdr.record_size != sizeof(struct trace_record)) {
+        errorf("not a trace file (or another version), path=%s", path);
+        fclose(fp);
+        return NULL;
+    }
+    records = memory_alloc(sizeof(*records) * (hdr.num ? hdr.num : 1));
+    if (!records) {
+        errorf("memory_alloc() failure");
+        fclose(fp);
+        return NULL;
+    }
+    *num = fread(records, sizeof(*records), hdr.num, fp);
+    fclose(fp);
+    qsort(records, *num, sizeof(*records), trace_record_cmp);
+    return records;
+}
+
+const char *
+trace_event_name(uint32_t id)
+{
+    switch (id) {
+    case TRACE_EVENT_NET_INPUT:
+        return "NET_INPUT";
+    case TRACE_EVENT_NET_OUTPUT:
+        return "NET_OUTPUT";
+    case TRACE_EVENT_IP_INPUT:
+        return "IP_INPUT";
+    case TRACE_EVENT_IP_OUTPUT:
+        return "IP_OUTPUT";
+    case TRACE_EVENT_TCP_INPUT:
+        return "TCP_INPUT";
+    case TRACE_EVENT_TCP_OUTPUT:
+        return "TCP_OUTPUT";
+    case TRACE_EVENT_UDP_INPUT:
+        return "UDP_INPUT";
+    case TRACE_EVENT_UDP_OUTPUT:
+        return "UDP_OUTPUT";
+    case TRACE_EVENT_SOFTIRQ:
+        return "SOFTIRQ";
+    }
+    return "UNKNOWN";
+}
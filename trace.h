@@ -0,0 +1,65 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Trace Ring
+ *
+ * NOTE: opt-in (CFLAGS=-DTRACE_RING), each thread records binary events into its own ring without locks,
+ *       the oldest ones are overwritten. the rings are written to TRACE_RING_FILE by net_shutdown()
+ *       (or trace_dump()), and decoded offline (see app/tracedump.c). without TRACE_RING, tracef() is nothing.
+ */
+
+#ifndef TRACE_RING_SIZE
+#define TRACE_RING_SIZE 8192 /* records per thread, power of 2 */
+#endif
+#ifndef TRACE_RING_FILE
+#define TRACE_RING_FILE "trace.bin"
+#endif
+
+#define TRACE_FILE_MAGIC "MPTR"
+#define TRACE_FILE_VERSION 1
+
+/* NOTE: the arguments of each event (a0, a1, a2, a3) */
+#define TRACE_EVENT_NET_INPUT  1 /* dev index, type, len, worker */
+#define TRACE_EVENT_NET_OUTPUT 2 /* dev index, type, len, - */
+#define TRACE_EVENT_IP_INPUT   3 /* src, dst, protocol, len */
+#define TRACE_EVENT_IP_OUTPUT  4 /* src, dst, protocol, len */
+#define TRACE_EVENT_TCP_INPUT  5 /* src port << 16 | dst port, seq, ack, flags << 16 | len */
+#define TRACE_EVENT_TCP_OUTPUT 6 /* src port << 16 | dst port, seq, ack, flags << 16 | len */
+#define TRACE_EVENT_UDP_INPUT  7 /* src port << 16 | dst port, len, -, - */
+#define TRACE_EVENT_UDP_OUTPUT 8 /* src port << 16 | dst port, len, -, - */
+#define TRACE_EVENT_SOFTIRQ    9 /* worker, type, packets taken, packets left */
+
+struct trace_record {
+    uint64_t ts; /* nanoseconds (CLOCK_MONOTONIC) */
+    uint32_t id;
+    uint32_t thread; /* the ring, in the order of the first event */
+    uint32_t args[4];
+};
+
+struct trace_file_hdr {
+    char magic[4];
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t num;
+};
+
+#ifdef TRACE_RING
+#define tracef(id, a0, a1, a2, a3) trace_record((id), (a0), (a1), (a2), (a3))
+#else
+#define tracef(id, a0, a1, a2, a3) do {} while (0)
+#endif
+
+extern void
+trace_record(uint32_t id, uint32_t a0, uint32_t a1, uint32_t a2, uint32_t a3);
+extern int
+trace_dump(const char *path);
+extern struct trace_record *
+trace_load(const char *path, size_t *num);
+extern const char *
+trace_event_name(uint32_t id);
+
+#endif
@@ -11,25 +11,31 @@
 #include "net.h"
 #include "ip.h"
 #include "udp.h"
+#include "trace.h"
+#include "stats.h"
 
-#define UDP_PCB_SIZE 16
+#define UDP_PCB_SIZE_MIN 16
+#define UDP_PCB_SIZE_MAX 65536
+#define UDP_PCB_HASH_SIZE 64 /* initial number of buckets (grows) */
 
 #define UDP_PCB_STATE_FREE    0
 #define UDP_PCB_STATE_OPEN    1
 #define UDP_PCB_STATE_CLOSING 2
 
+#define UDP_PCB_FLAG_NONBLOCK 0x0001 /* udp_recvfrom() fails with EAGAIN instead of sleeping */
+
+/* NOTE: the memory held by the receive queue (the whole frames kept, see udp_input()), the datagrams beyond are dropped */
+#define UDP_RCVBUF_DEFAULT (64 * 1024)
+#define UDP_RCVBUF_MIN     MEMORY_POOL_FRAME_SIZE
+#define UDP_RCVBUF_MAX     (16 * 1024 * 1024)
+
+/* NOTE: payloads up to this are copied into the entry (a small block) instead of holding the frame */
+#define UDP_COPY_MAX 64
+
 /* see https://tools.ietf.org/html/rfc6335 */
 #define UDP_SOURCE_PORT_MIN 49152
 #define UDP_SOURCE_PORT_MAX 65535
 
-struct pseudo_hdr {
-    uint32_t src;
-    uint32_t dst;
-    uint8_t zero;
-    uint8_t protocol;
-    uint16_t len;
-};
-
 struct udp_hdr {
     uint16_t src;
     uint16_t dst;
@@ -38,26 +44,47 @@ struct udp_hdr {
 };
 
 struct udp_pcb {
+    int id;
+    mutex_t lock; /* NOTE: kept (and unlocked) while the pcb is free */
+    unsigned int gen; /* NOTE: incremented when rebound or released, changed with both locks held */
     int state;
+    int flags;
     struct ip_endpoint local;
-    struct queue_head queue; /* receive queue */
+    struct ip_dst dst; /* NOTE: the route (and the link address) used last, see ip_dst_lookup_cached() */
+    struct list_head queue; /* receive queue (struct udp_queue_entry) */
+    size_t rcvbuf; /* upper limit of rcvbuf_used (SO_RCVBUF) */
+    size_t rcvbuf_used; /* memory held by the queue (see udp_queue_entry_size()) */
     struct sched_ctx ctx;
+    struct udp_pcb *next; /* free list */
+    struct hash_node node; /* bind table (keyed by the local port) */
 };
 
-/* NOTE: the data follows immediately after the structure */
 struct udp_queue_entry {
+    struct list_node node;
     struct ip_endpoint foreign;
-    uint16_t len;
+    struct pbuf *pb; /* NOTE: holds a reference to the received buffer (pb->data points to the payload), NULL if copied */
+    size_t len;
+    uint8_t data[]; /* NOTE: the payload copied (up to UDP_COPY_MAX) if pb is NULL */
 };
 
-static mutex_t mutex = MUTEX_INITIALIZER;
-static struct udp_pcb pcbs[UDP_PCB_SIZE];
+/*
+ * NOTE: table_lock protects the tables below (pcbs, pcb_free and bind_table) and the local endpoint of the PCBs.
+ *       it is taken after the lock of a PCB, never the other way around.
+ */
+static rwlock_t table_lock = RWLOCK_INITIALIZER;
+static struct udp_pcb **pcbs; /* indexed by id, grows up to UDP_PCB_SIZE_MAX */
+static int pcb_num, pcb_capacity;
+static struct udp_pcb *pcb_free; /* NOTE: released PCBs are kept and reused with their id */
+static struct hash_table bind_table;
 
 static void
 udp_dump(const uint8_t *data, size_t len)
 {
     struct udp_hdr *hdr;
 
+    if (!LOG_ENABLED(DEBUG)) {
+        return;
+    }
     flockfile(stderr);
     hdr = (struct udp_hdr *)data;
     fprintf(stderr, "        src: %u\n", ntoh16(hdr->src));
@@ -73,28 +100,108 @@ udp_dump(const uint8_t *data, size_t len)
 /*
  * UDP Protocol Control Block (PCB)
  *
- * NOTE: UDP PCB functions must be called after mutex locked
+ * NOTE: UDP PCB functions must be called after the lock of the PCB taken (udp_pcb_alloc() and udp_pcb_get()
+ *       return the PCB locked), udp_pcb_bind(), udp_pcb_select() and udp_pcb_select_port() also with table_lock
  */
 
+static int
+udp_pcb_table_grow(void)
+{
+    struct udp_pcb **table;
+    int capacity;
+
+    if (pcb_capacity >= UDP_PCB_SIZE_MAX) {
+        return -1;
+    }
+    capacity = pcb_capacity ? pcb_capacity * 2 : UDP_PCB_SIZE_MIN;
+    table = memory_alloc(sizeof(*table) * capacity);
+    if (!table) {
+        errorf("memory_alloc() failure");
+        return -1;
+    }
+    if (pcbs) {
+        memcpy(table, pcbs, sizeof(*table) * pcb_num);
+        memory_free(pcbs);
+    }
+    pcbs = table;
+    pcb_capacity = capacity;
+    return 0;
+}
+
 static struct udp_pcb *
 udp_pcb_alloc(void)
 {
     struct udp_pcb *pcb;
 
-    for (pcb = pcbs; pcb < tailof(pcbs); pcb++) {
-        if (pcb->state == UDP_PCB_STATE_FREE) {
-            pcb->state = UDP_PCB_STATE_OPEN;
-            sched_ctx_init(&pcb->ctx);
-            return pcb;
+    rwlock_wrlock(&table_lock);
+    if (pcb_free) {
+        pcb = pcb_free;
+        pcb_free = pcb->next;
+        pcb->next = NULL;
+    } else {
+        if (pcb_num == pcb_capacity && udp_pcb_table_grow() == -1) {
+            rwlock_unlock(&table_lock);
+            return NULL;
         }
+        pcb = memory_alloc(sizeof(*pcb));
+        if (!pcb) {
+            errorf("memory_alloc() failure");
+            rwlock_unlock(&table_lock);
+            return NULL;
+        }
+        mutex_init(&pcb->lock);
+        pcb->id = pcb_num;
+        pcbs[pcb_num++] = pcb;
+    }
+    rwlock_unlock(&table_lock);
+    /* NOTE: still FREE until locked, a stale udp_pcb_get() does not see it half initialized */
+    mutex_lock(&pcb->lock);
+    pcb->state = UDP_PCB_STATE_OPEN;
+    pcb->rcvbuf = UDP_RCVBUF_DEFAULT;
+    pcb->rcvbuf_used = 0;
+    sched_ctx_init(&pcb->ctx);
+    return pcb;
+}
+
+/* NOTE: the memory the entry holds, the whole frame if it keeps the received buffer */
+static size_t
+udp_queue_entry_size(struct udp_queue_entry *entry)
+{
+    return entry->pb ? entry->pb->size : MEMORY_POOL_SMALL_SIZE;
+}
+
+static const uint8_t *
+udp_queue_entry_data(struct udp_queue_entry *entry)
+{
+    return entry->pb ? entry->pb->data : entry->data;
+}
+
+static void
+udp_queue_entry_free(struct udp_queue_entry *entry)
+{
+    pbuf_free(entry->pb);
+    memory_pool_free(entry);
+}
+
+static struct udp_queue_entry *
+udp_queue_pop(struct udp_pcb *pcb)
+{
+    struct list_node *node;
+    struct udp_queue_entry *entry;
+
+    node = list_pop(&pcb->queue);
+    if (!node) {
+        return NULL;
     }
-    return NULL;
+    entry = containerof(node, struct udp_queue_entry, node);
+    pcb->rcvbuf_used -= udp_queue_entry_size(entry);
+    return entry;
 }
 
 static void
 udp_pcb_release(struct udp_pcb *pcb)
 {
-    struct queue_entry *entry;
+    struct udp_queue_entry *entry;
 
     pcb->state = UDP_PCB_STATE_CLOSING;
     if (sched_ctx_destroy(&pcb->ctx) == -1) {
@@ -102,39 +209,109 @@ udp_pcb_release(struct udp_pcb *pcb)
         return;
     }
     pcb->state = UDP_PCB_STATE_FREE;
+    pcb->flags = 0;
+    while ((entry = udp_queue_pop(pcb)) != NULL) {
+        udp_queue_entry_free(entry);
+    }
+    rwlock_wrlock(&table_lock);
+    hash_table_remove(&bind_table, &pcb->node);
     pcb->local.addr = IP_ADDR_ANY;
     pcb->local.port = 0;
-    while ((entry = queue_pop(&pcb->queue)) != NULL) {
-        memory_free(entry);
+    pcb->dst.iface = NULL;
+    pcb->gen++;
+    pcb->next = pcb_free;
+    pcb_free = pcb;
+    rwlock_unlock(&table_lock);
+}
+
+static void
+udp_pcb_bind(struct udp_pcb *pcb, struct ip_endpoint *local)
+{
+    hash_table_remove(&bind_table, &pcb->node);
+    pcb->local = *local;
+    if (pcb->local.port) {
+        hash_table_insert(&bind_table, &pcb->node, hash32(pcb->local.port));
     }
+    pcb->gen++;
 }
 
 static struct udp_pcb *
 udp_pcb_select(ip_addr_t addr, uint16_t port)
 {
-    struct udp_pcb *pcb;
-
-    for (pcb = pcbs; pcb < tailof(pcbs); pcb++) {
-        if (pcb->state == UDP_PCB_STATE_OPEN) {
-            if ((pcb->local.addr == IP_ADDR_ANY || pcb->local.addr == addr) && pcb->local.port == port) {
+    struct hash_node *node;
+    struct udp_pcb *pcb, *wildcard = NULL;
+    uint32_t hash;
+
+    hash = hash32(port);
+    for (node = hash_table_lookup(&bind_table, hash); node; node = node->next) {
+        if (node->hash != hash) {
+            continue;
+        }
+        pcb = containerof(node, struct udp_pcb, node);
+        if (pcb->state == UDP_PCB_STATE_OPEN && pcb->local.port == port) {
+            if (pcb->local.addr == addr) {
                 return pcb;
             }
+            if (pcb->local.addr == IP_ADDR_ANY) {
+                wildcard = pcb;
+            }
+        }
+    }
+    return wildcard;
+}
+
+/* NOTE: the pcb found is returned locked, it may have been rebound or released while waiting for the lock */
+static struct udp_pcb *
+udp_pcb_select_lock(ip_addr_t addr, uint16_t port)
+{
+    struct udp_pcb *pcb;
+    unsigned int gen;
+
+    while (1) {
+        rwlock_rdlock(&table_lock);
+        pcb = udp_pcb_select(addr, port);
+        if (!pcb) {
+            rwlock_unlock(&table_lock);
+            return NULL;
+        }
+        gen = pcb->gen;
+        rwlock_unlock(&table_lock);
+        mutex_lock(&pcb->lock);
+        if (pcb->gen == gen && pcb->state == UDP_PCB_STATE_OPEN) {
+            return pcb;
         }
+        mutex_unlock(&pcb->lock);
+    }
+}
+
+/* NOTE: PCBs are never freed (the memory is reused), the pointer stays valid after table_lock released */
+static struct udp_pcb *
+udp_pcb_lookup(int id)
+{
+    struct udp_pcb *pcb = NULL;
+
+    rwlock_rdlock(&table_lock);
+    if (id >= 0 && id < pcb_num) {
+        pcb = pcbs[id];
     }
-    return NULL;
+    rwlock_unlock(&table_lock);
+    return pcb;
 }
 
+/* NOTE: the pcb is returned locked */
 static struct udp_pcb *
 udp_pcb_get(int id)
 {
     struct udp_pcb *pcb;
 
-    if (id < 0 || id >= (int)countof(pcbs)) {
+    pcb = udp_pcb_lookup(id);
+    if (!pcb) {
         /* out of range */
         return NULL;
     }
-    pcb = &pcbs[id];
+    mutex_lock(&pcb->lock);
     if (pcb->state != UDP_PCB_STATE_OPEN) {
+        mutex_unlock(&pcb->lock);
         return NULL;
     }
     return pcb;
@@ -143,77 +320,112 @@ udp_pcb_get(int id)
 static int
 udp_pcb_id(struct udp_pcb *pcb)
 {
-    return indexof(pcbs, pcb);
+    return pcb->id;
+}
+
+/* NOTE: the ports are tried in turn from where the last search stopped */
+static uint16_t
+udp_pcb_select_port(ip_addr_t addr)
+{
+    static uint32_t next = UDP_SOURCE_PORT_MIN;
+    uint32_t p, n;
+
+    for (n = 0; n <= UDP_SOURCE_PORT_MAX - UDP_SOURCE_PORT_MIN; n++) {
+        p = next;
+        next = (p == UDP_SOURCE_PORT_MAX) ? UDP_SOURCE_PORT_MIN : p + 1;
+        if (!udp_pcb_select(addr, hton16(p))) {
+            return hton16(p);
+        }
+    }
+    return 0;
 }
 
 static void
-udp_input(const uint8_t *data, size_t len, ip_addr_t src, ip_addr_t dst, struct ip_iface *iface)
+udp_input(struct pbuf *pb, ip_addr_t src, ip_addr_t dst, struct ip_iface *iface)
 {
-    struct pseudo_hdr pseudo;
+    const uint8_t *data = pb->data;
+    size_t len = pb->len;
     uint16_t psum = 0;
     struct udp_hdr *hdr;
     char addr1[IP_ADDR_STR_LEN];
     char addr2[IP_ADDR_STR_LEN];
     struct udp_pcb *pcb;
     struct udp_queue_entry *entry;
+    size_t size;
 
     if (len < sizeof(*hdr)) {
         errorf("too short");
+        stats_inc(STATS_UDP_IN_ERRORS);
         return;
     }
     hdr = (struct udp_hdr *)data;
     if (len != ntoh16(hdr->len)) { /* just to make sure */
         errorf("length error: len=%zu, hdr->len=%u", len, ntoh16(hdr->len));
+        stats_inc(STATS_UDP_IN_ERRORS);
         return;
     }
-    pseudo.src = src;
-    pseudo.dst = dst;
-    pseudo.zero = 0;
-    pseudo.protocol = IP_PROTOCOL_UDP;
-    pseudo.len = hton16(len);
-    psum = ~cksum16((uint16_t *)&pseudo, sizeof(pseudo), 0);
-    if (cksum16((uint16_t *)hdr, len, psum) != 0) {
-        errorf("checksum error: sum=0x%04x, verify=0x%04x", ntoh16(hdr->sum), ntoh16(cksum16((uint16_t *)hdr, len, -hdr->sum + psum)));
-        return;
+    if (!(pb->flags & PBUF_FLAG_CSUM_VALID)) {
+        psum = cksum16_pseudo(src, dst, IP_PROTOCOL_UDP, len);
+        if (cksum16((uint16_t *)hdr, len, psum) != 0) {
+            errorf("checksum error: sum=0x%04x, verify=0x%04x", ntoh16(hdr->sum), ntoh16(cksum16((uint16_t *)hdr, len, -hdr->sum + psum)));
+            stats_inc(STATS_UDP_IN_ERRORS);
+            stats_inc(STATS_UDP_IN_CSUM_ERRORS);
+            return;
+        }
     }
     debugf("%s:%d => %s:%d, len=%zu (payload=%zu)",
         ip_addr_ntop(src, addr1, sizeof(addr1)), ntoh16(hdr->src),
         ip_addr_ntop(dst, addr2, sizeof(addr2)), ntoh16(hdr->dst),
         len, len - sizeof(*hdr));
     udp_dump(data, len);
-    mutex_lock(&mutex);
-    pcb = udp_pcb_select(dst, hdr->dst);
+    tracef(TRACE_EVENT_UDP_INPUT, (uint32_t)ntoh16(hdr->src) << 16 | ntoh16(hdr->dst), len - sizeof(*hdr), 0, 0);
+    pcb = udp_pcb_select_lock(dst, hdr->dst);
     if (!pcb) {
         /* port is not in use */
-        mutex_unlock(&mutex);
+        stats_inc(STATS_UDP_NO_PORTS);
+        return;
+    }
+    pbuf_pull(pb, sizeof(*hdr));
+    /* NOTE: a small payload is copied not to pin a whole frame of the bounded pool for a few bytes */
+    size = (pb->len <= UDP_COPY_MAX) ? MEMORY_POOL_SMALL_SIZE : pb->size;
+    /* NOTE: an empty queue takes one anyway, a datagram larger than the limit (reassembled) is not always dropped */
+    if (pcb->rcvbuf_used && pcb->rcvbuf_used + size > pcb->rcvbuf) {
+        mutex_unlock(&pcb->lock);
+        debugf("receive buffer full, drop, len=%zu, used=%zu", pb->len, pcb->rcvbuf_used);
+        stats_inc(STATS_UDP_RCVBUF_ERRORS);
         return;
     }
-    entry = memory_alloc(sizeof(*entry) + (len - sizeof(*hdr)));
+    entry = memory_pool_alloc(sizeof(*entry) + (pb->len <= UDP_COPY_MAX ? pb->len : 0));
     if (!entry) {
-        mutex_unlock(&mutex);
-        errorf("memory_alloc() failure");
+        mutex_unlock(&pcb->lock);
+        errorf("memory_pool_alloc() failure");
+        stats_inc(STATS_UDP_RCVBUF_ERRORS);
         return;
     }
     entry->foreign.addr = src;
     entry->foreign.port = hdr->src;
-    entry->len = len - sizeof(*hdr);
-    memcpy(entry + 1, hdr + 1, entry->len);
-    if (!queue_push(&pcb->queue, entry)) {
-        mutex_unlock(&mutex);
-        errorf("queue_push() failure");
-        return;
+    entry->len = pb->len;
+    if (pb->len <= UDP_COPY_MAX) {
+        entry->pb = NULL;
+        memcpy(entry->data, pb->data, pb->len);
+    } else {
+        /* NOTE: keep the received buffer instead of copying the payload */
+        entry->pb = pbuf_ref(pb);
     }
+    list_push(&pcb->queue, &entry->node);
+    pcb->rcvbuf_used += size;
+    stats_inc(STATS_UDP_IN_DATAGRAMS);
     sched_wakeup(&pcb->ctx);
-    mutex_unlock(&mutex);
+    mutex_unlock(&pcb->lock);
 }
 
-ssize_t
-udp_output(struct ip_endpoint *src, struct ip_endpoint *dst, const  uint8_t *data, size_t len)
+/* NOTE: src->addr must be the one of the route (dst->src) */
+static ssize_t
+udp_output_dst(struct ip_endpoint *src, struct ip_endpoint *dst, const uint8_t *data, size_t len, struct ip_dst *route)
 {
-    uint8_t buf[IP_PAYLOAD_SIZE_MAX];
+    struct pbuf *pb;
     struct udp_hdr *hdr;
-    struct pseudo_hdr pseudo;
-    uint16_t total, psum = 0;
+    uint16_t total, psum, sum;
     char ep1[IP_ENDPOINT_STR_LEN];
     char ep2[IP_ENDPOINT_STR_LEN];
 
@@ -221,47 +433,78 @@ udp_output(struct ip_endpoint *src, struct ip_endpoint *dst, const  uint8_t *dat
         errorf("too long");
         return -1;
     }
-    hdr = (struct udp_hdr *)buf;
+    pb = pbuf_alloc(sizeof(*hdr) + len);
+    if (!pb) {
+        errorf("pbuf_alloc() failure");
+        return -1;
+    }
+    hdr = (struct udp_hdr *)pb->data;
     hdr->src = src->port;
     hdr->dst = dst->port;
     total = sizeof(*hdr) + len;
     hdr->len = hton16(total);
     hdr->sum = 0;
-    memcpy(hdr + 1, data, len);
-    pseudo.src = src->addr;
-    pseudo.dst = dst->addr;
-    pseudo.zero = 0;
-    pseudo.protocol = IP_PROTOCOL_UDP;
-    pseudo.len = hton16(total);
-    psum = ~cksum16((uint16_t *)&pseudo, sizeof(pseudo), 0);
-    hdr->sum = cksum16((uint16_t *)hdr, total, psum);
+    psum = cksum16_pseudo(src->addr, dst->addr, IP_PROTOCOL_UDP, total);
+    if (NET_IFACE(route->iface)->dev->offload & NET_DEVICE_OFFLOAD_TX_CSUM) {
+        memcpy(hdr + 1, data, len);
+        /* NOTE: completed by the device */
+        hdr->sum = psum;
+        pbuf_csum_partial(pb, offsetof(struct udp_hdr, sum));
+    } else {
+        /* NOTE: the payload is summed while copied, the header (8 bytes) is summed on top of it */
+        sum = cksum16_copy(hdr + 1, data, len, 0);
+        hdr->sum = cksum16((uint16_t *)hdr, sizeof(*hdr), (uint32_t)psum + sum);
+    }
     debugf("%s => %s, len=%zu (payload=%zu)",
         ip_endpoint_ntop(src, ep1, sizeof(ep1)), ip_endpoint_ntop(dst, ep2, sizeof(ep2)), total, len);
     udp_dump((uint8_t *)hdr, total);
-    if (ip_output(IP_PROTOCOL_UDP, (uint8_t *)hdr, total, src->addr, dst->addr) == -1) {
-        errorf("ip_output() failure");
+    tracef(TRACE_EVENT_UDP_OUTPUT, (uint32_t)ntoh16(src->port) << 16 | ntoh16(dst->port), len, 0, 0);
+    stats_inc(STATS_UDP_OUT_DATAGRAMS);
+    if (ip_output_dst(IP_PROTOCOL_UDP, pb, route) == -1) {
+        errorf("ip_output_dst() failure");
         return -1;
     }
     return len;
 }
 
+ssize_t
+udp_output(struct ip_endpoint *src, struct ip_endpoint *dst, const  uint8_t *data, size_t len)
+{
+    struct ip_dst route;
+    struct ip_endpoint local;
+
+    if (ip_dst_lookup(&route, src->addr, dst->addr) == -1) {
+        errorf("ip_dst_lookup() failure");
+        return -1;
+    }
+    local.addr = route.src;
+    local.port = src->port;
+    return udp_output_dst(&local, dst, data, len, &route);
+}
+
 static void
 event_handler(void *arg)
 {
     struct udp_pcb *pcb;
 
-    mutex_lock(&mutex);
-    for (pcb = pcbs; pcb < tailof(pcbs); pcb++) {
+    int i;
+
+    for (i = 0; (pcb = udp_pcb_lookup(i)) != NULL; i++) {
+        mutex_lock(&pcb->lock);
         if (pcb->state == UDP_PCB_STATE_OPEN) {
             sched_interrupt(&pcb->ctx);
         }
+        mutex_unlock(&pcb->lock);
     }
-    mutex_unlock(&mutex);
 }
 
 int
 udp_init(void)
 {
+    if (hash_table_init(&bind_table, UDP_PCB_HASH_SIZE) == -1) {
+        errorf("hash_table_init() failure");
+        return -1;
+    }
     if (ip_protocol_register("UDP", IP_PROTOCOL_UDP, udp_input) == -1) {
         errorf("ip_protocol_register() failure");
         return -1;
@@ -280,15 +523,13 @@ udp_open(void)
     struct udp_pcb *pcb;
     int id;
 
-    mutex_lock(&mutex);
     pcb = udp_pcb_alloc();
     if (!pcb) {
         errorf("udp_pcb_alloc() failure");
-        mutex_unlock(&mutex);
         return -1;
     }
     id = udp_pcb_id(pcb);
-    mutex_unlock(&mutex);
+    mutex_unlock(&pcb->lock);
     return id;
 }
 
@@ -297,15 +538,13 @@ udp_close(int id)
 {
     struct udp_pcb *pcb;
 
-    mutex_lock(&mutex);
     pcb = udp_pcb_get(id);
     if (!pcb) {
         errorf("pcb not found, id=%d", id);
-        mutex_unlock(&mutex);
         return -1;
     }
     udp_pcb_release(pcb);
-    mutex_unlock(&mutex);
+    mutex_unlock(&pcb->lock);
     return 0;
 }
 
@@ -316,107 +555,273 @@ udp_bind(int id, struct ip_endpoint *local)
     char ep1[IP_ENDPOINT_STR_LEN];
     char ep2[IP_ENDPOINT_STR_LEN];
 
-    mutex_lock(&mutex);
     pcb = udp_pcb_get(id);
     if (!pcb) {
         errorf("pcb not found, id=%d", id);
-        mutex_unlock(&mutex);
         return -1;
     }
+    rwlock_wrlock(&table_lock);
     exist = udp_pcb_select(local->addr, local->port);
     if (exist) {
         errorf("already in use, id=%d, want=%s, exist=%s",
             id, ip_endpoint_ntop(local, ep1, sizeof(ep1)), ip_endpoint_ntop(&exist->local, ep2, sizeof(ep2)));
-        mutex_unlock(&mutex);
+        rwlock_unlock(&table_lock);
+        mutex_unlock(&pcb->lock);
         return -1;
     }
-    pcb->local = *local;
+    udp_pcb_bind(pcb, local);
+    rwlock_unlock(&table_lock);
     debugf("bound, id=%d, local=%s", id, ip_endpoint_ntop(&pcb->local, ep1, sizeof(ep1)));
-    mutex_unlock(&mutex);
+    mutex_unlock(&pcb->lock);
     return 0;
 }
 
 ssize_t
 udp_sendto(int id, uint8_t *data, size_t len, struct ip_endpoint *foreign)
+{
+    struct udp_msg msg;
+
+    msg.buf = data;
+    msg.len = len;
+    msg.foreign = *foreign;
+    if (udp_sendmmsg(id, &msg, 1) != 1) {
+        return -1;
+    }
+    return len;
+}
+
+/*
+ * NOTE: the pcb is looked up (and bound) once for the batch, and the route (and the ARP resolution)
+ *       is reused while the messages go to the same address (also by the next call, cached in the pcb).
+ *       returns the number of messages sent, stops at the first failure.
+ */
+int
+udp_sendmmsg(int id, struct udp_msg *msgs, int num)
 {
     struct udp_pcb *pcb;
-    struct ip_endpoint local;
-    struct ip_iface *iface;
+    struct ip_endpoint local, bound;
+    struct ip_dst route;
+    unsigned int gen;
     char addr[IP_ADDR_STR_LEN];
-    uint32_t p;
+    int i;
 
-    mutex_lock(&mutex);
+    if (num <= 0) {
+        return 0;
+    }
     pcb = udp_pcb_get(id);
     if (!pcb) {
         errorf("pcb not found, id=%d", id);
-        mutex_unlock(&mutex);
         return -1;
     }
-    local.addr = pcb->local.addr;
-    if (local.addr == IP_ADDR_ANY) {
-        iface = ip_route_get_iface(foreign->addr);
-        if (!iface) {
-            errorf("iface not found that can reach foreign address, addr=%s",
-                ip_addr_ntop(foreign->addr, addr, sizeof(addr)));
-            mutex_unlock(&mutex);
+    /* NOTE: the local address is selected by the route if not bound */
+    if (ip_dst_lookup_cached(&pcb->dst, pcb->local.addr, msgs[0].foreign.addr) == -1) {
+        errorf("iface not found that can reach foreign address, addr=%s",
+            ip_addr_ntop(msgs[0].foreign.addr, addr, sizeof(addr)));
+        mutex_unlock(&pcb->lock);
+        return -1;
+    }
+    route = pcb->dst;
+    if (!pcb->local.port) {
+        bound.addr = pcb->local.addr; /* NOTE: keep the local address as is (may be IP_ADDR_ANY) */
+        rwlock_wrlock(&table_lock);
+        bound.port = udp_pcb_select_port(route.src);
+        if (!bound.port) {
+            debugf("failed to dinamic assign local port, addr=%s", ip_addr_ntop(route.src, addr, sizeof(addr)));
+            rwlock_unlock(&table_lock);
+            mutex_unlock(&pcb->lock);
             return -1;
         }
-        local.addr = iface->unicast;
-        debugf("select local address, addr=%s", ip_addr_ntop(local.addr, addr, sizeof(addr)));
+        udp_pcb_bind(pcb, &bound);
+        rwlock_unlock(&table_lock);
+        debugf("dinamic assign local port, port=%d", ntoh16(bound.port));
     }
-    if (!pcb->local.port) {
-        for (p = UDP_SOURCE_PORT_MIN; p <= UDP_SOURCE_PORT_MAX; p++) {
-            if (!udp_pcb_select(local.addr, hton16(p))) {
-                pcb->local.port = hton16(p);
-                debugf("dinamic assign local port, port=%d", p);
-                break;
-            }
+    local = pcb->local;
+    gen = pcb->gen;
+    mutex_unlock(&pcb->lock);
+    net_tx_begin();
+    for (i = 0; i < num; i++) {
+        if (msgs[i].foreign.addr != route.addr && ip_dst_lookup(&route, local.addr, msgs[i].foreign.addr) == -1) {
+            errorf("ip_dst_lookup() failure");
+            break;
         }
-        if (!pcb->local.port) {
-            debugf("failed to dinamic assign local port, addr=%s", ip_addr_ntop(local.addr, addr, sizeof(addr)));
-            mutex_unlock(&mutex);
-            return -1;
+        bound.addr = route.src;
+        bound.port = local.port;
+        if (udp_output_dst(&bound, &msgs[i].foreign, msgs[i].buf, msgs[i].len, &route) == -1) {
+            break;
         }
     }
-    local.port = pcb->local.port;
-    mutex_unlock(&mutex);
-    return udp_output(&local, foreign, data, len);
+    net_tx_end();
+    /* NOTE: written back to keep the ARP resolution done while sending, unless the pcb was released (or rebound) */
+    mutex_lock(&pcb->lock);
+    if (pcb->gen == gen && pcb->local.addr == local.addr) {
+        pcb->dst = route;
+    }
+    mutex_unlock(&pcb->lock);
+    return i ? i : -1;
 }
 
 ssize_t
-udp_recvfrom(int id, uint8_t *buf, size_t size, struct ip_endpoint *foreign)
+udp_recvfrom(int id, uint8_t *buf, size_t size, struct ip_endpoint *foreign, int flags)
+{
+    struct udp_msg msg;
+
+    msg.buf = buf;
+    msg.size = size;
+    if (udp_recvmmsg(id, &msg, 1, flags) != 1) {
+        return -1;
+    }
+    if (foreign) {
+        *foreign = msg.foreign;
+    }
+    return msg.len;
+}
+
+/*
+ * NOTE: waits for at least one datagram, then takes up to num (and UDP_MMSG_MAX) queued ones at once.
+ *       returns the number of messages received.
+ */
+int
+udp_recvmmsg(int id, struct udp_msg *msgs, int num, int flags)
 {
     struct udp_pcb *pcb;
-    struct udp_queue_entry *entry;
-    ssize_t len;
+    struct udp_queue_entry *entries[UDP_MMSG_MAX];
+    int n, i;
 
-    mutex_lock(&mutex);
+    num = MIN(num, UDP_MMSG_MAX);
+    if (num <= 0) {
+        return 0;
+    }
     pcb = udp_pcb_get(id);
     if (!pcb) {
         errorf("pcb not found, id=%d", id);
-        mutex_unlock(&mutex);
         return -1;
     }
-    while (!(entry = queue_pop(&pcb->queue))) {
-        if (sched_sleep(&pcb->ctx, &mutex, NULL) == -1) {
+    while (!(entries[0] = udp_queue_pop(pcb))) {
+        if ((pcb->flags & UDP_PCB_FLAG_NONBLOCK) || (flags & NET_MSG_DONTWAIT)) {
+            mutex_unlock(&pcb->lock);
+            errno = EAGAIN;
+            return -1;
+        }
+        if (sched_sleep(&pcb->ctx, &pcb->lock, NULL) == -1) {
             debugf("interrupted");
-            mutex_unlock(&mutex);
+            mutex_unlock(&pcb->lock);
             errno = EINTR;
             return -1;
         }
         if (pcb->state == UDP_PCB_STATE_CLOSING) {
             debugf("closed");
             udp_pcb_release(pcb);
-            mutex_unlock(&mutex);
+            mutex_unlock(&pcb->lock);
             return -1;
         }
     }
-    mutex_unlock(&mutex);
-    if (foreign) {
-        *foreign = entry->foreign;
+    for (n = 1; n < num; n++) {
+        entries[n] = udp_queue_pop(pcb);
+        if (!entries[n]) {
+            break;
+        }
     }
-    len = MIN(size, entry->len); /* truncate */
-    memcpy(buf, entry + 1, len);
-    memory_free(entry);
-    return len;
+    mutex_unlock(&pcb->lock);
+    for (i = 0; i < n; i++) {
+        msgs[i].foreign = entries[i]->foreign;
+        msgs[i].len = MIN(msgs[i].size, entries[i]->len); /* truncate */
+        memcpy(msgs[i].buf, udp_queue_entry_data(entries[i]), msgs[i].len);
+        udp_queue_entry_free(entries[i]);
+    }
+    return n;
+}
+
+int
+udp_setopt(int id, int opt, int val)
+{
+    struct udp_pcb *pcb;
+
+    pcb = udp_pcb_get(id);
+    if (!pcb) {
+        errorf("pcb not found, id=%d", id);
+        return -1;
+    }
+    switch (opt) {
+    case UDP_OPT_NONBLOCK:
+        if (val) {
+            pcb->flags |= UDP_PCB_FLAG_NONBLOCK;
+        } else {
+            pcb->flags &= ~UDP_PCB_FLAG_NONBLOCK;
+        }
+        break;
+    case UDP_OPT_RCVBUF:
+        if (val < UDP_RCVBUF_MIN || val > UDP_RCVBUF_MAX) {
+            errorf("out of range, val=%d", val);
+            mutex_unlock(&pcb->lock);
+            return -1;
+        }
+        /* NOTE: the datagrams queued already are kept even if beyond the new limit */
+        pcb->rcvbuf = val;
+        break;
+    default:
+        errorf("unsupported option, opt=%d", opt);
+        mutex_unlock(&pcb->lock);
+        return -1;
+    }
+    mutex_unlock(&pcb->lock);
+    return 0;
+}
+
+int
+udp_getopt(int id, int opt, int *val)
+{
+    struct udp_pcb *pcb;
+
+    pcb = udp_pcb_get(id);
+    if (!pcb) {
+        errorf("pcb not found, id=%d", id);
+        return -1;
+    }
+    switch (opt) {
+    case UDP_OPT_NONBLOCK:
+        *val = (pcb->flags & UDP_PCB_FLAG_NONBLOCK) ? 1 : 0;
+        break;
+    case UDP_OPT_RCVBUF:
+        *val = pcb->rcvbuf;
+        break;
+    default:
+        errorf("unsupported option, opt=%d", opt);
+        mutex_unlock(&pcb->lock);
+        return -1;
+    }
+    mutex_unlock(&pcb->lock);
+    return 0;
+}
+
+/* NOTE: always writable (no send buffer), readable while datagrams are queued */
+int
+udp_poll(int id)
+{
+    struct udp_pcb *pcb;
+    int events = NET_POLL_OUT;
+
+    pcb = udp_pcb_get(id);
+    if (!pcb) {
+        return NET_POLL_ERR | NET_POLL_HUP;
+    }
+    if (pcb->queue.num) {
+        events |= NET_POLL_IN;
+    }
+    mutex_unlock(&pcb->lock);
+    return events;
+}
+
+/* NOTE: attaches the watch to the pcb, the changes of the readiness are notified to the poller from now on */
+int
+udp_watch(int id, struct sched_watch *watch, struct sched_poller *poller, void *arg)
+{
+    struct udp_pcb *pcb;
+
+    pcb = udp_pcb_get(id);
+    if (!pcb) {
+        return -1;
+    }
+    sched_watch_attach(watch, poller, &pcb->ctx, &pcb->lock, arg);
+    mutex_unlock(&pcb->lock);
+    return 0;
 }
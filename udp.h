@@ -6,6 +6,18 @@
 
 #include "ip.h"
 
+#define UDP_OPT_NONBLOCK 1
+#define UDP_OPT_RCVBUF   2 /* bytes of the frames held by the receive queue */
+
+#define UDP_MMSG_MAX 64 /* datagrams taken by one udp_recvmmsg() call */
+
+struct udp_msg {
+    uint8_t *buf;
+    size_t size; /* recv: the size of buf */
+    size_t len; /* send: the length of the datagram, recv: the length received (truncated to size) */
+    struct ip_endpoint foreign;
+};
+
 extern ssize_t
 udp_output(struct ip_endpoint *src, struct ip_endpoint *dst, const uint8_t *buf, size_t len);
 
@@ -19,8 +31,20 @@ udp_bind(int index, struct ip_endpoint *local);
 extern ssize_t
 udp_sendto(int id, uint8_t *buf, size_t len, struct ip_endpoint *foreign);
 extern ssize_t
-udp_recvfrom(int id, uint8_t *buf, size_t size, struct ip_endpoint *foreign);
+udp_recvfrom(int id, uint8_t *buf, size_t size, struct ip_endpoint *foreign, int flags);
+extern int
+udp_sendmmsg(int id, struct udp_msg *msgs, int num);
+extern int
+udp_recvmmsg(int id, struct udp_msg *msgs, int num, int flags);
 extern int
 udp_close(int id);
+extern int
+udp_setopt(int id, int opt, int val);
+extern int
+udp_getopt(int id, int opt, int *val);
+extern int
+udp_poll(int id);
+extern int
+udp_watch(int id, struct sched_watch *watch, struct sched_poller *poller, void *arg);
 
 #endif
@@ -7,6 +7,7 @@
 #include <limits.h>
 #include <ctype.h>
 #include <time.h>
+#include <sched.h>
 #include <sys/time.h>
 
 #include "platform.h"
@@ -70,86 +71,251 @@ hexdump(FILE *fp, const void *data, size_t size)
     funlockfile(fp);
 }
 
-struct queue_entry {
-    struct queue_entry *next;
-    void *data;
-};
+void
+list_init(struct list_head *list)
+{
+    list->head = NULL;
+    list->tail = NULL;
+    list->num = 0;
+}
 
 void
-queue_init(struct queue_head *queue)
+list_push(struct list_head *list, struct list_node *node)
 {
-    queue->head = NULL;
-    queue->tail = NULL;
-    queue->num = 0;
+    node->next = NULL;
+    if (list->tail) {
+        list->tail->next = node;
+    } else {
+        list->head = node;
+    }
+    list->tail = node;
+    list->num++;
 }
 
-void *
-queue_push(struct queue_head *queue, void *data)
+struct list_node *
+list_pop(struct list_head *list)
 {
-    struct queue_entry *entry;
+    struct list_node *node;
 
-    if (!queue) {
+    node = list->head;
+    if (!node) {
         return NULL;
     }
-    entry = memory_alloc(sizeof(*entry));
-    if (!entry) {
+    list->head = node->next;
+    if (!list->head) {
+        list->tail = NULL;
+    }
+    list->num--;
+    node->next = NULL;
+    return node;
+}
+
+struct list_node *
+list_peek(struct list_head *list)
+{
+    return list->head;
+}
+
+void
+list_foreach(struct list_head *list, void (*func)(void *arg, struct list_node *node), void *arg)
+{
+    struct list_node *node, *next;
+
+    /* NOTE: the next is taken first, func may free the node (but must not touch the others) */
+    for (node = list->head; node; node = next) {
+        next = node->next;
+        func(arg, node);
+    }
+}
+
+struct ring *
+ring_alloc(unsigned int size)
+{
+    struct ring *ring;
+    unsigned int n = 1;
+    size_t bytes;
+
+    while (n < size) {
+        n <<= 1;
+    }
+    bytes = sizeof(*ring) + sizeof(*ring->slots) * n;
+    /* NOTE: the size must be a multiple of the alignment for aligned_alloc() */
+    bytes = (bytes + RING_CACHELINE_SIZE - 1) & ~(size_t)(RING_CACHELINE_SIZE - 1);
+    ring = aligned_alloc(RING_CACHELINE_SIZE, bytes);
+    if (!ring) {
+        errorf("aligned_alloc() failure");
         return NULL;
     }
-    entry->next = NULL;
-    entry->data = data;
-    if (queue->tail) {
-        queue->tail->next = entry;
+    memset(ring, 0, bytes);
+    ring->size = n;
+    ring->mask = n - 1;
+    return ring;
+}
+
+void
+ring_free(struct ring *ring)
+{
+    free(ring);
+}
+
+unsigned int
+ring_enqueue(struct ring *ring, void * const *objs, unsigned int num)
+{
+    unsigned int head, room, i;
+
+    head = ring->prod_tail;
+    /* NOTE: loaded once, MIN() evaluates the argument twice (the consumer may have moved in between) */
+    room = ring->size - (head - __atomic_load_n(&ring->cons_tail, __ATOMIC_ACQUIRE));
+    num = MIN(num, room);
+    for (i = 0; i < num; i++) {
+        ring->slots[(head + i) & ring->mask] = objs[i];
     }
-    queue->tail = entry;
-    if (!queue->head) {
-        queue->head = entry;
+    ring->prod_head = head + num;
+    __atomic_store_n(&ring->prod_tail, head + num, __ATOMIC_RELEASE);
+    return num;
+}
+
+unsigned int
+ring_enqueue_mp(struct ring *ring, void * const *objs, unsigned int num)
+{
+    unsigned int head, room, n, i;
+
+    head = __atomic_load_n(&ring->prod_head, __ATOMIC_RELAXED);
+    do {
+        room = ring->size - (head - __atomic_load_n(&ring->cons_tail, __ATOMIC_ACQUIRE));
+        n = MIN(num, room);
+        if (!n) {
+            return 0;
+        }
+    } while (!__atomic_compare_exchange_n(&ring->prod_head, &head, head + n, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    for (i = 0; i < n; i++) {
+        ring->slots[(head + i) & ring->mask] = objs[i];
+    }
+    /*
+     * NOTE: wait for the producers reserved before, the range is published next to theirs. acquire pairs with
+     *       their release of prod_tail, their slots are visible before ours are published by the release below.
+     */
+    while (__atomic_load_n(&ring->prod_tail, __ATOMIC_ACQUIRE) != head) {
+        sched_yield();
     }
-    queue->num++;
-    return data;
+    __atomic_store_n(&ring->prod_tail, head + n, __ATOMIC_RELEASE);
+    return n;
 }
 
-void *
-queue_pop(struct queue_head *queue)
+unsigned int
+ring_dequeue(struct ring *ring, void **objs, unsigned int num)
 {
-    struct queue_entry *entry;
-    void *data;
+    unsigned int tail, avail, i;
 
-    if (!queue || !queue->head) {
-        return NULL;
+    tail = ring->cons_tail;
+    avail = __atomic_load_n(&ring->prod_tail, __ATOMIC_ACQUIRE) - tail;
+    num = MIN(num, avail);
+    for (i = 0; i < num; i++) {
+        objs[i] = ring->slots[(tail + i) & ring->mask];
     }
-    entry = queue->head;
-    queue->head = entry->next;
-    if (!queue->head) {
-        queue->tail = NULL;
+    __atomic_store_n(&ring->cons_tail, tail + num, __ATOMIC_RELEASE);
+    return num;
+}
+
+/* NOTE: a snapshot, may be behind the producers and the consumer */
+unsigned int
+ring_count(const struct ring *ring)
+{
+    return __atomic_load_n(&ring->prod_tail, __ATOMIC_ACQUIRE) - __atomic_load_n(&ring->cons_tail, __ATOMIC_ACQUIRE);
+}
+
+int
+hash_table_init(struct hash_table *table, size_t size)
+{
+    size_t n = 1;
+
+    while (n < size) {
+        n <<= 1;
     }
-    queue->num--;
-    data = entry->data;
-    memory_free(entry);
-    return data;
+    table->buckets = memory_alloc(sizeof(*table->buckets) * n);
+    if (!table->buckets) {
+        errorf("memory_alloc() failure");
+        return -1;
+    }
+    table->size = n;
+    table->num = 0;
+    return 0;
 }
 
-void *
-queue_peek(struct queue_head *queue)
+static void
+hash_table_grow(struct hash_table *table)
 {
-    if (!queue || !queue->head) {
-        return NULL;
+    struct hash_node **buckets, *node, *next;
+    size_t size, i;
+
+    size = table->size << 1;
+    buckets = memory_alloc(sizeof(*buckets) * size);
+    if (!buckets) {
+        /* NOTE: keep the current buckets, the chains just get longer */
+        return;
+    }
+    for (i = 0; i < table->size; i++) {
+        for (node = table->buckets[i]; node; node = next) {
+            next = node->next;
+            node->next = buckets[node->hash & (size - 1)];
+            buckets[node->hash & (size - 1)] = node;
+        }
     }
-    return queue->head->data;
+    memory_free(table->buckets);
+    table->buckets = buckets;
+    table->size = size;
 }
 
 void
-queue_foreach(struct queue_head *queue, void (*func)(void *arg, void *data), void *arg)
+hash_table_insert(struct hash_table *table, struct hash_node *node, uint32_t hash)
 {
-    struct queue_entry *entry;
+    struct hash_node **bucket;
 
-    if (!queue || !func) {
-        return;
+    if (table->num >= table->size) {
+        hash_table_grow(table);
     }
-    for (entry = queue->head; entry; entry = entry->next) {
-        func(arg, entry->data);
+    bucket = &table->buckets[hash & (table->size - 1)];
+    node->hash = hash;
+    node->next = *bucket;
+    *bucket = node;
+    table->num++;
+}
+
+/* NOTE: does nothing if the node is not in the table */
+void
+hash_table_remove(struct hash_table *table, struct hash_node *node)
+{
+    struct hash_node **p;
+
+    for (p = &table->buckets[node->hash & (table->size - 1)]; *p; p = &(*p)->next) {
+        if (*p == node) {
+            *p = node->next;
+            node->next = NULL;
+            table->num--;
+            return;
+        }
     }
 }
 
+/* NOTE: returns the head of the chain, the caller must check node->hash and the key */
+struct hash_node *
+hash_table_lookup(struct hash_table *table, uint32_t hash)
+{
+    return table->buckets[hash & (table->size - 1)];
+}
+
+/* NOTE: final mix of MurmurHash3 */
+uint32_t
+hash32(uint32_t x)
+{
+    x ^= x >> 16;
+    x *= 0x85ebca6b;
+    x ^= x >> 13;
+    x *= 0xc2b2ae35;
+    x ^= x >> 16;
+    return x;
+}
+
 #ifndef __BIG_ENDIAN
 #define __BIG_ENDIAN 4321
 #endif
@@ -214,21 +380,189 @@ ntoh32(uint32_t n)
     return endian == __LITTLE_ENDIAN ? byteswap32(n) : n;
 }
 
-uint16_t
-cksum16(uint16_t *addr, uint16_t count, uint32_t init)
+/*
+ * Internet Checksum (RFC 1071)
+ *
+ * NOTE: the one's complement sum does not depend on the byte order, the words are added as loaded
+ *       (native order) and wider words are folded down to 16 bits at the end. the callers store the
+ *       result as is, without converting the byte order.
+ */
+
+/* NOTE: also copies the data to dst if not NULL (the data is read once for both) */
+static uint64_t
+cksum_add_scalar(uint8_t *dst, const uint8_t *p, size_t len, uint64_t sum)
+{
+    uint64_t w[4], carry = 0;
+    uint32_t d;
+    uint16_t h;
+    int i;
+
+    /* NOTE: 64-bit words, the carries are counted and added back at the end */
+    while (len >= sizeof(w)) {
+        memcpy(w, p, sizeof(w));
+        if (dst) {
+            memcpy(dst, w, sizeof(w));
+            dst += sizeof(w);
+        }
+        for (i = 0; i < 4; i++) {
+            sum += w[i];
+            carry += (sum < w[i]);
+        }
+        p += sizeof(w);
+        len -= sizeof(w);
+    }
+    while (len >= sizeof(w[0])) {
+        memcpy(w, p, sizeof(w[0]));
+        if (dst) {
+            memcpy(dst, w, sizeof(w[0]));
+            dst += sizeof(w[0]);
+        }
+        sum += w[0];
+        carry += (sum < w[0]);
+        p += sizeof(w[0]);
+        len -= sizeof(w[0]);
+    }
+    sum += carry;
+    if (sum < carry) {
+        sum++;
+    }
+    /* NOTE: sum < 2^64 - 2^32, the rest does not overflow */
+    sum = (sum & 0xffffffff) + (sum >> 32);
+    if (dst) {
+        memcpy(dst, p, len);
+    }
+    if (len >= sizeof(d)) {
+        memcpy(&d, p, sizeof(d));
+        sum += d;
+        p += sizeof(d);
+        len -= sizeof(d);
+    }
+    if (len >= sizeof(h)) {
+        memcpy(&h, p, sizeof(h));
+        sum += h;
+        p += sizeof(h);
+        len -= sizeof(h);
+    }
+    if (len) {
+        /* NOTE: the odd byte is padded with zero */
+        h = 0;
+        memcpy(&h, p, 1);
+        sum += h;
+    }
+    return sum;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+
+#define CKSUM_AVX2_BLOCK 16384 /* iterations, a 32-bit lane would overflow after 32768 */
+
+/* NOTE: 16-bit words widened to 32-bit lanes, the lanes are added up to sum every CKSUM_AVX2_BLOCK */
+__attribute__((target("avx2")))
+static uint64_t
+cksum_add_avx2(uint8_t *dst, const uint8_t *p, size_t len, uint64_t sum)
 {
-    uint32_t sum;
+    __m256i zero, acc, v;
+    uint32_t lanes[8];
+    size_t n;
+    int i;
 
-    sum = init;
-    while (count > 1) {
-        sum += *(addr++);
-        count -= 2;
+    zero = _mm256_setzero_si256();
+    while (len >= 32) {
+        acc = zero;
+        for (n = 0; len >= 32 && n < CKSUM_AVX2_BLOCK; n++) {
+            v = _mm256_loadu_si256((const __m256i *)p);
+            if (dst) {
+                _mm256_storeu_si256((__m256i *)dst, v);
+                dst += 32;
+            }
+            acc = _mm256_add_epi32(acc, _mm256_unpacklo_epi16(v, zero));
+            acc = _mm256_add_epi32(acc, _mm256_unpackhi_epi16(v, zero));
+            p += 32;
+            len -= 32;
+        }
+        _mm256_storeu_si256((__m256i *)lanes, acc);
+        for (i = 0; i < 8; i++) {
+            sum += lanes[i];
+        }
     }
-    if (count > 0) {
-        sum += *(uint8_t *)addr;
+    return cksum_add_scalar(dst, p, len, sum);
+}
+#endif
+
+static uint64_t (*cksum_add)(uint8_t *dst, const uint8_t *p, size_t len, uint64_t sum);
+
+/* NOTE: the implementation is chosen at the first use by the features of the running CPU */
+static uint64_t
+cksum_add_select(uint8_t *dst, const uint8_t *p, size_t len, uint64_t sum)
+{
+    uint64_t (*func)(uint8_t *dst, const uint8_t *p, size_t len, uint64_t sum);
+
+    func = __atomic_load_n(&cksum_add, __ATOMIC_RELAXED);
+    if (!func) {
+        func = cksum_add_scalar;
+#if defined(__x86_64__) && defined(__GNUC__)
+        if (__builtin_cpu_supports("avx2")) {
+            func = cksum_add_avx2;
+        }
+#endif
+        __atomic_store_n(&cksum_add, func, __ATOMIC_RELAXED);
     }
+    return func(dst, p, len, sum);
+}
+
+static uint16_t
+cksum_fold(uint64_t sum)
+{
     while (sum >> 16) {
         sum = (sum & 0xffff) + (sum >> 16);
     }
-    return ~(uint16_t)sum;
+    return sum;
+}
+
+uint16_t
+cksum16(uint16_t *addr, uint16_t count, uint32_t init)
+{
+    return ~cksum_fold(cksum_add_select(NULL, (uint8_t *)addr, count, init));
+}
+
+/*
+ * NOTE: copies len bytes from src to dst and returns the sum (not complemented) of them added to sum,
+ *       the data is read once for both (see cksum16_add() for the data at an odd offset)
+ */
+uint16_t
+cksum16_copy(void *dst, const void *src, size_t len, uint16_t sum)
+{
+    return cksum_fold(cksum_add_select(dst, src, len, sum));
+}
+
+/* NOTE: adds the sum (not complemented) of a part starting at offset, the bytes are swapped at an odd offset */
+uint16_t
+cksum16_add(uint16_t sum, uint16_t part, size_t offset)
+{
+    if (offset & 1) {
+        part = byteswap16(part);
+    }
+    return cksum_fold((uint32_t)sum + part);
+}
+
+/* NOTE: the sum (not complemented) of the pseudo header, to be passed to cksum16() as init */
+uint16_t
+cksum16_pseudo(uint32_t src, uint32_t dst, uint8_t protocol, uint16_t len)
+{
+    uint64_t sum;
+
+    /* NOTE: src/dst are in network byte order, the zero byte and the protocol form one word */
+    sum = (uint64_t)src + dst + hton16(protocol) + hton16(len);
+    return cksum_fold(sum);
+}
+
+/* RFC 1624 (3): HC' = ~(~HC + ~m + m'), the checksum updated for a 16-bit field changed from old to new */
+uint16_t
+cksum16_adjust(uint16_t sum, uint16_t old, uint16_t new)
+{
+    uint32_t tmp;
+
+    tmp = (uint16_t)~sum + (uint16_t)~old + new;
+    return ~cksum_fold(tmp);
 }
@@ -2,6 +2,7 @@
 #define UTIL_H
 
 #include <stdio.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <unistd.h>
 
@@ -15,6 +16,7 @@
 #define countof(x) ((sizeof(x) / sizeof(*x)))
 #define tailof(x) (x + countof(x))
 #define indexof(x, y) (((uintptr_t)y - (uintptr_t)x) / sizeof(*y))
+#define containerof(ptr, type, member) ((type *)((uintptr_t)(ptr) - offsetof(type, member)))
 
 #define timeval_add_usec(x, y)         \
     do {                               \
@@ -36,10 +38,33 @@
         }                                 \
     } while(0);
 
-#define errorf(...) lprintf(stderr, 'E', __FILE__, __LINE__, __func__, __VA_ARGS__)
-#define warnf(...) lprintf(stderr, 'W', __FILE__, __LINE__, __func__, __VA_ARGS__)
-#define infof(...) lprintf(stderr, 'I', __FILE__, __LINE__, __func__, __VA_ARGS__)
-#define debugf(...) lprintf(stderr, 'D', __FILE__, __LINE__, __func__, __VA_ARGS__)
+/*
+ * NOTE: the messages below LOG_LEVEL are compiled away (e.g. CFLAGS=-DLOG_LEVEL=LOG_LEVEL_INFO),
+ *       the arguments are still type checked but never evaluated. the packet dumps (xxx_dump()) go with debugf().
+ */
+#define LOG_LEVEL_NONE  0
+#define LOG_LEVEL_ERROR 1
+#define LOG_LEVEL_WARN  2
+#define LOG_LEVEL_INFO  3
+#define LOG_LEVEL_DEBUG 4
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_DEBUG
+#endif
+
+#define LOG_ENABLED(level) (LOG_LEVEL >= LOG_LEVEL_##level)
+
+#define log_at(level, c, ...)                                                 \
+    do {                                                                      \
+        if (LOG_ENABLED(level)) {                                             \
+            lprintf(stderr, c, __FILE__, __LINE__, __func__, __VA_ARGS__);    \
+        }                                                                     \
+    } while (0)
+
+#define errorf(...) log_at(ERROR, 'E', __VA_ARGS__)
+#define warnf(...) log_at(WARN, 'W', __VA_ARGS__)
+#define infof(...) log_at(INFO, 'I', __VA_ARGS__)
+#define debugf(...) log_at(DEBUG, 'D', __VA_ARGS__)
 
 #ifdef HEXDUMP
 #define debugdump(...) hexdump(stderr, __VA_ARGS__)
@@ -52,24 +77,96 @@ lprintf(FILE *fp, int level, const char *file, int line, const char *func, const
 extern void
 hexdump(FILE *fp, const void *data, size_t size);
 
-struct queue_entry;
+/*
+ * Intrusive List (singly linked, FIFO)
+ *
+ * NOTE: embed struct list_node in the element (no allocation on push), and take the element back
+ *       from the node with containerof(). an element is on one list at a time per node embedded.
+ */
+
+struct list_node {
+    struct list_node *next;
+};
 
-struct queue_head {
-    struct queue_entry *head;
-    struct queue_entry *tail;
+struct list_head {
+    struct list_node *head;
+    struct list_node *tail;
     unsigned int num;
 };
 
 extern void
-queue_init(struct queue_head *queue);
-extern void *
-queue_push(struct queue_head *queue, void *data);
-extern void *
-queue_pop(struct queue_head *queue);
-extern void *
-queue_peek(struct queue_head *queue);
+list_init(struct list_head *list);
+extern void
+list_push(struct list_head *list, struct list_node *node);
+extern struct list_node *
+list_pop(struct list_head *list);
+extern struct list_node *
+list_peek(struct list_head *list);
+extern void
+list_foreach(struct list_head *list, void (*func)(void *arg, struct list_node *node), void *arg);
+
+/*
+ * Ring (bounded, lock-free)
+ *
+ * NOTE: a power of 2 slots of pointers with free running indexes, the ones of the producers and the one of
+ *       the consumer are on their own cache lines. ring_enqueue() is for a single producer (SPSC), and
+ *       ring_enqueue_mp() for the multiple ones (MPSC): a range is reserved by CAS on prod_head, filled in,
+ *       then published on prod_tail in the order of the reservations. ring_dequeue() is for a single consumer.
+ *       all of them take a batch and return the number of the pointers actually moved (0 if full/empty).
+ */
+
+#define RING_CACHELINE_SIZE 64
+
+struct ring {
+    unsigned int size;
+    unsigned int mask;
+    unsigned int prod_head __attribute__((aligned(RING_CACHELINE_SIZE)));
+    unsigned int prod_tail;
+    unsigned int cons_tail __attribute__((aligned(RING_CACHELINE_SIZE)));
+    void *slots[] __attribute__((aligned(RING_CACHELINE_SIZE)));
+};
+
+extern struct ring *
+ring_alloc(unsigned int size);
+extern void
+ring_free(struct ring *ring);
+extern unsigned int
+ring_enqueue(struct ring *ring, void * const *objs, unsigned int num);
+extern unsigned int
+ring_enqueue_mp(struct ring *ring, void * const *objs, unsigned int num);
+extern unsigned int
+ring_dequeue(struct ring *ring, void **objs, unsigned int num);
+extern unsigned int
+ring_count(const struct ring *ring);
+
+/*
+ * Hash Table (intrusive, chained)
+ *
+ * NOTE: embed struct hash_node in the element and compare the keys while walking
+ *       the chain from hash_table_lookup(), the table doubles when num exceeds size.
+ */
+
+struct hash_node {
+    struct hash_node *next;
+    uint32_t hash;
+};
+
+struct hash_table {
+    struct hash_node **buckets;
+    size_t size; /* power of 2 */
+    size_t num;
+};
+
+extern int
+hash_table_init(struct hash_table *table, size_t size);
+extern void
+hash_table_insert(struct hash_table *table, struct hash_node *node, uint32_t hash);
 extern void
-queue_foreach(struct queue_head *queue, void (*func)(void *arg, void *data), void *arg);
+hash_table_remove(struct hash_table *table, struct hash_node *node);
+extern struct hash_node *
+hash_table_lookup(struct hash_table *table, uint32_t hash);
+extern uint32_t
+hash32(uint32_t x);
 
 extern uint16_t
 hton16(uint16_t h);
@@ -82,5 +179,13 @@ ntoh32(uint32_t n);
 
 extern uint16_t
 cksum16(uint16_t *addr, uint16_t count, uint32_t init);
+extern uint16_t
+cksum16_copy(void *dst, const void *src, size_t len, uint16_t sum);
+extern uint16_t
+cksum16_add(uint16_t sum, uint16_t part, size_t offset);
+extern uint16_t
+cksum16_pseudo(uint32_t src, uint32_t dst, uint8_t protocol, uint16_t len);
+extern uint16_t
+cksum16_adjust(uint16_t sum, uint16_t old, uint16_t new);
 
 #endif